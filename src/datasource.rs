@@ -1,9 +1,12 @@
 // SPDX-License-Identifier: MIT
 use std::time::SystemTime;
 
+use anyhow::{Result, bail};
 use serde::{Deserialize, Serialize};
 
-use crate::fex::types::AppType;
+use crate::fex::platform::cycle_counter_frequency;
+use crate::fex::shm::ShmReader;
+use crate::fex::types::{AppType, STATS_VERSION};
 use crate::sampler::accumulator::ComputedFrame;
 
 #[derive(Clone, Debug, Serialize, Deserialize)]
@@ -21,8 +24,55 @@ pub struct SessionMetadata {
     pub size: u32,
 }
 
+impl SessionMetadata {
+    /// Builds the metadata for a session on `pid` from its SHM header.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the segment uses an unsupported stats version.
+    pub fn from_shm(shm: &ShmReader, pid: i32) -> Result<Self> {
+        let header = shm.read_header();
+
+        if header.version != STATS_VERSION {
+            bail!(
+                "unsupported stats version {} (expected {STATS_VERSION})",
+                header.version
+            );
+        }
+
+        Ok(Self {
+            pid,
+            fex_version: header.fex_version,
+            app_type: header.app_type,
+            stats_version: header.version,
+            cycle_counter_frequency: cycle_counter_frequency(),
+            hardware_concurrency: hardware_concurrency(),
+            recording_start: SystemTime::now(),
+            head: header.head,
+            size: header.size,
+        })
+    }
+}
+
+fn hardware_concurrency() -> usize {
+    std::thread::available_parallelism().map_or(1, std::num::NonZeroUsize::get)
+}
+
 pub trait DataSource {
     fn next_frame(&mut self) -> Option<ComputedFrame>;
+
+    /// Writes the next frame into `frame`, reusing its allocations where the
+    /// source supports it. Returns `false` if no frame is ready.
+    fn next_frame_into(&mut self, frame: &mut ComputedFrame) -> bool {
+        match self.next_frame() {
+            Some(next) => {
+                *frame = next;
+                true
+            }
+            None => false,
+        }
+    }
+
     #[allow(dead_code)]
     fn metadata(&self) -> &SessionMetadata;
     #[allow(dead_code)]
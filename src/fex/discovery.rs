@@ -0,0 +1,304 @@
+// SPDX-License-Identifier: MIT
+//! Finding FEX processes through their `/dev/shm/fex-<pid>-stats` segments.
+
+use std::ffi::CString;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
+use std::time::Duration;
+
+use super::shm::ShmReader;
+
+/// Directory FEX creates its stats segments in.
+pub const SHM_DIR: &str = "/dev/shm";
+
+/// inotify events that can make a segment appear or become usable: creation,
+/// a rename into the directory, and the `ftruncate` that sizes it.
+const WATCH_MASK: u32 = libc::IN_CREATE | libc::IN_MOVED_TO | libc::IN_MODIFY;
+const EVENT_HEADER_SIZE: usize = std::mem::size_of::<libc::inotify_event>();
+
+#[must_use]
+pub fn process_alive(pid: i32) -> bool {
+    // kill(pid, 0) checks if the process exists without sending a signal
+    unsafe { libc::kill(pid, 0) == 0 }
+}
+
+/// Extracts the PID from a stats segment file name (`fex-<pid>-stats`).
+#[must_use]
+pub fn segment_pid(name: &str) -> Option<i32> {
+    name.strip_prefix("fex-")?
+        .strip_suffix("-stats")?
+        .parse()
+        .ok()
+}
+
+/// PIDs of all live processes that have a stats segment, ascending.
+#[must_use]
+pub fn find_all_fex_processes() -> Vec<i32> {
+    let Some(read_dir) = std::fs::read_dir(SHM_DIR).ok() else {
+        return Vec::new();
+    };
+    let mut candidates: Vec<i32> = Vec::new();
+
+    for entry in read_dir.flatten() {
+        let name = entry.file_name();
+        if let Some(pid) = segment_pid(&name.to_string_lossy())
+            && process_alive(pid)
+        {
+            candidates.push(pid);
+        }
+    }
+
+    candidates.sort_unstable();
+    candidates
+}
+
+#[must_use]
+pub fn find_fex_process() -> Option<i32> {
+    find_all_fex_processes().last().copied()
+}
+
+#[must_use]
+pub fn read_process_cmdline(pid: i32) -> String {
+    let path = format!("/proc/{pid}/cmdline");
+    std::fs::read(&path).map_or_else(
+        |_| String::new(),
+        |bytes| {
+            bytes
+                .split(|&b| b == 0)
+                .filter(|s| !s.is_empty())
+                .map(|s| String::from_utf8_lossy(s).into_owned())
+                .collect::<Vec<_>>()
+                .join(" ")
+        },
+    )
+}
+
+#[must_use]
+pub fn read_process_ppid(pid: i32) -> Option<i32> {
+    let stat = std::fs::read_to_string(format!("/proc/{pid}/stat")).ok()?;
+    // Format: pid (comm) state ppid ... — comm can contain ')' so find the last one
+    let after_comm = &stat[stat.rfind(')')? + 2..];
+    // Fields after comm: state ppid ...
+    after_comm.split_whitespace().nth(1)?.parse().ok()
+}
+
+/// Whether `pid`'s segment is sized and FEX has written its header. A
+/// segment is briefly empty right after FEX creates it.
+#[must_use]
+pub fn segment_ready(pid: i32) -> bool {
+    ShmReader::open(pid).is_ok_and(|shm| shm.read_header().version != 0)
+}
+
+/// Wakes when a stats segment is created in `SHM_DIR`, so new processes are
+/// seen within milliseconds instead of on the next poll. Falls back to
+/// sleeping when inotify is unavailable.
+pub struct SegmentWatcher {
+    /// `None` when inotify could not be set up.
+    inotify: Option<OwnedFd>,
+    buf: Vec<u8>,
+}
+
+impl SegmentWatcher {
+    #[must_use]
+    pub fn new() -> Self {
+        Self::watching(SHM_DIR)
+    }
+
+    fn watching(dir: &str) -> Self {
+        Self {
+            inotify: open_inotify(dir),
+            buf: vec![0; 4096],
+        }
+    }
+
+    /// Whether changes are reported by inotify rather than by polling.
+    #[must_use]
+    pub fn is_event_driven(&self) -> bool {
+        self.inotify.is_some()
+    }
+
+    /// Blocks until a stats segment changes or `timeout` passes, and
+    /// returns whether the caller should rescan. Without inotify this
+    /// sleeps the whole timeout and always asks for a rescan.
+    pub fn wait(&mut self, timeout: Duration) -> bool {
+        if self.inotify.is_none() {
+            std::thread::sleep(timeout);
+            return true;
+        }
+        self.poll(timeout)
+    }
+
+    fn poll(&mut self, timeout: Duration) -> bool {
+        let Some(fd) = &self.inotify else {
+            return false;
+        };
+        let mut pfd = libc::pollfd {
+            fd: fd.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        // `ppoll` takes nanoseconds, so the sampler's wait for a deadline
+        // is not rounded up to a whole millisecond.
+        let timeout = libc::timespec {
+            tv_sec: libc::time_t::try_from(timeout.as_secs()).unwrap_or(libc::time_t::MAX),
+            tv_nsec: libc::c_long::from(timeout.subsec_nanos().cast_signed()),
+        };
+        // SAFETY: `pfd` is a single valid pollfd and `timeout` outlives the
+        // call; a null sigmask leaves the signal mask alone.
+        if unsafe { libc::ppoll(&raw mut pfd, 1, &raw const timeout, std::ptr::null()) } <= 0 {
+            return false;
+        }
+
+        let mut changed = false;
+        loop {
+            // SAFETY: reads into our own buffer, bounded by its length.
+            let n =
+                unsafe { libc::read(fd.as_raw_fd(), self.buf.as_mut_ptr().cast(), self.buf.len()) };
+            let Ok(n) = usize::try_from(n) else {
+                // EAGAIN: drained.
+                break;
+            };
+            if n == 0 {
+                break;
+            }
+            changed |= events_touch_segment(&self.buf[..n]);
+        }
+        changed
+    }
+}
+
+impl Default for SegmentWatcher {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+fn open_inotify(dir: &str) -> Option<OwnedFd> {
+    let path = CString::new(dir).ok()?;
+    // SAFETY: plain syscall; the returned fd is owned below.
+    let raw = unsafe { libc::inotify_init1(libc::IN_NONBLOCK | libc::IN_CLOEXEC) };
+    if raw < 0 {
+        return None;
+    }
+    // SAFETY: `raw` is a fresh fd nothing else owns.
+    let fd = unsafe { OwnedFd::from_raw_fd(raw) };
+    // SAFETY: `path` is NUL-terminated and outlives the call.
+    if unsafe { libc::inotify_add_watch(fd.as_raw_fd(), path.as_ptr(), WATCH_MASK) } < 0 {
+        return None;
+    }
+    Some(fd)
+}
+
+/// Whether a buffer of `inotify_event`s names a stats segment. A queue
+/// overflow counts too, since the events it lost are unknown.
+fn events_touch_segment(mut buf: &[u8]) -> bool {
+    let mut touched = false;
+    while buf.len() >= EVENT_HEADER_SIZE {
+        // SAFETY: at least one header's worth of bytes remain; read_unaligned
+        // has no alignment requirement.
+        let event: libc::inotify_event =
+            unsafe { buf.as_ptr().cast::<libc::inotify_event>().read_unaligned() };
+        let end = (EVENT_HEADER_SIZE + event.len as usize).min(buf.len());
+        let name = &buf[EVENT_HEADER_SIZE..end];
+        let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+        if event.mask & libc::IN_Q_OVERFLOW != 0
+            || std::str::from_utf8(name).is_ok_and(|n| segment_pid(n).is_some())
+        {
+            touched = true;
+        }
+        buf = &buf[end..];
+    }
+    touched
+}
+
+/// Whether `pid` is `root` or one of its descendants.
+#[must_use]
+pub fn is_in_tree(pid: i32, root: i32) -> bool {
+    let mut current = pid;
+    // Bounded in case /proc changes under us and forms a cycle.
+    for _ in 0..64 {
+        if current == root {
+            return true;
+        }
+        match read_process_ppid(current) {
+            Some(parent) if parent > 0 && parent != current => current = parent,
+            _ => return false,
+        }
+    }
+    false
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn segment_names_parse() {
+        assert_eq!(segment_pid("fex-1234-stats"), Some(1234));
+        assert_eq!(segment_pid("fex--5-stats"), Some(-5));
+        assert_eq!(segment_pid("fex-1234-stat"), None);
+        assert_eq!(segment_pid("fex-abc-stats"), None);
+        assert_eq!(segment_pid("sem.fex-1-stats"), None);
+    }
+
+    #[test]
+    fn own_process_is_in_init_tree() {
+        #[allow(clippy::cast_possible_wrap)]
+        let me = std::process::id() as i32;
+        assert!(is_in_tree(me, me));
+        assert!(is_in_tree(me, 1) || read_process_ppid(me) == Some(0));
+        let parent = read_process_ppid(me).unwrap();
+        assert!(!is_in_tree(parent, me));
+    }
+
+    fn event(mask: u32, name: &str) -> Vec<u8> {
+        // Names are NUL-padded, as the kernel does.
+        let len = (name.len() + 1).next_multiple_of(16);
+        let header = libc::inotify_event {
+            wd: 1,
+            mask,
+            cookie: 0,
+            len: u32::try_from(len).unwrap(),
+        };
+        let mut buf = vec![0u8; EVENT_HEADER_SIZE + len];
+        // SAFETY: the buffer holds a full header.
+        unsafe {
+            buf.as_mut_ptr()
+                .cast::<libc::inotify_event>()
+                .write_unaligned(header);
+        }
+        buf[EVENT_HEADER_SIZE..EVENT_HEADER_SIZE + name.len()].copy_from_slice(name.as_bytes());
+        buf
+    }
+
+    #[test]
+    fn events_are_filtered_to_segments() {
+        let other = event(libc::IN_CREATE, "pulse-shm-1234");
+        assert!(!events_touch_segment(&other));
+        let mut both = other.clone();
+        both.extend(event(libc::IN_MODIFY, "fex-42-stats"));
+        assert!(events_touch_segment(&both));
+        assert!(events_touch_segment(&event(libc::IN_Q_OVERFLOW, "")));
+    }
+
+    #[test]
+    fn watcher_wakes_on_segment_creation() {
+        let dir = std::env::temp_dir().join("felix_discovery_test_watch");
+        std::fs::create_dir_all(&dir).unwrap();
+        let mut watcher = SegmentWatcher::watching(dir.to_str().unwrap());
+        assert!(watcher.is_event_driven());
+        assert!(!watcher.wait(Duration::ZERO));
+
+        std::fs::write(dir.join("unrelated"), b"x").unwrap();
+        assert!(!watcher.wait(Duration::from_millis(20)));
+
+        let start = std::time::Instant::now();
+        let segment = dir.join("fex-7-stats");
+        std::fs::write(&segment, b"x").unwrap();
+        assert!(watcher.wait(Duration::from_secs(5)));
+        assert!(start.elapsed() < Duration::from_secs(1));
+
+        std::fs::remove_file(segment).ok();
+        std::fs::remove_file(dir.join("unrelated")).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+}
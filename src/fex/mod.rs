@@ -1,4 +1,5 @@
 // SPDX-License-Identifier: MIT
+pub mod discovery;
 pub mod platform;
 pub mod shm;
 pub mod smaps;
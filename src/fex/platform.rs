@@ -37,3 +37,81 @@ pub fn store_memory_barrier() {
     #[cfg(target_arch = "x86_64")]
     {}
 }
+
+/// Reads a monotonic counter suitable for scheduling sample deadlines.
+///
+/// On aarch64, reads `CNTVCT_EL0`, the same counter FEX timestamps with.
+/// On `x86_64`, returns `CLOCK_MONOTONIC` in nanoseconds.
+#[must_use]
+pub fn monotonic_counter() -> u64 {
+    #[cfg(target_arch = "aarch64")]
+    {
+        let ticks: u64;
+        // SAFETY: CNTVCT_EL0 is readable from userspace on Linux; the isb
+        // keeps the read from being speculated ahead of earlier code.
+        unsafe {
+            std::arch::asm!("isb", "mrs {}, cntvct_el0", out(reg) ticks, options(nomem, nostack));
+        }
+        ticks
+    }
+    #[cfg(target_arch = "x86_64")]
+    {
+        let mut ts = libc::timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        };
+        // SAFETY: valid clock id and a valid out pointer.
+        unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &raw mut ts) };
+        #[allow(clippy::cast_sign_loss)]
+        let ns = ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64;
+        ns
+    }
+}
+
+/// Ticks per second of `monotonic_counter`.
+#[must_use]
+pub fn monotonic_counter_frequency() -> u64 {
+    #[cfg(target_arch = "aarch64")]
+    {
+        cycle_counter_frequency()
+    }
+    #[cfg(target_arch = "x86_64")]
+    {
+        1_000_000_000
+    }
+}
+
+/// Restricts the calling thread to `cpu`. Threads spawned afterwards
+/// inherit the mask, so pin only after helper threads are running.
+///
+/// # Errors
+///
+/// Returns an error if `cpu` is out of range or not available to us.
+pub fn pin_current_thread(cpu: usize) -> anyhow::Result<()> {
+    // SAFETY: cpu_set_t is plain data; all-zero is the empty set.
+    let mut set: libc::cpu_set_t = unsafe { std::mem::zeroed() };
+    if cpu >= 8 * std::mem::size_of::<libc::cpu_set_t>() {
+        anyhow::bail!("CPU {cpu} is out of range");
+    }
+    // SAFETY: `cpu` was bounds-checked against the set size above.
+    unsafe { libc::CPU_SET(cpu, &mut set) };
+    // SAFETY: pid 0 is the calling thread and `set` is a valid cpu_set_t.
+    let rc = unsafe {
+        libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &raw const set)
+    };
+    if rc != 0 {
+        anyhow::bail!(
+            "failed to pin to CPU {cpu}: {}",
+            std::io::Error::last_os_error()
+        );
+    }
+    Ok(())
+}
+
+/// Sets the calling thread's timer slack to 1 ns so short sleeps are not
+/// rounded up by the default 50 us slack.
+pub fn minimize_timer_slack() {
+    // SAFETY: PR_SET_TIMERSLACK takes a plain integer and cannot fail in a
+    // way that matters here; on failure the default slack remains.
+    unsafe { libc::prctl(libc::PR_SET_TIMERSLACK, 1 as libc::c_ulong) };
+}
@@ -10,6 +10,10 @@ use nix::sys::stat::Mode;
 
 use super::types::{AppType, ThreadStats, ThreadStatsHeader};
 
+/// Further copies taken of an entry that changed while it was copied; if
+/// none matches the one before it, the last is used as is.
+const TORN_READ_RETRIES: usize = 3;
+
 #[derive(Debug, Clone)]
 pub struct HeaderSnapshot {
     pub version: u8,
@@ -25,6 +29,11 @@ pub struct ShmReader {
     base: NonNull<u8>,
     fd: OwnedFd,
     size: usize,
+    /// Offsets of the thread list entries, in list order, as of the last
+    /// read. Lets a sample copy known entries without chasing `next`.
+    offsets: Vec<u32>,
+    /// Entries of the last read that changed while being copied.
+    torn_reads: u32,
 }
 
 // SAFETY: The mapped memory is read-only and only accessed through volatile reads.
@@ -76,6 +85,8 @@ impl ShmReader {
             base,
             fd,
             size: file_size,
+            offsets: Vec::new(),
+            torn_reads: 0,
         })
     }
 
@@ -87,14 +98,7 @@ impl ShmReader {
     /// cannot happen because `open` validates the minimum size.
     #[must_use]
     pub fn read_header(&self) -> HeaderSnapshot {
-        assert!(self.size >= std::mem::size_of::<ThreadStatsHeader>());
-
-        // SAFETY: We validated that the mapping is at least as large as
-        // ThreadStatsHeader. The pointer is aligned because mmap returns
-        // page-aligned addresses. We use read_volatile because the other
-        // process may update these fields concurrently.
-        #[allow(clippy::cast_ptr_alignment)] // mmap guarantees page alignment
-        let raw = unsafe { ptr::read_volatile(self.base.as_ptr().cast::<ThreadStatsHeader>()) };
+        let raw = self.read_raw_header();
 
         let version_len = raw
             .fex_version
@@ -115,44 +119,122 @@ impl ShmReader {
         }
     }
 
-    /// Walks the linked list of thread stats from the header and returns
-    /// a snapshot of all thread stats entries.
-    #[must_use]
-    pub fn read_thread_stats(&self) -> Vec<ThreadStats> {
-        let header = self.read_header();
-        let mut result = Vec::new();
-        let mut offset = header.head;
+    /// Replaces the contents of `out` with a snapshot of every entry in
+    /// the thread list, remapping first if the region has grown. Reuses
+    /// `out`'s allocation.
+    ///
+    /// Entries are located through the offset table cached from the
+    /// previous read, so their loads are independent instead of each
+    /// waiting on the last entry's `next`. Every copied `next` is still
+    /// checked against the table: where the list was relinked, the rest is
+    /// walked afresh, and new threads are walked on from the old tail. Only
+    /// a changed head forces a full walk.
+    ///
+    /// Single-copy atomicity only covers each 16- or 8-byte chunk, so an
+    /// entry FEX updates mid-copy can mix old and new counters. Each entry
+    /// is copied until two consecutive copies agree, up to
+    /// `TORN_READ_RETRIES` extra copies; `torn_reads` reports how many
+    /// entries needed more than one.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the region grew and could not be remapped.
+    pub fn read_thread_stats_into(&mut self, out: &mut Vec<ThreadStats>) -> anyhow::Result<()> {
+        let header = self.read_raw_header();
+        self.remap_if_resized(header.size as usize)?;
+        out.clear();
+
+        if self.offsets.first() != Some(&header.head) {
+            self.offsets.clear();
+        }
 
-        while offset != 0 {
-            let offset_usize = offset as usize;
-            if offset_usize + std::mem::size_of::<ThreadStats>() > self.size {
+        let mut torn = 0;
+        let mut next = header.head;
+        let mut valid = 0;
+        for &offset in &self.offsets {
+            if offset != next {
                 break;
             }
+            let Some(stats) = self.read_entry(offset, &mut torn) else {
+                break;
+            };
+            next = stats.next;
+            out.push(stats);
+            valid += 1;
+        }
+        self.offsets.truncate(valid);
 
-            // SAFETY: We just bounds-checked that offset + sizeof(ThreadStats)
-            // fits within the mapped region. ThreadStats is repr(C, align(16))
-            // and shm offsets from FEX are always 16-byte aligned.
-            let stats = unsafe {
-                let src = self.base.as_ptr().add(offset_usize);
-                volatile_copy_thread_stats(src)
+        // Bounds the walk if the list is rewritten into a cycle under us.
+        let max_entries = self.size / std::mem::size_of::<ThreadStats>();
+        while next != 0 && self.offsets.len() < max_entries {
+            let Some(stats) = self.read_entry(next, &mut torn) else {
+                break;
             };
+            self.offsets.push(next);
+            next = stats.next;
+            out.push(stats);
+        }
+        self.torn_reads = torn;
+        Ok(())
+    }
 
-            offset = stats.next;
-            result.push(stats);
+    /// Entries of the last `read_thread_stats_into` that changed while they
+    /// were copied and had to be re-read.
+    #[must_use]
+    pub fn torn_reads(&self) -> u32 {
+        self.torn_reads
+    }
+
+    /// Copies the entry at `offset` until two consecutive copies agree,
+    /// counting it in `torn` if the first two did not.
+    fn read_entry(&self, offset: u32, torn: &mut u32) -> Option<ThreadStats> {
+        let mut stats = self.copy_entry(offset)?;
+        for retry in 0..TORN_READ_RETRIES {
+            let again = self.copy_entry(offset)?;
+            if again == stats {
+                break;
+            }
+            if retry == 0 {
+                *torn += 1;
+            }
+            stats = again;
+        }
+        Some(stats)
+    }
+
+    /// Copies the entry at `offset`, or `None` if it does not lie within the
+    /// mapping on a 16-byte boundary.
+    fn copy_entry(&self, offset: u32) -> Option<ThreadStats> {
+        let offset = offset as usize;
+        if offset + std::mem::size_of::<ThreadStats>() > self.size
+            || !offset.is_multiple_of(std::mem::align_of::<ThreadStats>())
+        {
+            return None;
         }
 
-        result
+        // SAFETY: We just checked that offset + sizeof(ThreadStats) fits
+        // within the mapped region and that the entry is 16-byte aligned, as
+        // ThreadStats (repr(C, align(16))) requires.
+        Some(unsafe { volatile_copy_thread_stats(self.base.as_ptr().add(offset)) })
     }
 
-    /// Re-checks the shared memory size and remaps if it has grown.
-    ///
-    /// # Errors
-    ///
-    /// Returns an error if the remap fails.
-    pub fn check_resize(&mut self) -> anyhow::Result<()> {
-        let header = self.read_header();
+    /// Volatile copy of the raw header; unlike `read_header` it does not
+    /// allocate, so it is used on the sampling path.
+    fn read_raw_header(&self) -> ThreadStatsHeader {
+        assert!(self.size >= std::mem::size_of::<ThreadStatsHeader>());
+
+        // SAFETY: We validated that the mapping is at least as large as
+        // ThreadStatsHeader. The pointer is aligned because mmap returns
+        // page-aligned addresses. We use read_volatile because the other
+        // process may update these fields concurrently.
+        #[allow(clippy::cast_ptr_alignment)] // mmap guarantees page alignment
+        unsafe {
+            ptr::read_volatile(self.base.as_ptr().cast::<ThreadStatsHeader>())
+        }
+    }
 
-        let new_size = header.size as usize;
+    /// Remaps if the header reports a size different from the mapping.
+    fn remap_if_resized(&mut self, new_size: usize) -> anyhow::Result<()> {
         if new_size == self.size || new_size == 0 {
             return Ok(());
         }
@@ -239,3 +321,196 @@ unsafe fn volatile_copy_thread_stats(src: *const u8) -> ThreadStats {
 
     dest
 }
+
+/// Stats segments for tests, laid out like FEX's.
+#[cfg(test)]
+pub(crate) mod test_segment {
+    use std::fs::File;
+    use std::os::unix::fs::FileExt;
+    use std::sync::atomic::{AtomicI32, Ordering};
+
+    use nix::fcntl::OFlag;
+    use nix::sys::mman;
+    use nix::sys::stat::Mode;
+
+    use super::ThreadStats;
+
+    pub const HEADER_SIZE: usize = 64;
+    pub const STATS_SIZE: usize = std::mem::size_of::<ThreadStats>();
+
+    /// A segment under a negative "pid", which keeps its name clear of real
+    /// FEX processes. Unlinked on drop.
+    pub struct TestSegment {
+        pub pid: i32,
+        name: String,
+        file: File,
+    }
+
+    impl TestSegment {
+        pub fn create(contents: &[u8]) -> Self {
+            static NEXT: AtomicI32 = AtomicI32::new(0);
+            #[allow(clippy::cast_possible_wrap)]
+            let pid = -(std::process::id() as i32 * 100 + NEXT.fetch_add(1, Ordering::Relaxed));
+            let name = format!("/fex-{pid}-stats");
+            let fd = mman::shm_open(
+                name.as_str(),
+                OFlag::O_CREAT | OFlag::O_EXCL | OFlag::O_RDWR,
+                Mode::S_IRUSR | Mode::S_IWUSR,
+            )
+            .unwrap();
+            let file = File::from(fd);
+            file.write_all_at(contents, 0).unwrap();
+            Self { pid, name, file }
+        }
+
+        pub fn write_u32(&self, at: usize, value: u32) {
+            self.file
+                .write_all_at(&value.to_le_bytes(), at as u64)
+                .unwrap();
+        }
+    }
+
+    impl Drop for TestSegment {
+        fn drop(&mut self) {
+            let _ = mman::shm_unlink(self.name.as_str());
+        }
+    }
+
+    /// Header followed by `threads` entries linked in address order, with
+    /// room for `capacity` entries. Entry `i` has TID `1000 + i`.
+    pub fn linked_segment(threads: u32, capacity: u32) -> Vec<u8> {
+        let size = HEADER_SIZE + STATS_SIZE * capacity as usize;
+        let mut buf = vec![0u8; size];
+        buf[2..4].copy_from_slice(&u16::try_from(STATS_SIZE).unwrap().to_le_bytes());
+        let head = if threads == 0 { 0 } else { HEADER_SIZE };
+        buf[52..56].copy_from_slice(&u32::try_from(head).unwrap().to_le_bytes());
+        buf[56..60].copy_from_slice(&u32::try_from(size).unwrap().to_le_bytes());
+
+        for i in 0..capacity {
+            let at = entry_offset(i);
+            let next = if i + 1 >= threads { 0 } else { at + STATS_SIZE };
+            buf[at..at + 4].copy_from_slice(&u32::try_from(next).unwrap().to_le_bytes());
+            buf[at + 4..at + 8].copy_from_slice(&(1000 + i).to_le_bytes());
+            buf[at + 8..at + 16].copy_from_slice(&(u64::from(i) * 100).to_le_bytes());
+        }
+        buf
+    }
+
+    pub fn entry_offset(index: u32) -> usize {
+        HEADER_SIZE + STATS_SIZE * index as usize
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::test_segment::{HEADER_SIZE, TestSegment, entry_offset, linked_segment};
+    use super::*;
+
+    /// Reference walk of the list, without the offset cache.
+    fn walk(shm: &ShmReader) -> Vec<u32> {
+        let mut tids = Vec::new();
+        let mut offset = shm.read_raw_header().head;
+        while offset != 0 {
+            let stats = shm.copy_entry(offset).unwrap();
+            tids.push(stats.tid);
+            offset = stats.next;
+        }
+        tids
+    }
+
+    fn read_tids(shm: &mut ShmReader, out: &mut Vec<ThreadStats>) -> Vec<u32> {
+        shm.read_thread_stats_into(out).unwrap();
+        out.iter().map(|s| s.tid).collect()
+    }
+
+    fn offset_u32(index: u32) -> u32 {
+        u32::try_from(entry_offset(index)).unwrap()
+    }
+
+    #[test]
+    fn cached_offsets_follow_list_changes() {
+        let segment = TestSegment::create(&linked_segment(4, 8));
+        let mut shm = ShmReader::open(segment.pid).unwrap();
+        let mut out = Vec::new();
+
+        assert_eq!(read_tids(&mut shm, &mut out), [1000, 1001, 1002, 1003]);
+        // Nothing writes concurrently, so every first re-read agrees.
+        assert_eq!(shm.torn_reads(), 0);
+        assert_eq!(read_tids(&mut shm, &mut out), walk(&shm));
+
+        // New threads are linked on from the old tail.
+        segment.write_u32(entry_offset(3), offset_u32(4));
+        segment.write_u32(entry_offset(4), offset_u32(5));
+        assert_eq!(
+            read_tids(&mut shm, &mut out),
+            [1000, 1001, 1002, 1003, 1004, 1005]
+        );
+
+        // A thread in the middle exits and is unlinked.
+        segment.write_u32(entry_offset(1), offset_u32(3));
+        assert_eq!(
+            read_tids(&mut shm, &mut out),
+            [1000, 1001, 1003, 1004, 1005]
+        );
+        assert_eq!(shm.offsets.len(), 5);
+
+        // The list is rebuilt from a new head.
+        segment.write_u32(52, offset_u32(6));
+        segment.write_u32(entry_offset(6), offset_u32(0));
+        assert_eq!(
+            read_tids(&mut shm, &mut out),
+            [1006, 1000, 1001, 1003, 1004, 1005]
+        );
+        assert_eq!(read_tids(&mut shm, &mut out), walk(&shm));
+
+        // A cycle written under us does not hang the reader.
+        segment.write_u32(entry_offset(5), offset_u32(6));
+        read_tids(&mut shm, &mut out);
+        assert!(out.len() <= shm.size / std::mem::size_of::<ThreadStats>());
+
+        // Emptied list.
+        segment.write_u32(52, 0);
+        assert!(read_tids(&mut shm, &mut out).is_empty());
+        assert!(shm.offsets.is_empty());
+    }
+
+    #[test]
+    fn misaligned_or_out_of_range_links_end_the_walk() {
+        let segment = TestSegment::create(&linked_segment(2, 2));
+        let mut shm = ShmReader::open(segment.pid).unwrap();
+        let mut out = Vec::new();
+
+        segment.write_u32(entry_offset(1), u32::try_from(HEADER_SIZE + 8).unwrap());
+        assert_eq!(read_tids(&mut shm, &mut out), [1000, 1001]);
+        segment.write_u32(entry_offset(1), u32::MAX - 15);
+        assert_eq!(read_tids(&mut shm, &mut out), [1000, 1001]);
+    }
+
+    /// `cargo test --release -- --ignored bench_ --nocapture --test-threads=1`.
+    ///
+    /// Reads linked segments of 10 to 10,000 threads with nothing writing
+    /// concurrently, so every entry is copied twice.
+    #[test]
+    #[ignore = "benchmark"]
+    fn bench_read_thread_stats() {
+        for threads in [10, 100, 1000, 10_000] {
+            let segment = TestSegment::create(&linked_segment(threads, threads));
+            let mut shm = ShmReader::open(segment.pid).unwrap();
+            let mut out = Vec::new();
+            let iters = (1_000_000 / threads).clamp(10, 10_000);
+
+            shm.read_thread_stats_into(&mut out).unwrap();
+            assert_eq!(out.len(), threads as usize);
+            let start = std::time::Instant::now();
+            for _ in 0..iters {
+                shm.read_thread_stats_into(std::hint::black_box(&mut out))
+                    .unwrap();
+            }
+            let per_iter = start.elapsed() / iters;
+            eprintln!(
+                "read_thread_stats threads={threads}: {} ns/iter",
+                per_iter.as_nanos()
+            );
+        }
+    }
+}
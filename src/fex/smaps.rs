@@ -1,18 +1,19 @@
 // SPDX-License-Identifier: MIT
 use std::fs::File;
 use std::io::{Read, Seek, SeekFrom};
+use std::os::unix::fs::FileExt;
 
 use anyhow::Context;
 use serde::{Deserialize, Serialize};
 
-#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+#[derive(Debug, Clone, Default, PartialEq, Eq, Serialize, Deserialize)]
 pub struct LargestAnon {
     pub begin: u64,
     pub end: u64,
     pub size: u64,
 }
 
-#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+#[derive(Debug, Clone, Default, PartialEq, Eq, Serialize, Deserialize)]
 pub struct MemSnapshot {
     pub total_anon: u64,
     pub jit_code: u64,
@@ -29,13 +30,58 @@ pub struct MemSnapshot {
     pub largest_anon: LargestAnon,
 }
 
+/// Pagemap entries read per syscall.
+const PAGEMAP_CHUNK: usize = 4096;
+const PAGEMAP_PRESENT: u64 = 1 << 63;
+/// Pages of pagemap costing about one mapping of smaps (`bench_smaps`):
+/// pagemap writes an entry for every page, smaps a block of text per
+/// mapping but skips unpopulated page tables. Sampling reads smaps instead
+/// once the accessible tracked pages exceed this per mapping.
+const PAGEMAP_PAGES_PER_MAPPING: u64 = 1024;
+
 pub struct MemSampler {
+    maps: File,
+    maps_buf: Vec<u8>,
+    prev_maps: Vec<u8>,
+    regions: Vec<TrackedRegion>,
+    /// Pages of the accessible `regions`, which pagemap has to read.
+    pagemap_pages: u64,
+    /// Lines of `/proc/{pid}/maps`, which smaps has to write out.
+    mappings: u64,
+    source: RssSource,
+    page_size: u64,
+    pid: i32,
+}
+
+/// Where per-region Rss comes from: `pagemap` walks only the tracked ranges,
+/// and `smaps` once they are too large for that (opened when first needed);
+/// `Smaps` is the fallback when pagemap cannot be read.
+enum RssSource {
+    Pagemap {
+        file: File,
+        buf: Vec<u64>,
+        smaps: Option<SmapsFile>,
+    },
+    Smaps(SmapsFile),
+}
+
+struct SmapsFile {
     file: File,
-    buf: String,
+    buf: Vec<u8>,
+}
+
+/// A FEX or allocator mapping from `/proc/{pid}/maps`.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+struct TrackedRegion {
+    begin: u64,
+    end: u64,
+    region: ActiveRegion,
+    /// `---p`: reserved address space, which has no resident pages to count.
+    prot_none: bool,
 }
 
 /// Identifies which sub-region accumulator an smaps region maps to.
-#[derive(Clone, Copy)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
 enum ActiveRegion {
     JitCode,
     OpDispatcher,
@@ -51,118 +97,309 @@ enum ActiveRegion {
 }
 
 impl MemSampler {
-    /// Opens `/proc/{pid}/smaps` and keeps the fd open for repeated sampling.
+    /// Opens `/proc/{pid}/maps` and `/proc/{pid}/pagemap` (or `smaps` if
+    /// pagemap is unavailable) and keeps the fds open for repeated sampling.
     ///
     /// # Errors
     ///
-    /// Returns an error if the smaps file cannot be opened.
+    /// Returns an error if neither pagemap nor smaps can be opened.
     pub fn new(pid: i32) -> anyhow::Result<Self> {
-        let path = format!("/proc/{pid}/smaps");
-        let file = File::open(&path).with_context(|| format!("failed to open {path}"))?;
+        let path = format!("/proc/{pid}/maps");
+        let maps = File::open(&path).with_context(|| format!("failed to open {path}"))?;
+        let source = match File::open(format!("/proc/{pid}/pagemap")) {
+            Ok(file) => RssSource::Pagemap {
+                file,
+                buf: vec![0; PAGEMAP_CHUNK],
+                smaps: None,
+            },
+            Err(_) => RssSource::Smaps(SmapsFile::open(pid)?),
+        };
+
+        // SAFETY: sysconf has no preconditions.
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) };
         Ok(Self {
-            file,
-            buf: String::with_capacity(256 * 1024),
+            maps,
+            maps_buf: Vec::with_capacity(64 * 1024),
+            prev_maps: Vec::new(),
+            regions: Vec::new(),
+            pagemap_pages: 0,
+            mappings: 0,
+            source,
+            page_size: u64::try_from(page_size).unwrap_or(4096),
+            pid,
         })
     }
 
-    /// Reads and parses the full smaps file, returning a memory snapshot.
+    /// Samples Rss of the FEX and allocator mappings.
+    ///
+    /// The region table is rebuilt only when `/proc/{pid}/maps` changed since
+    /// the previous sample. Reserved (`---p`) ranges are kept in it but not
+    /// read, and count as empty on either path. If the accessible ranges are too large for pagemap to be the
+    /// cheaper read, this sample parses smaps instead. If pagemap turns out
+    /// to be unreadable the sampler switches to parsing smaps for the rest
+    /// of its life.
     ///
     /// # Errors
     ///
     /// Returns an error if seeking or reading fails.
     pub fn sample(&mut self) -> anyhow::Result<MemSnapshot> {
-        self.buf.clear();
-        self.file
-            .seek(SeekFrom::Start(0))
-            .context("failed to seek smaps")?;
-        self.file
-            .read_to_string(&mut self.buf)
-            .context("failed to read smaps")?;
+        if let RssSource::Smaps(smaps) = &mut self.source {
+            return smaps.sample();
+        }
+
+        read_from_start(&mut self.maps, &mut self.maps_buf).context("failed to read maps")?;
+        if self.maps_buf != self.prev_maps {
+            self.regions.clear();
+            self.regions.extend(parse_maps(&self.maps_buf));
+            self.pagemap_pages = self
+                .regions
+                .iter()
+                .filter(|r| !r.prot_none)
+                .map(|r| r.end.div_ceil(self.page_size) - r.begin / self.page_size)
+                .sum();
+            self.mappings = self.maps_buf.split(|&b| b == b'\n').count() as u64;
+            std::mem::swap(&mut self.maps_buf, &mut self.prev_maps);
+        }
+
+        if !self.pagemap_cheaper()
+            && let RssSource::Pagemap { smaps, .. } = &mut self.source
+        {
+            let smaps = match smaps {
+                Some(smaps) => smaps,
+                None => smaps.insert(SmapsFile::open(self.pid)?),
+            };
+            return smaps.sample();
+        }
+        if let Ok(snap) = self.sample_pagemap() {
+            return Ok(snap);
+        }
+        self.source = RssSource::Smaps(SmapsFile::open(self.pid)?);
+        self.sample()
+    }
 
+    /// Whether reading the accessible tracked pages from pagemap costs less
+    /// than one read of smaps.
+    fn pagemap_cheaper(&self) -> bool {
+        self.pagemap_pages <= self.mappings.max(1) * PAGEMAP_PAGES_PER_MAPPING
+    }
+
+    fn sample_pagemap(&mut self) -> std::io::Result<MemSnapshot> {
+        let RssSource::Pagemap { file, buf, .. } = &mut self.source else {
+            unreachable!("sample_pagemap called without pagemap");
+        };
+
+        let mut snap = MemSnapshot::default();
+        for region in &self.regions {
+            if region.prot_none {
+                snap.add(region.region, 0, region.begin, region.end);
+                continue;
+            }
+            let mut resident: u64 = 0;
+            let mut page = region.begin / self.page_size;
+            let end_page = region.end.div_ceil(self.page_size);
+            while page < end_page {
+                #[allow(clippy::cast_possible_truncation)]
+                let n = (end_page - page).min(PAGEMAP_CHUNK as u64) as usize;
+                let bytes = as_bytes_mut(&mut buf[..n]);
+                file.read_exact_at(bytes, page * 8)?;
+                resident += buf[..n]
+                    .iter()
+                    .filter(|&&e| e & PAGEMAP_PRESENT != 0)
+                    .count() as u64;
+                page += n as u64;
+            }
+            snap.add(
+                region.region,
+                resident * self.page_size,
+                region.begin,
+                region.end,
+            );
+        }
+        Ok(snap)
+    }
+}
+
+impl SmapsFile {
+    fn open(pid: i32) -> anyhow::Result<Self> {
+        let path = format!("/proc/{pid}/smaps");
+        let file = File::open(&path).with_context(|| format!("failed to open {path}"))?;
+        Ok(Self {
+            file,
+            buf: Vec::with_capacity(256 * 1024),
+        })
+    }
+
+    fn sample(&mut self) -> anyhow::Result<MemSnapshot> {
+        read_from_start(&mut self.file, &mut self.buf).context("failed to read smaps")?;
         Ok(parse_smaps(&self.buf))
     }
 }
 
-fn parse_smaps(content: &str) -> MemSnapshot {
+impl MemSnapshot {
+    fn add(&mut self, region: ActiveRegion, rss_bytes: u64, begin: u64, end: u64) {
+        self.total_anon += rss_bytes;
+        let target = match region {
+            ActiveRegion::JitCode => &mut self.jit_code,
+            ActiveRegion::OpDispatcher => &mut self.op_dispatcher,
+            ActiveRegion::Frontend => &mut self.frontend,
+            ActiveRegion::CpuBackend => &mut self.cpu_backend,
+            ActiveRegion::Lookup => &mut self.lookup,
+            ActiveRegion::LookupL1 => &mut self.lookup_l1,
+            ActiveRegion::ThreadStates => &mut self.thread_states,
+            ActiveRegion::BlockLinks => &mut self.block_links,
+            ActiveRegion::Misc => &mut self.misc,
+            ActiveRegion::JeMalloc => &mut self.jemalloc,
+            ActiveRegion::Unaccounted => &mut self.unaccounted,
+        };
+        *target += rss_bytes;
+
+        if region == ActiveRegion::JeMalloc && rss_bytes > self.largest_anon.size {
+            self.largest_anon = LargestAnon {
+                begin,
+                end,
+                size: rss_bytes,
+            };
+        }
+    }
+}
+
+fn read_from_start(file: &mut File, buf: &mut Vec<u8>) -> std::io::Result<()> {
+    buf.clear();
+    file.seek(SeekFrom::Start(0))?;
+    file.read_to_end(buf)?;
+    Ok(())
+}
+
+fn as_bytes_mut(words: &mut [u64]) -> &mut [u8] {
+    // SAFETY: u64 has no invalid bit patterns and u8 has alignment 1.
+    unsafe { std::slice::from_raw_parts_mut(words.as_mut_ptr().cast(), words.len() * 8) }
+}
+
+/// Classifies a mapping by the name at the end of its maps/smaps header line.
+fn classify(line: &[u8]) -> Option<ActiveRegion> {
+    let name = mapping_name(line);
+    if name.is_empty() {
+        return None;
+    }
+    if contains(name, b"FEXMem") {
+        // Order matters: check more specific names before less specific ones.
+        Some(if contains(name, b"FEXMemJIT") {
+            ActiveRegion::JitCode
+        } else if contains(name, b"FEXMem_OpDispatcher") {
+            ActiveRegion::OpDispatcher
+        } else if contains(name, b"FEXMem_Frontend") {
+            ActiveRegion::Frontend
+        } else if contains(name, b"FEXMem_CPUBackend") {
+            ActiveRegion::CpuBackend
+        } else if contains(name, b"FEXMem_Lookup_L1") {
+            ActiveRegion::LookupL1
+        } else if contains(name, b"FEXMem_Lookup") {
+            ActiveRegion::Lookup
+        } else if contains(name, b"FEXMem_ThreadState") {
+            ActiveRegion::ThreadStates
+        } else if contains(name, b"FEXMem_BlockLinks") {
+            ActiveRegion::BlockLinks
+        } else if contains(name, b"FEXMem_Misc") {
+            ActiveRegion::Misc
+        } else {
+            ActiveRegion::Unaccounted
+        })
+    } else if contains(name, b"JEMalloc") || contains(name, b"FEXAllocator") {
+        Some(ActiveRegion::JeMalloc)
+    } else {
+        None
+    }
+}
+
+/// Returns the pathname field of a header line: everything after the fifth
+/// whitespace-separated field (address, perms, offset, dev, inode).
+fn mapping_name(line: &[u8]) -> &[u8] {
+    let mut rest = line;
+    for _ in 0..5 {
+        let start = rest
+            .iter()
+            .position(|b| !b.is_ascii_whitespace())
+            .unwrap_or(rest.len());
+        rest = &rest[start..];
+        let end = rest
+            .iter()
+            .position(u8::is_ascii_whitespace)
+            .unwrap_or(rest.len());
+        rest = &rest[end..];
+    }
+    rest
+}
+
+/// Substring search for the short, non-empty literal names above.
+fn contains(haystack: &[u8], needle: &[u8]) -> bool {
+    haystack.len() >= needle.len()
+        && (0..=haystack.len() - needle.len())
+            .any(|i| haystack[i] == needle[0] && haystack[i..].starts_with(needle))
+}
+
+/// Header lines start with a lowercase hex address; attribute lines
+/// (`Rss:`, `VmFlags:`, ...) start with an uppercase letter.
+fn is_header_line(line: &[u8]) -> bool {
+    line.first()
+        .is_some_and(|b| b.is_ascii_digit() || (b'a'..=b'f').contains(b))
+}
+
+/// Extracts the tracked regions from `/proc/{pid}/maps` content.
+fn parse_maps(content: &[u8]) -> impl Iterator<Item = TrackedRegion> + '_ {
+    content.split(|&b| b == b'\n').filter_map(|line| {
+        let region = classify(line)?;
+        let (begin, end) = parse_address_range(line)?;
+        Some(TrackedRegion {
+            begin,
+            end,
+            region,
+            prot_none: is_prot_none(line),
+        })
+    })
+}
+
+/// Whether the permissions field of a maps line is `---p` or `---s`.
+fn is_prot_none(line: &[u8]) -> bool {
+    line.iter()
+        .position(|&b| b == b' ')
+        .is_some_and(|space| line[space + 1..].starts_with(b"---"))
+}
+
+fn parse_smaps(content: &[u8]) -> MemSnapshot {
     let mut snap = MemSnapshot::default();
     let mut active: Option<ActiveRegion> = None;
     let mut current_begin: u64 = 0;
     let mut current_end: u64 = 0;
 
-    for line in content.lines() {
+    for line in content.split(|&b| b == b'\n') {
         // Region header lines look like:
         // 359519000-359918000 ---p 00000000 00:00 0    [anon:FEXMem]
-        if line.contains("FEXMem") {
-            if let Some((begin, end)) = parse_address_range(line) {
-                current_begin = begin;
-                current_end = end;
-            }
-
-            // Order matters: check more specific names before less specific ones.
-            if line.contains("FEXMemJIT") {
-                active = Some(ActiveRegion::JitCode);
-            } else if line.contains("FEXMem_OpDispatcher") {
-                active = Some(ActiveRegion::OpDispatcher);
-            } else if line.contains("FEXMem_Frontend") {
-                active = Some(ActiveRegion::Frontend);
-            } else if line.contains("FEXMem_CPUBackend") {
-                active = Some(ActiveRegion::CpuBackend);
-            } else if line.contains("FEXMem_Lookup_L1") {
-                active = Some(ActiveRegion::LookupL1);
-            } else if line.contains("FEXMem_Lookup") {
-                active = Some(ActiveRegion::Lookup);
-            } else if line.contains("FEXMem_ThreadState") {
-                active = Some(ActiveRegion::ThreadStates);
-            } else if line.contains("FEXMem_BlockLinks") {
-                active = Some(ActiveRegion::BlockLinks);
-            } else if line.contains("FEXMem_Misc") {
-                active = Some(ActiveRegion::Misc);
-            } else {
-                active = Some(ActiveRegion::Unaccounted);
+        if is_header_line(line) {
+            if let Some(region) = classify(line) {
+                // Reserved ranges count as empty, as on the pagemap path,
+                // whatever an earlier mapping left resident in them.
+                if is_prot_none(line) {
+                    active = None;
+                    continue;
+                }
+                active = Some(region);
+                if let Some((begin, end)) = parse_address_range(line) {
+                    current_begin = begin;
+                    current_end = end;
+                }
             }
             continue;
         }
 
-        if line.contains("JEMalloc") || line.contains("FEXAllocator") {
-            active = Some(ActiveRegion::JeMalloc);
-            if let Some((begin, end)) = parse_address_range(line) {
-                current_begin = begin;
-                current_end = end;
-            }
+        // Attribute lines of untracked regions only matter as far as the
+        // next header.
+        let Some(region) = active else {
             continue;
-        }
-
-        if line.contains("VmFlags") {
+        };
+        if line.starts_with(b"VmFlags") {
             active = None;
-            continue;
-        }
-
-        if let Some(region) = active
-            && let Some(rss_bytes) = parse_rss_line(line)
-        {
-            snap.total_anon += rss_bytes;
-            let target = match region {
-                ActiveRegion::JitCode => &mut snap.jit_code,
-                ActiveRegion::OpDispatcher => &mut snap.op_dispatcher,
-                ActiveRegion::Frontend => &mut snap.frontend,
-                ActiveRegion::CpuBackend => &mut snap.cpu_backend,
-                ActiveRegion::Lookup => &mut snap.lookup,
-                ActiveRegion::LookupL1 => &mut snap.lookup_l1,
-                ActiveRegion::ThreadStates => &mut snap.thread_states,
-                ActiveRegion::BlockLinks => &mut snap.block_links,
-                ActiveRegion::Misc => &mut snap.misc,
-                ActiveRegion::JeMalloc => &mut snap.jemalloc,
-                ActiveRegion::Unaccounted => &mut snap.unaccounted,
-            };
-            *target += rss_bytes;
-
-            if matches!(region, ActiveRegion::JeMalloc) && rss_bytes > snap.largest_anon.size {
-                snap.largest_anon = LargestAnon {
-                    begin: current_begin,
-                    end: current_end,
-                    size: rss_bytes,
-                };
-            }
+        } else if let Some(rss_bytes) = parse_rss_line(line) {
+            snap.add(region, rss_bytes, current_begin, current_end);
         }
     }
 
@@ -171,30 +408,43 @@ fn parse_smaps(content: &str) -> MemSnapshot {
 
 /// Parses an address range from the start of a mapping line.
 /// Example: `359519000-359918000 ---p ...` -> Some((0x359519000, 0x359918000))
-fn parse_address_range(line: &str) -> Option<(u64, u64)> {
-    let addr_part = line.split_whitespace().next()?;
-    let (begin_str, end_str) = addr_part.split_once('-')?;
-    let begin = u64::from_str_radix(begin_str, 16).ok()?;
-    let end = u64::from_str_radix(end_str, 16).ok()?;
+fn parse_address_range(line: &[u8]) -> Option<(u64, u64)> {
+    let dash = line.iter().position(|&b| b == b'-')?;
+    let end_len = line[dash + 1..]
+        .iter()
+        .position(|&b| b == b' ')
+        .unwrap_or(line.len() - dash - 1);
+    let begin = parse_hex(&line[..dash])?;
+    let end = parse_hex(&line[dash + 1..dash + 1 + end_len])?;
     Some((begin, end))
 }
 
-/// Parses an `Rss:` line and returns the value in bytes.
-/// Example: `Rss:                 560 kB` -> Some(573440)
-fn parse_rss_line(line: &str) -> Option<u64> {
-    let trimmed = line.trim_start();
-    if !trimmed.starts_with("Rss:") {
+fn parse_hex(digits: &[u8]) -> Option<u64> {
+    if digits.is_empty() || digits.len() > 16 {
         return None;
     }
+    digits.iter().try_fold(0u64, |acc, &b| {
+        let d = (b as char).to_digit(16)?;
+        Some(acc << 4 | u64::from(d))
+    })
+}
 
-    let value_part = trimmed.strip_prefix("Rss:")?;
-    let mut parts = value_part.split_whitespace();
+/// Parses an `Rss:` line and returns the value in bytes.
+/// Example: `Rss:                 560 kB` -> Some(573440)
+fn parse_rss_line(line: &[u8]) -> Option<u64> {
+    let value_part = line.trim_ascii_start().strip_prefix(b"Rss:")?;
+    let mut parts = value_part
+        .split(u8::is_ascii_whitespace)
+        .filter(|p| !p.is_empty());
     let size_str = parts.next()?;
     let granule = parts.next()?;
 
-    let size: u64 = size_str.parse().ok()?;
+    let size = size_str.iter().try_fold(0u64, |acc, &b| {
+        let d = (b as char).to_digit(10)?;
+        acc.checked_mul(10)?.checked_add(u64::from(d))
+    })?;
 
-    if granule == "kB" {
+    if granule == b"kB" {
         Some(size * 1024)
     } else {
         None
@@ -207,22 +457,25 @@ mod tests {
 
     #[test]
     fn parse_rss_line_valid() {
-        assert_eq!(parse_rss_line("Rss:                 560 kB"), Some(573_440));
+        assert_eq!(
+            parse_rss_line(b"Rss:                 560 kB"),
+            Some(573_440)
+        );
     }
 
     #[test]
     fn parse_rss_line_zero() {
-        assert_eq!(parse_rss_line("Rss:                   0 kB"), Some(0));
+        assert_eq!(parse_rss_line(b"Rss:                   0 kB"), Some(0));
     }
 
     #[test]
     fn parse_rss_line_not_rss() {
-        assert_eq!(parse_rss_line("Pss:                 560 kB"), None);
+        assert_eq!(parse_rss_line(b"Pss:                 560 kB"), None);
     }
 
     #[test]
     fn parse_address_range_valid() {
-        let line = "359519000-359918000 ---p 00000000 00:00 0                                [anon:FEXMem]";
+        let line = b"359519000-359918000 ---p 00000000 00:00 0                                [anon:FEXMem]";
         assert_eq!(
             parse_address_range(line),
             Some((0x3_5951_9000, 0x3_5991_8000))
@@ -231,22 +484,365 @@ mod tests {
 
     #[test]
     fn parse_smaps_basic() {
-        let content = "\
-359519000-359918000 ---p 00000000 00:00 0                                [anon:FEXMemJIT]
+        let content = b"\
+359519000-359918000 rwxp 00000000 00:00 0                                [anon:FEXMemJIT]
 Size:               4096 kB
 Rss:                 560 kB
 Pss:                 560 kB
-VmFlags: rd
-400000000-400100000 ---p 00000000 00:00 0                                [anon:JEMalloc]
+VmFlags: rd wr ex
+400000000-400100000 rw-p 00000000 00:00 0                                [anon:JEMalloc]
 Size:               1024 kB
 Rss:                 128 kB
 Pss:                 128 kB
 VmFlags: rd wr
+500000000-500100000 ---p 00000000 00:00 0                                [anon:FEXMem_Lookup]
+Size:               1024 kB
+Rss:                  64 kB
+Pss:                  64 kB
+VmFlags: mr mw me
 ";
         let snap = parse_smaps(content);
         assert_eq!(snap.jit_code, 560 * 1024);
         assert_eq!(snap.jemalloc, 128 * 1024);
+        assert_eq!(snap.lookup, 0);
         assert_eq!(snap.total_anon, (560 + 128) * 1024);
         assert_eq!(snap.largest_anon.size, 128 * 1024);
     }
+
+    #[test]
+    fn parse_smaps_ignores_names_in_attribute_lines() {
+        let content = b"\
+7f0000000000-7f0000001000 rw-p 00000000 00:00 0 
+Size:                  4 kB
+Rss:                   4 kB
+VmFlags: rd wr
+7f0000001000-7f0000002000 rw-p 00000000 00:00 0                          [anon:FEXMem_Lookup_L1]
+Rss:                   8 kB
+VmFlags: rd wr
+";
+        let snap = parse_smaps(content);
+        assert_eq!(snap.lookup_l1, 8 * 1024);
+        assert_eq!(snap.lookup, 0);
+        assert_eq!(snap.total_anon, 8 * 1024);
+    }
+
+    #[test]
+    fn parse_maps_extracts_tracked_regions() {
+        let content = b"\
+55d0c0000000-55d0c0021000 r-xp 00000000 08:01 1234                       /usr/bin/FEXInterpreter
+359519000-359918000 ---p 00000000 00:00 0                                [anon:FEXMemJIT]
+400000000-400100000 rw-p 00000000 00:00 0                                [anon:JEMalloc]
+7ffd00000000-7ffd00021000 rw-p 00000000 00:00 0                          [stack]
+";
+        let regions: Vec<_> = parse_maps(content).collect();
+        assert_eq!(
+            regions,
+            vec![
+                TrackedRegion {
+                    begin: 0x3_5951_9000,
+                    end: 0x3_5991_8000,
+                    region: ActiveRegion::JitCode,
+                    prot_none: true,
+                },
+                TrackedRegion {
+                    begin: 0x4_0000_0000,
+                    end: 0x4_0010_0000,
+                    region: ActiveRegion::JeMalloc,
+                    prot_none: false,
+                },
+            ]
+        );
+    }
+
+    fn page_size() -> usize {
+        // SAFETY: sysconf has no preconditions.
+        usize::try_from(unsafe { libc::sysconf(libc::_SC_PAGESIZE) }).unwrap()
+    }
+
+    /// A shared memfd mapping in this process; it shows up in maps as
+    /// `/memfd:<name> (deleted)`, so its name classifies it.
+    struct NamedMapping {
+        addr: *mut libc::c_void,
+        len: usize,
+        fd: i32,
+    }
+
+    impl NamedMapping {
+        fn new(name: &std::ffi::CStr, pages: usize, prot: i32) -> Self {
+            let len = pages * page_size();
+            // SAFETY: valid NUL-terminated name; the fd is closed on drop.
+            let fd = unsafe { libc::memfd_create(name.as_ptr(), 0) };
+            assert!(fd >= 0);
+            // SAFETY: fd is a valid memfd.
+            assert_eq!(
+                unsafe { libc::ftruncate(fd, libc::off_t::try_from(len).unwrap()) },
+                0
+            );
+            // SAFETY: shared mapping of the memfd, unmapped on drop.
+            let addr =
+                unsafe { libc::mmap(std::ptr::null_mut(), len, prot, libc::MAP_SHARED, fd, 0) };
+            assert_ne!(addr, libc::MAP_FAILED);
+            Self { addr, len, fd }
+        }
+
+        fn touch(&self, pages: usize) {
+            for i in 0..pages {
+                // SAFETY: within the mapping, which is writable.
+                unsafe {
+                    self.addr
+                        .cast::<u8>()
+                        .add(i * page_size())
+                        .write_volatile(1);
+                }
+            }
+        }
+
+        fn begin(&self) -> u64 {
+            self.addr as u64
+        }
+    }
+
+    impl Drop for NamedMapping {
+        fn drop(&mut self) {
+            // SAFETY: unmapping and closing what `new` created.
+            unsafe {
+                libc::munmap(self.addr, self.len);
+                libc::close(self.fd);
+            }
+        }
+    }
+
+    fn self_pid() -> i32 {
+        i32::try_from(std::process::id()).unwrap()
+    }
+
+    /// Checks that the pagemap path and the smaps path agree on the Rss of
+    /// a FEX region. Each test names its mappings differently, as they
+    /// share this process.
+    #[test]
+    fn pagemap_matches_smaps_for_named_region() {
+        const TOUCHED: usize = 5;
+
+        let mapping = NamedMapping::new(c"FEXMem_Misc", 16, libc::PROT_READ | libc::PROT_WRITE);
+        mapping.touch(TOUCHED);
+
+        let mut sampler = MemSampler::new(self_pid()).unwrap();
+        let via_pagemap = sampler.sample().unwrap();
+        // Sample twice so the cached region table path is exercised too.
+        let again = sampler.sample().unwrap();
+        let via_smaps = SmapsFile::open(self_pid()).unwrap().sample().unwrap();
+        drop(mapping);
+
+        assert_eq!(via_pagemap.misc, (TOUCHED * page_size()) as u64);
+        assert_eq!(again.misc, via_pagemap.misc);
+        assert_eq!(via_smaps.misc, via_pagemap.misc);
+    }
+
+    #[test]
+    fn reservations_are_skipped_and_huge_ranges_read_from_smaps() {
+        // Pages written before the range was made inaccessible stay
+        // resident; both paths leave them out all the same.
+        let reserved =
+            NamedMapping::new(c"FEXMem_BlockLinks", 64, libc::PROT_READ | libc::PROT_WRITE);
+        reserved.touch(4);
+        // SAFETY: the range is this mapping's own.
+        assert_eq!(
+            unsafe { libc::mprotect(reserved.addr, reserved.len, libc::PROT_NONE) },
+            0
+        );
+        let mut sampler = MemSampler::new(self_pid()).unwrap();
+        let snap = sampler.sample().unwrap();
+        assert_eq!(snap.block_links, 0);
+        let via_smaps = SmapsFile::open(self_pid()).unwrap().sample().unwrap();
+        assert_eq!(via_smaps.block_links, 0);
+        assert!(
+            sampler
+                .regions
+                .iter()
+                .any(|r| r.begin == reserved.begin() && r.prot_none)
+        );
+        assert!(sampler.pagemap_cheaper());
+
+        // 4 GiB of mostly untouched address space costs more to read from
+        // pagemap than all of smaps.
+        let huge = NamedMapping::new(
+            c"FEXMem_Lookup",
+            (4 << 30) / page_size(),
+            libc::PROT_READ | libc::PROT_WRITE,
+        );
+        huge.touch(3);
+        let snap = sampler.sample().unwrap();
+        assert!(!sampler.pagemap_cheaper());
+        assert!(matches!(
+            sampler.source,
+            RssSource::Pagemap { smaps: Some(_), .. }
+        ));
+        assert_eq!(snap.lookup, (3 * page_size()) as u64);
+        assert_eq!(snap.block_links, 0);
+    }
+
+    /// The pre-byte-parser implementation, kept as a reference for the
+    /// equivalence test and the benchmark.
+    fn reference_parse_smaps(content: &str) -> MemSnapshot {
+        let mut snap = MemSnapshot::default();
+        let mut active = None;
+        let (mut begin, mut end) = (0, 0);
+        for line in content.lines() {
+            if line.contains("FEXMem") || line.contains("JEMalloc") || line.contains("FEXAllocator")
+            {
+                active = classify(line.as_bytes());
+                if let Some(range) = parse_address_range(line.as_bytes()) {
+                    (begin, end) = range;
+                }
+                continue;
+            }
+            if line.contains("VmFlags") {
+                active = None;
+                continue;
+            }
+            if let Some(region) = active
+                && let Some(rss) = parse_rss_line(line.as_bytes())
+            {
+                snap.add(region, rss, begin, end);
+            }
+        }
+        snap
+    }
+
+    /// smaps text shaped like a large Proton title: mostly library and
+    /// anonymous mappings with FEX and allocator regions sprinkled in.
+    fn synthetic_smaps(mappings: usize) -> String {
+        use std::fmt::Write;
+
+        const NAMES: [&str; 8] = [
+            "[anon:FEXMemJIT]",
+            "[anon:FEXMem_Lookup_L1]",
+            "[anon:FEXMem_Lookup]",
+            "[anon:FEXMem_ThreadState]",
+            "[anon:FEXMem_CPUBackend]",
+            "[anon:FEXMem]",
+            "[anon:JEMalloc]",
+            "[anon:FEXAllocator]",
+        ];
+        let mut out = String::new();
+        for i in 0..mappings {
+            let begin = 0x7f00_0000_0000_u64 + i as u64 * 0x10_000;
+            let name = if i % 40 == 0 {
+                NAMES[(i / 40) % NAMES.len()]
+            } else if i % 3 == 0 {
+                "/usr/lib/wine/x86_64-windows/d3d11.dll"
+            } else {
+                ""
+            };
+            let rss = (i * 37) % 4096;
+            let _ = write!(
+                out,
+                "{begin:x}-{:x} rw-p 00000000 00:00 0                          {name}\n\
+                 Size:                 64 kB\n\
+                 KernelPageSize:        4 kB\n\
+                 MMUPageSize:           4 kB\n\
+                 Rss:                {rss:>4} kB\n\
+                 Pss:                {rss:>4} kB\n\
+                 Shared_Clean:          0 kB\n\
+                 Shared_Dirty:          0 kB\n\
+                 Private_Clean:         0 kB\n\
+                 Private_Dirty:      {rss:>4} kB\n\
+                 Referenced:         {rss:>4} kB\n\
+                 Anonymous:          {rss:>4} kB\n\
+                 Swap:                  0 kB\n\
+                 Locked:                0 kB\n\
+                 THPeligible:           0\n\
+                 VmFlags: rd wr mr mw me ac\n",
+                begin + 0x10_000,
+            );
+        }
+        out
+    }
+
+    #[test]
+    fn byte_parser_matches_reference() {
+        let content = synthetic_smaps(2000);
+        let fast = parse_smaps(content.as_bytes());
+        let reference = reference_parse_smaps(&content);
+        assert_eq!(format!("{fast:?}"), format!("{reference:?}"));
+        assert!(fast.total_anon > 0);
+        assert!(fast.largest_anon.size > 0);
+    }
+
+    /// `cargo test --release -- --ignored bench_smaps --nocapture`.
+    ///
+    /// Parses `FELIX_SMAPS_FIXTURE` (a captured `/proc/<pid>/smaps`) if set,
+    /// otherwise a 30k-mapping synthetic file.
+    #[test]
+    #[ignore = "benchmark"]
+    fn bench_smaps() {
+        const ITERS: u32 = 50;
+
+        let content = std::env::var_os("FELIX_SMAPS_FIXTURE").map_or_else(
+            || synthetic_smaps(30_000),
+            |path| std::fs::read_to_string(path).expect("failed to read fixture"),
+        );
+
+        let time = |f: &mut dyn FnMut() -> MemSnapshot| {
+            let start = std::time::Instant::now();
+            for _ in 0..ITERS {
+                std::hint::black_box(f());
+            }
+            start.elapsed() / ITERS
+        };
+        let reference = time(&mut || reference_parse_smaps(std::hint::black_box(&content)));
+        let bytes = time(&mut || parse_smaps(std::hint::black_box(content.as_bytes())));
+        // The maps file holds just the header lines of smaps.
+        let maps_content: Vec<u8> = content
+            .lines()
+            .filter(|l| is_header_line(l.as_bytes()))
+            .flat_map(|l| l.bytes().chain(std::iter::once(b'\n')))
+            .collect();
+        let maps = time(&mut || {
+            let mut snap = MemSnapshot::default();
+            for r in parse_maps(std::hint::black_box(&maps_content)) {
+                snap.add(r.region, 0, r.begin, r.end);
+            }
+            snap
+        });
+
+        eprintln!(
+            "smaps {} KiB: reference {reference:?}, byte parser {bytes:?}; \
+             maps {} KiB: region scan {maps:?}",
+            content.len() / 1024,
+            maps_content.len() / 1024,
+        );
+
+        // A 1 GiB FEX region of this process with 16 pages touched, first
+        // reserved, then accessible.
+        let pages = (1 << 30) / page_size();
+        let region = NamedMapping::new(c"FEXMemJIT", pages, libc::PROT_READ | libc::PROT_WRITE);
+        region.touch(16);
+        // SAFETY: changes the protection of the mapping created above.
+        assert_eq!(
+            unsafe { libc::mprotect(region.addr, region.len, libc::PROT_NONE) },
+            0
+        );
+        let mut sampler = MemSampler::new(self_pid()).unwrap();
+        let reserved = time(&mut || sampler.sample().unwrap());
+        // SAFETY: as above.
+        assert_eq!(
+            unsafe { libc::mprotect(region.addr, region.len, libc::PROT_READ) },
+            0
+        );
+        sampler.sample().unwrap();
+        let pagemap = time(&mut || sampler.sample_pagemap().unwrap());
+        let chosen = time(&mut || sampler.sample().unwrap());
+        eprintln!(
+            "{} MiB region, {} mappings: reserved {reserved:?}; accessible: pagemap \
+             {pagemap:?}, sample ({}) {chosen:?}",
+            region.len >> 20,
+            sampler.mappings,
+            if sampler.pagemap_cheaper() {
+                "pagemap"
+            } else {
+                "smaps"
+            },
+        );
+    }
 }
@@ -51,7 +51,7 @@ pub struct ThreadStatsHeader {
     pub pad: u32,
 }
 
-#[derive(Debug, Clone, Copy, Default, Serialize, Deserialize)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq, Serialize, Deserialize)]
 #[repr(C, align(16))]
 pub struct ThreadStats {
     pub next: u32,
@@ -7,16 +7,19 @@ mod datasource;
 mod fex;
 mod recording;
 mod sampler;
+mod serve;
+mod stream;
 mod tui;
 
 use std::io::{self, BufRead, IsTerminal, Stdout, Write};
+use std::net::SocketAddr;
 use std::path::{Path, PathBuf};
-use std::sync::Arc;
 use std::sync::atomic::{AtomicBool, Ordering};
-use std::time::{Duration, Instant, SystemTime};
+use std::sync::{Arc, mpsc};
+use std::time::{Duration, Instant};
 
 use anyhow::{Context, Result, bail};
-use clap::{Parser, Subcommand};
+use clap::{Args, Parser, Subcommand};
 use crossterm::event::{self, Event, KeyEventKind};
 use crossterm::terminal::{
     EnterAlternateScreen, LeaveAlternateScreen, disable_raw_mode, enable_raw_mode,
@@ -25,21 +28,55 @@ use ratatui::Terminal;
 use ratatui::backend::CrosstermBackend;
 
 use crate::datasource::{DataSource, SessionMetadata};
-use crate::fex::platform::{cycle_counter_frequency, store_memory_barrier};
-use crate::fex::shm::ShmReader;
-use crate::fex::types::STATS_VERSION;
-use crate::recording::format::Frame;
+use crate::fex::discovery::{
+    SHM_DIR, SegmentWatcher, find_all_fex_processes, find_fex_process, read_process_cmdline,
+    read_process_ppid, segment_ready,
+};
+use crate::recording::async_writer::{AsyncRecordingWriter, OverflowPolicy};
+use crate::recording::compression::{ARCHIVE_LEVEL, CompressionOptions, DEFAULT_LEVEL, recompress};
+use crate::recording::diff::{DiffOptions, DiffSummary, Gate, METRICS, load_pair, metric_index};
+use crate::recording::export::{
+    CONTENTION_HEADER, CsvOutput, contention_by_process, export_csv, write_contention_rows,
+};
+use crate::recording::flight::{FlightOptions, TriggerFlag};
+use crate::recording::follow::FollowSource;
+use crate::recording::mapped::MappedRecording;
 use crate::recording::reader::{RecordingReader, ReplaySource};
-use crate::recording::writer::RecordingWriter;
-use crate::sampler::accumulator::{Accumulator, CumulativeCountStats};
-use crate::sampler::mem_stats::MemStatsWorker;
-use crate::sampler::thread_stats::ThreadSampler;
-use crate::tui::app::App;
+use crate::recording::thread_index::{Counter, ThreadIndex, ThreadTimeline};
+use crate::recording::writer::{BlockEncoding, RecordingOptions};
+use crate::sampler::jitter::format_duration_ns;
+use crate::sampler::mem_stats::{MIN_MEM_PERIOD_MS, MemPeriods};
+use crate::sampler::metrics::{MetricsSource, SharedMetrics};
+use crate::sampler::multi::{MultiSampler, Scope, TrackEvent};
+use crate::sampler::session::{
+    FrameSource, ProcessSource, Progress, Session, SessionConfig, SessionSummary, StopReason,
+    Update,
+};
+use crate::serve::MetricsServer;
+use crate::stream::{StreamAddr, StreamSource, StreamStats, StreamWriter};
+use crate::tui::app::{App, DEFAULT_MAX_FPS};
+use crate::tui::diff_view::DiffView;
 use crate::tui::input::{Action, handle_key};
-
-const EVENT_POLL_TIMEOUT: Duration = Duration::from_millis(10);
+use crate::tui::panels::mem_stats::format_bytes;
+
+/// Longest the TUI blocks on input with nothing due, so shutdown signals
+/// and a target exiting are still noticed promptly.
+const IDLE_POLL_TIMEOUT: Duration = Duration::from_millis(250);
+/// How often the input thread checks whether the TUI has exited.
+const INPUT_POLL_TIMEOUT: Duration = Duration::from_millis(100);
+/// Updates queued for the TUI or headless printer; the sampler drops frames
+/// rather than wait when it is full.
+const UI_QUEUE_CAPACITY: usize = 64;
+/// Rescan interval when inotify is unavailable; with inotify it is only a
+/// backstop.
 const WATCH_POLL_INTERVAL: Duration = Duration::from_secs(1);
+/// How often `replay --follow` checks the recording for new frames.
+const FOLLOW_POLL_INTERVAL: Duration = Duration::from_millis(100);
+const SEGMENT_RETRY_INTERVAL: Duration = Duration::from_millis(5);
+const SEGMENT_READY_TIMEOUT: Duration = Duration::from_secs(1);
 const HEADLESS_STATUS_INTERVAL: Duration = Duration::from_secs(5);
+/// Loopback only unless asked otherwise; OpenTelemetry's Prometheus port.
+const DEFAULT_LISTEN: &str = "127.0.0.1:9464";
 
 #[derive(Parser)]
 #[command(name = "felix", about = "felix: FEX-Emu profiler and recorder")]
@@ -52,71 +89,452 @@ struct Cli {
 enum Commands {
     /// Monitor a running FEX process
     Live {
-        pid: i32,
-        #[arg(short, long, default_value = "1000")]
-        sample_period: u64,
+        #[arg(required_unless_present = "connect")]
+        pid: Option<i32>,
+        /// Show frames streamed by `record --stream` instead of sampling
+        #[arg(long, value_name = "ADDR", conflicts_with_all = ["pid", "record"])]
+        connect: Option<StreamAddr>,
+        #[command(flatten)]
+        sampling: SamplingArgs,
+        #[command(flatten)]
+        display: DisplayArgs,
         #[arg(short, long)]
         record: Option<PathBuf>,
+        #[command(flatten)]
+        recording: RecordingArgs,
     },
     /// Replay a recorded session
-    Replay { path: PathBuf },
+    Replay(ReplayArgs),
     /// Record without TUI (headless)
-    Record {
-        pid: i32,
-        #[arg(short, long)]
-        output: PathBuf,
-        #[arg(short, long, default_value = "1000")]
-        sample_period: u64,
-        #[arg(long, default_value = "0")]
-        duration: u64,
-    },
+    Record(RecordArgs),
     /// Watch for FEX processes and auto-attach
     Watch {
-        #[arg(short, long, default_value = "1000")]
-        sample_period: u64,
+        #[command(flatten)]
+        sampling: SamplingArgs,
+        #[command(flatten)]
+        display: DisplayArgs,
         #[arg(short, long)]
         record: Option<PathBuf>,
+        /// Record the first process found and its descendants headless
+        #[arg(long, requires = "record")]
+        tree: bool,
+        #[command(flatten)]
+        recording: RecordingArgs,
     },
-    /// Export a recording to CSV
-    Export {
-        input: PathBuf,
-        #[arg(short, long)]
-        output: PathBuf,
+    /// Sample headless and serve Prometheus metrics over HTTP
+    Serve {
+        #[arg(required_unless_present = "all")]
+        pid: Option<i32>,
+        /// Serve every FEX process, including ones started later, until
+        /// interrupted
+        #[arg(long, conflicts_with_all = ["pid", "tree"])]
+        all: bool,
+        /// Also serve the process's descendants, including ones started later
+        #[arg(long)]
+        tree: bool,
+        /// Address to serve `/metrics` on
+        #[arg(long, default_value = DEFAULT_LISTEN)]
+        listen: SocketAddr,
+        #[command(flatten)]
+        sampling: SamplingArgs,
+        #[command(flatten)]
+        timing: TimingArgs,
+        #[arg(long, default_value = "0")]
+        duration: u64,
     },
+    /// Export a recording to CSV
+    Export(ExportArgs),
+    /// Compare two recordings, e.g. of one workload on two FEX builds
+    Diff(DiffArgs),
+    /// List a recording's hottest threads, or one thread's timeline
+    Threads(ThreadsArgs),
+    /// Summarize code cache lock contention of recordings as CSV, one row
+    /// per process, e.g. of one workload on several core counts
+    Contention(ContentionArgs),
+    /// Rewrite a recording with denser compression, e.g. for archiving
+    Recompress(RecompressArgs),
     /// Pick a running FEX process interactively
     Pick {
-        #[arg(short, long, default_value = "1000")]
-        sample_period: u64,
+        #[command(flatten)]
+        sampling: SamplingArgs,
+        #[command(flatten)]
+        display: DisplayArgs,
         #[arg(short, long)]
         record: Option<PathBuf>,
+        /// Record the picked process and its descendants headless
+        #[arg(long, requires = "record")]
+        tree: bool,
+        #[command(flatten)]
+        recording: RecordingArgs,
     },
 }
 
+// Field names are the flag names.
+#[allow(clippy::struct_field_names)]
+#[derive(Args, Clone, Copy)]
+struct SamplingArgs {
+    /// Thread-stats sample period in milliseconds
+    #[arg(short, long, default_value = "1000")]
+    sample_period: u64,
+    /// Longest the memory sampler may back off to while memory is stable, in
+    /// milliseconds
+    #[arg(long, default_value = "8000")]
+    mem_max_period: u64,
+    /// Shortest interval between memory samples, in milliseconds: the cap
+    /// on how often /proc is read, however short the sample period is
+    #[arg(
+        long,
+        default_value_t = MIN_MEM_PERIOD_MS,
+        value_parser = clap::value_parser!(u64).range(1..)
+    )]
+    mem_min_period: u64,
+}
+
+impl SamplingArgs {
+    fn period(&self) -> Duration {
+        Duration::from_millis(self.sample_period)
+    }
+
+    fn mem_periods(&self) -> MemPeriods {
+        MemPeriods {
+            min: Duration::from_millis(self.mem_min_period),
+            max: Duration::from_millis(self.mem_max_period),
+        }
+    }
+}
+
+/// Scheduling options for headless recording.
+#[derive(Args, Clone, Copy, Default)]
+struct TimingArgs {
+    /// Thread-stats sample period in microseconds, for sub-millisecond
+    /// sampling; use instead of --sample-period
+    #[arg(long, conflicts_with = "sample_period")]
+    sample_period_us: Option<u64>,
+    /// Busy-poll this many microseconds before each deadline instead of
+    /// sleeping through it
+    #[arg(long, default_value = "0")]
+    spin_us: u64,
+    /// Pin the sampling thread to this CPU
+    #[arg(long)]
+    pin_cpu: Option<usize>,
+}
+
+impl TimingArgs {
+    fn period(&self, sampling: &SamplingArgs) -> Duration {
+        self.sample_period_us
+            .map_or_else(|| sampling.period(), Duration::from_micros)
+    }
+
+    fn spin(&self) -> Duration {
+        Duration::from_micros(self.spin_us)
+    }
+}
+
+#[derive(Args, Clone, Copy)]
+struct DisplayArgs {
+    /// Redraw the TUI at most this many times per second (0: uncapped)
+    #[arg(long, default_value_t = DEFAULT_MAX_FPS)]
+    fps: u32,
+}
+
+#[derive(Args)]
+struct RecordingArgs {
+    /// Block encoding for recordings
+    #[arg(long, value_enum, default_value_t)]
+    encoding: BlockEncoding,
+    /// What to do with new frames when the recording queue is full
+    #[arg(long, value_enum, default_value_t)]
+    on_overflow: OverflowPolicy,
+    /// Flight-recorder mode: hold the last SECS of frames in memory and
+    /// write them only when a trigger fires or on SIGUSR1
+    #[arg(long, value_name = "SECS")]
+    flight: Option<u64>,
+    /// Seconds to keep writing after the last trigger
+    #[arg(long, value_name = "SECS", default_value_t = 10, requires = "flight")]
+    flight_after: u64,
+    /// Histogram flags that trigger a flush
+    #[arg(
+        long = "trigger",
+        value_enum,
+        value_delimiter = ',',
+        requires = "flight"
+    )]
+    triggers: Vec<TriggerFlag>,
+    /// Load at or above which a frame triggers a flush, in percent
+    #[arg(long, value_name = "PERCENT", requires = "flight")]
+    trigger_load: Option<f64>,
+    /// zstd level of the blocks; higher is denser but slower, negative
+    /// levels are faster still
+    #[arg(long, default_value_t = DEFAULT_LEVEL, allow_negative_numbers = true)]
+    compression_level: i32,
+    /// Threads compressing blocks, so high levels keep up (0: the writer
+    /// thread)
+    #[arg(long, default_value = "0")]
+    compression_workers: usize,
+    /// Compress against the dictionary embedded in this recording, e.g.
+    /// one from `felix recompress --dictionary`
+    #[arg(long, value_name = "RECORDING")]
+    dictionary_from: Option<PathBuf>,
+    /// End blocks after a second so `replay --follow` keeps up; at low
+    /// sample rates the blocks are smaller and compress worse
+    #[arg(long)]
+    followable: bool,
+}
+
+#[derive(Args)]
+struct RecordArgs {
+    #[arg(required_unless_present = "all")]
+    pid: Option<i32>,
+    /// Record every running FEX process, including ones started later
+    #[arg(long, conflicts_with_all = ["pid", "tree"])]
+    all: bool,
+    /// Also record the process's descendants, including ones started later
+    #[arg(long)]
+    tree: bool,
+    #[arg(short, long, required_unless_present = "stream")]
+    output: Option<PathBuf>,
+    /// Serve frames to `live --connect` on tcp://HOST:PORT or unix:PATH
+    /// instead of writing a file
+    #[arg(long, value_name = "ADDR", conflicts_with = "output")]
+    stream: Option<StreamAddr>,
+    #[command(flatten)]
+    sampling: SamplingArgs,
+    #[command(flatten)]
+    timing: TimingArgs,
+    #[arg(long, default_value = "0")]
+    duration: u64,
+    #[command(flatten)]
+    recording: RecordingArgs,
+}
+
+#[derive(Args)]
+struct ReplayArgs {
+    path: PathBuf,
+    /// Replay from a memory-mapped cache (<path>.felixm, built on first use)
+    #[arg(long)]
+    mmap: bool,
+    /// Show frames as they are appended to a recording still being
+    /// written, like `live`
+    #[arg(long, conflicts_with = "mmap")]
+    follow: bool,
+    /// Replay only this process from a multiplexed recording
+    #[arg(long)]
+    pid: Option<i32>,
+    #[command(flatten)]
+    display: DisplayArgs,
+}
+
+#[derive(Args)]
+struct ExportArgs {
+    input: PathBuf,
+    /// Per-frame CSV; a `.zst` suffix compresses it
+    #[arg(short, long)]
+    output: PathBuf,
+    /// Also write one row per thread per frame to this CSV
+    #[arg(long)]
+    threads: Option<PathBuf>,
+    /// Threads decoding and formatting blocks (default: all cores)
+    #[arg(short, long)]
+    jobs: Option<usize>,
+}
+
+#[derive(Args)]
+struct ThreadsArgs {
+    input: PathBuf,
+    /// Counter to rank threads by
+    #[arg(long, value_enum, default_value = "jit-time")]
+    by: Counter,
+    /// Threads to list
+    #[arg(short = 'k', long, default_value = "10")]
+    top: usize,
+    /// Only threads of this process
+    #[arg(long)]
+    pid: Option<i32>,
+    /// Print this thread's counters per block as CSV instead
+    #[arg(long)]
+    tid: Option<u32>,
+    /// Threads decoding blocks of recordings without a per-thread index
+    /// (default: all cores)
+    #[arg(short, long)]
+    jobs: Option<usize>,
+}
+
+#[derive(Args)]
+struct ContentionArgs {
+    #[arg(required = true)]
+    inputs: Vec<PathBuf>,
+    /// Threads decoding blocks (default: all cores)
+    #[arg(short, long)]
+    jobs: Option<usize>,
+}
+
+#[derive(Args)]
+struct RecompressArgs {
+    input: PathBuf,
+    #[arg(short, long)]
+    output: PathBuf,
+    /// zstd level of the rewritten blocks
+    #[arg(long, default_value_t = ARCHIVE_LEVEL, allow_negative_numbers = true)]
+    level: i32,
+    /// Train a dictionary on the recording and embed it
+    #[arg(long, conflicts_with = "dictionary_from")]
+    dictionary: bool,
+    /// Compress against the dictionary embedded in this recording instead
+    #[arg(long, value_name = "RECORDING")]
+    dictionary_from: Option<PathBuf>,
+    /// Block encoding of the rewritten recording
+    #[arg(long, value_enum, default_value_t)]
+    encoding: BlockEncoding,
+    /// Threads decoding and compressing blocks (default: all cores)
+    #[arg(short, long)]
+    jobs: Option<usize>,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq, clap::ValueEnum)]
+enum DiffFormat {
+    /// Interactive view; a text table when stdout is not a terminal
+    Tui,
+    Text,
+    Json,
+}
+
+#[derive(Args)]
+struct DiffArgs {
+    /// Baseline recording
+    a: PathBuf,
+    /// Recording compared against the baseline
+    b: PathBuf,
+    /// Width of the time buckets compared, in milliseconds
+    #[arg(long, default_value = "1000")]
+    bucket: u64,
+    /// Milliseconds of A to skip before aligning the recordings
+    #[arg(long, default_value = "0")]
+    skip_a: u64,
+    /// Milliseconds of B to skip before aligning the recordings
+    #[arg(long, default_value = "0")]
+    skip_b: u64,
+    /// Compare at most this many seconds after the alignment point
+    #[arg(long)]
+    duration: Option<u64>,
+    #[arg(long, value_enum, default_value = "tui")]
+    format: DiffFormat,
+    /// Fail if the mean of a metric grows by more than this percentage
+    #[arg(long, value_name = "PERCENT")]
+    fail_above: Option<f64>,
+    /// Metrics --fail-above applies to (default: all)
+    #[arg(long, value_delimiter = ',', requires = "fail_above")]
+    gate: Vec<String>,
+    /// Threads decoding blocks, shared by both recordings (default: all cores)
+    #[arg(short, long)]
+    jobs: Option<usize>,
+}
+
+impl RecordingArgs {
+    fn options(&self) -> Result<RecordingOptions> {
+        Ok(RecordingOptions {
+            encoding: self.encoding,
+            compression: CompressionOptions {
+                level: self.compression_level,
+                workers: self.compression_workers,
+                dictionary: self
+                    .dictionary_from
+                    .as_deref()
+                    .map(dictionary_from)
+                    .transpose()?,
+            },
+            overflow: self.on_overflow,
+            flight: self.flight.map(|secs| FlightOptions {
+                before: Duration::from_secs(secs),
+                after: Duration::from_secs(self.flight_after),
+                flags: self.triggers.iter().fold(0, |bits, t| bits | t.bit()),
+                load_percent: self.trigger_load,
+            }),
+            followable: self.followable,
+        })
+    }
+}
+
+/// The compression dictionary embedded in the recording at `path`.
+fn dictionary_from(path: &Path) -> Result<Arc<[u8]>> {
+    let reader = RecordingReader::open(path)?;
+    let dictionary = reader
+        .dictionary()
+        .with_context(|| format!("{} has no compression dictionary", path.display()))?;
+    Ok(dictionary.into())
+}
+
 fn main() -> Result<()> {
     let cli = Cli::parse();
 
     match cli.command {
+        Commands::Live {
+            connect: Some(addr),
+            display,
+            ..
+        } => cmd_connect(&addr, display),
         Commands::Live {
             pid,
-            sample_period,
+            sampling,
+            display,
             record,
-        } => cmd_live(pid, sample_period, record.as_deref()),
-        Commands::Replay { path } => cmd_replay(&path),
-        Commands::Record {
-            pid,
-            output,
-            sample_period,
-            duration,
-        } => cmd_record(pid, &output, sample_period, duration),
+            recording,
+            ..
+        } => cmd_live(
+            pid.context("a PID or --connect is required")?,
+            sampling,
+            display,
+            record.as_deref(),
+            &recording.options()?,
+        ),
+        Commands::Replay(args) => cmd_replay(&args),
+        Commands::Record(args) => cmd_record(&args),
         Commands::Watch {
-            sample_period,
+            sampling,
+            display,
             record,
-        } => cmd_watch(sample_period, record.as_deref()),
-        Commands::Export { input, output } => cmd_export(&input, &output),
+            tree,
+            recording,
+        } => cmd_watch(
+            sampling,
+            display,
+            record.as_deref(),
+            tree,
+            &recording.options()?,
+        ),
+        Commands::Serve {
+            pid,
+            all,
+            tree,
+            listen,
+            sampling,
+            timing,
+            duration,
+        } => {
+            let scope = match pid {
+                _ if all => Some(Scope::All),
+                Some(pid) if tree => Some(Scope::Tree(pid)),
+                _ => None,
+            };
+            cmd_serve(pid, scope, listen, sampling, timing, duration)
+        }
+        Commands::Export(args) => cmd_export(&args),
+        Commands::Diff(args) => cmd_diff(&args),
+        Commands::Threads(args) => cmd_threads(&args),
+        Commands::Contention(args) => cmd_contention(&args),
+        Commands::Recompress(args) => cmd_recompress(&args),
         Commands::Pick {
-            sample_period,
+            sampling,
+            display,
             record,
-        } => cmd_pick(sample_period, record.as_deref()),
+            tree,
+            recording,
+        } => cmd_pick(
+            sampling,
+            display,
+            record.as_deref(),
+            tree,
+            &recording.options()?,
+        ),
     }
 }
 
@@ -133,15 +551,6 @@ fn install_signal_handler() -> Result<Arc<AtomicBool>> {
     Ok(shutdown)
 }
 
-// ---------------------------------------------------------------------------
-// Process liveness check
-// ---------------------------------------------------------------------------
-
-fn process_alive(pid: i32) -> bool {
-    // kill(pid, 0) checks if the process exists without sending a signal
-    unsafe { libc::kill(pid, 0) == 0 }
-}
-
 // ---------------------------------------------------------------------------
 // Terminal setup / teardown
 // ---------------------------------------------------------------------------
@@ -163,208 +572,165 @@ fn restore_terminal(terminal: &mut Terminal<CrosstermBackend<Stdout>>) -> Result
     Ok(())
 }
 
-// ---------------------------------------------------------------------------
-// Shared: build metadata from SHM header
-// ---------------------------------------------------------------------------
-
-fn build_metadata(shm: &ShmReader, pid: i32) -> Result<SessionMetadata> {
-    let header = shm.read_header();
-
-    if header.version != STATS_VERSION {
-        bail!(
-            "unsupported stats version {} (expected {STATS_VERSION})",
-            header.version
-        );
-    }
-
-    Ok(SessionMetadata {
-        pid,
-        fex_version: header.fex_version,
-        app_type: header.app_type,
-        stats_version: header.version,
-        cycle_counter_frequency: cycle_counter_frequency(),
-        hardware_concurrency: hardware_concurrency(),
-        recording_start: SystemTime::now(),
-        head: header.head,
-        size: header.size,
-    })
-}
-
-fn hardware_concurrency() -> usize {
-    std::thread::available_parallelism().map_or(1, std::num::NonZeroUsize::get)
-}
-
 // ---------------------------------------------------------------------------
 // Live subcommand
 // ---------------------------------------------------------------------------
 
-fn cmd_live(pid: i32, sample_period_ms: u64, record_path: Option<&Path>) -> Result<()> {
+fn cmd_live(
+    pid: i32,
+    sampling: SamplingArgs,
+    display: DisplayArgs,
+    record_path: Option<&Path>,
+    options: &RecordingOptions,
+) -> Result<()> {
     let shutdown = install_signal_handler()?;
-    let mut shm = ShmReader::open(pid)?;
-    let metadata = build_metadata(&shm, pid)?;
-    let sample_period = Duration::from_millis(sample_period_ms);
-    #[allow(clippy::cast_possible_truncation)]
-    let period_nanos = sample_period.as_nanos() as u64;
-
-    let mut mem_worker = MemStatsWorker::spawn(pid, sample_period)?;
-    let mut thread_sampler = ThreadSampler::new();
-    let accumulator = Accumulator::new(
-        #[allow(clippy::cast_precision_loss)]
-        {
-            metadata.cycle_counter_frequency as f64
-        },
-        metadata.hardware_concurrency,
-    );
+    let sample_period = sampling.period();
+    let source = ProcessSource::open(pid, sample_period, sampling.mem_periods())?;
+    let metadata = source.metadata().clone();
 
-    let mut writer = match record_path {
-        Some(p) => Some(RecordingWriter::create(p, &metadata)?),
+    let writer = match record_path {
+        Some(p) => Some(AsyncRecordingWriter::create(p, &metadata, options)?),
         None => None,
     };
 
+    let (tx, rx) = mpsc::sync_channel(UI_QUEUE_CAPACITY);
+    let config = SessionConfig {
+        sample_period,
+        forward_frames: true,
+        ..SessionConfig::default()
+    };
+    let session = Session::spawn(source, writer, config, Arc::clone(&shutdown), tx.clone())?;
+
     let mut terminal = setup_terminal()?;
+    let input = spawn_input_thread(tx)?;
     let mut app = App::new(metadata, false);
-    let mut total_jit_invocations: u64 = 0;
-    let mut last_sample = Instant::now();
+    app.set_max_fps(display.fps);
 
-    let result = run_live_loop(
-        &shutdown,
-        pid,
-        &mut shm,
-        &mut thread_sampler,
-        &accumulator,
-        &mut mem_worker,
-        &mut app,
-        &mut writer,
-        &mut terminal,
-        &mut total_jit_invocations,
-        &mut last_sample,
-        sample_period,
-        period_nanos,
-    );
+    let result = run_live_loop(&shutdown, &session, &rx, &mut app, &mut terminal);
 
-    mem_worker.shutdown();
-    if let Some(w) = writer {
-        let _ = w.finish();
-    }
+    input.stop();
     restore_terminal(&mut terminal)?;
+    // The sampler finishes its current wait, at most one period, and the
+    // recording before returning.
+    let summary = session.join();
+    result?;
+    summary.map(|_| ())
+}
 
-    result
+/// The live TUI's inputs: frames from the sampler and terminal events.
+enum UiEvent {
+    Sampler(Update),
+    Input(Event),
+}
+
+impl From<Update> for UiEvent {
+    fn from(update: Update) -> Self {
+        Self::Sampler(update)
+    }
+}
+
+/// Reads terminal events on their own thread so the TUI can block on one
+/// channel for both input and frames.
+struct InputThread {
+    stop: Arc<AtomicBool>,
+    handle: std::thread::JoinHandle<()>,
+}
+
+impl InputThread {
+    fn stop(self) {
+        self.stop.store(true, Ordering::Relaxed);
+        let _ = self.handle.join();
+    }
+}
+
+fn spawn_input_thread(tx: mpsc::SyncSender<UiEvent>) -> Result<InputThread> {
+    let stop = Arc::new(AtomicBool::new(false));
+    let flag = Arc::clone(&stop);
+    let handle = std::thread::Builder::new()
+        .name("felix-input".into())
+        .spawn(move || {
+            while !flag.load(Ordering::Relaxed) {
+                match event::poll(INPUT_POLL_TIMEOUT) {
+                    Ok(false) => {}
+                    Ok(true) => match event::read() {
+                        Ok(ev) => {
+                            if tx.send(UiEvent::Input(ev)).is_err() {
+                                break;
+                            }
+                        }
+                        Err(_) => break,
+                    },
+                    Err(_) => break,
+                }
+            }
+        })
+        .context("failed to spawn input thread")?;
+    Ok(InputThread { stop, handle })
 }
 
-#[allow(clippy::too_many_arguments)]
 fn run_live_loop(
     shutdown: &Arc<AtomicBool>,
-    pid: i32,
-    shm: &mut ShmReader,
-    thread_sampler: &mut ThreadSampler,
-    accumulator: &Accumulator,
-    mem_worker: &mut MemStatsWorker,
+    session: &Session,
+    rx: &mpsc::Receiver<UiEvent>,
     app: &mut App,
-    writer: &mut Option<RecordingWriter>,
     terminal: &mut Terminal<CrosstermBackend<Stdout>>,
-    total_jit_invocations: &mut u64,
-    last_sample: &mut Instant,
-    interval: Duration,
-    period_nanos: u64,
 ) -> Result<()> {
     loop {
-        if shutdown.load(Ordering::Relaxed) || app.should_quit {
+        if shutdown.load(Ordering::Relaxed) || app.should_quit || session.is_finished() {
             break;
         }
 
-        if !process_alive(pid) {
-            break;
+        // Block until a frame or input arrives or a pending redraw is
+        // allowed, then take everything already queued so a backlog of
+        // frames costs one redraw.
+        let timeout = app
+            .until_draw()
+            .map_or(IDLE_POLL_TIMEOUT, |t| t.min(IDLE_POLL_TIMEOUT));
+        match rx.recv_timeout(timeout) {
+            Ok(ev) => handle_ui_event(ev, session, app),
+            Err(mpsc::RecvTimeoutError::Timeout) => {}
+            Err(mpsc::RecvTimeoutError::Disconnected) => break,
         }
-
-        let elapsed = last_sample.elapsed();
-        let poll_timeout = if elapsed >= interval {
-            Duration::ZERO
-        } else {
-            EVENT_POLL_TIMEOUT.min(interval.checked_sub(elapsed).unwrap())
-        };
-
-        if event::poll(poll_timeout).context("failed to poll events")?
-            && let Event::Key(key) = event::read().context("failed to read event")?
-            && key.kind == KeyEventKind::Press
-        {
-            let action = handle_key(key, false);
-            handle_sample_period_action(&action, app);
-            app.handle_action(&action);
+        while let Ok(ev) = rx.try_recv() {
+            handle_ui_event(ev, session, app);
         }
 
-        if last_sample.elapsed() >= interval {
-            take_live_sample(
-                shm,
-                thread_sampler,
-                accumulator,
-                mem_worker,
-                app,
-                writer,
-                total_jit_invocations,
-                period_nanos,
-            )?;
-            *last_sample = Instant::now();
+        if app.draw_due() {
+            let started = Instant::now();
+            terminal
+                .draw(|f| app.render(f))
+                .context("failed to draw frame")?;
+            app.record_draw(started.elapsed());
         }
-
-        terminal
-            .draw(|f| app.render(f))
-            .context("failed to draw frame")?;
     }
 
     Ok(())
 }
 
-#[allow(clippy::too_many_arguments)]
-fn take_live_sample(
-    shm: &mut ShmReader,
-    thread_sampler: &mut ThreadSampler,
-    accumulator: &Accumulator,
-    mem_worker: &mut MemStatsWorker,
-    app: &mut App,
-    writer: &mut Option<RecordingWriter>,
-    total_jit_invocations: &mut u64,
-    period_nanos: u64,
-) -> Result<()> {
-    store_memory_barrier();
-    shm.check_resize()?;
-
-    let raw_stats = shm.read_thread_stats();
-    let now = Instant::now();
-    let sample = thread_sampler.sample(&raw_stats, now);
-    let mem = mem_worker.latest();
-
-    *total_jit_invocations = total_jit_invocations
-        .wrapping_add(sample.per_thread.iter().map(|d| d.jit_count).sum::<u64>());
-
-    let cumulative = CumulativeCountStats {
-        sigbus: raw_stats.iter().map(|s| s.sigbus_count).sum(),
-        smc: raw_stats.iter().map(|s| s.smc_count).sum(),
-        float_fallback: raw_stats.iter().map(|s| s.float_fallback_count).sum(),
-        cache_miss: raw_stats
-            .iter()
-            .map(|s| s.accumulated_cache_miss_count)
-            .sum(),
-        jit: raw_stats.iter().map(|s| s.accumulated_jit_count).sum(),
-    };
-
-    let frame = accumulator.compute_frame(
-        &sample,
-        &mem,
-        period_nanos,
-        *total_jit_invocations,
-        cumulative,
-    );
-
-    if let Some(ref mut w) = *writer {
-        let rec_frame = Frame {
-            computed: frame.clone(),
-            per_thread_deltas: sample.per_thread,
-        };
-        w.write_frame(&rec_frame)?;
+fn handle_ui_event(ev: UiEvent, session: &Session, app: &mut App) {
+    match ev {
+        UiEvent::Sampler(Update::Frame {
+            mut frame,
+            recorder,
+        }) => {
+            // The previous frame goes back to the sampler to be overwritten.
+            app.update_frame_with(|slot| {
+                std::mem::swap(slot, &mut *frame);
+                true
+            });
+            session.recycle(frame);
+            if let Some(stats) = recorder {
+                app.set_recorder_stats(stats);
+            }
+        }
+        UiEvent::Input(Event::Key(key)) if key.kind == KeyEventKind::Press => {
+            let action = handle_key(key.code, false);
+            handle_sample_period_action(&action, app);
+            app.handle_action(&action);
+        }
+        UiEvent::Input(Event::Resize(..)) => app.mark_all_dirty(),
+        UiEvent::Sampler(Update::Track(_) | Update::Status(_)) | UiEvent::Input(_) => {}
     }
-
-    app.update_frame(frame);
-    Ok(())
 }
 
 fn handle_sample_period_action(_action: &Action, _app: &mut App) {
@@ -377,16 +743,55 @@ fn handle_sample_period_action(_action: &Action, _app: &mut App) {
 // Replay subcommand
 // ---------------------------------------------------------------------------
 
-fn cmd_replay(path: &Path) -> Result<()> {
+fn cmd_replay(args: &ReplayArgs) -> Result<()> {
+    let ReplayArgs {
+        ref path,
+        mmap,
+        follow,
+        pid,
+        display,
+    } = *args;
+    if follow {
+        return cmd_follow(path, pid, display);
+    }
     let shutdown = install_signal_handler()?;
-    let reader = RecordingReader::open(path)?;
+    let mut reader = RecordingReader::open(path)?;
     let total = reader.frame_count();
     let metadata = reader.metadata().clone();
 
     let mut app = App::new(metadata, true);
+    app.set_max_fps(display.fps);
     app.set_replay_total_frames(total);
-
-    let mut source = ReplaySource::new(reader);
+    // The footer's whole-recording summary, of every process unless one is
+    // picked.
+    let stats = reader.process_stats();
+    let summary = match pid {
+        Some(pid) => stats.iter().find(|s| s.pid == pid).cloned(),
+        None => stats.split_first().map(|(first, rest)| {
+            let mut all = first.clone();
+            for s in rest {
+                all.merge(s);
+            }
+            all
+        }),
+    };
+    app.set_recording_stats(summary);
+    // Recordings without a stored per-thread index are decoded once more,
+    // as for the histogram.
+    app.set_thread_index(reader.thread_index(jobs_or_all_cores(None))?, pid);
+
+    let mut source = if mmap {
+        eprintln!(
+            "Preparing replay cache {} ...",
+            MappedRecording::cache_path(path).display()
+        );
+        let mapped = MappedRecording::open_or_build(path, &mut reader)?;
+        ReplaySource::with_mapped(reader, mapped)
+    } else {
+        ReplaySource::new(reader)
+    };
+    source.set_pid_filter(pid);
+    app.set_replay_histogram(source.build_histogram()?);
     let mut terminal = setup_terminal()?;
 
     let result = run_replay_loop(&shutdown, &mut app, &mut source, &mut terminal);
@@ -406,237 +811,638 @@ fn run_replay_loop(
             break;
         }
 
-        if event::poll(EVENT_POLL_TIMEOUT).context("failed to poll events")?
-            && let Event::Key(key) = event::read().context("failed to read event")?
-            && key.kind == KeyEventKind::Press
-        {
-            let action = handle_key(key, true);
-            app.handle_action(&action);
+        // Block until the next frame is due, a pending redraw or input; a
+        // paused or finished replay waits on input alone.
+        let mut poll_timeout = source
+            .time_until_next()
+            .map_or(IDLE_POLL_TIMEOUT, |t| t.min(IDLE_POLL_TIMEOUT));
+        if let Some(until_draw) = app.until_draw() {
+            poll_timeout = poll_timeout.min(until_draw);
         }
 
-        sync_replay_state(app, source);
-
-        if let Some(frame) = source.next_frame() {
-            app.update_frame(frame);
-            if let Some(controls) = app.replay_controls_mut() {
-                controls.update_position(source.current_index());
+        if event::poll(poll_timeout).context("failed to poll events")? {
+            match event::read().context("failed to read event")? {
+                Event::Key(key) if key.kind == KeyEventKind::Press => {
+                    let action = handle_key(key.code, true);
+                    app.handle_action(&action);
+                }
+                Event::Resize(..) => app.mark_all_dirty(),
+                _ => {}
             }
         }
 
-        terminal
-            .draw(|f| app.render(f))
-            .context("failed to draw frame")?;
+        sync_replay_state(app, source)?;
+
+        if app.update_frame_with(|slot| source.next_frame_into(slot))
+            && let Some(controls) = app.replay_controls_mut()
+        {
+            controls.update_position(source.current_index());
+        }
+        app.set_histogram_cursor(source.histogram_position());
+        // The view is at most as wide as the terminal. Decoding around the
+        // cursor also pins it down within its coarse bucket.
+        let width = terminal.size().map_or(0, |size| usize::from(size.width));
+        if app.load_replay_histogram(|pyramid, level, end| {
+            source.load_histogram(pyramid, level, end, width)
+        })? {
+            app.set_histogram_cursor(source.histogram_position());
+        }
+
+        if app.draw_due() {
+            let started = Instant::now();
+            terminal
+                .draw(|f| app.render(f))
+                .context("failed to draw frame")?;
+            app.record_draw(started.elapsed());
+        }
     }
     Ok(())
 }
 
-fn sync_replay_state(app: &App, source: &mut ReplaySource) {
-    if let Some(controls) = app.replay_controls() {
-        source.set_speed(controls.speed);
-        if controls.paused != source.is_paused() {
-            source.toggle_pause();
+/// Applies the replay bar to `source`. A seek restores the statistics and
+/// frame shown at the new position from the recording's keyframes.
+fn sync_replay_state(app: &mut App, source: &mut ReplaySource) -> Result<()> {
+    let Some(controls) = app.replay_controls() else {
+        return Ok(());
+    };
+    source.set_speed(controls.speed);
+    if controls.paused != source.is_paused() {
+        source.toggle_pause();
+    }
+    let target = controls.current_frame;
+    if target != source.current_index() {
+        source.seek_to(target);
+        let (stats, frame) = source.playback_at(target)?;
+        app.restore_playback(stats, frame);
+    }
+    Ok(())
+}
+
+/// Shows a recording as the writer appends to it, with the live display:
+/// no seeking, and a histogram bounded like a live session's.
+fn cmd_follow(path: &Path, pid: Option<i32>, display: DisplayArgs) -> Result<()> {
+    let shutdown = install_signal_handler()?;
+    let mut source = FollowSource::open(path)?;
+    source.set_pid_filter(pid);
+
+    let mut app = App::new(source.metadata().clone(), false);
+    app.set_max_fps(display.fps);
+    let mut terminal = setup_terminal()?;
+
+    let result = run_follow_loop(
+        &shutdown,
+        &mut app,
+        &mut source,
+        |source, _| source.poll(),
+        &mut terminal,
+    );
+
+    restore_terminal(&mut terminal)?;
+    if source.is_finished() {
+        eprintln!("The recording was finished");
+    }
+    if source.resyncs() > 0 {
+        eprintln!(
+            "Skipped {} unreadable stretches of {}",
+            source.resyncs(),
+            path.display()
+        );
+    }
+    result
+}
+
+/// Shows a source that grows in the background with the live display;
+/// `poll` brings `source` up to date before its frames are taken.
+fn run_follow_loop<S: DataSource>(
+    shutdown: &Arc<AtomicBool>,
+    app: &mut App,
+    source: &mut S,
+    mut poll: impl FnMut(&mut S, &mut App) -> Result<()>,
+    terminal: &mut Terminal<CrosstermBackend<Stdout>>,
+) -> Result<()> {
+    loop {
+        if shutdown.load(Ordering::Relaxed) || app.should_quit {
+            break;
         }
-        if controls.current_frame != source.current_index() {
-            source.seek_to(controls.current_frame);
+
+        let poll_timeout = app
+            .until_draw()
+            .map_or(FOLLOW_POLL_INTERVAL, |t| t.min(FOLLOW_POLL_INTERVAL));
+        if event::poll(poll_timeout).context("failed to poll events")? {
+            match event::read().context("failed to read event")? {
+                Event::Key(key) if key.kind == KeyEventKind::Press => {
+                    let action = handle_key(key.code, false);
+                    app.handle_action(&action);
+                }
+                Event::Resize(..) => app.mark_all_dirty(),
+                _ => {}
+            }
+        }
+
+        // Each poll hands over whole blocks or batches; they are all shown
+        // before the next draw.
+        poll(source, app)?;
+        while app.update_frame_with(|slot| source.next_frame_into(slot)) {}
+
+        if app.draw_due() {
+            let started = Instant::now();
+            terminal
+                .draw(|f| app.render(f))
+                .context("failed to draw frame")?;
+            app.record_draw(started.elapsed());
         }
     }
+    Ok(())
 }
 
-// ---------------------------------------------------------------------------
-// Record (headless) subcommand
-// ---------------------------------------------------------------------------
-
-fn cmd_record(pid: i32, output: &Path, sample_period_ms: u64, duration_secs: u64) -> Result<()> {
+/// Shows the frames a `record --stream` serves, with the live display.
+/// Frames lost on either end show as dropped in the header.
+fn cmd_connect(addr: &StreamAddr, display: DisplayArgs) -> Result<()> {
     let shutdown = install_signal_handler()?;
-    let mut shm = ShmReader::open(pid)?;
-    let metadata = build_metadata(&shm, pid)?;
-    let sample_period = Duration::from_millis(sample_period_ms);
-    #[allow(clippy::cast_possible_truncation)]
-    let period_nanos = sample_period.as_nanos() as u64;
-
-    let mut mem_worker = MemStatsWorker::spawn(pid, sample_period)?;
-    let mut thread_sampler = ThreadSampler::new();
-    let accumulator = Accumulator::new(
-        #[allow(clippy::cast_precision_loss)]
-        {
-            metadata.cycle_counter_frequency as f64
+    let mut source = StreamSource::connect(addr)?;
+
+    let mut app = App::new(source.metadata().clone(), false);
+    app.set_max_fps(display.fps);
+    let mut terminal = setup_terminal()?;
+
+    let mut open = true;
+    let result = run_follow_loop(
+        &shutdown,
+        &mut app,
+        &mut source,
+        |source, app| {
+            if open {
+                open = source.poll()?;
+                app.set_recorder_stats(source.queue_stats());
+            }
+            Ok(())
         },
-        metadata.hardware_concurrency,
+        &mut terminal,
     );
 
-    let mut writer = RecordingWriter::create(output, &metadata)?;
-    let mut total_jit_invocations: u64 = 0;
+    restore_terminal(&mut terminal)?;
+    if !open {
+        eprintln!("The stream was closed by {addr}");
+    }
+    eprintln!(
+        "Received {} frames, {} lost",
+        source.received(),
+        source.lost()
+    );
+    result
+}
 
-    let max_duration = if duration_secs > 0 {
-        Some(Duration::from_secs(duration_secs))
-    } else {
-        None
-    };
+// ---------------------------------------------------------------------------
+// Record (headless) subcommand
+// ---------------------------------------------------------------------------
 
-    let start = Instant::now();
-    let mut last_status = Instant::now();
-    let mut frames_recorded: u64 = 0;
+/// Where a headless recording goes.
+enum RecordTarget {
+    File(PathBuf),
+    /// Served to `live --connect` clients.
+    Stream(StreamAddr, Arc<StreamStats>),
+}
 
-    eprintln!("Recording PID {pid} to {} ...", output.display());
+impl RecordTarget {
+    fn create_writer(
+        &self,
+        metadata: &SessionMetadata,
+        options: &RecordingOptions,
+    ) -> Result<AsyncRecordingWriter> {
+        match self {
+            Self::File(path) => AsyncRecordingWriter::create(path, metadata, options),
+            Self::Stream(addr, stats) => AsyncRecordingWriter::with_sink(
+                StreamWriter::bind(addr, metadata, Arc::clone(stats))?,
+                options,
+            ),
+        }
+    }
 
-    loop {
-        if shutdown.load(Ordering::Relaxed) {
-            eprintln!("\nInterrupted.");
-            break;
+    /// The file size or the client's state, for status lines.
+    #[allow(clippy::cast_precision_loss)]
+    fn status(&self) -> String {
+        match self {
+            Self::File(path) => {
+                let size = std::fs::metadata(path).map_or(0, |m| m.len());
+                format!("{:.1} KB", size as f64 / 1024.0)
+            }
+            Self::Stream(_, stats) => {
+                let client = if stats.connected.load(Ordering::Relaxed) {
+                    "client connected"
+                } else {
+                    "no client"
+                };
+                format!(
+                    "{client}, {} sent, {} unsent",
+                    stats.sent.load(Ordering::Relaxed),
+                    stats.unsent.load(Ordering::Relaxed)
+                )
+            }
         }
-        if !process_alive(pid) {
-            eprintln!("\nProcess {pid} exited.");
-            break;
+    }
+}
+
+impl std::fmt::Display for RecordTarget {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            Self::File(path) => write!(f, "{}", path.display()),
+            Self::Stream(addr, _) => write!(f, "{addr}"),
         }
-        if let Some(max) = max_duration
-            && start.elapsed() >= max
-        {
-            eprintln!("\nDuration limit reached.");
-            break;
+    }
+}
+
+fn cmd_record(args: &RecordArgs) -> Result<()> {
+    let target = match (&args.output, &args.stream) {
+        (_, Some(addr)) => RecordTarget::Stream(addr.clone(), Arc::default()),
+        (Some(path), None) => RecordTarget::File(path.clone()),
+        (None, None) => bail!("an output file or --stream is required"),
+    };
+    let options = args.recording.options()?;
+    let scope = match args.pid {
+        _ if args.all => Scope::All,
+        Some(pid) if args.tree => Scope::Tree(pid),
+        Some(pid) => {
+            return cmd_record_one(
+                pid,
+                &target,
+                args.sampling,
+                args.timing,
+                args.duration,
+                &options,
+            );
         }
+        None => bail!("a PID or --all is required"),
+    };
+    cmd_record_multi(
+        scope,
+        &target,
+        args.sampling,
+        args.timing,
+        args.duration,
+        &options,
+    )
+}
 
-        std::thread::sleep(sample_period);
+fn cmd_record_one(
+    pid: i32,
+    target: &RecordTarget,
+    sampling: SamplingArgs,
+    timing: TimingArgs,
+    duration_secs: u64,
+    options: &RecordingOptions,
+) -> Result<()> {
+    let sample_period = timing.period(&sampling);
+    if sample_period.is_zero() {
+        bail!("sample period must be non-zero");
+    }
 
-        store_memory_barrier();
-        shm.check_resize()?;
+    let shutdown = install_signal_handler()?;
+    let source = ProcessSource::open(pid, sample_period, sampling.mem_periods())?;
+    let writer = target.create_writer(source.metadata(), options)?;
+
+    eprintln!("Recording PID {pid} to {target} ...");
+    let summary = run_headless(
+        source,
+        writer,
+        target,
+        &timing,
+        sample_period,
+        duration_secs,
+        shutdown,
+    )?;
+    if summary.reason == StopReason::Exhausted {
+        eprintln!("\nProcess {pid} exited.");
+    }
+    print_recording_summary(target, &summary);
+    Ok(())
+}
 
-        let raw_stats = shm.read_thread_stats();
-        let now = Instant::now();
-        let sample = thread_sampler.sample(&raw_stats, now);
-        let mem = mem_worker.latest();
+/// Headless recording of every process in `scope` into one multiplexed
+/// recording. The header carries the first process's metadata with the
+/// PID of the scope (0 for all processes).
+fn cmd_record_multi(
+    scope: Scope,
+    target: &RecordTarget,
+    sampling: SamplingArgs,
+    timing: TimingArgs,
+    duration_secs: u64,
+    options: &RecordingOptions,
+) -> Result<()> {
+    let sample_period = timing.period(&sampling);
+    if sample_period.is_zero() {
+        bail!("sample period must be non-zero");
+    }
 
-        total_jit_invocations = total_jit_invocations
-            .wrapping_add(sample.per_thread.iter().map(|d| d.jit_count).sum::<u64>());
+    let shutdown = install_signal_handler()?;
+    let mut sampler = MultiSampler::new(scope, sample_period, sampling.mem_periods())?;
+    sampler.discover();
+    sampler.take_events().for_each(print_track_event);
+    let Some(first) = sampler.first_metadata() else {
+        bail!("no running FEX processes found");
+    };
+    let metadata = SessionMetadata {
+        pid: match scope {
+            Scope::All => 0,
+            Scope::Tree(root) => root,
+        },
+        ..first.clone()
+    };
 
-        let cumulative = CumulativeCountStats {
-            sigbus: raw_stats.iter().map(|s| s.sigbus_count).sum(),
-            smc: raw_stats.iter().map(|s| s.smc_count).sum(),
-            float_fallback: raw_stats.iter().map(|s| s.float_fallback_count).sum(),
-            cache_miss: raw_stats
-                .iter()
-                .map(|s| s.accumulated_cache_miss_count)
-                .sum(),
-            jit: raw_stats.iter().map(|s| s.accumulated_jit_count).sum(),
-        };
+    let writer = target.create_writer(&metadata, options)?;
 
-        let frame = accumulator.compute_frame(
-            &sample,
-            &mem,
-            period_nanos,
-            total_jit_invocations,
-            cumulative,
-        );
+    eprintln!("Recording {} processes to {target} ...", sampler.len());
+    if !sampler.is_event_driven() {
+        eprintln!("inotify unavailable; new processes are found by polling {SHM_DIR}");
+    }
 
-        let rec_frame = Frame {
-            computed: frame,
-            per_thread_deltas: sample.per_thread,
-        };
-        writer.write_frame(&rec_frame)?;
-        frames_recorded += 1;
+    let summary = run_headless(
+        sampler,
+        writer,
+        target,
+        &timing,
+        sample_period,
+        duration_secs,
+        shutdown,
+    )?;
+    if summary.reason == StopReason::Exhausted {
+        eprintln!("\nAll processes exited.");
+    }
+    print_recording_summary(target, &summary);
+    Ok(())
+}
 
-        if last_status.elapsed() >= HEADLESS_STATUS_INTERVAL {
-            print_recording_status(start.elapsed(), frames_recorded, output);
-            last_status = Instant::now();
+/// Records `source` on a sampler thread and prints its progress and
+/// attachment changes until it stops.
+fn run_headless(
+    source: impl FrameSource + 'static,
+    writer: AsyncRecordingWriter,
+    target: &RecordTarget,
+    timing: &TimingArgs,
+    sample_period: Duration,
+    duration_secs: u64,
+    shutdown: Arc<AtomicBool>,
+) -> Result<SessionSummary> {
+    let config = SessionConfig {
+        sample_period,
+        spin: timing.spin(),
+        pin_cpu: timing.pin_cpu,
+        max_duration: (duration_secs > 0).then(|| Duration::from_secs(duration_secs)),
+        forward_frames: false,
+        status_interval: Some(HEADLESS_STATUS_INTERVAL),
+    };
+    let (tx, rx) = mpsc::sync_channel::<Update>(UI_QUEUE_CAPACITY);
+    let session = Session::spawn(source, Some(writer), config, shutdown, tx)?;
+
+    // The sampler holds the only sender, so this ends when it stops.
+    for update in rx {
+        match update {
+            Update::Track(event) => print_track_event(event),
+            Update::Status(progress) => print_recording_status(&progress, target),
+            Update::Frame { .. } => {}
         }
     }
 
-    mem_worker.shutdown();
-    writer.finish()?;
+    let summary = session.join()?;
+    match summary.reason {
+        StopReason::Requested => eprintln!("\nInterrupted."),
+        StopReason::DurationLimit => eprintln!("\nDuration limit reached."),
+        StopReason::Exhausted => {}
+    }
+    Ok(summary)
+}
 
-    eprintln!(
-        "Finished: {frames_recorded} frames written to {}",
-        output.display()
-    );
-    Ok(())
+fn print_track_event(event: TrackEvent) {
+    match event {
+        TrackEvent::Attached(pid) => eprintln!("Attached to PID {pid}"),
+        TrackEvent::Skipped(pid, e) => eprintln!("Skipping PID {pid}: {e:#}"),
+        TrackEvent::Exited(pid) => eprintln!("Process {pid} exited."),
+        TrackEvent::Failed(pid, e) => eprintln!("Stopped sampling PID {pid}: {e:#}"),
+    }
+}
+
+fn print_recording_summary(target: &RecordTarget, summary: &SessionSummary) {
+    let SessionSummary {
+        frames,
+        dropped,
+        missed,
+        ref timing,
+        ..
+    } = *summary;
+    let discarded = summary.flight.map_or(0, |f| f.discarded);
+    // The counters come from different threads; never wrap if they
+    // disagree.
+    let written = frames.saturating_sub(dropped).saturating_sub(discarded);
+    match target {
+        RecordTarget::File(path) => {
+            eprintln!("Finished: {written} frames written to {}", path.display());
+        }
+        RecordTarget::Stream(addr, stats) => eprintln!(
+            "Finished: {} frames sent to {addr}, {} unsent with no client connected",
+            stats.sent.load(Ordering::Relaxed),
+            stats.unsent.load(Ordering::Relaxed)
+        ),
+    }
+    if dropped > 0 {
+        eprintln!("Dropped {dropped} frames because the recording queue was full");
+    }
+    if let Some(flight) = summary.flight {
+        eprintln!(
+            "Flight recorder: {} triggers, {discarded} frames not written",
+            flight.triggers
+        );
+    }
+    if !timing.is_empty() {
+        eprintln!(
+            "Sample lateness p50/p99: {}/{}, sampler overhead p50/p99: {}/{}",
+            format_duration_ns(timing.lateness.percentile(0.5)),
+            format_duration_ns(timing.lateness.percentile(0.99)),
+            format_duration_ns(timing.overhead.percentile(0.5)),
+            format_duration_ns(timing.overhead.percentile(0.99)),
+        );
+    }
+    if missed > 0 {
+        eprintln!("Missed {missed} sample deadlines; the period may be too short");
+    }
+    if timing.torn_reads > 0 {
+        eprintln!(
+            "{} thread entries were read torn and re-read or discarded",
+            timing.torn_reads
+        );
+    }
 }
 
-#[allow(clippy::cast_precision_loss)]
-fn print_recording_status(elapsed: Duration, frames: u64, path: &Path) {
-    let secs = elapsed.as_secs();
-    let size = std::fs::metadata(path).map_or(0, |m| m.len());
+fn print_recording_status(progress: &Progress, target: &RecordTarget) {
+    let secs = progress.elapsed.as_secs();
+    let frames = progress.frames;
+    let queue = &progress.queue;
+    let flight = queue.flight.map_or_else(String::new, |f| {
+        format!(", {} triggers, {} held", f.triggers, f.held)
+    });
     eprintln!(
-        "  [{secs}s] {frames} frames, {:.1} KB",
-        size as f64 / 1024.0
+        "  [{secs}s] {frames} frames, {}, queue {}/{}, {} dropped{flight}",
+        target.status(),
+        queue.depth,
+        queue.capacity,
+        queue.dropped,
     );
 }
 
 // ---------------------------------------------------------------------------
-// Watch subcommand
+// Serve subcommand
 // ---------------------------------------------------------------------------
 
-fn cmd_watch(sample_period_ms: u64, record_path: Option<&Path>) -> Result<()> {
-    let shutdown = install_signal_handler()?;
+/// Samples `pid`, or every process in `scope`, and serves the aggregated
+/// metrics on `listen` until interrupted, the processes exit (except with
+/// `--all`) or the duration passes.
+fn cmd_serve(
+    pid: Option<i32>,
+    scope: Option<Scope>,
+    listen: SocketAddr,
+    sampling: SamplingArgs,
+    timing: TimingArgs,
+    duration_secs: u64,
+) -> Result<()> {
+    let sample_period = timing.period(&sampling);
+    if sample_period.is_zero() {
+        bail!("sample period must be non-zero");
+    }
 
-    eprintln!("Watching for FEX processes...");
+    let shutdown = install_signal_handler()?;
+    let metrics = SharedMetrics::default();
+    let server = MetricsServer::spawn(listen, Arc::clone(&metrics))?;
+    eprintln!("Serving metrics on http://{}/metrics", server.local_addr());
 
-    loop {
-        if shutdown.load(Ordering::Relaxed) {
-            bail!("interrupted while watching for FEX processes");
+    let config = SessionConfig {
+        sample_period,
+        spin: timing.spin(),
+        pin_cpu: timing.pin_cpu,
+        max_duration: (duration_secs > 0).then(|| Duration::from_secs(duration_secs)),
+        forward_frames: false,
+        status_interval: None,
+    };
+    let (tx, rx) = mpsc::sync_channel::<Update>(UI_QUEUE_CAPACITY);
+    let session = match (scope, pid) {
+        (Some(scope), _) => {
+            let mut sampler = MultiSampler::new(scope, sample_period, sampling.mem_periods())?;
+            sampler.discover();
+            sampler.take_events().for_each(print_track_event);
+            if !sampler.is_event_driven() {
+                eprintln!("inotify unavailable; new processes are found by polling {SHM_DIR}");
+            }
+            // `--all` waits for processes; a tree ends with its processes.
+            let source = if scope == Scope::All {
+                MetricsSource::new(sampler, metrics).persistent()
+            } else if sampler.is_empty() {
+                bail!("no running FEX processes found");
+            } else {
+                MetricsSource::new(sampler, metrics)
+            };
+            Session::spawn(source, None, config, shutdown, tx)?
+        }
+        (None, Some(pid)) => {
+            let source = ProcessSource::open(pid, sample_period, sampling.mem_periods())?;
+            eprintln!("Sampling PID {pid}");
+            Session::spawn(
+                MetricsSource::new(source, metrics),
+                None,
+                config,
+                shutdown,
+                tx,
+            )?
         }
+        (None, None) => unreachable!("clap requires a PID unless --all"),
+    };
 
-        if let Some(pid) = find_fex_process() {
-            eprintln!("Found FEX process with PID {pid}");
-            return cmd_live(pid, sample_period_ms, record_path);
+    // The sampler holds the only sender, so this ends when it stops.
+    for update in rx {
+        if let Update::Track(event) = update {
+            print_track_event(event);
         }
+    }
 
-        std::thread::sleep(WATCH_POLL_INTERVAL);
+    let summary = session.join()?;
+    server.shutdown();
+    match summary.reason {
+        StopReason::Requested => eprintln!("\nInterrupted."),
+        StopReason::DurationLimit => eprintln!("\nDuration limit reached."),
+        StopReason::Exhausted => eprintln!("\nAll processes exited."),
     }
+    eprintln!("Sampled {} frames", summary.frames);
+    Ok(())
 }
 
-fn find_all_fex_processes() -> Vec<i32> {
-    let Some(read_dir) = std::fs::read_dir("/dev/shm").ok() else {
-        return Vec::new();
-    };
-    let mut candidates: Vec<i32> = Vec::new();
-
-    for entry in read_dir.flatten() {
-        let name = entry.file_name();
-        let name_str = name.to_string_lossy();
-        if let Some(rest) = name_str.strip_prefix("fex-")
-            && let Some(pid_str) = rest.strip_suffix("-stats")
-            && let Ok(pid) = pid_str.parse::<i32>()
-            && process_alive(pid)
-        {
-            candidates.push(pid);
-        }
+// ---------------------------------------------------------------------------
+// Watch subcommand
+// ---------------------------------------------------------------------------
+
+fn cmd_watch(
+    sampling: SamplingArgs,
+    display: DisplayArgs,
+    record_path: Option<&Path>,
+    tree: bool,
+    options: &RecordingOptions,
+) -> Result<()> {
+    let shutdown = install_signal_handler()?;
+    let mut watcher = SegmentWatcher::new();
+
+    if watcher.is_event_driven() {
+        eprintln!("Watching for FEX processes...");
+    } else {
+        eprintln!("Watching for FEX processes (inotify unavailable, polling {SHM_DIR})...");
     }
 
-    candidates.sort_unstable();
-    candidates
-}
+    // A segment FEX has not initialized yet, and when it was first seen.
+    let mut pending: Option<(i32, Instant)> = None;
 
-fn find_fex_process() -> Option<i32> {
-    find_all_fex_processes().last().copied()
-}
+    loop {
+        if shutdown.load(Ordering::Relaxed) {
+            bail!("interrupted while watching for FEX processes");
+        }
 
-fn read_process_cmdline(pid: i32) -> String {
-    let path = format!("/proc/{pid}/cmdline");
-    std::fs::read(&path).map_or_else(
-        |_| String::new(),
-        |bytes| {
-            bytes
-                .split(|&b| b == 0)
-                .filter(|s| !s.is_empty())
-                .map(|s| String::from_utf8_lossy(s).into_owned())
-                .collect::<Vec<_>>()
-                .join(" ")
-        },
-    )
-}
+        pending = find_fex_process().map(|pid| match pending {
+            Some((p, since)) if p == pid => (pid, since),
+            _ => (pid, Instant::now()),
+        });
+        // Past the timeout, attach anyway so a broken segment is reported.
+        if let Some((pid, since)) = pending
+            && (segment_ready(pid) || since.elapsed() >= SEGMENT_READY_TIMEOUT)
+        {
+            eprintln!("Found FEX process with PID {pid}");
+            if tree && let Some(output) = record_path {
+                return cmd_record_multi(
+                    Scope::Tree(pid),
+                    &RecordTarget::File(output.to_path_buf()),
+                    sampling,
+                    TimingArgs::default(),
+                    0,
+                    options,
+                );
+            }
+            return cmd_live(pid, sampling, display, record_path, options);
+        }
 
-fn read_process_ppid(pid: i32) -> Option<i32> {
-    let stat = std::fs::read_to_string(format!("/proc/{pid}/stat")).ok()?;
-    // Format: pid (comm) state ppid ... — comm can contain ')' so find the last one
-    let after_comm = &stat[stat.rfind(')')? + 2..];
-    // Fields after comm: state ppid ...
-    after_comm.split_whitespace().nth(1)?.parse().ok()
+        // A segment FEX has not initialized yet produces no further events,
+        // so it is re-checked shortly rather than on the next event.
+        let timeout = if pending.is_some() {
+            SEGMENT_RETRY_INTERVAL
+        } else {
+            WATCH_POLL_INTERVAL
+        };
+        watcher.wait(timeout);
+    }
 }
 
 // ---------------------------------------------------------------------------
 // Pick subcommand
 // ---------------------------------------------------------------------------
 
-fn cmd_pick(sample_period_ms: u64, record_path: Option<&Path>) -> Result<()> {
+fn cmd_pick(
+    sampling: SamplingArgs,
+    display: DisplayArgs,
+    record_path: Option<&Path>,
+    tree: bool,
+    options: &RecordingOptions,
+) -> Result<()> {
     let pids = find_all_fex_processes();
 
     if pids.is_empty() {
@@ -659,7 +1465,17 @@ fn cmd_pick(sample_period_ms: u64, record_path: Option<&Path>) -> Result<()> {
         prompt_selection(&ordered)?
     };
 
-    cmd_live(pid, sample_period_ms, record_path)
+    if tree && let Some(output) = record_path {
+        return cmd_record_multi(
+            Scope::Tree(pid),
+            &RecordTarget::File(output.to_path_buf()),
+            sampling,
+            TimingArgs::default(),
+            0,
+            options,
+        );
+    }
+    cmd_live(pid, sampling, display, record_path, options)
 }
 
 fn print_process_tree(pids: &[i32], color: bool) -> Vec<i32> {
@@ -789,87 +1605,306 @@ fn prompt_selection(pids: &[i32]) -> Result<i32> {
 // Export subcommand
 // ---------------------------------------------------------------------------
 
-fn cmd_export(input: &Path, output: &Path) -> Result<()> {
-    let reader = RecordingReader::open(input)?;
-    let total = reader.frame_count();
-
-    let mut out = std::fs::File::create(output)
-        .with_context(|| format!("failed to create {}", output.display()))?;
+fn jobs_or_all_cores(jobs: Option<usize>) -> usize {
+    jobs.unwrap_or_else(|| {
+        std::thread::available_parallelism().map_or(1, std::num::NonZeroUsize::get)
+    })
+}
 
-    write_csv_header(&mut out)?;
+fn cmd_export(args: &ExportArgs) -> Result<()> {
+    let reader = RecordingReader::open(&args.input)?;
+    let jobs = jobs_or_all_cores(args.jobs);
 
-    for i in 0..total {
-        if let Some(frame) = reader.frame_at(i) {
-            write_csv_row(&mut out, i, &frame.computed)?;
-        }
+    let mut frames = CsvOutput::create(&args.output)?;
+    let mut threads = args.threads.as_deref().map(CsvOutput::create).transpose()?;
+    let total = export_csv(&reader, &mut frames, threads.as_mut(), jobs)?;
+    frames.finish()?;
+    if let Some(threads) = threads {
+        threads.finish()?;
     }
 
     eprintln!(
         "Exported {total} frames from {} to {}",
-        input.display(),
-        output.display()
+        args.input.display(),
+        args.output.display()
     );
+    if let Some(path) = &args.threads {
+        eprintln!("Per-thread deltas written to {}", path.display());
+    }
     Ok(())
 }
 
-fn write_csv_header(out: &mut impl Write) -> Result<()> {
-    writeln!(
-        out,
-        "frame,timestamp_ns,sample_period_ns,threads_sampled,\
-         total_jit_time,total_signal_time,total_sigbus_count,\
-         total_smc_count,total_float_fallback_count,\
-         total_cache_miss_count,total_cache_read_lock_time,\
-         total_cache_write_lock_time,total_jit_count,\
-         total_jit_invocations,fex_load_percent,\
-         mem_total_anon,mem_jit_code,mem_op_dispatcher,\
-         mem_frontend,mem_cpu_backend,mem_lookup,mem_lookup_l1,\
-         mem_thread_states,mem_block_links,mem_misc,\
-         mem_jemalloc,mem_unaccounted,\
-         cum_sigbus_count,cum_smc_count,cum_float_fallback_count,\
-         cum_cache_miss_count,cum_jit_count"
-    )
-    .context("failed to write CSV header")
+// ---------------------------------------------------------------------------
+// Contention subcommand
+// ---------------------------------------------------------------------------
+
+fn cmd_contention(args: &ContentionArgs) -> Result<()> {
+    let jobs = jobs_or_all_cores(args.jobs);
+    // Open every input first, so a bad path fails before any output.
+    let readers = args
+        .inputs
+        .iter()
+        .map(|input| RecordingReader::open(input))
+        .collect::<Result<Vec<_>>>()?;
+    let mut out = io::stdout().lock();
+    writeln!(out, "{CONTENTION_HEADER}")?;
+    for (input, reader) in args.inputs.iter().zip(readers) {
+        let processes = contention_by_process(&reader, jobs)
+            .with_context(|| format!("failed to read {}", input.display()))?;
+        write_contention_rows(
+            &mut out,
+            &input.display().to_string(),
+            reader.metadata(),
+            &processes,
+        )?;
+    }
+    Ok(())
+}
+
+// ---------------------------------------------------------------------------
+// Recompress subcommand
+// ---------------------------------------------------------------------------
+
+fn cmd_recompress(args: &RecompressArgs) -> Result<()> {
+    let reader = RecordingReader::open(&args.input)?;
+    let jobs = jobs_or_all_cores(args.jobs);
+    let options = RecordingOptions {
+        encoding: args.encoding,
+        compression: CompressionOptions {
+            level: args.level,
+            workers: jobs,
+            dictionary: args
+                .dictionary_from
+                .as_deref()
+                .map(dictionary_from)
+                .transpose()?,
+        },
+        ..RecordingOptions::default()
+    };
+
+    let started = Instant::now();
+    let summary = recompress(
+        &reader,
+        &args.input,
+        &args.output,
+        options,
+        args.dictionary,
+        jobs,
+    )?;
+    #[allow(clippy::cast_precision_loss)]
+    let percent = summary.output_bytes as f64 / summary.input_bytes.max(1) as f64 * 100.0;
+    eprintln!(
+        "Recompressed {} frames from {} ({}) to {} ({}, {percent:.0}%) in {:.1}s",
+        summary.frames,
+        args.input.display(),
+        format_bytes(summary.input_bytes),
+        args.output.display(),
+        format_bytes(summary.output_bytes),
+        started.elapsed().as_secs_f64()
+    );
+    if summary.dictionary_bytes > 0 {
+        eprintln!(
+            "Blocks are compressed against a {} dictionary",
+            format_bytes(summary.dictionary_bytes as u64)
+        );
+    }
+    Ok(())
 }
 
-fn write_csv_row(
+// ---------------------------------------------------------------------------
+// Threads subcommand
+// ---------------------------------------------------------------------------
+
+fn cmd_threads(args: &ThreadsArgs) -> Result<()> {
+    let reader = RecordingReader::open(&args.input)?;
+    let started = Instant::now();
+    let index = reader.thread_index(jobs_or_all_cores(args.jobs))?;
+    eprintln!(
+        "Per-thread index of {} threads {} in {:.1} ms",
+        index.threads.len(),
+        if reader.has_thread_index() {
+            "read"
+        } else {
+            "built from the frames"
+        },
+        started.elapsed().as_secs_f64() * 1000.0
+    );
+
+    let mut out = io::stdout().lock();
+    if let Some(tid) = args.tid {
+        let thread = find_thread(&index, args.pid, tid)?;
+        return write_thread_timeline(&mut out, &index, thread);
+    }
+
+    #[allow(clippy::cast_precision_loss)]
+    let cycle_freq = reader.metadata().cycle_counter_frequency.max(1) as f64;
+    write!(out, "{:>7} {:>7} {:>8}", "pid", "tid", "frames")?;
+    for counter in Counter::ALL {
+        write!(
+            out,
+            " {:>w$}",
+            counter.name(),
+            w = counter.name().len().max(12)
+        )?;
+    }
+    writeln!(out)?;
+    for t in index.top(args.by, args.top, args.pid) {
+        write!(out, "{:>7} {:>7} {:>8}", t.pid, t.tid, t.frames)?;
+        for counter in Counter::ALL {
+            let w = counter.name().len().max(12);
+            if counter.is_cycles() {
+                #[allow(clippy::cast_precision_loss)]
+                let seconds = t.total(counter) as f64 / cycle_freq;
+                write!(out, " {:>w$}", format!("{seconds:.3}s"))?;
+            } else {
+                write!(out, " {:>w$}", t.total(counter))?;
+            }
+        }
+        writeln!(out)?;
+    }
+    Ok(())
+}
+
+/// Thread `tid`, which must be unambiguous without `pid` in multiplexed
+/// recordings.
+fn find_thread(index: &ThreadIndex, pid: Option<i32>, tid: u32) -> Result<&ThreadTimeline> {
+    if let Some(pid) = pid {
+        return index
+            .thread(pid, tid)
+            .with_context(|| format!("no thread {tid} in process {pid}"));
+    }
+    let mut matches = index.threads.iter().filter(|t| t.tid == tid);
+    let thread = matches
+        .next()
+        .with_context(|| format!("no thread {tid} in the recording"))?;
+    if matches.next().is_some() {
+        bail!("thread {tid} appears in several processes; pick one with --pid");
+    }
+    Ok(thread)
+}
+
+/// One CSV row per block `thread` ran in, counters in cycles or counts.
+fn write_thread_timeline(
     out: &mut impl Write,
-    index: usize,
-    f: &sampler::accumulator::ComputedFrame,
+    index: &ThreadIndex,
+    thread: &ThreadTimeline,
 ) -> Result<()> {
-    writeln!(
-        out,
-        "{index},{},{},{},{},{},{},{},{},{},{},{},{},{},{:.4},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{}",
-        f.timestamp_ns,
-        f.sample_period_ns,
-        f.threads_sampled,
-        f.total_jit_time,
-        f.total_signal_time,
-        f.total_sigbus_count,
-        f.total_smc_count,
-        f.total_float_fallback_count,
-        f.total_cache_miss_count,
-        f.total_cache_read_lock_time,
-        f.total_cache_write_lock_time,
-        f.total_jit_count,
-        f.total_jit_invocations,
-        f.fex_load_percent,
-        f.mem.total_anon,
-        f.mem.jit_code,
-        f.mem.op_dispatcher,
-        f.mem.frontend,
-        f.mem.cpu_backend,
-        f.mem.lookup,
-        f.mem.lookup_l1,
-        f.mem.thread_states,
-        f.mem.block_links,
-        f.mem.misc,
-        f.mem.jemalloc,
-        f.mem.unaccounted,
-        f.cumulative.sigbus,
-        f.cumulative.smc,
-        f.cumulative.float_fallback,
-        f.cumulative.cache_miss,
-        f.cumulative.jit,
-    )
-    .context("failed to write CSV row")
+    write!(out, "block,first_frame,timestamp_ns")?;
+    for counter in Counter::ALL {
+        write!(out, ",{}", counter.name())?;
+    }
+    writeln!(out)?;
+    for (i, &block) in thread.blocks.iter().enumerate() {
+        let span = index.blocks[block as usize];
+        write!(
+            out,
+            "{block},{},{}",
+            span.first_frame, span.first_timestamp_ns
+        )?;
+        for column in &thread.columns {
+            write!(out, ",{}", column[i])?;
+        }
+        writeln!(out)?;
+    }
+    Ok(())
+}
+
+// ---------------------------------------------------------------------------
+// Diff subcommand
+// ---------------------------------------------------------------------------
+
+fn cmd_diff(args: &DiffArgs) -> Result<()> {
+    if args.bucket == 0 {
+        bail!("bucket width must be non-zero");
+    }
+    let gate = args
+        .fail_above
+        .map(|threshold_percent| {
+            let metrics = args
+                .gate
+                .iter()
+                .map(|name| {
+                    metric_index(name).with_context(|| {
+                        let names: Vec<_> = METRICS.iter().map(|m| m.name).collect();
+                        format!(
+                            "unknown metric {name}; expected one of {}",
+                            names.join(", ")
+                        )
+                    })
+                })
+                .collect::<Result<_>>()?;
+            Ok::<_, anyhow::Error>(Gate {
+                threshold_percent,
+                metrics,
+            })
+        })
+        .transpose()?;
+
+    let options = DiffOptions {
+        bucket: Duration::from_millis(args.bucket),
+        skip: [
+            Duration::from_millis(args.skip_a),
+            Duration::from_millis(args.skip_b),
+        ],
+        duration: args.duration.map(Duration::from_secs),
+        jobs: jobs_or_all_cores(args.jobs),
+    };
+    let paths = [args.a.as_path(), args.b.as_path()];
+    let series = load_pair(paths, &options)?;
+    let summary = DiffSummary::new(&series, options.bucket);
+    let regressions = gate.as_ref().map(|g| summary.regressions(g));
+
+    let mut stdout = io::stdout().lock();
+    match args.format {
+        DiffFormat::Json => summary.write_json(&mut stdout, paths, gate.as_ref())?,
+        DiffFormat::Tui if stdout.is_terminal() => {
+            drop(stdout);
+            let title = format!(" A: {}  vs  B: {}", args.a.display(), args.b.display());
+            run_diff_view(DiffView::new(title, summary, series))?;
+        }
+        DiffFormat::Tui | DiffFormat::Text => summary.write_text(&mut stdout, paths)?,
+    }
+
+    if let (Some(gate), Some(failed)) = (&gate, regressions)
+        && !failed.is_empty()
+    {
+        bail!(
+            "{} regressed by more than {}%: {}",
+            if failed.len() == 1 {
+                "1 metric"
+            } else {
+                "metrics"
+            },
+            gate.threshold_percent,
+            failed.join(", ")
+        );
+    }
+    Ok(())
+}
+
+fn run_diff_view(mut view: DiffView) -> Result<()> {
+    let shutdown = install_signal_handler()?;
+    let mut terminal = setup_terminal()?;
+    let result = run_diff_loop(&shutdown, &mut view, &mut terminal);
+    restore_terminal(&mut terminal)?;
+    result
+}
+
+fn run_diff_loop(
+    shutdown: &Arc<AtomicBool>,
+    view: &mut DiffView,
+    terminal: &mut Terminal<CrosstermBackend<Stdout>>,
+) -> Result<()> {
+    while !view.should_quit && !shutdown.load(Ordering::Relaxed) {
+        terminal
+            .draw(|f| view.render(f))
+            .context("failed to draw frame")?;
+        if event::poll(IDLE_POLL_TIMEOUT).context("failed to poll events")?
+            && let Event::Key(key) = event::read().context("failed to read event")?
+            && key.kind == KeyEventKind::Press
+        {
+            view.handle_key(key.code);
+        }
+    }
+    Ok(())
 }
@@ -0,0 +1,508 @@
+// SPDX-License-Identifier: MIT
+//! Off-thread recording: the sampling loop hands frames to a dedicated writer
+//! thread through a bounded single-producer/single-consumer ring, so
+//! serialization, compression and file or network I/O never stall sampling.
+
+use std::cell::UnsafeCell;
+use std::mem::MaybeUninit;
+use std::path::Path;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant};
+
+use anyhow::{Context, Result, anyhow, bail};
+
+use super::flight::{FlightRecorder, FlightStats};
+use super::format::Frame;
+use super::writer::{RecordingOptions, RecordingWriter};
+use crate::datasource::SessionMetadata;
+
+/// Frames the ring can hold before the overflow policy applies.
+pub const QUEUE_CAPACITY: usize = 1024;
+
+/// Upper bound on how long the idle writer thread sleeps between checks.
+const CONSUMER_IDLE_TIMEOUT: Duration = Duration::from_millis(50);
+/// Longest a written frame stays in the file buffer and, in a followable
+/// recording, in a partial block, so followers lag by at most this much.
+const FLUSH_INTERVAL: Duration = Duration::from_secs(1);
+/// Back-off while a blocking producer waits for the writer to catch up.
+const PRODUCER_BACKOFF: Duration = Duration::from_micros(200);
+
+/// What `submit` does when the ring is full.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, clap::ValueEnum)]
+pub enum OverflowPolicy {
+    /// Wait for the writer thread; no frame is lost but sampling may stall.
+    #[default]
+    Block,
+    /// Discard the new frame and count it.
+    Drop,
+}
+
+/// Snapshot of the writer queue for status displays.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct QueueStats {
+    pub depth: usize,
+    pub capacity: usize,
+    pub dropped: u64,
+    /// Triggers and held frames, in flight-recorder mode.
+    pub flight: Option<FlightStats>,
+}
+
+/// Bounded lock-free SPSC ring. `head` and `tail` increase monotonically;
+/// only the producer stores `tail` and only the consumer stores `head`.
+struct Ring<T> {
+    slots: Box<[UnsafeCell<MaybeUninit<T>>]>,
+    head: AtomicUsize,
+    tail: AtomicUsize,
+}
+
+// SAFETY: a slot is accessed by exactly one side at a time; ownership moves
+// from producer to consumer through the release/acquire pair on `tail`, and
+// back through the pair on `head`.
+unsafe impl<T: Send> Sync for Ring<T> {}
+
+impl<T> Ring<T> {
+    fn new(capacity: usize) -> Self {
+        Self {
+            slots: (0..capacity.max(1))
+                .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+                .collect(),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+        }
+    }
+
+    fn capacity(&self) -> usize {
+        self.slots.len()
+    }
+
+    fn len(&self) -> usize {
+        let tail = self.tail.load(Ordering::Acquire);
+        let head = self.head.load(Ordering::Acquire);
+        tail.wrapping_sub(head)
+    }
+
+    /// Producer side. Returns the value back if the ring is full.
+    fn push(&self, value: T) -> Result<(), T> {
+        let tail = self.tail.load(Ordering::Relaxed);
+        let head = self.head.load(Ordering::Acquire);
+        if tail.wrapping_sub(head) == self.capacity() {
+            return Err(value);
+        }
+        // SAFETY: the slot is outside [head, tail), so the consumer is not
+        // reading it, and only this (single) producer writes slots.
+        unsafe { (*self.slots[tail % self.capacity()].get()).write(value) };
+        self.tail.store(tail.wrapping_add(1), Ordering::Release);
+        Ok(())
+    }
+
+    /// Consumer side.
+    fn pop(&self) -> Option<T> {
+        let head = self.head.load(Ordering::Relaxed);
+        let tail = self.tail.load(Ordering::Acquire);
+        if head == tail {
+            return None;
+        }
+        // SAFETY: the slot is inside [head, tail), so it was initialized by
+        // the producer and will not be touched again until `head` moves.
+        let value = unsafe { (*self.slots[head % self.capacity()].get()).assume_init_read() };
+        self.head.store(head.wrapping_add(1), Ordering::Release);
+        Some(value)
+    }
+}
+
+impl<T> Drop for Ring<T> {
+    fn drop(&mut self) {
+        while self.pop().is_some() {}
+    }
+}
+
+#[derive(Default)]
+struct SharedFlightStats {
+    triggers: AtomicU64,
+    held: AtomicUsize,
+    discarded: AtomicU64,
+}
+
+impl SharedFlightStats {
+    fn store(&self, stats: FlightStats) {
+        self.triggers.store(stats.triggers, Ordering::Relaxed);
+        self.held.store(stats.held, Ordering::Relaxed);
+        self.discarded.store(stats.discarded, Ordering::Relaxed);
+    }
+
+    fn load(&self) -> FlightStats {
+        FlightStats {
+            triggers: self.triggers.load(Ordering::Relaxed),
+            held: self.held.load(Ordering::Relaxed),
+            discarded: self.discarded.load(Ordering::Relaxed),
+        }
+    }
+}
+
+struct Shared {
+    ring: Ring<Frame>,
+    dropped: AtomicU64,
+    /// Time the writer thread has spent in `write_frame`.
+    busy_ns: AtomicU64,
+    /// Flight-recorder counters, published by the writer thread after each
+    /// frame.
+    flight: Option<SharedFlightStats>,
+    closed: AtomicBool,
+    failed: AtomicBool,
+    consumer_sleeping: AtomicBool,
+}
+
+/// Where the writer thread puts frames: a `RecordingWriter`, or a stream.
+pub trait FrameSink: Send + 'static {
+    /// # Errors
+    ///
+    /// Returns an error if the frame cannot be encoded or written.
+    fn write_frame(&mut self, frame: &Frame) -> Result<()>;
+
+    /// Frames taken but not yet written out.
+    fn pending_frames(&self) -> u32;
+
+    /// Writes out buffered output; with `end_block`, frames held for a
+    /// larger block too.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if writing fails.
+    fn flush(&mut self, end_block: bool) -> Result<()>;
+
+    /// # Errors
+    ///
+    /// Returns an error if the remaining output cannot be written.
+    fn finish(self) -> Result<()>;
+
+    /// Frames the queue has dropped so far, for sinks that report them.
+    fn set_queue_dropped(&mut self, _dropped: u64) {}
+}
+
+impl FrameSink for RecordingWriter {
+    fn write_frame(&mut self, frame: &Frame) -> Result<()> {
+        Self::write_frame(self, frame)
+    }
+
+    fn pending_frames(&self) -> u32 {
+        Self::pending_frames(self)
+    }
+
+    fn flush(&mut self, end_block: bool) -> Result<()> {
+        Self::flush(self, end_block)
+    }
+
+    fn finish(self) -> Result<()> {
+        Self::finish(self)
+    }
+}
+
+/// A `FrameSink` running on its own thread.
+pub struct AsyncRecordingWriter {
+    shared: Arc<Shared>,
+    handle: Option<JoinHandle<Result<()>>>,
+    policy: OverflowPolicy,
+}
+
+impl AsyncRecordingWriter {
+    /// Creates the recording file and starts its writer thread.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file cannot be created or the thread cannot
+    /// be spawned.
+    pub fn create(
+        path: &Path,
+        metadata: &SessionMetadata,
+        options: &RecordingOptions,
+    ) -> Result<Self> {
+        let writer = RecordingWriter::create(path, metadata, options)?;
+        Self::with_sink(writer, options)
+    }
+
+    /// Starts a writer thread for `sink` with the queue settings of
+    /// `options`.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the flight recorder or the thread cannot be set
+    /// up.
+    pub fn with_sink(sink: impl FrameSink, options: &RecordingOptions) -> Result<Self> {
+        let flight = options.flight.map(FlightRecorder::new).transpose()?;
+        Self::spawn(
+            sink,
+            QUEUE_CAPACITY,
+            options.overflow,
+            flight,
+            options.followable,
+        )
+    }
+
+    /// Moves `writer` onto a new thread fed by a ring of `capacity` frames,
+    /// writing only what `flight` lets through if given. With `followable`,
+    /// a block open for `FLUSH_INTERVAL` is ended early.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the thread cannot be spawned.
+    pub fn spawn(
+        writer: impl FrameSink,
+        capacity: usize,
+        policy: OverflowPolicy,
+        flight: Option<FlightRecorder>,
+        followable: bool,
+    ) -> Result<Self> {
+        let shared = Arc::new(Shared {
+            ring: Ring::new(capacity),
+            dropped: AtomicU64::new(0),
+            busy_ns: AtomicU64::new(0),
+            flight: flight.as_ref().map(|_| SharedFlightStats::default()),
+            closed: AtomicBool::new(false),
+            failed: AtomicBool::new(false),
+            consumer_sleeping: AtomicBool::new(false),
+        });
+
+        let thread_shared = Arc::clone(&shared);
+        let handle = std::thread::Builder::new()
+            .name("felix-writer".into())
+            .spawn(move || {
+                let result = writer_loop(&thread_shared, writer, flight, followable);
+                if result.is_err() {
+                    thread_shared.failed.store(true, Ordering::Release);
+                }
+                result
+            })
+            .context("failed to spawn recording writer thread")?;
+
+        Ok(Self {
+            shared,
+            handle: Some(handle),
+            policy,
+        })
+    }
+
+    /// Queues a frame for writing, applying the overflow policy if the ring
+    /// is full.
+    ///
+    /// # Errors
+    ///
+    /// Returns the writer thread's error if it has stopped.
+    pub fn submit(&mut self, frame: Frame) -> Result<()> {
+        let mut frame = frame;
+        loop {
+            if self.shared.failed.load(Ordering::Acquire) {
+                return Err(self
+                    .join()
+                    .unwrap_or_else(|| anyhow!("recording writer stopped")));
+            }
+            match self.shared.ring.push(frame) {
+                Ok(()) => break,
+                Err(rejected) => match self.policy {
+                    OverflowPolicy::Drop => {
+                        self.shared.dropped.fetch_add(1, Ordering::Relaxed);
+                        return Ok(());
+                    }
+                    OverflowPolicy::Block => {
+                        frame = rejected;
+                        self.wake_consumer();
+                        std::thread::sleep(PRODUCER_BACKOFF);
+                    }
+                },
+            }
+        }
+
+        if self.shared.consumer_sleeping.load(Ordering::SeqCst) {
+            self.wake_consumer();
+        }
+        Ok(())
+    }
+
+    #[must_use]
+    pub fn stats(&self) -> QueueStats {
+        QueueStats {
+            depth: self.shared.ring.len(),
+            capacity: self.shared.ring.capacity(),
+            dropped: self.shared.dropped.load(Ordering::Relaxed),
+            flight: self.shared.flight.as_ref().map(SharedFlightStats::load),
+        }
+    }
+
+    /// Total time the writer thread has spent serializing, compressing and
+    /// writing frames.
+    #[must_use]
+    pub fn busy_ns(&self) -> u64 {
+        self.shared.busy_ns.load(Ordering::Relaxed)
+    }
+
+    /// Drains the queue, finishes the recording and joins the writer thread.
+    /// Returns the final queue statistics.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if writing or finishing the recording failed.
+    pub fn finish(mut self) -> Result<QueueStats> {
+        self.join().map_or(Ok(()), Err)?;
+        Ok(self.stats())
+    }
+
+    fn wake_consumer(&self) {
+        if let Some(handle) = &self.handle {
+            handle.thread().unpark();
+        }
+    }
+
+    /// Closes the queue and joins the writer thread, returning its error.
+    fn join(&mut self) -> Option<anyhow::Error> {
+        let handle = self.handle.take()?;
+        self.shared.closed.store(true, Ordering::Release);
+        handle.thread().unpark();
+        match handle.join() {
+            Ok(Ok(())) => None,
+            Ok(Err(e)) => Some(e),
+            Err(_) => Some(anyhow!("recording writer thread panicked")),
+        }
+    }
+}
+
+impl Drop for AsyncRecordingWriter {
+    fn drop(&mut self) {
+        let _ = self.join();
+    }
+}
+
+fn writer_loop(
+    shared: &Shared,
+    mut writer: impl FrameSink,
+    mut flight: Option<FlightRecorder>,
+    followable: bool,
+) -> Result<()> {
+    let mut last_flush = Instant::now();
+    // When the current block got its first frame.
+    let mut block_started: Option<Instant> = None;
+    let publish = |flight: &FlightRecorder| {
+        if let Some(stats) = &shared.flight {
+            stats.store(flight.stats());
+        }
+    };
+    loop {
+        while let Some(frame) = shared.ring.pop() {
+            writer.set_queue_dropped(shared.dropped.load(Ordering::Relaxed));
+            match flight.as_mut() {
+                Some(flight) => {
+                    flight.push(frame, |f| timed(shared, || writer.write_frame(f)))?;
+                    publish(flight);
+                }
+                None => timed(shared, || writer.write_frame(&frame))?,
+            }
+            if writer.pending_frames() == 0 {
+                block_started = None;
+            } else if block_started.is_none() {
+                block_started = Some(Instant::now());
+            }
+        }
+        // Ending blocks early costs compression at low sample rates, so
+        // only followable recordings do it, and only for blocks that did
+        // not fill within the interval.
+        if last_flush.elapsed() >= FLUSH_INTERVAL {
+            let end_block =
+                followable && block_started.is_some_and(|t| t.elapsed() >= FLUSH_INTERVAL);
+            timed(shared, || writer.flush(end_block))?;
+            if end_block {
+                block_started = None;
+            }
+            last_flush = Instant::now();
+        }
+        if shared.closed.load(Ordering::Acquire) {
+            if shared.ring.len() == 0 {
+                break;
+            }
+            continue;
+        }
+
+        // Publish that we are about to sleep, then re-check so a frame pushed
+        // in between is not left waiting for the timeout.
+        shared.consumer_sleeping.store(true, Ordering::SeqCst);
+        if shared.ring.len() == 0 && !shared.closed.load(Ordering::Acquire) {
+            std::thread::park_timeout(CONSUMER_IDLE_TIMEOUT);
+        }
+        shared.consumer_sleeping.store(false, Ordering::SeqCst);
+    }
+
+    if shared.ring.len() != 0 {
+        bail!("recording queue not drained");
+    }
+    if let Some(flight) = flight.as_mut() {
+        flight.finish();
+        publish(flight);
+    }
+    writer.finish()
+}
+
+/// Runs `work`, adding its duration to the writer's busy time.
+fn timed(shared: &Shared, work: impl FnOnce() -> Result<()>) -> Result<()> {
+    let started = Instant::now();
+    let result = work();
+    #[allow(clippy::cast_possible_truncation)]
+    let cost = started.elapsed().as_nanos() as u64;
+    shared.busy_ns.fetch_add(cost, Ordering::Relaxed);
+    result
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn ring_is_fifo_and_bounded() {
+        let ring = Ring::new(3);
+        assert!(ring.push(1).is_ok());
+        assert!(ring.push(2).is_ok());
+        assert!(ring.push(3).is_ok());
+        assert_eq!(ring.push(4), Err(4));
+        assert_eq!(ring.len(), 3);
+        assert_eq!(ring.pop(), Some(1));
+        assert!(ring.push(4).is_ok());
+        assert_eq!(ring.pop(), Some(2));
+        assert_eq!(ring.pop(), Some(3));
+        assert_eq!(ring.pop(), Some(4));
+        assert_eq!(ring.pop(), None);
+    }
+
+    #[test]
+    fn ring_transfers_across_threads() {
+        let ring = Arc::new(Ring::new(8));
+        let consumer = {
+            let ring = Arc::clone(&ring);
+            std::thread::spawn(move || {
+                let mut expected = 0u32;
+                while expected < 10_000 {
+                    if let Some(v) = ring.pop() {
+                        assert_eq!(v, expected);
+                        expected += 1;
+                    } else {
+                        std::thread::yield_now();
+                    }
+                }
+            })
+        };
+        for mut v in 0..10_000u32 {
+            while let Err(back) = ring.push(v) {
+                v = back;
+                std::thread::yield_now();
+            }
+        }
+        consumer.join().unwrap();
+    }
+
+    #[test]
+    fn ring_drops_unconsumed_values() {
+        let value = Arc::new(());
+        let ring = Ring::new(4);
+        ring.push(Arc::clone(&value)).unwrap();
+        ring.push(Arc::clone(&value)).unwrap();
+        drop(ring);
+        assert_eq!(Arc::strong_count(&value), 1);
+    }
+}
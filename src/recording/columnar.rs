@@ -0,0 +1,460 @@
+// SPDX-License-Identifier: MIT
+//! Columnar, delta-encoded block payload.
+//!
+//! Only the raw inputs of `Accumulator::compute_frame` are stored: the
+//! PID, timestamp, period, JIT invocation counter, memory age, sampler
+//! timing, felix's own stage times and torn-read count, cumulative counters
+//! and per-thread deltas, each as its own column
+//! of LEB128 varints (signed columns zigzag-encoded against the previous
+//! frame of the same process). `MemSnapshot` is stored only when it differs
+//! from that frame. Everything else in `ComputedFrame` is recomputed on
+//! read.
+
+use std::time::Instant;
+
+use anyhow::{Context, Result, bail};
+
+use super::format::{BLOCK_ENCODING_COLUMNAR, Frame};
+use crate::fex::smaps::{LargestAnon, MemSnapshot};
+use crate::sampler::accumulator::{Accumulator, CumulativeCountStats};
+use crate::sampler::thread_stats::{SampleResult, ThreadDelta};
+
+const COL_TIMESTAMP: usize = 0;
+const COL_PERIOD: usize = 1;
+const COL_INVOCATIONS: usize = 2;
+const COL_CUMULATIVE: usize = 3; // five columns
+const COL_THREAD_COUNT: usize = 8;
+const COL_TID: usize = 9;
+const COL_THREAD_COUNTERS: usize = 10; // nine columns
+const COL_MEM_CHANGED: usize = 19;
+const COL_MEM: usize = 20;
+const COL_MEM_AGE: usize = 21;
+const COL_LATENESS: usize = 22;
+const COL_OVERHEAD: usize = 23;
+const COL_PID: usize = 24;
+const COL_TORN: usize = 25;
+const COL_STAGES: usize = 26; // three columns
+const COLUMN_COUNT: usize = 29;
+
+const THREAD_COUNTERS: usize = 9;
+const MEM_FIELDS: usize = 15;
+
+/// Per-process delta state. Multiplexed recordings interleave processes, so
+/// each one is delta-encoded against its own previous frame.
+#[derive(Default)]
+struct TrackState {
+    pid: i32,
+    period: u64,
+    invocations: u64,
+    mem_age: u64,
+    cumulative: [u64; 5],
+    tids: Vec<u32>,
+    mem: Option<[u64; MEM_FIELDS]>,
+}
+
+/// Returns the state for `pid`, creating it on first use. Recordings hold a
+/// handful of processes, so a linear scan beats hashing.
+fn track_state(tracks: &mut Vec<TrackState>, pid: i32) -> &mut TrackState {
+    let i = tracks.iter().position(|t| t.pid == pid).unwrap_or_else(|| {
+        tracks.push(TrackState {
+            pid,
+            ..TrackState::default()
+        });
+        tracks.len() - 1
+    });
+    &mut tracks[i]
+}
+
+/// Incrementally builds one columnar block; frames are appended as they are
+/// recorded, so the writer never has to buffer whole `Frame`s.
+#[derive(Default)]
+pub struct ColumnarEncoder {
+    columns: Vec<Vec<u8>>,
+    frames: u64,
+    prev_timestamp: u64,
+    prev_pid: i32,
+    tracks: Vec<TrackState>,
+}
+
+impl ColumnarEncoder {
+    #[must_use]
+    pub fn new() -> Self {
+        Self {
+            columns: vec![Vec::new(); COLUMN_COUNT],
+            ..Self::default()
+        }
+    }
+
+    /// Appends one frame, delta-encoding it against the previous frame of
+    /// the same process.
+    pub fn push(&mut self, frame: &Frame) {
+        let c = &frame.computed;
+        let cols = &mut self.columns;
+
+        put_delta(
+            &mut cols[COL_PID],
+            pid_bits(frame.pid),
+            pid_bits(self.prev_pid),
+        );
+        self.prev_pid = frame.pid;
+        put_delta(
+            &mut cols[COL_TIMESTAMP],
+            c.timestamp_ns,
+            self.prev_timestamp,
+        );
+        self.prev_timestamp = c.timestamp_ns;
+
+        let track = track_state(&mut self.tracks, frame.pid);
+        put_delta(&mut cols[COL_PERIOD], c.sample_period_ns, track.period);
+        put_delta(
+            &mut cols[COL_INVOCATIONS],
+            c.total_jit_invocations,
+            track.invocations,
+        );
+        track.period = c.sample_period_ns;
+        track.invocations = c.total_jit_invocations;
+        put_delta(&mut cols[COL_MEM_AGE], c.mem_age_ns, track.mem_age);
+        track.mem_age = c.mem_age_ns;
+        // Timing jitter is uncorrelated between frames; store it undeltaed.
+        put_varint(&mut cols[COL_LATENESS], c.sample_lateness_ns);
+        put_varint(&mut cols[COL_OVERHEAD], c.sample_overhead_ns);
+        put_varint(&mut cols[COL_TORN], u64::from(c.torn_reads));
+        for (i, ns) in [c.shm_read_ns, c.smaps_ns, c.record_ns]
+            .into_iter()
+            .enumerate()
+        {
+            put_varint(&mut cols[COL_STAGES + i], ns);
+        }
+
+        let cumulative = cumulative_fields(&c.cumulative);
+        for (i, (&v, prev)) in cumulative
+            .iter()
+            .zip(track.cumulative.iter_mut())
+            .enumerate()
+        {
+            put_delta(&mut cols[COL_CUMULATIVE + i], v, *prev);
+            *prev = v;
+        }
+
+        put_varint(
+            &mut cols[COL_THREAD_COUNT],
+            frame.per_thread_deltas.len() as u64,
+        );
+        // Threads keep their SHM list order between samples, so comparing the
+        // TID against the same slot of the previous frame is nearly always 0.
+        for (slot, d) in frame.per_thread_deltas.iter().enumerate() {
+            let prev = track.tids.get(slot).copied().unwrap_or(0);
+            put_delta(&mut cols[COL_TID], u64::from(d.tid), u64::from(prev));
+            for (i, v) in thread_counter_fields(d).into_iter().enumerate() {
+                put_varint(&mut cols[COL_THREAD_COUNTERS + i], v);
+            }
+        }
+        track.tids.clear();
+        track
+            .tids
+            .extend(frame.per_thread_deltas.iter().map(|d| d.tid));
+
+        let mem = mem_fields(&c.mem);
+        if track.mem == Some(mem) {
+            cols[COL_MEM_CHANGED].push(0);
+        } else {
+            cols[COL_MEM_CHANGED].push(1);
+            for v in mem {
+                put_varint(&mut cols[COL_MEM], v);
+            }
+            track.mem = Some(mem);
+        }
+
+        self.frames += 1;
+    }
+
+    /// Writes the tagged block payload to `out` and resets the encoder for
+    /// the next block, keeping its buffers.
+    pub fn finish_into(&mut self, out: &mut Vec<u8>) {
+        out.push(BLOCK_ENCODING_COLUMNAR);
+        put_varint(out, self.frames);
+        for col in &mut self.columns {
+            put_varint(out, col.len() as u64);
+            out.extend_from_slice(col);
+            col.clear();
+        }
+
+        self.frames = 0;
+        self.prev_timestamp = 0;
+        self.prev_pid = 0;
+        self.tracks.clear();
+    }
+}
+
+/// Decodes a columnar block payload (after the encoding tag), recomputing
+/// derived fields with `accumulator`.
+///
+/// # Errors
+///
+/// Returns an error if the payload is truncated or malformed.
+pub fn decode_block(mut payload: &[u8], accumulator: &Accumulator) -> Result<Vec<Frame>> {
+    let frame_count = usize::try_from(get_varint(&mut payload)?).context("bad frame count")?;
+
+    let mut columns: Vec<&[u8]> = Vec::with_capacity(COLUMN_COUNT);
+    for _ in 0..COLUMN_COUNT {
+        let len = usize::try_from(get_varint(&mut payload)?).context("bad column length")?;
+        let Some((col, rest)) = payload.split_at_checked(len) else {
+            bail!("truncated column in block");
+        };
+        columns.push(col);
+        payload = rest;
+    }
+
+    let mut timestamp = 0;
+    let mut pid = 0;
+    let mut tracks: Vec<TrackState> = Vec::new();
+
+    let mut frames = Vec::with_capacity(frame_count);
+    for _ in 0..frame_count {
+        pid = pid_from_bits(get_delta(&mut columns[COL_PID], pid_bits(pid))?)?;
+        timestamp = get_delta(&mut columns[COL_TIMESTAMP], timestamp)?;
+
+        let track = track_state(&mut tracks, pid);
+        track.period = get_delta(&mut columns[COL_PERIOD], track.period)?;
+        track.invocations = get_delta(&mut columns[COL_INVOCATIONS], track.invocations)?;
+        track.mem_age = get_delta(&mut columns[COL_MEM_AGE], track.mem_age)?;
+        let lateness = get_varint(&mut columns[COL_LATENESS])?;
+        let overhead = get_varint(&mut columns[COL_OVERHEAD])?;
+        let torn_reads =
+            u32::try_from(get_varint(&mut columns[COL_TORN])?).context("bad torn-read count")?;
+        let mut stages = [0u64; 3];
+        for (i, ns) in stages.iter_mut().enumerate() {
+            *ns = get_varint(&mut columns[COL_STAGES + i])?;
+        }
+        for (i, v) in track.cumulative.iter_mut().enumerate() {
+            *v = get_delta(&mut columns[COL_CUMULATIVE + i], *v)?;
+        }
+
+        let thread_count = usize::try_from(get_varint(&mut columns[COL_THREAD_COUNT])?)
+            .context("bad thread count")?;
+        let mut per_thread = Vec::with_capacity(thread_count);
+        for slot in 0..thread_count {
+            let prev = track.tids.get(slot).copied().unwrap_or(0);
+            let tid = u32::try_from(get_delta(&mut columns[COL_TID], u64::from(prev))?)
+                .context("bad thread id")?;
+            let mut counters = [0u64; THREAD_COUNTERS];
+            for (i, v) in counters.iter_mut().enumerate() {
+                *v = get_varint(&mut columns[COL_THREAD_COUNTERS + i])?;
+            }
+            per_thread.push(thread_delta(tid, counters));
+        }
+        track.tids.clear();
+        track.tids.extend(per_thread.iter().map(|d| d.tid));
+
+        let Some((&changed, rest)) = columns[COL_MEM_CHANGED].split_first() else {
+            bail!("truncated memory column in block");
+        };
+        columns[COL_MEM_CHANGED] = rest;
+        if changed != 0 {
+            let mut fields = [0u64; MEM_FIELDS];
+            for v in &mut fields {
+                *v = get_varint(&mut columns[COL_MEM])?;
+            }
+            track.mem = Some(fields);
+        }
+        let mem = track.mem.map(mem_snapshot).unwrap_or_default();
+
+        let sample = SampleResult {
+            timestamp: Instant::now(),
+            threads_sampled: per_thread.len(),
+            rejected: 0,
+            per_thread,
+        };
+        let c = &track.cumulative;
+        let mut computed = accumulator.compute_frame(
+            &sample,
+            &mem,
+            track.period,
+            track.invocations,
+            CumulativeCountStats {
+                sigbus: c[0],
+                smc: c[1],
+                float_fallback: c[2],
+                cache_miss: c[3],
+                jit: c[4],
+            },
+        );
+        computed.timestamp_ns = timestamp;
+        computed.mem_age_ns = track.mem_age;
+        computed.sample_lateness_ns = lateness;
+        computed.sample_overhead_ns = overhead;
+        computed.torn_reads = torn_reads;
+        [computed.shm_read_ns, computed.smaps_ns, computed.record_ns] = stages;
+
+        frames.push(Frame {
+            pid,
+            computed,
+            per_thread_deltas: sample.per_thread,
+        });
+    }
+
+    Ok(frames)
+}
+
+#[allow(clippy::cast_sign_loss)]
+fn pid_bits(pid: i32) -> u64 {
+    u64::from(pid as u32)
+}
+
+fn pid_from_bits(bits: u64) -> Result<i32> {
+    #[allow(clippy::cast_possible_wrap)]
+    let pid = u32::try_from(bits).context("bad pid")? as i32;
+    Ok(pid)
+}
+
+fn cumulative_fields(c: &CumulativeCountStats) -> [u64; 5] {
+    [c.sigbus, c.smc, c.float_fallback, c.cache_miss, c.jit]
+}
+
+fn thread_counter_fields(d: &ThreadDelta) -> [u64; THREAD_COUNTERS] {
+    [
+        d.jit_time,
+        d.signal_time,
+        d.sigbus_count,
+        d.smc_count,
+        d.float_fallback_count,
+        d.cache_miss_count,
+        d.cache_read_lock_time,
+        d.cache_write_lock_time,
+        d.jit_count,
+    ]
+}
+
+fn thread_delta(tid: u32, f: [u64; THREAD_COUNTERS]) -> ThreadDelta {
+    ThreadDelta {
+        tid,
+        jit_time: f[0],
+        signal_time: f[1],
+        sigbus_count: f[2],
+        smc_count: f[3],
+        float_fallback_count: f[4],
+        cache_miss_count: f[5],
+        cache_read_lock_time: f[6],
+        cache_write_lock_time: f[7],
+        jit_count: f[8],
+    }
+}
+
+fn mem_fields(m: &MemSnapshot) -> [u64; MEM_FIELDS] {
+    [
+        m.total_anon,
+        m.jit_code,
+        m.op_dispatcher,
+        m.frontend,
+        m.cpu_backend,
+        m.lookup,
+        m.lookup_l1,
+        m.thread_states,
+        m.block_links,
+        m.misc,
+        m.jemalloc,
+        m.unaccounted,
+        m.largest_anon.begin,
+        m.largest_anon.end,
+        m.largest_anon.size,
+    ]
+}
+
+fn mem_snapshot(f: [u64; MEM_FIELDS]) -> MemSnapshot {
+    MemSnapshot {
+        total_anon: f[0],
+        jit_code: f[1],
+        op_dispatcher: f[2],
+        frontend: f[3],
+        cpu_backend: f[4],
+        lookup: f[5],
+        lookup_l1: f[6],
+        thread_states: f[7],
+        block_links: f[8],
+        misc: f[9],
+        jemalloc: f[10],
+        unaccounted: f[11],
+        largest_anon: LargestAnon {
+            begin: f[12],
+            end: f[13],
+            size: f[14],
+        },
+    }
+}
+
+fn put_varint(out: &mut Vec<u8>, mut v: u64) {
+    while v >= 0x80 {
+        #[allow(clippy::cast_possible_truncation)]
+        out.push((v as u8) | 0x80);
+        v >>= 7;
+    }
+    #[allow(clippy::cast_possible_truncation)]
+    out.push(v as u8);
+}
+
+fn get_varint(input: &mut &[u8]) -> Result<u64> {
+    let mut v: u64 = 0;
+    for shift in (0..64).step_by(7) {
+        let Some((&byte, rest)) = input.split_first() else {
+            bail!("truncated varint in block");
+        };
+        *input = rest;
+        v |= u64::from(byte & 0x7F) << shift;
+        if byte & 0x80 == 0 {
+            return Ok(v);
+        }
+    }
+    bail!("varint too long in block")
+}
+
+/// Stores `v - prev` (wrapping) as a zigzag varint.
+fn put_delta(out: &mut Vec<u8>, v: u64, prev: u64) {
+    #[allow(clippy::cast_possible_wrap)]
+    let d = v.wrapping_sub(prev) as i64;
+    #[allow(clippy::cast_sign_loss)]
+    put_varint(out, ((d << 1) ^ (d >> 63)) as u64);
+}
+
+fn get_delta(input: &mut &[u8], prev: u64) -> Result<u64> {
+    let z = get_varint(input)?;
+    #[allow(clippy::cast_possible_wrap)]
+    let d = ((z >> 1) as i64) ^ -((z & 1) as i64);
+    #[allow(clippy::cast_sign_loss)]
+    Ok(prev.wrapping_add(d as u64))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn varint_round_trip() {
+        let mut buf = Vec::new();
+        for v in [0, 1, 127, 128, 300, u64::from(u32::MAX), u64::MAX] {
+            put_varint(&mut buf, v);
+        }
+        let mut input = buf.as_slice();
+        for v in [0, 1, 127, 128, 300, u64::from(u32::MAX), u64::MAX] {
+            assert_eq!(get_varint(&mut input).unwrap(), v);
+        }
+        assert!(input.is_empty());
+    }
+
+    #[test]
+    fn delta_round_trip_handles_decrease_and_wrap() {
+        let mut buf = Vec::new();
+        put_delta(&mut buf, 5, 10);
+        put_delta(&mut buf, 0, u64::MAX);
+        put_delta(&mut buf, u64::MAX, 0);
+        let mut input = buf.as_slice();
+        assert_eq!(get_delta(&mut input, 10).unwrap(), 5);
+        assert_eq!(get_delta(&mut input, u64::MAX).unwrap(), 0);
+        assert_eq!(get_delta(&mut input, 0).unwrap(), u64::MAX);
+    }
+
+    #[test]
+    fn truncated_varint_is_an_error() {
+        let mut input: &[u8] = &[0x80, 0x80];
+        assert!(get_varint(&mut input).is_err());
+    }
+}
@@ -0,0 +1,323 @@
+// SPDX-License-Identifier: MIT
+//! Block compression settings: the zstd level, worker threads compressing
+//! blocks while the writer carries on, and a dictionary trained on block
+//! payloads. Per-frame payloads are small and repetitive, so a dictionary
+//! lets each block start from what earlier recordings of the same kind
+//! looked like. The dictionary is stored raw in a skippable frame
+//! (`DICTIONARY_MAGIC`) right after the file header; every block of that
+//! file is compressed against it. `recompress` rewrites a whole recording
+//! with other settings.
+
+use std::fs::File;
+use std::io::Read;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+use std::sync::mpsc::{self, Receiver, Sender, SyncSender};
+use std::sync::{Arc, Mutex, PoisonError};
+use std::thread::{self, JoinHandle};
+
+use anyhow::{Context, Result, bail};
+
+use super::format::{DICTIONARY_MAGIC, FRAMES_PER_BLOCK, SKIPPABLE_HEADER_LEN};
+use super::reader::RecordingReader;
+use super::writer::{BlockBuilder, BlockEncoding, RecordingOptions, RecordingWriter};
+
+/// Level of live recordings: cheap enough to keep up on any device.
+pub const DEFAULT_LEVEL: i32 = 3;
+/// Level of `felix recompress`.
+pub const ARCHIVE_LEVEL: i32 = 19;
+/// Largest dictionary trained; zstd's own default.
+pub const DICTIONARY_SIZE: usize = 110 << 10;
+/// Blocks sampled for training, spread over the recording; about a hundred
+/// times the dictionary size, as zstd recommends.
+const TRAINING_BLOCKS: usize = 64;
+/// Training sample length. Whole blocks are too few samples for short
+/// recordings.
+const SAMPLE_LEN: usize = 4 << 10;
+/// Blocks each compression worker may have queued or in flight.
+const BLOCKS_PER_WORKER: usize = 2;
+
+#[derive(Clone, Debug)]
+pub struct CompressionOptions {
+    /// zstd level of the blocks; negative levels are faster still.
+    pub level: i32,
+    /// Threads compressing blocks off the writer's thread; 0 compresses on
+    /// it.
+    pub workers: usize,
+    /// Dictionary every block is compressed against, from
+    /// `train_dictionary`.
+    pub dictionary: Option<Arc<[u8]>>,
+}
+
+impl Default for CompressionOptions {
+    fn default() -> Self {
+        Self {
+            level: DEFAULT_LEVEL,
+            workers: 0,
+            dictionary: None,
+        }
+    }
+}
+
+impl CompressionOptions {
+    /// A compressor of these settings, for one thread.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if zstd rejects the level or the dictionary.
+    pub fn compressor(&self) -> Result<zstd::bulk::Compressor<'static>> {
+        match &self.dictionary {
+            Some(dictionary) => zstd::bulk::Compressor::with_dictionary(self.level, dictionary),
+            None => zstd::bulk::Compressor::new(self.level),
+        }
+        .with_context(|| format!("failed to set up zstd level {}", self.level))
+    }
+}
+
+/// Trains a dictionary of at most `DICTIONARY_SIZE` bytes on block
+/// payloads, in `SAMPLE_LEN` pieces.
+///
+/// # Errors
+///
+/// Returns an error if there is too little data to train on.
+pub fn train_dictionary(payloads: &[Vec<u8>]) -> Result<Vec<u8>> {
+    let samples: Vec<&[u8]> = payloads.iter().flat_map(|p| p.chunks(SAMPLE_LEN)).collect();
+    zstd::dict::from_samples(&samples, DICTIONARY_SIZE)
+        .context("failed to train a dictionary; the recording may be too short")
+}
+
+/// Wraps `dictionary` in its skippable frame.
+#[must_use]
+pub fn encode_dictionary(dictionary: &[u8]) -> Vec<u8> {
+    let mut out = Vec::with_capacity(SKIPPABLE_HEADER_LEN + dictionary.len());
+    out.extend_from_slice(&DICTIONARY_MAGIC.to_le_bytes());
+    #[allow(clippy::cast_possible_truncation)]
+    out.extend_from_slice(&(dictionary.len() as u32).to_le_bytes());
+    out.extend_from_slice(dictionary);
+    out
+}
+
+/// Reads the dictionary frame at `offset`, just past the file header, if
+/// the recording has one.
+///
+/// # Errors
+///
+/// Returns an error if the file cannot be read or the frame is truncated.
+pub fn read_dictionary(file: &File, offset: u64) -> Result<Option<Vec<u8>>> {
+    let mut head = [0u8; SKIPPABLE_HEADER_LEN];
+    let n = file
+        .read_at(&mut head, offset)
+        .context("failed to read recording")?;
+    if n < head.len()
+        || u32::from_le_bytes([head[0], head[1], head[2], head[3]]) != DICTIONARY_MAGIC
+    {
+        return Ok(None);
+    }
+    let len = u32::from_le_bytes([head[4], head[5], head[6], head[7]]) as usize;
+    let mut dictionary = vec![0u8; len];
+    file.read_exact_at(&mut dictionary, offset + SKIPPABLE_HEADER_LEN as u64)
+        .context("failed to read compression dictionary")?;
+    Ok(Some(dictionary))
+}
+
+/// Decompresses one zstd frame of unknown size, such as a block found by
+/// walking the file.
+///
+/// # Errors
+///
+/// Returns an error if `data` is not a frame compressed against
+/// `dictionary`.
+pub fn decompress(data: &[u8], dictionary: Option<&[u8]>) -> Result<Vec<u8>> {
+    let mut decoder = match dictionary {
+        Some(dictionary) => zstd::stream::read::Decoder::with_dictionary(data, dictionary),
+        None => zstd::stream::read::Decoder::with_buffer(data),
+    }
+    .context("failed to create zstd decoder")?;
+    let mut raw = Vec::new();
+    decoder
+        .read_to_end(&mut raw)
+        .context("failed to decompress block")?;
+    Ok(raw)
+}
+
+struct Job {
+    raw: Vec<u8>,
+    reply: SyncSender<Result<Vec<u8>>>,
+}
+
+/// Threads compressing blocks for a `RecordingWriter`. Each block's result
+/// comes back on its own channel, so the writer can keep file order.
+pub struct CompressionPool {
+    jobs: Option<Sender<Job>>,
+    handles: Vec<JoinHandle<()>>,
+}
+
+impl CompressionPool {
+    /// Starts `options.workers` workers, at least one.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if a compressor or a worker thread cannot be set up.
+    pub fn new(options: &CompressionOptions) -> Result<Self> {
+        let (jobs, queue) = mpsc::channel::<Job>();
+        let queue = Arc::new(Mutex::new(queue));
+        let mut pool = Self {
+            jobs: Some(jobs),
+            handles: Vec::new(),
+        };
+        for i in 0..options.workers.max(1) {
+            let mut compressor = options.compressor()?;
+            let queue = Arc::clone(&queue);
+            let handle = thread::Builder::new()
+                .name(format!("zstd-pool-{i}"))
+                .spawn(move || {
+                    loop {
+                        // The lock is released before compressing. A worker
+                        // panicking mid-block leaves the queue consistent.
+                        let job = queue.lock().unwrap_or_else(PoisonError::into_inner).recv();
+                        let Ok(job) = job else {
+                            return;
+                        };
+                        let result = compressor
+                            .compress(&job.raw)
+                            .context("failed to compress frame block");
+                        let _ = job.reply.send(result);
+                    }
+                })
+                .map_err(|e| anyhow::anyhow!("failed to spawn zstd-pool thread: {e}"))?;
+            pool.handles.push(handle);
+        }
+        Ok(pool)
+    }
+
+    /// Blocks that may be queued or in flight before the writer waits.
+    #[must_use]
+    pub fn depth(&self) -> usize {
+        self.handles.len() * BLOCKS_PER_WORKER
+    }
+
+    /// Queues `raw` for compression.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if every worker has exited.
+    pub fn submit(&self, raw: Vec<u8>) -> Result<Receiver<Result<Vec<u8>>>> {
+        let (reply, result) = mpsc::sync_channel(1);
+        self.jobs
+            .as_ref()
+            .context("compression pool shut down")?
+            .send(Job { raw, reply })
+            .map_err(|_| anyhow::anyhow!("compression workers exited"))?;
+        Ok(result)
+    }
+}
+
+impl Drop for CompressionPool {
+    fn drop(&mut self) {
+        self.jobs = None;
+        for handle in self.handles.drain(..) {
+            let _ = handle.join();
+        }
+    }
+}
+
+/// Sizes of a recording before and after `recompress`.
+#[derive(Clone, Copy, Debug, Default)]
+pub struct RecompressSummary {
+    pub frames: u64,
+    pub input_bytes: u64,
+    pub output_bytes: u64,
+    /// 0 without a dictionary.
+    pub dictionary_bytes: usize,
+}
+
+/// Rewrites `reader`'s recording to `output` with `options`, decoding
+/// blocks on `jobs` threads and compressing them on
+/// `options.compression.workers`. With `train`, a dictionary is first
+/// trained on blocks spread over the recording and replaces any in
+/// `options`. Keyframes and the per-thread index are rebuilt; the frames
+/// read back the same.
+///
+/// # Errors
+///
+/// Returns an error if `output` is the input, or if reading, training or
+/// writing fails.
+pub fn recompress(
+    reader: &RecordingReader,
+    input: &Path,
+    output: &Path,
+    mut options: RecordingOptions,
+    train: bool,
+    jobs: usize,
+) -> Result<RecompressSummary> {
+    if output.exists() && std::fs::canonicalize(input).ok() == std::fs::canonicalize(output).ok() {
+        bail!("recompress cannot overwrite its input {}", input.display());
+    }
+
+    if train {
+        let dictionary = train_dictionary(&training_payloads(reader, options.encoding, jobs)?)?;
+        options.compression.dictionary = Some(dictionary.into());
+    }
+    let dictionary_bytes = options
+        .compression
+        .dictionary
+        .as_ref()
+        .map_or(0, |d| d.len());
+
+    let mut writer = RecordingWriter::create(output, reader.metadata(), &options)?;
+    let mut frames = 0;
+    reader.map_blocks(
+        jobs,
+        |_, block| Ok(block.to_vec()),
+        |block| {
+            for frame in &block {
+                writer.write_frame(frame)?;
+            }
+            frames += block.len() as u64;
+            Ok(())
+        },
+    )?;
+    writer.finish()?;
+
+    let size = |path: &Path| {
+        std::fs::metadata(path)
+            .map(|m| m.len())
+            .with_context(|| format!("failed to stat {}", path.display()))
+    };
+    Ok(RecompressSummary {
+        frames,
+        input_bytes: size(input)?,
+        output_bytes: size(output)?,
+        dictionary_bytes,
+    })
+}
+
+/// Payloads of up to `TRAINING_BLOCKS` blocks evenly spread over the
+/// recording, laid out in `encoding`.
+fn training_payloads(
+    reader: &RecordingReader,
+    encoding: BlockEncoding,
+    jobs: usize,
+) -> Result<Vec<Vec<u8>>> {
+    let blocks = reader.frame_count().div_ceil(FRAMES_PER_BLOCK);
+    let stride = blocks.div_ceil(TRAINING_BLOCKS).max(1);
+    let mut payloads = Vec::new();
+    reader.map_blocks(
+        jobs,
+        |first, frames| {
+            if !(first / FRAMES_PER_BLOCK).is_multiple_of(stride) {
+                return Ok(None);
+            }
+            let mut block = BlockBuilder::new(encoding);
+            for frame in frames {
+                block.push(frame)?;
+            }
+            Ok(Some(block.finish()))
+        },
+        |payload| {
+            payloads.extend(payload);
+            Ok(())
+        },
+    )?;
+    Ok(payloads)
+}
@@ -0,0 +1,597 @@
+// SPDX-License-Identifier: MIT
+//! Comparison of two recordings, typically of the same workload on two FEX
+//! builds. Both are decoded at once, each on its own `map_blocks` workers,
+//! and reduced to fixed-width time buckets counted from the first frame
+//! after a per-recording skip, which lines up the same scene when one build
+//! takes longer to get there. Counters become per-second rates and memory
+//! regions per-bucket means, summed over processes; the summary holds the
+//! distribution of bucket values on each side and the change from A to B.
+
+use std::io::Write;
+use std::path::Path;
+use std::time::Duration;
+
+use anyhow::{Context, Result, anyhow};
+
+use super::format::Frame;
+use super::reader::RecordingReader;
+use crate::sampler::accumulator::ComputedFrame;
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum MetricKind {
+    /// A per-frame count, compared as a rate per second.
+    Rate,
+    /// A level, compared as its mean over each bucket.
+    Level,
+}
+
+pub struct Metric {
+    pub name: &'static str,
+    pub unit: &'static str,
+    pub kind: MetricKind,
+    /// The frame's value, given nanoseconds per cycle.
+    value: fn(&ComputedFrame, f64) -> f64,
+}
+
+const fn rate(
+    name: &'static str,
+    unit: &'static str,
+    value: fn(&ComputedFrame, f64) -> f64,
+) -> Metric {
+    Metric {
+        name,
+        unit,
+        kind: MetricKind::Rate,
+        value,
+    }
+}
+
+const fn level(
+    name: &'static str,
+    unit: &'static str,
+    value: fn(&ComputedFrame, f64) -> f64,
+) -> Metric {
+    Metric {
+        name,
+        unit,
+        kind: MetricKind::Level,
+        value,
+    }
+}
+
+#[allow(clippy::cast_precision_loss)]
+pub const METRICS: [Metric; 20] = [
+    rate("jit_time", "ns/s", |f, ns| f.total_jit_time as f64 * ns),
+    rate("signal_time", "ns/s", |f, ns| {
+        f.total_signal_time as f64 * ns
+    }),
+    rate("jit_count", "/s", |f, _| f.total_jit_count as f64),
+    rate("cache_misses", "/s", |f, _| f.total_cache_miss_count as f64),
+    rate("smc", "/s", |f, _| f.total_smc_count as f64),
+    rate("sigbus", "/s", |f, _| f.total_sigbus_count as f64),
+    rate("float_fallbacks", "/s", |f, _| {
+        f.total_float_fallback_count as f64
+    }),
+    level("fex_load", "%", |f, _| f.fex_load_percent),
+    level("mem_total_anon", "B", |f, _| f.mem.total_anon as f64),
+    level("mem_jit_code", "B", |f, _| f.mem.jit_code as f64),
+    level("mem_op_dispatcher", "B", |f, _| f.mem.op_dispatcher as f64),
+    level("mem_frontend", "B", |f, _| f.mem.frontend as f64),
+    level("mem_cpu_backend", "B", |f, _| f.mem.cpu_backend as f64),
+    level("mem_lookup", "B", |f, _| f.mem.lookup as f64),
+    level("mem_lookup_l1", "B", |f, _| f.mem.lookup_l1 as f64),
+    level("mem_thread_states", "B", |f, _| f.mem.thread_states as f64),
+    level("mem_block_links", "B", |f, _| f.mem.block_links as f64),
+    level("mem_misc", "B", |f, _| f.mem.misc as f64),
+    level("mem_jemalloc", "B", |f, _| f.mem.jemalloc as f64),
+    level("mem_unaccounted", "B", |f, _| f.mem.unaccounted as f64),
+];
+
+pub const METRIC_COUNT: usize = METRICS.len();
+
+/// Index into `METRICS` of the metric called `name`.
+#[must_use]
+pub fn metric_index(name: &str) -> Option<usize> {
+    METRICS.iter().position(|m| m.name == name)
+}
+
+#[derive(Clone, Copy, Debug)]
+pub struct DiffOptions {
+    pub bucket: Duration,
+    /// Time skipped from the start of each recording before aligning.
+    pub skip: [Duration; 2],
+    /// Longest stretch compared after alignment.
+    pub duration: Option<Duration>,
+    /// Decoding threads, shared by both recordings.
+    pub jobs: usize,
+}
+
+/// One process's frames in a bucket.
+struct ProcessBucket {
+    pid: i32,
+    frames: u32,
+    period_ns: u64,
+    sums: [f64; METRIC_COUNT],
+}
+
+/// What one frame contributes to its bucket.
+struct Sample {
+    pid: i32,
+    timestamp_ns: u64,
+    period_ns: u64,
+    values: [f64; METRIC_COUNT],
+}
+
+/// A recording reduced to aligned buckets.
+#[derive(Default)]
+pub struct Series {
+    /// Frames that fell in a bucket.
+    pub frames: usize,
+    /// One entry per bucket from the alignment point; `None` where no frame
+    /// fell.
+    pub buckets: Vec<Option<[f64; METRIC_COUNT]>>,
+}
+
+impl Series {
+    /// Decodes `path` on up to `jobs` threads and buckets its frames.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the recording cannot be opened or decoded.
+    pub fn load(path: &Path, skip: Duration, options: &DiffOptions, jobs: usize) -> Result<Self> {
+        let reader = RecordingReader::open(path)?;
+        #[allow(clippy::cast_precision_loss)]
+        let ns_per_cycle = match reader.metadata().cycle_counter_frequency {
+            0 => 0.0,
+            freq => 1e9 / freq as f64,
+        };
+        #[allow(clippy::cast_possible_truncation)]
+        let bucket_ns = (options.bucket.as_nanos() as u64).max(1);
+        #[allow(clippy::cast_possible_truncation)]
+        let skip_ns = skip.as_nanos() as u64;
+        #[allow(clippy::cast_possible_truncation)]
+        let end_ns = options.duration.map_or(u64::MAX, |d| d.as_nanos() as u64);
+
+        let mut origin = None;
+        let mut frames = 0;
+        let mut open: Vec<Vec<ProcessBucket>> = Vec::new();
+        reader.map_blocks(
+            jobs,
+            |_, block| {
+                Ok(block
+                    .iter()
+                    .map(|f| sample(f, ns_per_cycle))
+                    .collect::<Vec<_>>())
+            },
+            |samples| {
+                for s in samples {
+                    let origin = *origin.get_or_insert(s.timestamp_ns);
+                    let Some(elapsed) = s
+                        .timestamp_ns
+                        .saturating_sub(origin)
+                        .checked_sub(skip_ns)
+                        .filter(|&t| t < end_ns)
+                    else {
+                        continue;
+                    };
+                    #[allow(clippy::cast_possible_truncation)]
+                    let bucket = (elapsed / bucket_ns) as usize;
+                    if open.len() <= bucket {
+                        open.resize_with(bucket + 1, Vec::new);
+                    }
+                    add_sample(&mut open[bucket], &s);
+                    frames += 1;
+                }
+                Ok(())
+            },
+        )?;
+
+        let buckets = open
+            .iter()
+            .map(|processes| finish_bucket(processes, bucket_ns))
+            .collect();
+        Ok(Self { frames, buckets })
+    }
+
+    /// Values of metric `metric` in the buckets that have one.
+    fn values(&self, metric: usize) -> Vec<f64> {
+        self.buckets.iter().flatten().map(|b| b[metric]).collect()
+    }
+}
+
+fn sample(frame: &Frame, ns_per_cycle: f64) -> Sample {
+    Sample {
+        pid: frame.pid,
+        timestamp_ns: frame.computed.timestamp_ns,
+        period_ns: frame.computed.sample_period_ns,
+        values: std::array::from_fn(|i| (METRICS[i].value)(&frame.computed, ns_per_cycle)),
+    }
+}
+
+fn add_sample(processes: &mut Vec<ProcessBucket>, s: &Sample) {
+    let i = processes
+        .iter()
+        .position(|p| p.pid == s.pid)
+        .unwrap_or_else(|| {
+            processes.push(ProcessBucket {
+                pid: s.pid,
+                frames: 0,
+                period_ns: 0,
+                sums: [0.0; METRIC_COUNT],
+            });
+            processes.len() - 1
+        });
+    let p = &mut processes[i];
+    p.frames += 1;
+    p.period_ns += s.period_ns;
+    for (sum, value) in p.sums.iter_mut().zip(s.values) {
+        *sum += value;
+    }
+}
+
+/// Rates are over the time each process's frames cover, so a bucket only
+/// partly recorded is not read as a drop.
+fn finish_bucket(processes: &[ProcessBucket], bucket_ns: u64) -> Option<[f64; METRIC_COUNT]> {
+    if processes.is_empty() {
+        return None;
+    }
+    let mut values = [0.0; METRIC_COUNT];
+    for p in processes {
+        #[allow(clippy::cast_precision_loss)]
+        let seconds = if p.period_ns > 0 {
+            p.period_ns
+        } else {
+            bucket_ns
+        } as f64
+            / 1e9;
+        for (i, value) in values.iter_mut().enumerate() {
+            *value += match METRICS[i].kind {
+                MetricKind::Rate => p.sums[i] / seconds,
+                MetricKind::Level => p.sums[i] / f64::from(p.frames),
+            };
+        }
+    }
+    Some(values)
+}
+
+/// Decodes both recordings at once, `options.jobs` threads between them.
+///
+/// # Errors
+///
+/// Returns an error if either recording cannot be opened or decoded.
+pub fn load_pair(paths: [&Path; 2], options: &DiffOptions) -> Result<[Series; 2]> {
+    let jobs = options.jobs.div_ceil(2).max(1);
+    std::thread::scope(|scope| {
+        let a = scope.spawn(|| Series::load(paths[0], options.skip[0], options, jobs));
+        let b = Series::load(paths[1], options.skip[1], options, jobs)
+            .with_context(|| format!("failed to load {}", paths[1].display()))?;
+        let a = a
+            .join()
+            .map_err(|_| anyhow!("decoding thread panicked"))?
+            .with_context(|| format!("failed to load {}", paths[0].display()))?;
+        Ok([a, b])
+    })
+}
+
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Distribution {
+    pub mean: f64,
+    pub p50: f64,
+    pub p99: f64,
+    pub max: f64,
+}
+
+impl Distribution {
+    fn of(mut values: Vec<f64>) -> Self {
+        if values.is_empty() {
+            return Self::default();
+        }
+        values.sort_by(f64::total_cmp);
+        #[allow(clippy::cast_precision_loss)]
+        let mean = values.iter().sum::<f64>() / values.len() as f64;
+        Self {
+            mean,
+            p50: nearest_rank(&values, 0.5),
+            p99: nearest_rank(&values, 0.99),
+            max: values[values.len() - 1],
+        }
+    }
+}
+
+#[allow(
+    clippy::cast_possible_truncation,
+    clippy::cast_precision_loss,
+    clippy::cast_sign_loss
+)]
+fn nearest_rank(sorted: &[f64], q: f64) -> f64 {
+    let rank = (q * sorted.len() as f64).ceil() as usize;
+    sorted[rank.clamp(1, sorted.len()) - 1]
+}
+
+pub struct MetricDiff {
+    pub metric: &'static Metric,
+    pub a: Distribution,
+    pub b: Distribution,
+    /// Median of B minus A over the buckets both recordings cover.
+    pub paired_p50: f64,
+}
+
+impl MetricDiff {
+    /// Change of the mean from A to B; `None` when A's is zero.
+    #[must_use]
+    pub fn change_percent(&self) -> Option<f64> {
+        (self.a.mean > 0.0).then(|| (self.b.mean - self.a.mean) / self.a.mean * 100.0)
+    }
+
+    /// Whether B's mean is more than `threshold_percent` above A's; any
+    /// rise from zero counts.
+    #[must_use]
+    pub fn regressed(&self, threshold_percent: f64) -> bool {
+        self.change_percent()
+            .map_or(self.b.mean > 0.0, |change| change > threshold_percent)
+    }
+}
+
+pub struct DiffSummary {
+    pub bucket: Duration,
+    pub frames: [usize; 2],
+    pub buckets: [usize; 2],
+    /// Buckets with frames from both recordings.
+    pub aligned: usize,
+    /// In `METRICS` order.
+    pub metrics: Vec<MetricDiff>,
+}
+
+/// A CI gate: the metrics whose mean may not grow by more than
+/// `threshold_percent`.
+pub struct Gate {
+    pub threshold_percent: f64,
+    /// Indexes into `METRICS`; empty for every metric.
+    pub metrics: Vec<usize>,
+}
+
+impl DiffSummary {
+    #[must_use]
+    pub fn new(series: &[Series; 2], bucket: Duration) -> Self {
+        let [a, b] = series;
+        let aligned = a
+            .buckets
+            .iter()
+            .zip(&b.buckets)
+            .filter(|(a, b)| a.is_some() && b.is_some())
+            .count();
+        let metrics = METRICS
+            .iter()
+            .enumerate()
+            .map(|(i, metric)| {
+                let deltas: Vec<f64> = a
+                    .buckets
+                    .iter()
+                    .zip(&b.buckets)
+                    .filter_map(|(a, b)| Some(b.as_ref()?[i] - a.as_ref()?[i]))
+                    .collect();
+                MetricDiff {
+                    metric,
+                    a: Distribution::of(a.values(i)),
+                    b: Distribution::of(b.values(i)),
+                    paired_p50: Distribution::of(deltas).p50,
+                }
+            })
+            .collect();
+        Self {
+            bucket,
+            frames: [a.frames, b.frames],
+            buckets: [a.buckets.len(), b.buckets.len()],
+            aligned,
+            metrics,
+        }
+    }
+
+    /// Names of the metrics that fail `gate`.
+    #[must_use]
+    pub fn regressions(&self, gate: &Gate) -> Vec<&'static str> {
+        self.metrics
+            .iter()
+            .enumerate()
+            .filter(|(i, m)| {
+                (gate.metrics.is_empty() || gate.metrics.contains(i))
+                    && m.regressed(gate.threshold_percent)
+            })
+            .map(|(_, m)| m.metric.name)
+            .collect()
+    }
+
+    /// Writes the summary as a table.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if `out` cannot be written.
+    pub fn write_text(&self, out: &mut impl Write, paths: [&Path; 2]) -> Result<()> {
+        for (label, i) in [("A", 0), ("B", 1)] {
+            writeln!(
+                out,
+                "{label}: {} ({} frames, {} buckets)",
+                paths[i].display(),
+                self.frames[i],
+                self.buckets[i]
+            )?;
+        }
+        writeln!(
+            out,
+            "{} buckets of {} ms aligned\n",
+            self.aligned,
+            self.bucket.as_millis()
+        )?;
+        writeln!(
+            out,
+            "{:<18}{:>6}{:>16}{:>16}{:>10}{:>16}{:>16}",
+            "metric", "unit", "A mean", "B mean", "change", "A p99", "B p99"
+        )?;
+        for m in &self.metrics {
+            let change = m
+                .change_percent()
+                .map_or_else(|| "-".to_string(), |c| format!("{c:+.1}%"));
+            writeln!(
+                out,
+                "{:<18}{:>6}{:>16.1}{:>16.1}{change:>10}{:>16.1}{:>16.1}",
+                m.metric.name, m.metric.unit, m.a.mean, m.b.mean, m.a.p99, m.b.p99
+            )?;
+        }
+        Ok(())
+    }
+
+    /// Writes the summary as JSON, with the outcome of `gate` if given.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if `out` cannot be written.
+    pub fn write_json(
+        &self,
+        out: &mut impl Write,
+        paths: [&Path; 2],
+        gate: Option<&Gate>,
+    ) -> Result<()> {
+        write!(out, "{{\"bucket_ns\":{}", self.bucket.as_nanos())?;
+        for (label, i) in [("a", 0), ("b", 1)] {
+            write!(
+                out,
+                ",\"{label}\":{{\"path\":{},\"frames\":{},\"buckets\":{}}}",
+                json_string(&paths[i].to_string_lossy()),
+                self.frames[i],
+                self.buckets[i]
+            )?;
+        }
+        write!(out, ",\"aligned_buckets\":{},\"metrics\":{{", self.aligned)?;
+        for (i, m) in self.metrics.iter().enumerate() {
+            if i > 0 {
+                write!(out, ",")?;
+            }
+            write!(
+                out,
+                "\"{}\":{{\"unit\":\"{}\",\"a\":{},\"b\":{},\"change_percent\":{},\"paired_p50\":{}}}",
+                m.metric.name,
+                m.metric.unit,
+                json_distribution(&m.a),
+                json_distribution(&m.b),
+                m.change_percent()
+                    .map_or_else(|| "null".to_string(), json_number),
+                json_number(m.paired_p50)
+            )?;
+        }
+        write!(out, "}}")?;
+        if let Some(gate) = gate {
+            let failed: Vec<String> = self
+                .regressions(gate)
+                .iter()
+                .map(|name| format!("\"{name}\""))
+                .collect();
+            write!(
+                out,
+                ",\"gate\":{{\"threshold_percent\":{},\"failed\":[{}]}}",
+                json_number(gate.threshold_percent),
+                failed.join(",")
+            )?;
+        }
+        writeln!(out, "}}")?;
+        Ok(())
+    }
+}
+
+fn json_distribution(d: &Distribution) -> String {
+    format!(
+        "{{\"mean\":{},\"p50\":{},\"p99\":{},\"max\":{}}}",
+        json_number(d.mean),
+        json_number(d.p50),
+        json_number(d.p99),
+        json_number(d.max)
+    )
+}
+
+fn json_number(value: f64) -> String {
+    if value.is_finite() {
+        format!("{value}")
+    } else {
+        "null".to_string()
+    }
+}
+
+fn json_string(s: &str) -> String {
+    let mut out = String::with_capacity(s.len() + 2);
+    out.push('"');
+    for c in s.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if u32::from(c) < 0x20 => {
+                use std::fmt::Write as _;
+                let _ = write!(out, "\\u{:04x}", u32::from(c));
+            }
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+    out
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn series(values: &[Option<f64>], metric: usize) -> Series {
+        Series {
+            frames: values.len(),
+            buckets: values
+                .iter()
+                .map(|v| {
+                    v.map(|v| {
+                        let mut b = [0.0; METRIC_COUNT];
+                        b[metric] = v;
+                        b
+                    })
+                })
+                .collect(),
+        }
+    }
+
+    #[test]
+    fn gate_flags_growth_and_rises_from_zero() {
+        let smc = metric_index("smc").unwrap();
+        let sigbus = metric_index("sigbus").unwrap();
+        let mut a = series(&[Some(10.0), Some(10.0), None], smc);
+        let mut b = series(&[Some(11.0), None, Some(13.0)], smc);
+        b.buckets[0].as_mut().unwrap()[sigbus] = 1.0;
+        a.frames = 2;
+
+        let summary = DiffSummary::new(&[a, b], Duration::from_secs(1));
+        assert_eq!(summary.aligned, 1);
+        let m = &summary.metrics[smc];
+        assert!((m.change_percent().unwrap() - 20.0).abs() < 1e-9);
+        assert!((m.paired_p50 - 1.0).abs() < f64::EPSILON);
+        assert!((m.b.max - 13.0).abs() < f64::EPSILON);
+
+        let gate = |threshold_percent, metrics| Gate {
+            threshold_percent,
+            metrics,
+        };
+        assert_eq!(summary.regressions(&gate(25.0, vec![])), ["sigbus"]);
+        assert_eq!(summary.regressions(&gate(10.0, vec![])), ["smc", "sigbus"]);
+        assert!(
+            summary
+                .regressions(&gate(10.0, vec![metric_index("jit_time").unwrap()]))
+                .is_empty()
+        );
+
+        let mut json = Vec::new();
+        summary
+            .write_json(
+                &mut json,
+                [Path::new("a\".felixr"), Path::new("b.felixr")],
+                Some(&gate(10.0, vec![])),
+            )
+            .unwrap();
+        let json = String::from_utf8(json).unwrap();
+        assert!(json.contains("\"path\":\"a\\\".felixr\""));
+        assert!(json.contains("\"failed\":[\"smc\",\"sigbus\"]"));
+        assert!(json.contains("\"mem_jit_code\":{\"unit\":\"B\""));
+    }
+}
@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: MIT
+//! CSV export of recordings: one row per frame, and optionally a long-form
+//! table with one row per thread per frame. Rows are formatted block by
+//! block on `RecordingReader::map_blocks` workers and written in order, so
+//! neither the recording nor the output is ever held in memory. Outputs
+//! whose name ends in `.zst` are zstd-compressed as they are written.
+//!
+//! The contention table has one row per process of each recording given,
+//! so recordings of one workload on different core counts line up for a
+//! scaling study.
+
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::Path;
+
+use anyhow::{Context, Result};
+
+use super::format::Frame;
+use super::reader::RecordingReader;
+use crate::datasource::SessionMetadata;
+use crate::sampler::accumulator::ComputedFrame;
+use crate::sampler::contention::ContentionStats;
+
+const FRAMES_HEADER: &str = "frame,timestamp_ns,sample_period_ns,threads_sampled,\
+     total_jit_time,total_signal_time,total_sigbus_count,\
+     total_smc_count,total_float_fallback_count,\
+     total_cache_miss_count,total_cache_read_lock_time,\
+     total_cache_write_lock_time,total_jit_count,\
+     total_jit_invocations,fex_load_percent,\
+     mem_total_anon,mem_jit_code,mem_op_dispatcher,\
+     mem_frontend,mem_cpu_backend,mem_lookup,mem_lookup_l1,\
+     mem_thread_states,mem_block_links,mem_misc,\
+     mem_jemalloc,mem_unaccounted,\
+     cum_sigbus_count,cum_smc_count,cum_float_fallback_count,\
+     cum_cache_miss_count,cum_jit_count,mem_age_ns,\
+     sample_lateness_ns,sample_overhead_ns,pid,torn_reads,\
+     shm_read_ns,smaps_ns,record_ns,write_lock_spikes";
+
+const THREADS_HEADER: &str = "frame,timestamp_ns,pid,tid,jit_time,signal_time,\
+     sigbus_count,smc_count,float_fallback_count,cache_miss_count,\
+     cache_read_lock_time,cache_write_lock_time,jit_count";
+
+pub const CONTENTION_HEADER: &str = "recording,pid,hardware_concurrency,frames,\
+     lock_threads,jit_time_s,read_lock_time_s,write_lock_time_s,\
+     contention_percent,contention_p50,contention_p99,convoys,\
+     convoy_frames,longest_convoy_frames,longest_convoy_ns,\
+     top_thread_share_percent";
+
+/// A CSV file being written, compressed if its name ends in `.zst`.
+pub enum CsvOutput {
+    Plain(BufWriter<File>),
+    Zstd(zstd::Encoder<'static, BufWriter<File>>),
+}
+
+impl CsvOutput {
+    /// # Errors
+    ///
+    /// Returns an error if the file cannot be created.
+    pub fn create(path: &Path) -> Result<Self> {
+        let file = BufWriter::new(
+            File::create(path).with_context(|| format!("failed to create {}", path.display()))?,
+        );
+        if path.extension().is_some_and(|ext| ext == "zst") {
+            let encoder = zstd::Encoder::new(file, zstd::DEFAULT_COMPRESSION_LEVEL)
+                .context("failed to create zstd encoder")?;
+            Ok(Self::Zstd(encoder))
+        } else {
+            Ok(Self::Plain(file))
+        }
+    }
+
+    fn writer(&mut self) -> &mut dyn Write {
+        match self {
+            Self::Plain(w) => w,
+            Self::Zstd(w) => w,
+        }
+    }
+
+    /// Flushes buffered rows and ends the zstd frame.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the remaining output cannot be written.
+    pub fn finish(self) -> Result<()> {
+        let file = match self {
+            Self::Plain(w) => w,
+            Self::Zstd(w) => w.finish().context("failed to finish zstd stream")?,
+        };
+        file.into_inner()
+            .map_err(std::io::IntoInnerError::into_error)
+            .context("failed to flush CSV output")?;
+        Ok(())
+    }
+}
+
+/// Rows formatted from one block.
+#[derive(Default)]
+struct BlockRows {
+    frames: Vec<u8>,
+    threads: Vec<u8>,
+    count: usize,
+}
+
+/// Writes every frame of `reader` to `frames` and, if given, every
+/// per-thread delta to `threads`, formatting on up to `jobs` threads.
+/// Returns the number of frames written; the outputs still need `finish`.
+///
+/// # Errors
+///
+/// Returns an error if the recording cannot be decoded or the output
+/// cannot be written.
+pub fn export_csv(
+    reader: &RecordingReader,
+    frames: &mut CsvOutput,
+    mut threads: Option<&mut CsvOutput>,
+    jobs: usize,
+) -> Result<usize> {
+    writeln!(frames.writer(), "{FRAMES_HEADER}").context("failed to write CSV header")?;
+    if let Some(out) = threads.as_deref_mut() {
+        writeln!(out.writer(), "{THREADS_HEADER}").context("failed to write CSV header")?;
+    }
+
+    let with_threads = threads.is_some();
+    let mut total = 0;
+    reader.map_blocks(
+        jobs,
+        |first, block| format_block(first, block, with_threads),
+        |rows| {
+            frames
+                .writer()
+                .write_all(&rows.frames)
+                .context("failed to write CSV rows")?;
+            if let Some(out) = threads.as_deref_mut() {
+                out.writer()
+                    .write_all(&rows.threads)
+                    .context("failed to write CSV rows")?;
+            }
+            total += rows.count;
+            Ok(())
+        },
+    )?;
+    Ok(total)
+}
+
+fn format_block(first: usize, block: &[Frame], with_threads: bool) -> Result<BlockRows> {
+    let mut rows = BlockRows {
+        count: block.len(),
+        ..BlockRows::default()
+    };
+    for (i, frame) in block.iter().enumerate() {
+        let index = first + i;
+        write_frame_row(&mut rows.frames, index, frame.pid, &frame.computed)?;
+        if with_threads {
+            write_thread_rows(&mut rows.threads, index, frame)?;
+        }
+    }
+    Ok(rows)
+}
+
+fn write_frame_row(out: &mut impl Write, index: usize, pid: i32, f: &ComputedFrame) -> Result<()> {
+    writeln!(
+        out,
+        "{index},{},{},{},{},{},{},{},{},{},{},{},{},{},{:.4},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{}",
+        f.timestamp_ns,
+        f.sample_period_ns,
+        f.threads_sampled,
+        f.total_jit_time,
+        f.total_signal_time,
+        f.total_sigbus_count,
+        f.total_smc_count,
+        f.total_float_fallback_count,
+        f.total_cache_miss_count,
+        f.total_cache_read_lock_time,
+        f.total_cache_write_lock_time,
+        f.total_jit_count,
+        f.total_jit_invocations,
+        f.fex_load_percent,
+        f.mem.total_anon,
+        f.mem.jit_code,
+        f.mem.op_dispatcher,
+        f.mem.frontend,
+        f.mem.cpu_backend,
+        f.mem.lookup,
+        f.mem.lookup_l1,
+        f.mem.thread_states,
+        f.mem.block_links,
+        f.mem.misc,
+        f.mem.jemalloc,
+        f.mem.unaccounted,
+        f.cumulative.sigbus,
+        f.cumulative.smc,
+        f.cumulative.float_fallback,
+        f.cumulative.cache_miss,
+        f.cumulative.jit,
+        f.mem_age_ns,
+        f.sample_lateness_ns,
+        f.sample_overhead_ns,
+        pid,
+        f.torn_reads,
+        f.shm_read_ns,
+        f.smaps_ns,
+        f.record_ns,
+        f.write_lock_spikes,
+    )
+    .context("failed to write CSV row")
+}
+
+fn write_thread_rows(out: &mut impl Write, index: usize, frame: &Frame) -> Result<()> {
+    let timestamp = frame.computed.timestamp_ns;
+    for d in &frame.per_thread_deltas {
+        writeln!(
+            out,
+            "{index},{timestamp},{},{},{},{},{},{},{},{},{},{},{}",
+            frame.pid,
+            d.tid,
+            d.jit_time,
+            d.signal_time,
+            d.sigbus_count,
+            d.smc_count,
+            d.float_fallback_count,
+            d.cache_miss_count,
+            d.cache_read_lock_time,
+            d.cache_write_lock_time,
+            d.jit_count,
+        )
+        .context("failed to write CSV row")?;
+    }
+    Ok(())
+}
+
+/// Lock contention of each process of `reader`, sorted by PID, decoding on
+/// up to `jobs` threads.
+///
+/// # Errors
+///
+/// Returns an error if the recording cannot be decoded.
+pub fn contention_by_process(
+    reader: &RecordingReader,
+    jobs: usize,
+) -> Result<Vec<(i32, ContentionStats)>> {
+    let mut processes: Vec<(i32, ContentionStats)> = Vec::new();
+    reader.map_blocks(
+        jobs,
+        |_, block| {
+            Ok(block
+                .iter()
+                .map(|f| (f.pid, f.computed.clone()))
+                .collect::<Vec<_>>())
+        },
+        |frames| {
+            for (pid, computed) in frames {
+                let i = match processes.binary_search_by_key(&pid, |(p, _)| *p) {
+                    Ok(i) => i,
+                    Err(i) => {
+                        processes.insert(i, (pid, ContentionStats::default()));
+                        i
+                    }
+                };
+                processes[i].1.record(&computed);
+            }
+            Ok(())
+        },
+    )?;
+    Ok(processes)
+}
+
+/// Writes one `CONTENTION_HEADER` row per process of `recording`.
+///
+/// # Errors
+///
+/// Returns an error if the output cannot be written.
+pub fn write_contention_rows(
+    out: &mut impl Write,
+    recording: &str,
+    metadata: &SessionMetadata,
+    processes: &[(i32, ContentionStats)],
+) -> Result<()> {
+    #[allow(clippy::cast_precision_loss)]
+    let cycle_freq = metadata.cycle_counter_frequency.max(1) as f64;
+    #[allow(clippy::cast_precision_loss)]
+    let seconds = |cycles: u64| cycles as f64 / cycle_freq;
+    for (pid, stats) in processes {
+        let longest = stats.longest_convoy().unwrap_or_default();
+        let top_share = stats.top_threads(1).first().map_or(0.0, |t| t.1);
+        writeln!(
+            out,
+            "{recording},{pid},{},{},{},{:.6},{:.6},{:.6},{:.4},{:.4},{:.4},{},{},{},{},{top_share:.4}",
+            metadata.hardware_concurrency,
+            stats.frames,
+            stats.thread_count(),
+            seconds(stats.jit_time),
+            seconds(stats.read_lock_time),
+            seconds(stats.write_lock_time),
+            stats.contention_percent().unwrap_or(0.0),
+            stats.contention.quantile(0.5),
+            stats.contention.quantile(0.99),
+            stats.convoy_count(),
+            stats.convoy_frames(),
+            longest.frames,
+            longest.end_ns - longest.start_ns,
+        )
+        .context("failed to write CSV row")?;
+    }
+    Ok(())
+}
@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: MIT
+//! Flight-recorder mode. The writer thread keeps the last `before` of
+//! frames in memory instead of writing them; when a trigger fires (a
+//! histogram flag, the load crossing a threshold, or SIGUSR1) the held
+//! frames and the `after` that follow go to disk. Triggers inside that
+//! window extend it, so a recording is a series of episodes separated by
+//! gaps in time.
+
+use std::collections::VecDeque;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
+
+use anyhow::{Context, Result};
+
+use super::format::Frame;
+use crate::sampler::accumulator::{
+    FLAG_HIGH_JIT_LOAD, FLAG_HIGH_SIGBUS, FLAG_HIGH_SMC, FLAG_HIGH_SOFTFLOAT,
+};
+
+/// A histogram flag that triggers a flush.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, clap::ValueEnum)]
+pub enum TriggerFlag {
+    /// `high_jit_load`
+    Jit,
+    /// `high_invalidation_or_smc`
+    Smc,
+    /// `high_sigbus`
+    Sigbus,
+    /// `high_softfloat`
+    Softfloat,
+}
+
+impl TriggerFlag {
+    #[must_use]
+    pub fn bit(self) -> u8 {
+        match self {
+            Self::Jit => FLAG_HIGH_JIT_LOAD,
+            Self::Smc => FLAG_HIGH_SMC,
+            Self::Sigbus => FLAG_HIGH_SIGBUS,
+            Self::Softfloat => FLAG_HIGH_SOFTFLOAT,
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct FlightOptions {
+    /// How much history is held and written when a trigger fires.
+    pub before: Duration,
+    /// How long to keep writing after the last trigger.
+    pub after: Duration,
+    /// `FLAG_*` bits of `HistogramEntry` that trigger a flush.
+    pub flags: u8,
+    /// Load at or above which a frame triggers a flush.
+    pub load_percent: Option<f64>,
+}
+
+/// Trigger and ring counters, for status displays.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct FlightStats {
+    pub triggers: u64,
+    /// Frames currently held in memory.
+    pub held: usize,
+    /// Frames that aged out of the ring without being written.
+    pub discarded: u64,
+}
+
+pub struct FlightRecorder {
+    options: FlightOptions,
+    ring: VecDeque<Frame>,
+    /// Frames stamped up to this time are written through.
+    until_ns: Option<u64>,
+    signal: Arc<AtomicBool>,
+    signal_id: Option<signal_hook::SigId>,
+    stats: FlightStats,
+}
+
+impl FlightRecorder {
+    /// Creates a recorder that also triggers on SIGUSR1.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the signal handler cannot be registered.
+    pub fn new(options: FlightOptions) -> Result<Self> {
+        let signal = Arc::new(AtomicBool::new(false));
+        let id = signal_hook::flag::register(signal_hook::consts::SIGUSR1, Arc::clone(&signal))
+            .context("failed to register SIGUSR1 handler")?;
+        let mut recorder = Self::without_signal(options, signal);
+        recorder.signal_id = Some(id);
+        Ok(recorder)
+    }
+
+    fn without_signal(options: FlightOptions, signal: Arc<AtomicBool>) -> Self {
+        Self {
+            options,
+            ring: VecDeque::new(),
+            until_ns: None,
+            signal,
+            signal_id: None,
+            stats: FlightStats::default(),
+        }
+    }
+
+    #[must_use]
+    pub fn stats(&self) -> FlightStats {
+        FlightStats {
+            held: self.ring.len(),
+            ..self.stats
+        }
+    }
+
+    /// Takes the next frame and passes whatever should be written now, in
+    /// order, to `write`.
+    ///
+    /// # Errors
+    ///
+    /// Returns the first error from `write`.
+    pub fn push(
+        &mut self,
+        frame: Frame,
+        mut write: impl FnMut(&Frame) -> Result<()>,
+    ) -> Result<()> {
+        let now = frame.computed.timestamp_ns;
+        if self.fires(&frame) {
+            self.stats.triggers += 1;
+            self.until_ns = Some(now.saturating_add(duration_ns(self.options.after)));
+        }
+        if self.until_ns.is_some_and(|until| now <= until) {
+            for held in self.ring.drain(..) {
+                write(&held)?;
+            }
+            return write(&frame);
+        }
+        self.until_ns = None;
+
+        if self.ring.capacity() == 0 && frame.computed.sample_period_ns > 0 {
+            // Sized from the first frame so the ring does not grow while
+            // sampling one process.
+            let frames = duration_ns(self.options.before) / frame.computed.sample_period_ns;
+            self.ring
+                .reserve(usize::try_from(frames).unwrap_or(0).saturating_add(1));
+        }
+        self.ring.push_back(frame);
+        let horizon = now.saturating_sub(duration_ns(self.options.before));
+        while self
+            .ring
+            .front()
+            .is_some_and(|f| f.computed.timestamp_ns < horizon)
+        {
+            self.ring.pop_front();
+            self.stats.discarded += 1;
+        }
+        Ok(())
+    }
+
+    /// Frames still held at the end of the recording are not written.
+    pub fn finish(&mut self) {
+        self.stats.discarded += self.ring.len() as u64;
+        self.ring.clear();
+    }
+
+    fn fires(&self, frame: &Frame) -> bool {
+        let entry = &frame.computed.histogram_entry;
+        // Swapped first so a signal is consumed even if a flag also fired.
+        self.signal.swap(false, Ordering::Relaxed)
+            || entry.flags() & self.options.flags != 0
+            || self
+                .options
+                .load_percent
+                .is_some_and(|limit| frame.computed.fex_load_percent >= limit)
+    }
+}
+
+impl Drop for FlightRecorder {
+    fn drop(&mut self) {
+        if let Some(id) = self.signal_id.take() {
+            signal_hook::low_level::unregister(id);
+        }
+    }
+}
+
+fn duration_ns(d: Duration) -> u64 {
+    u64::try_from(d.as_nanos()).unwrap_or(u64::MAX)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::sampler::accumulator::{ComputedFrame, HistogramEntry};
+
+    const SEC: u64 = 1_000_000_000;
+
+    fn frame(secs: u64, load: f64, flags: u8) -> Frame {
+        Frame {
+            pid: 1,
+            computed: ComputedFrame {
+                timestamp_ns: secs * SEC,
+                sample_period_ns: SEC,
+                fex_load_percent: load,
+                histogram_entry: HistogramEntry::from_flags(0.0, flags),
+                ..ComputedFrame::default()
+            },
+            per_thread_deltas: Vec::new(),
+        }
+    }
+
+    fn recorder(signal: &Arc<AtomicBool>) -> FlightRecorder {
+        FlightRecorder::without_signal(
+            FlightOptions {
+                before: Duration::from_secs(3),
+                after: Duration::from_secs(2),
+                flags: FLAG_HIGH_SIGBUS,
+                load_percent: Some(90.0),
+            },
+            Arc::clone(signal),
+        )
+    }
+
+    fn push(
+        recorder: &mut FlightRecorder,
+        written: &mut Vec<u64>,
+        secs: u64,
+        load: f64,
+        flags: u8,
+    ) {
+        recorder
+            .push(frame(secs, load, flags), |f| {
+                written.push(f.computed.timestamp_ns / SEC);
+                Ok(())
+            })
+            .unwrap();
+    }
+
+    #[test]
+    fn trigger_flushes_history_and_following_frames() {
+        let signal = Arc::new(AtomicBool::new(false));
+        let mut rec = recorder(&signal);
+        let mut written = Vec::new();
+        for s in 0..10 {
+            push(&mut rec, &mut written, s, 10.0, FLAG_HIGH_JIT_LOAD);
+        }
+        assert!(written.is_empty());
+        assert_eq!(rec.stats().held, 4);
+        assert!(rec.ring.capacity() >= 4);
+
+        push(&mut rec, &mut written, 10, 10.0, FLAG_HIGH_SIGBUS);
+        assert_eq!(written, [6, 7, 8, 9, 10]);
+        // Written through until 2 s after the trigger; a load spike at 12
+        // extends the window to 14.
+        push(&mut rec, &mut written, 11, 10.0, 0);
+        push(&mut rec, &mut written, 12, 95.0, 0);
+        for s in 13..20 {
+            push(&mut rec, &mut written, s, 10.0, 0);
+        }
+        assert_eq!(written, [6, 7, 8, 9, 10, 11, 12, 13, 14]);
+
+        signal.store(true, Ordering::Relaxed);
+        push(&mut rec, &mut written, 20, 10.0, 0);
+        assert_eq!(written[9..], [16, 17, 18, 19, 20]);
+
+        rec.finish();
+        let stats = rec.stats();
+        assert_eq!(stats.triggers, 3);
+        assert_eq!(stats.held, 0);
+        assert_eq!(stats.discarded, 7);
+    }
+}
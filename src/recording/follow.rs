@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: MIT
+//! Tail-following of a v3 recording that is still being written, for
+//! `replay --follow`. Blocks are independent zstd frames and the writer
+//! flushes at least once a second, so the follower polls for appended bytes,
+//! decodes each block once its frame is complete and hands its frames out
+//! without keeping them. Catching up on an existing file only decodes its
+//! last complete block. Bytes that are not a zstd frame, such as a block
+//! torn by a crash, are skipped up to the next frame magic, and keyframes
+//! and the compression dictionary are stepped over. The footer index ends
+//! the follow.
+
+use std::collections::VecDeque;
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+use std::path::Path;
+
+use anyhow::{Context, Result, bail};
+
+use super::compression::{self, read_dictionary};
+use super::format::{
+    FORMAT_VERSION, Frame, MAGIC, MAX_BLOCK_LEN, SKIPPABLE_FRAME_MAGIC, SKIPPABLE_FRAME_MAGIC_MASK,
+    SKIPPABLE_HEADER_LEN,
+};
+use super::reader::{RecordingReader, block_accumulator, decode_block};
+use crate::datasource::{DataSource, SessionMetadata};
+use crate::sampler::accumulator::{Accumulator, ComputedFrame};
+
+/// Bytes read from the file at a time.
+const READ_CHUNK: usize = 64 << 10;
+const ZSTD_MAGIC: [u8; 4] = 0xFD2F_B528u32.to_le_bytes();
+
+pub struct FollowSource {
+    file: File,
+    metadata: SessionMetadata,
+    accumulator: Accumulator,
+    dictionary: Option<Vec<u8>>,
+    /// File offset of `pending[0]`.
+    offset: u64,
+    /// Bytes read but not yet consumed: at most one incomplete block.
+    pending: Vec<u8>,
+    frames: VecDeque<Frame>,
+    /// Whether the bytes present at open have been skipped.
+    caught_up: bool,
+    /// The footer index has been reached.
+    finished: bool,
+    pid_filter: Option<i32>,
+    resyncs: u64,
+}
+
+impl FollowSource {
+    /// Opens `path` and reads its header. Nothing else is read until `poll`.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file cannot be read, its header is not
+    /// complete yet, or it is not a v3 recording.
+    pub fn open(path: &Path) -> Result<Self> {
+        let file = File::open(path)
+            .with_context(|| format!("failed to open recording file: {}", path.display()))?;
+        let mut head = vec![0u8; READ_CHUNK];
+        let n = file
+            .read_at(&mut head, 0)
+            .context("failed to read recording header")?;
+        head.truncate(n);
+        let header_len = zstd::zstd_safe::find_frame_compressed_size(&head)
+            .map_err(|_| anyhow::anyhow!("recording header is incomplete or corrupt"))?;
+        let raw = zstd::stream::decode_all(&head[..header_len])
+            .context("failed to decompress recording header")?;
+        let header = RecordingReader::read_header(&mut raw.as_slice())?;
+        if header.magic != MAGIC {
+            bail!("invalid magic bytes in recording file");
+        }
+        if header.format_version != FORMAT_VERSION {
+            bail!(
+                "only format version {FORMAT_VERSION} recordings can be followed, not {}",
+                header.format_version
+            );
+        }
+
+        // Written together with the header, so it is there if it ever is.
+        let dictionary = read_dictionary(&file, header_len as u64)?;
+
+        Ok(Self {
+            file,
+            accumulator: block_accumulator(&header.metadata),
+            metadata: header.metadata,
+            dictionary,
+            offset: header_len as u64,
+            pending: Vec::new(),
+            frames: VecDeque::new(),
+            caught_up: false,
+            finished: false,
+            pid_filter: None,
+            resyncs: 0,
+        })
+    }
+
+    /// Only frames sampled from `pid` are returned, for multiplexed
+    /// recordings.
+    pub fn set_pid_filter(&mut self, pid: Option<i32>) {
+        self.pid_filter = pid;
+    }
+
+    /// Reads whatever the writer has appended and queues the frames of
+    /// every block now complete. The first call skips to the last complete
+    /// block.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file cannot be read.
+    pub fn poll(&mut self) -> Result<()> {
+        let mut last_block = Vec::new();
+        while !self.finished {
+            let start = self.pending.len();
+            self.pending.resize(start + READ_CHUNK, 0);
+            let n = self
+                .file
+                .read_at(&mut self.pending[start..], self.offset + start as u64)
+                .context("failed to read recording")?;
+            self.pending.truncate(start + n);
+            self.consume(&mut last_block);
+            if n == 0 {
+                break;
+            }
+        }
+        if !self.caught_up {
+            self.caught_up = true;
+            if !last_block.is_empty() {
+                self.decode(&last_block);
+            }
+        }
+        Ok(())
+    }
+
+    /// Takes every complete zstd frame off the front of `pending`. Until
+    /// caught up, blocks are only copied to `last_block`.
+    fn consume(&mut self, last_block: &mut Vec<u8>) {
+        let mut start = 0;
+        while !self.finished {
+            let rest = &self.pending[start..];
+            let magic = (rest.len() >= ZSTD_MAGIC.len())
+                .then(|| u32::from_le_bytes([rest[0], rest[1], rest[2], rest[3]]));
+            if let Some(magic) = magic
+                && magic & SKIPPABLE_FRAME_MAGIC_MASK == SKIPPABLE_FRAME_MAGIC
+            {
+                // Not garbage, however little of the header has arrived.
+                if rest.len() < SKIPPABLE_HEADER_LEN {
+                    break;
+                }
+                if magic == SKIPPABLE_FRAME_MAGIC {
+                    // Written by `finish`: the index.
+                    self.finished = true;
+                    break;
+                }
+                // A keyframe, another footer frame, or the dictionary read
+                // by `open`.
+                let len = u32::from_le_bytes([rest[4], rest[5], rest[6], rest[7]]) as usize;
+                if rest.len() < SKIPPABLE_HEADER_LEN + len {
+                    break;
+                }
+                start += SKIPPABLE_HEADER_LEN + len;
+                continue;
+            }
+            if rest.len() >= ZSTD_MAGIC.len() && !rest.starts_with(&ZSTD_MAGIC) {
+                start += self.resync(start);
+                continue;
+            }
+            match zstd::zstd_safe::find_frame_compressed_size(rest) {
+                Ok(len) => {
+                    let block = &self.pending[start..start + len];
+                    if self.caught_up {
+                        let block = block.to_vec();
+                        if !self.decode(&block) {
+                            // Looked complete but is not a block; skip past
+                            // its magic.
+                            start += 1 + self.resync(start + 1);
+                            continue;
+                        }
+                    } else {
+                        last_block.clear();
+                        last_block.extend_from_slice(block);
+                    }
+                    start += len;
+                }
+                Err(_) if rest.len() > MAX_BLOCK_LEN => start += 1 + self.resync(start + 1),
+                // The rest of the block has not been written yet.
+                Err(_) => break,
+            }
+        }
+        self.pending.drain(..start);
+        self.offset += start as u64;
+    }
+
+    /// Distance from `from` to the next zstd frame magic in `pending`, or to
+    /// the last few bytes that could still begin one.
+    fn resync(&mut self, from: usize) -> usize {
+        self.resyncs += 1;
+        let rest = &self.pending[from..];
+        rest.windows(ZSTD_MAGIC.len())
+            .position(|w| w == ZSTD_MAGIC)
+            .unwrap_or_else(|| rest.len().saturating_sub(ZSTD_MAGIC.len() - 1))
+    }
+
+    /// Queues the wanted frames of a compressed block. Returns `false` if
+    /// it does not decode.
+    fn decode(&mut self, block: &[u8]) -> bool {
+        let Ok(raw) = compression::decompress(block, self.dictionary.as_deref()) else {
+            return false;
+        };
+        let Ok(frames) = decode_block(&raw, &self.accumulator) else {
+            return false;
+        };
+        let pid_filter = self.pid_filter;
+        self.frames.extend(
+            frames
+                .into_iter()
+                .filter(|f| pid_filter.is_none_or(|pid| pid == f.pid)),
+        );
+        true
+    }
+
+    /// Whether the writer finished the recording and every frame was
+    /// returned.
+    #[must_use]
+    pub fn is_finished(&self) -> bool {
+        self.finished && self.frames.is_empty()
+    }
+
+    /// Times garbage was skipped to find the next block.
+    #[must_use]
+    pub fn resyncs(&self) -> u64 {
+        self.resyncs
+    }
+}
+
+impl DataSource for FollowSource {
+    fn next_frame(&mut self) -> Option<ComputedFrame> {
+        self.frames.pop_front().map(|f| f.computed)
+    }
+
+    fn metadata(&self) -> &SessionMetadata {
+        &self.metadata
+    }
+
+    fn is_live(&self) -> bool {
+        true
+    }
+}
@@ -6,12 +6,70 @@ use crate::fex::smaps::MemSnapshot;
 use crate::sampler::accumulator::{
     ComputedFrame, CumulativeCountStats, HistogramEntry, ThreadLoad,
 };
+use crate::sampler::rolling::ProcessStats;
 use crate::sampler::thread_stats::ThreadDelta;
 
 pub const MAGIC: [u8; 4] = *b"FLXR";
-pub const FORMAT_VERSION: u8 = 2;
+pub const FORMAT_VERSION: u8 = 3;
 pub const EOF_MARKER: [u8; 4] = *b"FEOF";
 
+/// Last version that stored the whole recording as one zstd stream.
+pub const STREAM_FORMAT_VERSION: u8 = 2;
+
+/// Number of frames compressed together into one independently decodable block.
+pub const FRAMES_PER_BLOCK: usize = 256;
+/// Longest stretch without a complete frame before it is treated as
+/// garbage; far beyond any block the writer produces.
+pub const MAX_BLOCK_LEN: usize = 64 << 20;
+
+/// Block payload tag: length-prefixed postcard `Frame`s.
+pub const BLOCK_ENCODING_POSTCARD: u8 = 0;
+
+/// Block payload tag: delta-encoded columns of raw counters; derived fields
+/// are recomputed on read (see `columnar`).
+pub const BLOCK_ENCODING_COLUMNAR: u8 = 1;
+
+/// zstd skippable frame magic used to wrap the block index so that the file
+/// remains a valid zstd stream.
+pub const SKIPPABLE_FRAME_MAGIC: u32 = 0x184D_2A50;
+pub const SKIPPABLE_FRAME_MAGIC_MASK: u32 = 0xFFFF_FFF0;
+pub const SKIPPABLE_HEADER_LEN: usize = 8;
+
+/// Skippable frame magic of keyframes (see `keyframe`); the index uses
+/// `SKIPPABLE_FRAME_MAGIC`.
+pub const KEYFRAME_MAGIC: u32 = 0x184D_2A51;
+/// Frames between keyframes, and so the most a seek replays after
+/// restoring one.
+pub const KEYFRAME_INTERVAL: u64 = 1024;
+
+/// Skippable frame magic of the per-thread index (see `thread_index`),
+/// written just before the block index.
+pub const THREAD_INDEX_MAGIC: u32 = 0x184D_2A52;
+/// Skippable frame magic of a piece of the per-thread index covering
+/// `THREAD_SEGMENT_BLOCKS` blocks, written after the last of them.
+pub const THREAD_SEGMENT_MAGIC: u32 = 0x184D_2A54;
+/// Skippable frame magic of the list of thread index pieces, written by
+/// `finish` in place of a whole `THREAD_INDEX_MAGIC` index when the
+/// recording has more than one.
+pub const THREAD_SEGMENTS_MAGIC: u32 = 0x184D_2A55;
+/// Blocks the writer sums threads over before writing them out.
+pub const THREAD_SEGMENT_BLOCKS: usize = 64;
+
+/// Skippable frame magic of the coarse replay histogram (see
+/// `histogram_index`), written after the per-thread index.
+pub const HISTOGRAM_MAGIC: u32 = 0x184D_2A56;
+/// Pyramid level of the stored histogram buckets, `FANOUT^4` (256) frames
+/// each.
+pub const HISTOGRAM_LEVEL: usize = 4;
+
+/// Skippable frame magic of the compression dictionary (see
+/// `compression`), written right after the file header.
+pub const DICTIONARY_MAGIC: u32 = 0x184D_2A53;
+
+/// Trailer at the very end of a v3 file: `u32` index length + `INDEX_MAGIC`.
+pub const INDEX_MAGIC: [u8; 4] = *b"FIDX";
+pub const TRAILER_LEN: usize = 8;
+
 #[derive(Serialize, Deserialize, Debug, Clone)]
 pub struct FileHeader {
     pub magic: [u8; 4],
@@ -21,10 +79,83 @@ pub struct FileHeader {
 
 #[derive(Serialize, Deserialize, Debug, Clone)]
 pub struct Frame {
+    /// Process the frame was sampled from; multiplexed recordings
+    /// interleave frames of several processes.
+    pub pid: i32,
     pub computed: ComputedFrame,
     pub per_thread_deltas: Vec<ThreadDelta>,
 }
 
+/// Location and summary of one compressed block in a v3 recording.
+#[derive(Serialize, Deserialize, Debug, Clone, Default)]
+pub struct BlockEntry {
+    /// Byte offset of the block's zstd frame from the start of the file.
+    pub offset: u64,
+    pub compressed_len: u32,
+    pub raw_len: u32,
+    pub first_frame: u64,
+    pub frame_count: u32,
+    pub first_timestamp_ns: u64,
+}
+
+/// Location of one keyframe in a v3 recording.
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct KeyframeEntry {
+    /// Index of the first frame after the keyframe.
+    pub frame: u64,
+    /// Byte offset of its skippable frame.
+    pub offset: u64,
+    pub len: u32,
+}
+
+/// Location of the per-thread index, or of the coarse histogram, in a v3
+/// recording.
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ThreadIndexEntry {
+    /// Byte offset of its skippable frame.
+    pub offset: u64,
+    pub len: u32,
+}
+
+/// Footer index written by `RecordingWriter::finish`.
+#[derive(Serialize, Deserialize, Debug, Clone, Default)]
+pub struct BlockIndex {
+    pub frame_count: u64,
+    pub blocks: Vec<BlockEntry>,
+    /// Whole-recording statistics per process, sorted by PID. Empty for
+    /// recordings whose index was recovered.
+    pub stats: Vec<ProcessStats>,
+    /// Sorted by frame.
+    pub keyframes: Vec<KeyframeEntry>,
+    pub threads: Option<ThreadIndexEntry>,
+    pub histogram: Option<ThreadIndexEntry>,
+}
+
+/// `BlockIndex` as written before it located the histogram. Readers
+/// ignore trailing bytes, so older ones still read the current index.
+#[derive(Deserialize)]
+pub struct PreHistogramBlockIndex {
+    pub frame_count: u64,
+    pub blocks: Vec<BlockEntry>,
+    pub stats: Vec<ProcessStats>,
+    pub keyframes: Vec<KeyframeEntry>,
+    pub threads: Option<ThreadIndexEntry>,
+}
+
+impl From<PreHistogramBlockIndex> for BlockIndex {
+    fn from(index: PreHistogramBlockIndex) -> Self {
+        Self {
+            frame_count: index.frame_count,
+            blocks: index.blocks,
+            stats: index.stats,
+            keyframes: index.keyframes,
+            threads: index.threads,
+            histogram: None,
+        }
+    }
+}
+
+/// `ComputedFrame` as written by format version 1.
 #[derive(Deserialize)]
 pub struct LegacyComputedFrame {
     pub timestamp_ns: u64,
@@ -52,10 +183,42 @@ pub struct LegacyFrame {
     pub per_thread_deltas: Vec<ThreadDelta>,
 }
 
+/// `ComputedFrame` as written by format version 2 (no `mem_age_ns`).
+/// Postcard has no field tags, so this layout is frozen.
+#[derive(Serialize, Deserialize)]
+pub struct V2ComputedFrame {
+    pub timestamp_ns: u64,
+    pub sample_period_ns: u64,
+    pub threads_sampled: usize,
+    pub total_jit_time: u64,
+    pub total_signal_time: u64,
+    pub total_sigbus_count: u64,
+    pub total_smc_count: u64,
+    pub total_float_fallback_count: u64,
+    pub total_cache_miss_count: u64,
+    pub total_cache_read_lock_time: u64,
+    pub total_cache_write_lock_time: u64,
+    pub total_jit_count: u64,
+    pub total_jit_invocations: u64,
+    pub fex_load_percent: f64,
+    pub thread_loads: Vec<ThreadLoad>,
+    pub mem: MemSnapshot,
+    pub histogram_entry: HistogramEntry,
+    pub cumulative: CumulativeCountStats,
+}
+
+#[derive(Serialize, Deserialize)]
+pub struct V2Frame {
+    pub computed: V2ComputedFrame,
+    pub per_thread_deltas: Vec<ThreadDelta>,
+}
+
 impl From<LegacyFrame> for Frame {
     fn from(legacy: LegacyFrame) -> Self {
         let lc = legacy.computed;
         Self {
+            // Filled in from the session metadata by the reader.
+            pid: 0,
             computed: ComputedFrame {
                 timestamp_ns: lc.timestamp_ns,
                 sample_period_ns: lc.sample_period_ns,
@@ -72,7 +235,16 @@ impl From<LegacyFrame> for Frame {
                 total_jit_invocations: lc.total_jit_invocations,
                 fex_load_percent: lc.fex_load_percent,
                 thread_loads: lc.thread_loads,
+                lock_loads: Vec::new(),
+                write_lock_spikes: 0,
                 mem: lc.mem,
+                mem_age_ns: 0,
+                sample_lateness_ns: 0,
+                sample_overhead_ns: 0,
+                shm_read_ns: 0,
+                smaps_ns: 0,
+                record_ns: 0,
+                torn_reads: 0,
                 histogram_entry: lc.histogram_entry,
                 cumulative: CumulativeCountStats::default(),
             },
@@ -80,3 +252,43 @@ impl From<LegacyFrame> for Frame {
         }
     }
 }
+
+impl From<V2Frame> for Frame {
+    fn from(v2: V2Frame) -> Self {
+        let c = v2.computed;
+        Self {
+            // Filled in from the session metadata by the reader.
+            pid: 0,
+            computed: ComputedFrame {
+                timestamp_ns: c.timestamp_ns,
+                sample_period_ns: c.sample_period_ns,
+                threads_sampled: c.threads_sampled,
+                total_jit_time: c.total_jit_time,
+                total_signal_time: c.total_signal_time,
+                total_sigbus_count: c.total_sigbus_count,
+                total_smc_count: c.total_smc_count,
+                total_float_fallback_count: c.total_float_fallback_count,
+                total_cache_miss_count: c.total_cache_miss_count,
+                total_cache_read_lock_time: c.total_cache_read_lock_time,
+                total_cache_write_lock_time: c.total_cache_write_lock_time,
+                total_jit_count: c.total_jit_count,
+                total_jit_invocations: c.total_jit_invocations,
+                fex_load_percent: c.fex_load_percent,
+                thread_loads: c.thread_loads,
+                lock_loads: Vec::new(),
+                write_lock_spikes: 0,
+                mem: c.mem,
+                mem_age_ns: 0,
+                sample_lateness_ns: 0,
+                sample_overhead_ns: 0,
+                shm_read_ns: 0,
+                smaps_ns: 0,
+                record_ns: 0,
+                torn_reads: 0,
+                histogram_entry: c.histogram_entry,
+                cumulative: c.cumulative,
+            },
+            per_thread_deltas: v2.per_thread_deltas,
+        }
+    }
+}
@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: MIT
+//! Coarse replay histogram: for the whole recording and for each process,
+//! the `HistogramPyramid` buckets of level `HISTOGRAM_LEVEL` over its
+//! frames, with where in the recording each bucket starts.
+//! `RecordingWriter::finish` writes it in a skippable frame
+//! (`HISTOGRAM_MAGIC`) after the per-thread index, and the block index
+//! locates it. Replay builds the
+//! coarse levels of its pyramid from it and decodes frames only for the
+//! finer levels in view; recordings without one are read in full.
+
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+
+use anyhow::{Context, Result, bail};
+use serde::{Deserialize, Serialize};
+
+use super::format::{
+    Frame, HISTOGRAM_LEVEL, HISTOGRAM_MAGIC, SKIPPABLE_HEADER_LEN, ThreadIndexEntry,
+};
+use crate::sampler::histogram::{Bucket, FANOUT, HistogramPyramid};
+
+const COMPRESSION_LEVEL: i32 = 3;
+
+#[derive(Clone, Debug, Default, PartialEq, Serialize, Deserialize)]
+pub struct HistogramGroup {
+    /// `None` for every process together.
+    pub pid: Option<i32>,
+    pub frames: u64,
+    /// Complete buckets only; a last one still filling is left to the
+    /// finer levels.
+    pub buckets: Vec<Bucket>,
+    /// Index in the recording of the first frame of every bucket, the one
+    /// still filling included.
+    pub starts: Vec<u64>,
+}
+
+impl HistogramGroup {
+    /// The pyramid of the group, with its coarse levels built.
+    #[must_use]
+    pub fn pyramid(&self) -> HistogramPyramid {
+        HistogramPyramid::from_coarse(HISTOGRAM_LEVEL, &self.buckets, self.frames)
+    }
+}
+
+#[derive(Clone, Debug, Default, PartialEq, Serialize, Deserialize)]
+pub struct HistogramIndex {
+    /// Every process first, then by PID.
+    pub groups: Vec<HistogramGroup>,
+}
+
+impl HistogramIndex {
+    /// Encodes the histogram as a skippable frame.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the histogram cannot be encoded.
+    pub fn encode(&self) -> Result<Vec<u8>> {
+        let serialized = postcard::to_stdvec(self).context("failed to serialize histogram")?;
+        let compressed = zstd::bulk::compress(&serialized, COMPRESSION_LEVEL)
+            .context("failed to compress histogram")?;
+        let mut out = Vec::with_capacity(SKIPPABLE_HEADER_LEN + compressed.len());
+        out.extend_from_slice(&HISTOGRAM_MAGIC.to_le_bytes());
+        #[allow(clippy::cast_possible_truncation)]
+        out.extend_from_slice(&(compressed.len() as u32).to_le_bytes());
+        out.extend_from_slice(&compressed);
+        Ok(out)
+    }
+
+    /// Reads the histogram `entry` locates in `file`.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the histogram cannot be read or decoded.
+    pub fn read(file: &File, entry: &ThreadIndexEntry) -> Result<Self> {
+        let mut data = vec![0u8; entry.len as usize];
+        file.read_exact_at(&mut data, entry.offset)
+            .context("failed to read histogram")?;
+        if data.len() < SKIPPABLE_HEADER_LEN
+            || u32::from_le_bytes([data[0], data[1], data[2], data[3]]) != HISTOGRAM_MAGIC
+        {
+            bail!(
+                "histogram at offset {} does not match the index",
+                entry.offset
+            );
+        }
+        let raw = zstd::stream::decode_all(&data[SKIPPABLE_HEADER_LEN..])
+            .context("failed to decompress histogram")?;
+        postcard::from_bytes(&raw).context("failed to deserialize histogram")
+    }
+}
+
+/// One group's buckets as frames arrive. Only the last few buckets of each
+/// level are kept to fold the next coarse one, so memory grows with the
+/// coarse buckets alone.
+struct GroupBuilder {
+    group: HistogramGroup,
+    pyramid: HistogramPyramid,
+    last: Vec<Bucket>,
+}
+
+impl GroupBuilder {
+    fn new(pid: Option<i32>) -> Self {
+        Self {
+            group: HistogramGroup {
+                pid,
+                ..HistogramGroup::default()
+            },
+            pyramid: HistogramPyramid::rolling(FANOUT),
+            last: Vec::with_capacity(1),
+        }
+    }
+
+    fn record(&mut self, index: u64, frame: &Frame) {
+        let span = HistogramPyramid::frames_per_bucket(HISTOGRAM_LEVEL);
+        if self.group.frames.is_multiple_of(span) {
+            self.group.starts.push(index);
+        }
+        self.pyramid.push(&frame.computed.histogram_entry);
+        self.group.frames += 1;
+        if self.group.frames.is_multiple_of(span) {
+            self.pyramid
+                .view(HISTOGRAM_LEVEL, self.group.frames, 1, &mut self.last);
+            self.group.buckets.extend(self.last.pop());
+        }
+    }
+}
+
+/// Builds a `HistogramIndex` frame by frame, in file order.
+pub struct HistogramIndexBuilder {
+    all: GroupBuilder,
+    /// Sorted by PID.
+    processes: Vec<GroupBuilder>,
+}
+
+impl Default for HistogramIndexBuilder {
+    fn default() -> Self {
+        Self {
+            all: GroupBuilder::new(None),
+            processes: Vec::new(),
+        }
+    }
+}
+
+impl HistogramIndexBuilder {
+    /// Adds `frame`, frame `index` of the recording.
+    pub fn record(&mut self, index: u64, frame: &Frame) {
+        self.all.record(index, frame);
+        let i = match self
+            .processes
+            .binary_search_by_key(&Some(frame.pid), |p| p.group.pid)
+        {
+            Ok(i) => i,
+            Err(i) => {
+                self.processes.insert(i, GroupBuilder::new(Some(frame.pid)));
+                i
+            }
+        };
+        self.processes[i].record(index, frame);
+    }
+
+    #[must_use]
+    pub fn finish(self) -> HistogramIndex {
+        HistogramIndex {
+            groups: std::iter::once(self.all)
+                .chain(self.processes)
+                .map(|g| g.group)
+                .collect(),
+        }
+    }
+}
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: MIT
+//! Keyframes: snapshots of the statistics replay builds up from the frames
+//! it plays (rolling windows, sampler timing, stage times, lock
+//! contention), written every `KEYFRAME_INTERVAL` frames so a seek restores
+//! them from the nearest one and replays at most that many frames, wherever
+//! it lands.
+//!
+//! A keyframe is a zstd skippable frame between two blocks: `KEYFRAME_MAGIC`,
+//! the payload length, the index of the frame it precedes (`u64`), and the
+//! zstd-compressed postcard snapshots. Multiplexed recordings get one
+//! snapshot of every frame and one per process, for `replay --pid`.
+
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+
+use anyhow::{Context, Result, bail};
+use serde::{Deserialize, Serialize};
+
+use super::format::{
+    Frame, KEYFRAME_INTERVAL, KEYFRAME_MAGIC, KeyframeEntry, SKIPPABLE_HEADER_LEN,
+};
+use crate::sampler::accumulator::ComputedFrame;
+use crate::sampler::contention::ContentionStats;
+use crate::sampler::jitter::SamplerTiming;
+use crate::sampler::overhead::OverheadStats;
+use crate::sampler::rolling::RollingStats;
+
+const COMPRESSION_LEVEL: i32 = 3;
+/// Bytes of a keyframe before its snapshots: the skippable frame header
+/// and the frame index.
+pub const KEYFRAME_HEADER_LEN: usize = SKIPPABLE_HEADER_LEN + 8;
+
+/// What the replay UI accumulates from the frames played so far.
+#[derive(Clone, Default, Serialize, Deserialize)]
+pub struct PlaybackStats {
+    pub rolling: RollingStats,
+    pub timing: SamplerTiming,
+    pub overhead: OverheadStats,
+    pub contention: ContentionStats,
+}
+
+impl PlaybackStats {
+    pub fn record(&mut self, frame: &ComputedFrame) {
+        self.timing.record(frame);
+        self.rolling.record(frame);
+        self.overhead.record_frame(frame);
+        self.contention.record(frame);
+    }
+}
+
+/// `pid` is `None` for the snapshot of every process. Written from
+/// borrowed statistics, read into owned ones.
+#[derive(Serialize, Deserialize)]
+struct Snapshot<S> {
+    pid: Option<i32>,
+    stats: S,
+}
+
+/// Keeps the statistics keyframes are made of, on the writer thread.
+#[derive(Default)]
+pub struct KeyframeTracker {
+    /// Of every frame; only kept once there is more than one process.
+    all: PlaybackStats,
+    /// Sorted by PID.
+    processes: Vec<(i32, PlaybackStats)>,
+    next_frame: u64,
+}
+
+impl KeyframeTracker {
+    pub fn record(&mut self, frame: &Frame) {
+        if self.next_frame == 0 {
+            self.next_frame = KEYFRAME_INTERVAL;
+        }
+        let i = match self
+            .processes
+            .binary_search_by_key(&frame.pid, |(pid, _)| *pid)
+        {
+            Ok(i) => i,
+            Err(i) => {
+                if let [(_, only)] = self.processes.as_slice() {
+                    // Until now every frame was this process's.
+                    self.all = only.clone();
+                }
+                self.processes
+                    .insert(i, (frame.pid, PlaybackStats::default()));
+                i
+            }
+        };
+        self.processes[i].1.record(&frame.computed);
+        if self.processes.len() > 1 {
+            self.all.record(&frame.computed);
+        }
+    }
+
+    /// Whether a keyframe is due before frame `frame_count`.
+    #[must_use]
+    pub fn is_due(&self, frame_count: u64) -> bool {
+        self.next_frame > 0 && frame_count >= self.next_frame
+    }
+
+    /// Encodes the keyframe that precedes frame `frame_count`.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the snapshots cannot be encoded.
+    pub fn encode(&mut self, frame_count: u64) -> Result<Vec<u8>> {
+        self.next_frame = frame_count + KEYFRAME_INTERVAL;
+        // With one process so far, its snapshot is also that of every
+        // process.
+        let all = (self.processes.len() > 1).then_some(Snapshot {
+            pid: None,
+            stats: &self.all,
+        });
+        let snapshots: Vec<_> = all
+            .into_iter()
+            .chain(self.processes.iter().map(|(pid, stats)| Snapshot {
+                pid: Some(*pid),
+                stats,
+            }))
+            .collect();
+        let serialized = postcard::to_stdvec(&snapshots).context("failed to serialize keyframe")?;
+        let compressed = zstd::bulk::compress(&serialized, COMPRESSION_LEVEL)
+            .context("failed to compress keyframe")?;
+
+        let mut out = Vec::with_capacity(KEYFRAME_HEADER_LEN + compressed.len());
+        out.extend_from_slice(&KEYFRAME_MAGIC.to_le_bytes());
+        #[allow(clippy::cast_possible_truncation)]
+        out.extend_from_slice(&((8 + compressed.len()) as u32).to_le_bytes());
+        out.extend_from_slice(&frame_count.to_le_bytes());
+        out.extend_from_slice(&compressed);
+        Ok(out)
+    }
+}
+
+/// Index of the frame a keyframe precedes, from its first
+/// `KEYFRAME_HEADER_LEN` bytes.
+#[must_use]
+pub fn keyframe_frame(header: &[u8]) -> Option<u64> {
+    let bytes = header.get(SKIPPABLE_HEADER_LEN..KEYFRAME_HEADER_LEN)?;
+    Some(u64::from_le_bytes(bytes.try_into().ok()?))
+}
+
+/// Reads the statistics of `entry` for `pid`, or of every process.
+///
+/// # Errors
+///
+/// Returns an error if the keyframe cannot be read or decoded.
+pub fn read_keyframe(
+    file: &File,
+    entry: &KeyframeEntry,
+    pid: Option<i32>,
+) -> Result<PlaybackStats> {
+    let mut data = vec![0u8; entry.len as usize];
+    file.read_exact_at(&mut data, entry.offset)
+        .context("failed to read keyframe")?;
+    if keyframe_frame(&data) != Some(entry.frame) {
+        bail!(
+            "keyframe at offset {} does not match the index",
+            entry.offset
+        );
+    }
+    let raw = zstd::stream::decode_all(&data[KEYFRAME_HEADER_LEN..])
+        .context("failed to decompress keyframe")?;
+    let snapshots: Vec<Snapshot<PlaybackStats>> =
+        postcard::from_bytes(&raw).context("failed to deserialize keyframe")?;
+
+    let found = match pid {
+        Some(_) => snapshots.into_iter().find(|s| s.pid == pid),
+        None if snapshots.len() == 1 => snapshots.into_iter().next(),
+        None => snapshots.into_iter().find(|s| s.pid.is_none()),
+    };
+    // A process that had not started yet has played nothing.
+    Ok(found.map(|s| s.stats).unwrap_or_default())
+}
@@ -0,0 +1,529 @@
+// SPDX-License-Identifier: MIT
+//! Memory-mapped replay cache.
+//!
+//! A `.felixm` file sits next to a recording and holds every frame as a
+//! fixed-layout `FrameRecord`, followed by one flat array of
+//! `ThreadLoadRecord`s: each frame's thread loads, then its lock loads. Replay maps it read-only and copies views into a
+//! caller-owned `ComputedFrame`, so scrubbing does not allocate.
+
+use std::fs::{File, OpenOptions};
+use std::io::{BufWriter, Seek, SeekFrom, Write};
+use std::num::NonZeroUsize;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+use std::ptr::NonNull;
+
+use anyhow::{Context, Result, bail};
+use nix::sys::mman::{self, MapFlags, ProtFlags};
+
+use super::reader::RecordingReader;
+use crate::fex::smaps::{LargestAnon, MemSnapshot};
+use crate::sampler::accumulator::{
+    ComputedFrame, CumulativeCountStats, HistogramEntry, ThreadLoad,
+};
+
+const MAPPED_MAGIC: [u8; 4] = *b"FLXM";
+const MAPPED_VERSION: u32 = 7;
+const MAPPED_EXTENSION: &str = "felixm";
+
+#[derive(Debug, Clone, Copy, Default)]
+#[repr(C, align(8))]
+struct MappedHeader {
+    magic: [u8; 4],
+    version: u32,
+    frame_count: u64,
+    thread_load_count: u64,
+    source_len: u64,
+    source_mtime_ns: i64,
+    pad: [u8; 24],
+}
+
+/// Fixed-layout mirror of `ComputedFrame`. `thread_loads` and then
+/// `lock_loads` are stored as one range into the shared `ThreadLoadRecord`
+/// array.
+#[derive(Debug, Clone, Copy, Default)]
+#[repr(C, align(8))]
+pub struct FrameRecord {
+    pub timestamp_ns: u64,
+    pub sample_period_ns: u64,
+    pub threads_sampled: u64,
+    pub total_jit_time: u64,
+    pub total_signal_time: u64,
+    pub total_sigbus_count: u64,
+    pub total_smc_count: u64,
+    pub total_float_fallback_count: u64,
+    pub total_cache_miss_count: u64,
+    pub total_cache_read_lock_time: u64,
+    pub total_cache_write_lock_time: u64,
+    pub total_jit_count: u64,
+    pub total_jit_invocations: u64,
+    pub fex_load_percent: f64,
+    pub mem: [u64; 15],
+    pub mem_age_ns: u64,
+    pub sample_lateness_ns: u64,
+    pub sample_overhead_ns: u64,
+    pub shm_read_ns: u64,
+    pub smaps_ns: u64,
+    pub record_ns: u64,
+    pub cumulative: [u64; 5],
+    pub thread_loads_start: u64,
+    pub thread_loads_len: u32,
+    pub histogram_load_percent: f32,
+    pub pid: i32,
+    pub torn_reads: u32,
+    pub lock_loads_len: u32,
+    pub write_lock_spikes: u32,
+    pub histogram_flags: u8,
+    pub pad: [u8; 7],
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+#[repr(C, align(8))]
+pub struct ThreadLoadRecord {
+    pub tid: u32,
+    pub load_percent: f32,
+    pub total_cycles: u64,
+}
+
+const _: () = assert!(
+    std::mem::size_of::<MappedHeader>() == 64,
+    "MappedHeader must be 64 bytes"
+);
+
+const _: () = assert!(
+    std::mem::size_of::<FrameRecord>().is_multiple_of(8),
+    "FrameRecord size must be a multiple of 8"
+);
+
+const _: () = assert!(
+    std::mem::size_of::<ThreadLoadRecord>() == 16,
+    "ThreadLoadRecord must be 16 bytes"
+);
+
+impl FrameRecord {
+    fn from_frame(pid: i32, f: &ComputedFrame, thread_loads_start: u64) -> Self {
+        let m = &f.mem;
+        let c = &f.cumulative;
+        let h = &f.histogram_entry;
+
+        #[allow(clippy::cast_possible_truncation)]
+        Self {
+            timestamp_ns: f.timestamp_ns,
+            sample_period_ns: f.sample_period_ns,
+            threads_sampled: f.threads_sampled as u64,
+            total_jit_time: f.total_jit_time,
+            total_signal_time: f.total_signal_time,
+            total_sigbus_count: f.total_sigbus_count,
+            total_smc_count: f.total_smc_count,
+            total_float_fallback_count: f.total_float_fallback_count,
+            total_cache_miss_count: f.total_cache_miss_count,
+            total_cache_read_lock_time: f.total_cache_read_lock_time,
+            total_cache_write_lock_time: f.total_cache_write_lock_time,
+            total_jit_count: f.total_jit_count,
+            total_jit_invocations: f.total_jit_invocations,
+            fex_load_percent: f.fex_load_percent,
+            mem: [
+                m.total_anon,
+                m.jit_code,
+                m.op_dispatcher,
+                m.frontend,
+                m.cpu_backend,
+                m.lookup,
+                m.lookup_l1,
+                m.thread_states,
+                m.block_links,
+                m.misc,
+                m.jemalloc,
+                m.unaccounted,
+                m.largest_anon.begin,
+                m.largest_anon.end,
+                m.largest_anon.size,
+            ],
+            mem_age_ns: f.mem_age_ns,
+            sample_lateness_ns: f.sample_lateness_ns,
+            sample_overhead_ns: f.sample_overhead_ns,
+            shm_read_ns: f.shm_read_ns,
+            smaps_ns: f.smaps_ns,
+            record_ns: f.record_ns,
+            cumulative: [c.sigbus, c.smc, c.float_fallback, c.cache_miss, c.jit],
+            thread_loads_start,
+            thread_loads_len: f.thread_loads.len() as u32,
+            histogram_load_percent: h.load_percent,
+            pid,
+            torn_reads: f.torn_reads,
+            lock_loads_len: f.lock_loads.len() as u32,
+            write_lock_spikes: f.write_lock_spikes,
+            histogram_flags: h.flags(),
+            pad: [0; 7],
+        }
+    }
+}
+
+/// Borrowed view of one frame inside a `MappedRecording`.
+pub struct FrameView<'a> {
+    pub record: &'a FrameRecord,
+    pub thread_loads: &'a [ThreadLoadRecord],
+    pub lock_loads: &'a [ThreadLoadRecord],
+}
+
+impl FrameView<'_> {
+    /// Overwrites `out` with this frame, reusing its `thread_loads` and
+    /// `lock_loads` buffers.
+    pub fn copy_into(&self, out: &mut ComputedFrame) {
+        let r = self.record;
+        let m = &r.mem;
+        let c = &r.cumulative;
+
+        out.timestamp_ns = r.timestamp_ns;
+        out.sample_period_ns = r.sample_period_ns;
+        #[allow(clippy::cast_possible_truncation)]
+        {
+            out.threads_sampled = r.threads_sampled as usize;
+        }
+        out.total_jit_time = r.total_jit_time;
+        out.total_signal_time = r.total_signal_time;
+        out.total_sigbus_count = r.total_sigbus_count;
+        out.total_smc_count = r.total_smc_count;
+        out.total_float_fallback_count = r.total_float_fallback_count;
+        out.total_cache_miss_count = r.total_cache_miss_count;
+        out.total_cache_read_lock_time = r.total_cache_read_lock_time;
+        out.total_cache_write_lock_time = r.total_cache_write_lock_time;
+        out.total_jit_count = r.total_jit_count;
+        out.total_jit_invocations = r.total_jit_invocations;
+        out.fex_load_percent = r.fex_load_percent;
+
+        out.thread_loads.clear();
+        out.thread_loads
+            .extend(self.thread_loads.iter().map(|t| ThreadLoad {
+                tid: t.tid,
+                load_percent: t.load_percent,
+                total_cycles: t.total_cycles,
+            }));
+        out.lock_loads.clear();
+        out.lock_loads
+            .extend(self.lock_loads.iter().map(|t| ThreadLoad {
+                tid: t.tid,
+                load_percent: t.load_percent,
+                total_cycles: t.total_cycles,
+            }));
+        out.write_lock_spikes = r.write_lock_spikes;
+
+        out.mem = MemSnapshot {
+            total_anon: m[0],
+            jit_code: m[1],
+            op_dispatcher: m[2],
+            frontend: m[3],
+            cpu_backend: m[4],
+            lookup: m[5],
+            lookup_l1: m[6],
+            thread_states: m[7],
+            block_links: m[8],
+            misc: m[9],
+            jemalloc: m[10],
+            unaccounted: m[11],
+            largest_anon: LargestAnon {
+                begin: m[12],
+                end: m[13],
+                size: m[14],
+            },
+        };
+        out.mem_age_ns = r.mem_age_ns;
+        out.sample_lateness_ns = r.sample_lateness_ns;
+        out.sample_overhead_ns = r.sample_overhead_ns;
+        out.shm_read_ns = r.shm_read_ns;
+        out.smaps_ns = r.smaps_ns;
+        out.record_ns = r.record_ns;
+        out.torn_reads = r.torn_reads;
+
+        out.histogram_entry =
+            HistogramEntry::from_flags(r.histogram_load_percent, r.histogram_flags);
+
+        out.cumulative = CumulativeCountStats {
+            sigbus: c[0],
+            smc: c[1],
+            float_fallback: c[2],
+            cache_miss: c[3],
+            jit: c[4],
+        };
+    }
+}
+
+pub struct MappedRecording {
+    base: NonNull<u8>,
+    len: usize,
+    frame_count: usize,
+    thread_load_count: usize,
+}
+
+// SAFETY: The mapping is private, read-only and never written after `open`.
+unsafe impl Send for MappedRecording {}
+
+impl MappedRecording {
+    /// Returns the replay cache path for a recording (`<path>.felixm`).
+    #[must_use]
+    pub fn cache_path(recording: &Path) -> PathBuf {
+        let mut name = recording.as_os_str().to_owned();
+        name.push(".");
+        name.push(MAPPED_EXTENSION);
+        PathBuf::from(name)
+    }
+
+    /// Opens the replay cache for `recording`, (re)building it first if it is
+    /// missing or was built from a different version of the recording.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the recording cannot be read or the cache cannot
+    /// be written or mapped.
+    pub fn open_or_build(recording: &Path, reader: &mut RecordingReader) -> Result<Self> {
+        let cache = Self::cache_path(recording);
+        let (source_len, source_mtime_ns) = source_identity(recording)?;
+
+        if let Ok(mapped) = Self::open(&cache)
+            && mapped.header().source_len == source_len
+            && mapped.header().source_mtime_ns == source_mtime_ns
+            && mapped.frame_count() == reader.frame_count()
+        {
+            return Ok(mapped);
+        }
+
+        build(&cache, reader, source_len, source_mtime_ns)?;
+        Self::open(&cache)
+    }
+
+    /// Maps an existing replay cache and validates its layout.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the file cannot be mapped or is not a valid cache.
+    pub fn open(path: &Path) -> Result<Self> {
+        let file = File::open(path)
+            .with_context(|| format!("failed to open replay cache {}", path.display()))?;
+        let len = usize::try_from(
+            file.metadata()
+                .context("failed to stat replay cache")?
+                .len(),
+        )
+        .context("replay cache too large")?;
+        if len < std::mem::size_of::<MappedHeader>() {
+            bail!("replay cache too small: {len} bytes");
+        }
+
+        let map_len = NonZeroUsize::new(len).context("replay cache has zero size")?;
+
+        // SAFETY: Valid fd, read-only private mapping of a regular file.
+        let mapped: NonNull<std::ffi::c_void> = unsafe {
+            mman::mmap(
+                None,
+                map_len,
+                ProtFlags::PROT_READ,
+                MapFlags::MAP_PRIVATE,
+                &file,
+                0,
+            )
+            .context("failed to mmap replay cache")?
+        };
+
+        let mut this = Self {
+            base: mapped.cast::<u8>(),
+            len,
+            frame_count: 0,
+            thread_load_count: 0,
+        };
+
+        let header = *this.header();
+        if header.magic != MAPPED_MAGIC || header.version != MAPPED_VERSION {
+            bail!("replay cache has an unsupported layout");
+        }
+
+        let frame_count = usize::try_from(header.frame_count).context("bad frame count")?;
+        let thread_load_count =
+            usize::try_from(header.thread_load_count).context("bad thread load count")?;
+        let expected = std::mem::size_of::<MappedHeader>()
+            + frame_count * std::mem::size_of::<FrameRecord>()
+            + thread_load_count * std::mem::size_of::<ThreadLoadRecord>();
+        if expected != len {
+            bail!("replay cache is truncated ({len} bytes, expected {expected})");
+        }
+
+        this.frame_count = frame_count;
+        this.thread_load_count = thread_load_count;
+        Ok(this)
+    }
+
+    #[must_use]
+    pub fn frame_count(&self) -> usize {
+        self.frame_count
+    }
+
+    /// Returns a borrowed view of frame `index`.
+    #[must_use]
+    pub fn frame(&self, index: usize) -> Option<FrameView<'_>> {
+        if index >= self.frame_count {
+            return None;
+        }
+
+        // SAFETY: `open` checked that the mapping holds exactly the header,
+        // `frame_count` frame records and `thread_load_count` thread load
+        // records. Each section starts at a multiple of its alignment because
+        // mmap returns page-aligned memory and all record sizes are multiples
+        // of 8. Every field is plain data, so any bit pattern is valid.
+        #[allow(clippy::cast_ptr_alignment)]
+        let record = unsafe {
+            &*self
+                .base
+                .as_ptr()
+                .add(std::mem::size_of::<MappedHeader>())
+                .cast::<FrameRecord>()
+                .add(index)
+        };
+
+        let start = usize::try_from(record.thread_loads_start).ok()?;
+        let thread_loads_len = record.thread_loads_len as usize;
+        let len = thread_loads_len + record.lock_loads_len as usize;
+        if start.checked_add(len)? > self.thread_load_count {
+            return None;
+        }
+
+        // SAFETY: Bounds were checked above against `thread_load_count`.
+        #[allow(clippy::cast_ptr_alignment)]
+        let loads = unsafe {
+            let first = self
+                .base
+                .as_ptr()
+                .add(
+                    std::mem::size_of::<MappedHeader>()
+                        + self.frame_count * std::mem::size_of::<FrameRecord>(),
+                )
+                .cast::<ThreadLoadRecord>()
+                .add(start);
+            std::slice::from_raw_parts(first, len)
+        };
+
+        let (thread_loads, lock_loads) = loads.split_at(thread_loads_len);
+        Some(FrameView {
+            record,
+            thread_loads,
+            lock_loads,
+        })
+    }
+
+    fn header(&self) -> &MappedHeader {
+        // SAFETY: `open` checked that the mapping is at least as large as the
+        // header, and mmap returns page-aligned memory.
+        #[allow(clippy::cast_ptr_alignment)]
+        unsafe {
+            &*self.base.as_ptr().cast::<MappedHeader>()
+        }
+    }
+}
+
+impl Drop for MappedRecording {
+    fn drop(&mut self) {
+        // SAFETY: self.base was obtained from mmap with self.len length.
+        let _ = unsafe { mman::munmap(self.base.cast::<std::ffi::c_void>(), self.len) };
+    }
+}
+
+fn source_identity(recording: &Path) -> Result<(u64, i64)> {
+    let meta = std::fs::metadata(recording)
+        .with_context(|| format!("failed to stat {}", recording.display()))?;
+    Ok((
+        meta.len(),
+        meta.mtime()
+            .saturating_mul(1_000_000_000)
+            .saturating_add(meta.mtime_nsec()),
+    ))
+}
+
+/// Writes the replay cache in one sequential pass over the recording. The
+/// frame section has a known size, so thread loads are streamed through a
+/// second handle positioned after it.
+fn build(
+    cache: &Path,
+    reader: &mut RecordingReader,
+    source_len: u64,
+    source_mtime_ns: i64,
+) -> Result<()> {
+    let frame_count = reader.frame_count();
+    let open = || {
+        OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(false)
+            .open(cache)
+            .with_context(|| format!("failed to create replay cache {}", cache.display()))
+    };
+
+    let file = open()?;
+    file.set_len(0).context("failed to truncate replay cache")?;
+
+    let frames_start = std::mem::size_of::<MappedHeader>() as u64;
+    let loads_start = frames_start + (frame_count * std::mem::size_of::<FrameRecord>()) as u64;
+
+    let mut frames_out = BufWriter::new(file);
+    frames_out
+        .seek(SeekFrom::Start(frames_start))
+        .context("failed to seek replay cache")?;
+    let mut loads_out = BufWriter::new(open()?);
+    loads_out
+        .seek(SeekFrom::Start(loads_start))
+        .context("failed to seek replay cache")?;
+
+    let mut thread_load_count: u64 = 0;
+    for i in 0..frame_count {
+        let Some(frame) = reader.try_frame_at(i)? else {
+            bail!("recording ended early at frame {i}");
+        };
+        let computed = &frame.computed;
+
+        let record = FrameRecord::from_frame(frame.pid, computed, thread_load_count);
+        frames_out
+            .write_all(as_bytes(&record))
+            .context("failed to write frame record")?;
+
+        for tl in computed.thread_loads.iter().chain(&computed.lock_loads) {
+            let record = ThreadLoadRecord {
+                tid: tl.tid,
+                load_percent: tl.load_percent,
+                total_cycles: tl.total_cycles,
+            };
+            loads_out
+                .write_all(as_bytes(&record))
+                .context("failed to write thread load record")?;
+        }
+        thread_load_count += (computed.thread_loads.len() + computed.lock_loads.len()) as u64;
+    }
+
+    loads_out.flush().context("failed to flush replay cache")?;
+
+    let header = MappedHeader {
+        magic: MAPPED_MAGIC,
+        version: MAPPED_VERSION,
+        frame_count: frame_count as u64,
+        thread_load_count,
+        source_len,
+        source_mtime_ns,
+        pad: [0; 24],
+    };
+    frames_out
+        .seek(SeekFrom::Start(0))
+        .and_then(|_| frames_out.write_all(as_bytes(&header)))
+        .and_then(|()| frames_out.flush())
+        .context("failed to write replay cache header")?;
+
+    Ok(())
+}
+
+/// Views a plain-data record as its raw bytes.
+fn as_bytes<T: Copy>(value: &T) -> &[u8] {
+    // SAFETY: Only called with the repr(C) record types above, which have
+    // explicit padding fields and no references.
+    unsafe {
+        std::slice::from_raw_parts(
+            std::ptr::from_ref(value).cast::<u8>(),
+            std::mem::size_of::<T>(),
+        )
+    }
+}
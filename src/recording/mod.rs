@@ -1,22 +1,56 @@
 // SPDX-License-Identifier: MIT
+pub mod async_writer;
+pub mod columnar;
+pub mod compression;
+pub mod diff;
+pub mod export;
+pub mod flight;
+pub mod follow;
 pub mod format;
+pub mod histogram_index;
+pub mod keyframe;
+pub mod mapped;
 pub mod reader;
+pub mod thread_index;
 pub mod writer;
 
 #[cfg(test)]
 mod tests {
-    use std::time::SystemTime;
+    use std::io::Write;
+    use std::sync::Arc;
+    use std::sync::atomic::{AtomicU32, Ordering};
+    use std::time::{Duration, SystemTime};
 
+    use crate::datasource::DataSource;
     use crate::datasource::SessionMetadata;
     use crate::fex::smaps::MemSnapshot;
     use crate::fex::types::AppType;
-    use crate::recording::format::Frame;
-    use crate::recording::reader::RecordingReader;
-    use crate::recording::writer::RecordingWriter;
+    use crate::recording::async_writer::{
+        AsyncRecordingWriter, FrameSink, OverflowPolicy, QueueStats,
+    };
+    use crate::recording::compression::{ARCHIVE_LEVEL, CompressionOptions, recompress};
+    use crate::recording::diff::{DiffOptions, DiffSummary, load_pair, metric_index};
+    use crate::recording::export::{
+        CsvOutput, contention_by_process, export_csv, write_contention_rows,
+    };
+    use crate::recording::follow::FollowSource;
+    use crate::recording::format::{
+        BlockEntry, BlockIndex, FRAMES_PER_BLOCK, FileHeader, Frame, INDEX_MAGIC,
+        KEYFRAME_INTERVAL, KEYFRAME_MAGIC, KeyframeEntry, MAGIC, SKIPPABLE_FRAME_MAGIC,
+        SKIPPABLE_HEADER_LEN, THREAD_SEGMENT_BLOCKS, TRAILER_LEN, ThreadIndexEntry,
+        V2ComputedFrame, V2Frame,
+    };
+    use crate::recording::keyframe::PlaybackStats;
+    use crate::recording::mapped::MappedRecording;
+    use crate::recording::reader::{RecordingReader, ReplaySource};
+    use crate::recording::thread_index::Counter;
+    use crate::recording::writer::{BlockEncoding, RecordingOptions, RecordingWriter};
     use crate::sampler::accumulator::{
-        ComputedFrame, CumulativeCountStats, HistogramEntry, ThreadLoad,
+        Accumulator, ComputedFrame, CumulativeCountStats, HistogramEntry, ThreadLoad,
     };
-    use crate::sampler::thread_stats::ThreadDelta;
+    use crate::sampler::histogram::HistogramPyramid;
+    use crate::sampler::rolling::ProcessStats;
+    use crate::sampler::thread_stats::{SampleResult, ThreadDelta};
 
     fn make_metadata() -> SessionMetadata {
         SessionMetadata {
@@ -34,6 +68,7 @@ mod tests {
 
     fn make_frame(index: u64) -> Frame {
         Frame {
+            pid: 1234,
             computed: ComputedFrame {
                 timestamp_ns: index * 1_000_000_000,
                 sample_period_ns: 500_000_000,
@@ -61,7 +96,24 @@ mod tests {
                         total_cycles: 45_000,
                     },
                 ],
+                lock_loads: vec![ThreadLoad {
+                    tid: 2,
+                    load_percent: 0.5,
+                    total_cycles: 50 + index,
+                }],
+                write_lock_spikes: 1,
                 mem: MemSnapshot::default(),
+                mem_age_ns: 250_000_000 + index,
+                sample_lateness_ns: 40_000 + index,
+                sample_overhead_ns: 15_000,
+                shm_read_ns: 9_000,
+                smaps_ns: if index.is_multiple_of(4) {
+                    2_000_000
+                } else {
+                    0
+                },
+                record_ns: 3_000 + index,
+                torn_reads: 3,
                 histogram_entry: HistogramEntry {
                     load_percent: 12.5,
                     high_jit_load: false,
@@ -95,7 +147,35 @@ mod tests {
         }
     }
 
+    fn to_v2(frame: Frame) -> V2Frame {
+        let c = frame.computed;
+        V2Frame {
+            computed: V2ComputedFrame {
+                timestamp_ns: c.timestamp_ns,
+                sample_period_ns: c.sample_period_ns,
+                threads_sampled: c.threads_sampled,
+                total_jit_time: c.total_jit_time,
+                total_signal_time: c.total_signal_time,
+                total_sigbus_count: c.total_sigbus_count,
+                total_smc_count: c.total_smc_count,
+                total_float_fallback_count: c.total_float_fallback_count,
+                total_cache_miss_count: c.total_cache_miss_count,
+                total_cache_read_lock_time: c.total_cache_read_lock_time,
+                total_cache_write_lock_time: c.total_cache_write_lock_time,
+                total_jit_count: c.total_jit_count,
+                total_jit_invocations: c.total_jit_invocations,
+                fex_load_percent: c.fex_load_percent,
+                thread_loads: c.thread_loads,
+                mem: c.mem,
+                histogram_entry: c.histogram_entry,
+                cumulative: c.cumulative,
+            },
+            per_thread_deltas: frame.per_thread_deltas,
+        }
+    }
+
     #[test]
+    #[allow(clippy::too_many_lines)]
     fn round_trip_write_then_read() {
         let dir = std::env::temp_dir().join("felix_recording_test");
         std::fs::create_dir_all(&dir).unwrap();
@@ -105,14 +185,15 @@ mod tests {
         let frames: Vec<Frame> = (0..5).map(make_frame).collect();
 
         {
-            let mut writer = RecordingWriter::create(&path, &metadata).unwrap();
+            let mut writer =
+                RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
             for frame in &frames {
                 writer.write_frame(frame).unwrap();
             }
             writer.finish().unwrap();
         }
 
-        let reader = RecordingReader::open(&path).unwrap();
+        let mut reader = RecordingReader::open(&path).unwrap();
 
         assert_eq!(reader.metadata().pid, metadata.pid);
         assert_eq!(reader.metadata().fex_version, metadata.fex_version);
@@ -164,6 +245,17 @@ mod tests {
                 (actual.computed.fex_load_percent - expected.computed.fex_load_percent).abs()
                     < f64::EPSILON
             );
+            assert_eq!(actual.computed.mem_age_ns, expected.computed.mem_age_ns);
+            assert_eq!(
+                actual.computed.sample_lateness_ns,
+                expected.computed.sample_lateness_ns
+            );
+            assert_eq!(
+                actual.computed.sample_overhead_ns,
+                expected.computed.sample_overhead_ns
+            );
+            assert_eq!(actual.computed.smaps_ns, expected.computed.smaps_ns);
+            assert_eq!(actual.computed.record_ns, expected.computed.record_ns);
 
             assert_eq!(
                 actual.computed.cumulative.sigbus,
@@ -232,15 +324,1419 @@ mod tests {
         let metadata = make_metadata();
 
         {
-            let writer = RecordingWriter::create(&path, &metadata).unwrap();
+            let writer =
+                RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
             writer.finish().unwrap();
         }
 
-        let reader = RecordingReader::open(&path).unwrap();
+        let mut reader = RecordingReader::open(&path).unwrap();
         assert_eq!(reader.frame_count(), 0);
         assert!(reader.frame_at(0).is_none());
 
         std::fs::remove_file(&path).ok();
         std::fs::remove_dir(&dir).ok();
     }
+
+    /// Frames as the live loop produces them, so that columnar decoding can
+    /// recompute them exactly.
+    fn make_computed_frames(metadata: &SessionMetadata, count: u64) -> Vec<Frame> {
+        #[allow(clippy::cast_precision_loss)]
+        let acc = Accumulator::new(
+            metadata.cycle_counter_frequency as f64,
+            metadata.hardware_concurrency,
+        );
+        let mut cumulative = CumulativeCountStats::default();
+        (0..count)
+            .map(|i| {
+                // Thread 3 comes and goes to exercise the TID column.
+                let tids: &[u32] = if i % 5 == 0 { &[1, 2, 3] } else { &[1, 2] };
+                let per_thread: Vec<ThreadDelta> = tids
+                    .iter()
+                    .map(|&tid| ThreadDelta {
+                        tid,
+                        jit_time: (i * 7919 + u64::from(tid) * 104_729) % 1_000_000,
+                        signal_time: i % 13,
+                        sigbus_count: i % 3,
+                        smc_count: u64::from(i % 17 == 0),
+                        cache_read_lock_time: i % 5 * 1_000,
+                        cache_write_lock_time: if i % 50 < 5 { 60_000_000 } else { i % 7 * 100 },
+                        jit_count: i % 11,
+                        ..ThreadDelta::default()
+                    })
+                    .collect();
+                cumulative.sigbus += per_thread.iter().map(|d| d.sigbus_count).sum::<u64>();
+                cumulative.jit += per_thread.iter().map(|d| d.jit_count).sum::<u64>();
+                let mem = MemSnapshot {
+                    total_anon: 1 << 20 | (i / 10) << 12,
+                    jit_code: (i / 10) << 12,
+                    ..MemSnapshot::default()
+                };
+                let sample = SampleResult {
+                    timestamp: std::time::Instant::now(),
+                    threads_sampled: per_thread.len(),
+                    rejected: 0,
+                    per_thread,
+                };
+                let mut computed =
+                    acc.compute_frame(&sample, &mem, 1_000_000_000, i * 3, cumulative.clone());
+                computed.timestamp_ns = i * 1_000_000_000 + i % 7;
+                computed.sample_lateness_ns = (i * 7919) % 50_000;
+                computed.sample_overhead_ns = 20_000 + i % 3;
+                computed.torn_reads = u32::from(i % 11 == 0);
+                computed.shm_read_ns = 5_000 + i % 5;
+                computed.smaps_ns = if i.is_multiple_of(10) {
+                    1_500_000 + i
+                } else {
+                    0
+                };
+                computed.record_ns = i % 4 * 1_000;
+                Frame {
+                    // Two interleaved processes, as in a multiplexed recording.
+                    pid: if i % 3 == 0 { 4321 } else { 1234 },
+                    computed,
+                    per_thread_deltas: sample.per_thread,
+                }
+            })
+            .collect()
+    }
+
+    #[test]
+    fn columnar_round_trip_matches_postcard() {
+        let dir = std::env::temp_dir().join("felix_recording_test_columnar");
+        std::fs::create_dir_all(&dir).unwrap();
+        let metadata = make_metadata();
+        let frames = make_computed_frames(&metadata, FRAMES_PER_BLOCK as u64 * 2 + 5);
+
+        let mut sizes = Vec::new();
+        for encoding in [BlockEncoding::Postcard, BlockEncoding::Columnar] {
+            let path = dir.join(format!("{encoding:?}.felixr"));
+            let mut writer = RecordingWriter::create(
+                &path,
+                &metadata,
+                &RecordingOptions {
+                    encoding,
+                    ..RecordingOptions::default()
+                },
+            )
+            .unwrap();
+            for frame in &frames {
+                writer.write_frame(frame).unwrap();
+            }
+            writer.finish().unwrap();
+            sizes.push(std::fs::metadata(&path).unwrap().len());
+
+            let mut reader = RecordingReader::open(&path).unwrap();
+            assert_eq!(reader.frame_count(), frames.len());
+            for (i, expected) in frames.iter().enumerate() {
+                let got = reader.frame_at(i).expect("frame should exist");
+                assert_eq!(
+                    postcard::to_stdvec(got).unwrap(),
+                    postcard::to_stdvec(expected).unwrap(),
+                    "{encoding:?} frame {i} differs"
+                );
+            }
+            std::fs::remove_file(&path).ok();
+        }
+        assert!(
+            sizes[1] < sizes[0],
+            "columnar ({}) should be smaller than postcard ({})",
+            sizes[1],
+            sizes[0]
+        );
+
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn async_writer_round_trip() {
+        let dir = std::env::temp_dir().join("felix_recording_test_async");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("async.felixr");
+
+        let metadata = make_metadata();
+        let total = FRAMES_PER_BLOCK + 3;
+        {
+            // A tiny ring forces the producer through the blocking path.
+            let writer =
+                RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+            let mut writer =
+                AsyncRecordingWriter::spawn(writer, 4, OverflowPolicy::Block, None, false).unwrap();
+            for i in 0..total {
+                writer.submit(make_frame(i as u64)).unwrap();
+            }
+            let stats = writer.stats();
+            assert_eq!(stats.capacity, 4);
+            assert_eq!(stats.dropped, 0);
+            writer.finish().unwrap();
+        }
+
+        let mut reader = RecordingReader::open(&path).unwrap();
+        assert_eq!(reader.frame_count(), total);
+        for i in 0..total {
+            let frame = reader.frame_at(i).expect("frame should exist");
+            assert_eq!(frame.computed.timestamp_ns, i as u64 * 1_000_000_000);
+        }
+
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    /// A `RecordingWriter` counting the blocks ended before they filled.
+    struct EndedBlocks {
+        writer: RecordingWriter,
+        ended: Arc<AtomicU32>,
+    }
+
+    impl FrameSink for EndedBlocks {
+        fn write_frame(&mut self, frame: &Frame) -> anyhow::Result<()> {
+            self.writer.write_frame(frame)
+        }
+
+        fn pending_frames(&self) -> u32 {
+            self.writer.pending_frames()
+        }
+
+        fn flush(&mut self, end_block: bool) -> anyhow::Result<()> {
+            if end_block && self.writer.pending_frames() > 0 {
+                self.ended.fetch_add(1, Ordering::Relaxed);
+            }
+            self.writer.flush(end_block)
+        }
+
+        fn finish(self) -> anyhow::Result<()> {
+            self.writer.finish()
+        }
+    }
+
+    /// Submits frames slower than blocks fill, for longer than the flush
+    /// interval, and returns the blocks ended early.
+    fn slow_recording_ended_blocks(name: &str, followable: bool) -> u32 {
+        let dir = std::env::temp_dir().join(name);
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("slow.felixr");
+
+        let ended = Arc::new(AtomicU32::new(0));
+        let sink = EndedBlocks {
+            writer: RecordingWriter::create(&path, &make_metadata(), &RecordingOptions::default())
+                .unwrap(),
+            ended: Arc::clone(&ended),
+        };
+        let mut writer =
+            AsyncRecordingWriter::spawn(sink, 4, OverflowPolicy::Block, None, followable).unwrap();
+        let frames = 15;
+        for i in 0..frames {
+            writer.submit(make_frame(i)).unwrap();
+            std::thread::sleep(Duration::from_millis(100));
+        }
+        writer.finish().unwrap();
+
+        let mut reader = RecordingReader::open(&path).unwrap();
+        assert_eq!(reader.frame_count() as u64, frames);
+        assert_eq!(
+            reader.frame_at(14).unwrap().computed.timestamp_ns,
+            14 * 1_000_000_000
+        );
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+        ended.load(Ordering::Relaxed)
+    }
+
+    #[test]
+    fn slow_recording_keeps_whole_blocks() {
+        assert_eq!(
+            slow_recording_ended_blocks("felix_recording_test_slow", false),
+            0
+        );
+    }
+
+    #[test]
+    fn followable_recording_ends_blocks_early() {
+        assert!(slow_recording_ended_blocks("felix_recording_test_followable", true) >= 1);
+    }
+
+    #[test]
+    fn async_writer_drop_policy_counts_overflow() {
+        let dir = std::env::temp_dir().join("felix_recording_test_async_drop");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("async_drop.felixr");
+
+        let metadata = make_metadata();
+        let total: u64 = 2000;
+        let stats: QueueStats;
+        {
+            let writer =
+                RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+            let mut writer =
+                AsyncRecordingWriter::spawn(writer, 2, OverflowPolicy::Drop, None, false).unwrap();
+            for i in 0..total {
+                writer.submit(make_frame(i)).unwrap();
+            }
+            stats = writer.stats();
+            writer.finish().unwrap();
+        }
+
+        // Whatever was not dropped must have reached the file, in order.
+        let mut reader = RecordingReader::open(&path).unwrap();
+        assert_eq!(reader.frame_count() as u64 + stats.dropped, total);
+        let mut last = None;
+        for i in 0..reader.frame_count() {
+            let ts = reader.frame_at(i).unwrap().computed.timestamp_ns;
+            assert!(last.is_none_or(|l| l < ts));
+            last = Some(ts);
+        }
+
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn multi_block_random_access() {
+        let dir = std::env::temp_dir().join("felix_recording_test_blocks");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("blocks.felixr");
+
+        let metadata = make_metadata();
+        let total = FRAMES_PER_BLOCK * 3 + 7;
+
+        {
+            let mut writer =
+                RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+            for i in 0..total {
+                writer.write_frame(&make_frame(i as u64)).unwrap();
+            }
+            writer.finish().unwrap();
+        }
+
+        let mut reader = RecordingReader::open(&path).unwrap();
+        assert_eq!(reader.frame_count(), total);
+
+        // Jump around across block boundaries, including backwards.
+        for &i in &[
+            total - 1,
+            0,
+            FRAMES_PER_BLOCK,
+            FRAMES_PER_BLOCK - 1,
+            2 * FRAMES_PER_BLOCK + 3,
+        ] {
+            let frame = reader.frame_at(i).expect("frame should exist");
+            assert_eq!(frame.computed.timestamp_ns, i as u64 * 1_000_000_000);
+            assert_eq!(frame.computed.total_jit_time, 100 + i as u64);
+        }
+        assert!(reader.frame_at(total).is_none());
+
+        // The footer summarizes the whole recording.
+        let stats = reader.process_stats();
+        assert_eq!(stats.len(), 1);
+        assert_eq!(stats[0].pid, 1234);
+        assert_eq!(stats[0].frames, total as u64);
+        assert!((stats[0].fex_load.quantile(0.99) - 12.5).abs() < 0.2);
+        // make_frame(i) has i SIGBUS events.
+        assert_eq!(stats[0].sigbus, (total * (total - 1) / 2) as u64);
+
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn parallel_block_map_preserves_order() {
+        let dir = std::env::temp_dir().join("felix_recording_test_map_blocks");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("map.felixr");
+
+        let metadata = make_metadata();
+        let total = FRAMES_PER_BLOCK * 5 + 11;
+        {
+            let mut writer =
+                RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+            for i in 0..total {
+                writer.write_frame(&make_frame(i as u64)).unwrap();
+            }
+            writer.finish().unwrap();
+        }
+
+        let reader = RecordingReader::open(&path).unwrap();
+        for jobs in [1, 3, 16] {
+            let mut seen = Vec::new();
+            reader
+                .map_blocks(
+                    jobs,
+                    |first, frames| {
+                        Ok((
+                            first,
+                            frames
+                                .iter()
+                                .map(|f| f.computed.total_jit_time)
+                                .collect::<Vec<_>>(),
+                        ))
+                    },
+                    |(first, jit)| {
+                        assert_eq!(first, seen.len());
+                        seen.extend(jit);
+                        Ok(())
+                    },
+                )
+                .unwrap();
+            let expected: Vec<u64> = (0..total as u64).map(|i| 100 + i).collect();
+            assert_eq!(seen, expected, "jobs={jobs}");
+        }
+
+        // A failing sink stops the workers instead of hanging them.
+        let mut calls = 0;
+        let err = reader
+            .map_blocks(
+                4,
+                |first, _| Ok(first),
+                |_| {
+                    calls += 1;
+                    anyhow::ensure!(calls < 2, "sink full");
+                    Ok(())
+                },
+            )
+            .unwrap_err();
+        assert!(err.to_string().contains("sink full"));
+
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn export_writes_frame_and_thread_tables() {
+        let dir = std::env::temp_dir().join("felix_recording_test_export");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("export.felixr");
+        let frames_path = dir.join("frames.csv");
+        let threads_path = dir.join("threads.csv.zst");
+
+        let metadata = make_metadata();
+        let total = FRAMES_PER_BLOCK * 2 + 3;
+        {
+            let mut writer =
+                RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+            for i in 0..total {
+                writer.write_frame(&make_frame(i as u64)).unwrap();
+            }
+            writer.finish().unwrap();
+        }
+
+        let reader = RecordingReader::open(&path).unwrap();
+        let mut frames_out = CsvOutput::create(&frames_path).unwrap();
+        let mut threads_out = CsvOutput::create(&threads_path).unwrap();
+        let exported = export_csv(&reader, &mut frames_out, Some(&mut threads_out), 4).unwrap();
+        frames_out.finish().unwrap();
+        threads_out.finish().unwrap();
+        assert_eq!(exported, total);
+
+        let frames = std::fs::read_to_string(&frames_path).unwrap();
+        let lines: Vec<&str> = frames.lines().collect();
+        assert_eq!(lines.len(), total + 1);
+        assert!(lines[0].starts_with("frame,timestamp_ns,"));
+        assert!(lines[total].starts_with(&format!(
+            "{},{},",
+            total - 1,
+            (total - 1) as u64 * 1_000_000_000
+        )));
+
+        let threads = zstd::decode_all(std::fs::File::open(&threads_path).unwrap()).unwrap();
+        let threads = String::from_utf8(threads).unwrap();
+        let lines: Vec<&str> = threads.lines().collect();
+        assert_eq!(lines.len(), 2 * total + 1);
+        assert!(lines[0].starts_with("frame,timestamp_ns,pid,tid,jit_time,"));
+        // Frame 300, thread 1: jit_time 370, signal_time 330, sigbus 300.
+        assert_eq!(
+            lines[1 + 2 * 300],
+            "300,300000000000,1234,1,370,330,300,0,0,0,0,0,0"
+        );
+        assert_eq!(
+            lines[2 + 2 * 300],
+            "300,300000000000,1234,2,30,20,0,0,0,0,0,0,0"
+        );
+
+        for p in [&path, &frames_path, &threads_path] {
+            std::fs::remove_file(p).ok();
+        }
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn unfinished_recording_recovers_complete_blocks() {
+        let dir = std::env::temp_dir().join("felix_recording_test_unfinished");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("unfinished.felixr");
+
+        let metadata = make_metadata();
+
+        {
+            let mut writer =
+                RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+            for i in 0..(FRAMES_PER_BLOCK * 2 + 5) {
+                writer.write_frame(&make_frame(i as u64)).unwrap();
+            }
+            // Dropped without finish(): no index, partial block never written.
+        }
+
+        let mut reader = RecordingReader::open(&path).unwrap();
+        assert_eq!(reader.frame_count(), FRAMES_PER_BLOCK * 2);
+        assert!(reader.process_stats().is_empty());
+        let last = reader.frame_at(FRAMES_PER_BLOCK * 2 - 1).unwrap();
+        assert_eq!(
+            last.computed.total_jit_time,
+            100 + (FRAMES_PER_BLOCK * 2 - 1) as u64
+        );
+
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn recovery_reads_blocks_larger_than_its_window() {
+        let dir = std::env::temp_dir().join("felix_recording_test_large_blocks");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("unfinished.felixr");
+
+        // Threads with scrambled counters compress poorly, so each block is
+        // several times the first read of recovery.
+        let mut state = 0x9E37_79B9_7F4A_7C15_u64;
+        let mut next = || {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            state >> 24
+        };
+        let frames: Vec<Frame> = (0..FRAMES_PER_BLOCK * 2 + 5)
+            .map(|i| {
+                let mut frame = make_frame(i as u64);
+                frame.per_thread_deltas = (0..64)
+                    .map(|tid| ThreadDelta {
+                        tid,
+                        jit_time: next(),
+                        signal_time: next(),
+                        cache_miss_count: next(),
+                        ..ThreadDelta::default()
+                    })
+                    .collect();
+                frame
+            })
+            .collect();
+        {
+            let mut writer =
+                RecordingWriter::create(&path, &make_metadata(), &RecordingOptions::default())
+                    .unwrap();
+            for frame in &frames {
+                writer.write_frame(frame).unwrap();
+            }
+        }
+        assert!(std::fs::metadata(&path).unwrap().len() > 2 * (256 << 10));
+
+        let mut reader = RecordingReader::open(&path).unwrap();
+        assert_eq!(reader.frame_count(), FRAMES_PER_BLOCK * 2);
+        let last = reader.frame_at(FRAMES_PER_BLOCK * 2 - 1).unwrap();
+        assert_eq!(
+            last.per_thread_deltas[63].jit_time,
+            frames[FRAMES_PER_BLOCK * 2 - 1].per_thread_deltas[63].jit_time
+        );
+
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn reads_v2_stream_recording() {
+        let dir = std::env::temp_dir().join("felix_recording_test_v2");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("v2.felixr");
+
+        let header = FileHeader {
+            magic: MAGIC,
+            format_version: 2,
+            metadata: make_metadata(),
+        };
+
+        {
+            let file = std::fs::File::create(&path).unwrap();
+            let mut encoder = zstd::Encoder::new(file, 3).unwrap();
+            let mut write_record = |data: &[u8]| {
+                let len = u32::try_from(data.len()).unwrap();
+                encoder.write_all(&len.to_le_bytes()).unwrap();
+                encoder.write_all(data).unwrap();
+            };
+            write_record(&postcard::to_stdvec(&header).unwrap());
+            for i in 0..3 {
+                write_record(&postcard::to_stdvec(&to_v2(make_frame(i))).unwrap());
+            }
+            encoder.write_all(b"FEOF").unwrap();
+            encoder.finish().unwrap();
+        }
+
+        let mut reader = RecordingReader::open(&path).unwrap();
+        assert_eq!(reader.frame_count(), 3);
+        assert_eq!(reader.frame_at(2).unwrap().computed.total_jit_time, 102);
+        assert_eq!(reader.frame_at(2).unwrap().computed.mem_age_ns, 0);
+
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn mapped_cache_matches_recording() {
+        let dir = std::env::temp_dir().join("felix_recording_test_mapped");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("mapped.felixr");
+
+        let metadata = make_metadata();
+        let total = FRAMES_PER_BLOCK + 3;
+
+        {
+            let mut writer =
+                RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+            for i in 0..total {
+                writer.write_frame(&make_frame(i as u64)).unwrap();
+            }
+            writer.finish().unwrap();
+        }
+
+        let mut reader = RecordingReader::open(&path).unwrap();
+        let mapped = MappedRecording::open_or_build(&path, &mut reader).unwrap();
+        assert_eq!(mapped.frame_count(), total);
+        drop(mapped);
+
+        // Second open reuses the cache that was just built.
+        let mapped = MappedRecording::open_or_build(&path, &mut reader).unwrap();
+
+        let mut out = ComputedFrame::default();
+        mapped.frame(0).unwrap().copy_into(&mut out);
+        let buffer = out.thread_loads.as_ptr();
+
+        for i in [total - 1, 0, FRAMES_PER_BLOCK] {
+            mapped.frame(i).unwrap().copy_into(&mut out);
+            let expected = &reader.frame_at(i).unwrap().computed;
+            assert_eq!(out.timestamp_ns, expected.timestamp_ns);
+            assert_eq!(out.total_jit_time, expected.total_jit_time);
+            assert_eq!(out.cumulative.jit, expected.cumulative.jit);
+            assert_eq!(out.torn_reads, expected.torn_reads);
+            assert_eq!(out.smaps_ns, expected.smaps_ns);
+            assert_eq!(out.thread_loads.len(), expected.thread_loads.len());
+            assert_eq!(out.thread_loads[1].tid, expected.thread_loads[1].tid);
+            assert_eq!(
+                out.thread_loads[1].total_cycles,
+                expected.thread_loads[1].total_cycles
+            );
+            assert_eq!(out.lock_loads.len(), 1);
+            assert_eq!(
+                out.lock_loads[0].total_cycles,
+                expected.lock_loads[0].total_cycles
+            );
+            assert_eq!(out.write_lock_spikes, expected.write_lock_spikes);
+        }
+        assert_eq!(out.thread_loads.as_ptr(), buffer);
+        assert!(mapped.frame(total).is_none());
+
+        std::fs::remove_file(MappedRecording::cache_path(&path)).ok();
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn replay_pid_filter_skips_other_processes() {
+        let dir = std::env::temp_dir().join("felix_recording_test_pid_filter");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("multiplexed.felixr");
+
+        let metadata = make_metadata();
+        let frames = make_computed_frames(&metadata, FRAMES_PER_BLOCK as u64 + 7);
+        let mut writer =
+            RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+        for frame in &frames {
+            writer.write_frame(frame).unwrap();
+        }
+        writer.finish().unwrap();
+        let expected: Vec<u64> = frames
+            .iter()
+            .filter(|f| f.pid == 4321)
+            .map(|f| f.computed.timestamp_ns)
+            .collect();
+
+        for mmap in [false, true] {
+            let mut reader = RecordingReader::open(&path).unwrap();
+            let mut source = if mmap {
+                let mapped = MappedRecording::open_or_build(&path, &mut reader).unwrap();
+                ReplaySource::with_mapped(reader, mapped)
+            } else {
+                ReplaySource::new(reader)
+            };
+            source.set_pid_filter(Some(4321));
+            source.set_speed(f64::INFINITY);
+            let histogram = source.build_histogram().unwrap();
+            assert_eq!(histogram.len(), expected.len() as u64, "mmap {mmap}");
+
+            let mut out = ComputedFrame::default();
+            let mut got = Vec::new();
+            while !source.is_finished() {
+                if source.next_frame_into(&mut out) {
+                    got.push(out.timestamp_ns);
+                }
+            }
+            assert_eq!(got, expected, "mmap {mmap}");
+            assert_eq!(source.histogram_position(), expected.len() as u64);
+        }
+
+        std::fs::remove_file(MappedRecording::cache_path(&path)).ok();
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn replay_histogram_decodes_only_the_frames_in_view() {
+        let dir = std::env::temp_dir().join("felix_recording_test_stored_histogram");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("multiplexed.felixr");
+
+        let metadata = make_metadata();
+        let frames = make_computed_frames(&metadata, 3000);
+        let mut writer =
+            RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+        for frame in &frames {
+            writer.write_frame(frame).unwrap();
+        }
+        writer.finish().unwrap();
+
+        for (pid, mmap) in [(None, false), (Some(4321), false), (Some(4321), true)] {
+            let wanted = |f: &Frame| pid.is_none_or(|p| p == f.pid);
+            let mut full = HistogramPyramid::unbounded();
+            for frame in frames.iter().filter(|f| wanted(f)) {
+                full.push(&frame.computed.histogram_entry);
+            }
+
+            let mut reader = RecordingReader::open(&path).unwrap();
+            assert!(reader.histogram_index().unwrap().is_some());
+            let mut source = if mmap {
+                let mapped = MappedRecording::open_or_build(&path, &mut reader).unwrap();
+                ReplaySource::with_mapped(reader, mapped)
+            } else {
+                ReplaySource::new(reader)
+            };
+            source.set_pid_filter(pid);
+            let mut pyramid = source.build_histogram().unwrap();
+            assert_eq!(pyramid.len(), full.len());
+            assert_eq!(pyramid.levels(), full.levels());
+
+            let (mut want, mut got) = (Vec::new(), Vec::new());
+            for (level, index) in [(0, 1500), (2, 2999), (5, 3000), (3, 700), (4, 10)] {
+                source.seek_to(index);
+                let position = source.histogram_position();
+                source
+                    .load_histogram(&mut pyramid, level, position, 80)
+                    .unwrap();
+                let expected = frames[..index].iter().filter(|f| wanted(f)).count() as u64;
+                let position = source.histogram_position();
+                assert_eq!(position, expected, "{pid:?} at {index}");
+                // Loaded around the coarse bucket, the exact cursor needs
+                // nothing more.
+                assert!(pyramid.missing(level, position, 80).is_none());
+
+                full.view(level, position, 80, &mut want);
+                pyramid.view(level, position, 80, &mut got);
+                assert_eq!(got, want, "{pid:?} at {index}, level {level}");
+            }
+        }
+
+        std::fs::remove_file(MappedRecording::cache_path(&path)).ok();
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn indexes_written_before_the_histogram_still_open() {
+        // `BlockIndex` up to the per-thread index.
+        #[derive(serde::Serialize)]
+        struct Old<'a> {
+            frame_count: u64,
+            blocks: &'a [BlockEntry],
+            stats: &'a [ProcessStats],
+            keyframes: &'a [KeyframeEntry],
+            threads: Option<ThreadIndexEntry>,
+        }
+
+        let dir = std::env::temp_dir().join("felix_recording_test_old_index");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("old.felixr");
+
+        let metadata = make_metadata();
+        let frames = make_computed_frames(&metadata, 600);
+        let mut writer =
+            RecordingWriter::create(&path, &metadata, &RecordingOptions::default()).unwrap();
+        for frame in &frames {
+            writer.write_frame(frame).unwrap();
+        }
+        writer.finish().unwrap();
+
+        // Rewrite the footer without the trailing histogram entry.
+        let mut bytes = std::fs::read(&path).unwrap();
+        let trailer = bytes.len() - TRAILER_LEN;
+        let len = u32::from_le_bytes(bytes[trailer..trailer + 4].try_into().unwrap()) as usize;
+        let index: BlockIndex = postcard::from_bytes(&bytes[trailer - len..trailer]).unwrap();
+        assert!(index.histogram.is_some());
+        let old = postcard::to_stdvec(&Old {
+            frame_count: index.frame_count,
+            blocks: &index.blocks,
+            stats: &index.stats,
+            keyframes: &index.keyframes,
+            threads: index.threads,
+        })
+        .unwrap();
+        bytes.truncate(trailer - len - SKIPPABLE_HEADER_LEN);
+        bytes.extend_from_slice(&SKIPPABLE_FRAME_MAGIC.to_le_bytes());
+        let old_len = u32::try_from(old.len()).unwrap();
+        bytes.extend_from_slice(&(old_len + 8).to_le_bytes());
+        bytes.extend_from_slice(&old);
+        bytes.extend_from_slice(&old_len.to_le_bytes());
+        bytes.extend_from_slice(&INDEX_MAGIC);
+        std::fs::write(&path, &bytes).unwrap();
+
+        let reader = RecordingReader::open(&path).unwrap();
+        assert_eq!(reader.frame_count(), frames.len());
+        assert!(reader.has_thread_index());
+        assert!(reader.histogram_index().unwrap().is_none());
+        let mut source = ReplaySource::new(reader);
+        assert_eq!(source.build_histogram().unwrap().len(), frames.len() as u64);
+
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn follow_tails_a_growing_recording() {
+        let dir = std::env::temp_dir().join("felix_recording_test_follow");
+        std::fs::create_dir_all(&dir).unwrap();
+        let finished = dir.join("finished.felixr");
+        let growing = dir.join("growing.felixr");
+
+        let metadata = make_metadata();
+        let total = 2 * FRAMES_PER_BLOCK + 10;
+        {
+            let mut writer =
+                RecordingWriter::create(&finished, &metadata, &RecordingOptions::default())
+                    .unwrap();
+            for i in 0..total {
+                writer.write_frame(&make_frame(i as u64)).unwrap();
+            }
+            writer.finish().unwrap();
+        }
+        // Frame boundaries: header, three blocks, then the index.
+        let bytes = std::fs::read(&finished).unwrap();
+        let mut ends = vec![zstd::zstd_safe::find_frame_compressed_size(&bytes).unwrap()];
+        for _ in 0..3 {
+            let last = *ends.last().unwrap();
+            ends.push(last + zstd::zstd_safe::find_frame_compressed_size(&bytes[last..]).unwrap());
+        }
+
+        let drain = |source: &mut FollowSource| {
+            std::iter::from_fn(|| source.next_frame())
+                .map(|f| f.timestamp_ns / 1_000_000_000)
+                .collect::<Vec<_>>()
+        };
+
+        // Catching up on a finished file shows only its last block.
+        let mut source = FollowSource::open(&finished).unwrap();
+        source.poll().unwrap();
+        assert_eq!(drain(&mut source).len(), 10);
+        assert!(source.is_finished());
+
+        let mut file = std::fs::File::create(&growing).unwrap();
+        file.write_all(&bytes[..ends[1]]).unwrap();
+        let mut source = FollowSource::open(&growing).unwrap();
+        source.poll().unwrap();
+        assert_eq!(drain(&mut source).len(), FRAMES_PER_BLOCK);
+
+        // Garbage before the second block, and half of the third.
+        let half = usize::midpoint(ends[2], ends[3]);
+        file.write_all(b"torn block").unwrap();
+        file.write_all(&bytes[ends[1]..half]).unwrap();
+        source.poll().unwrap();
+        let frames = drain(&mut source);
+        assert_eq!(frames.len(), FRAMES_PER_BLOCK);
+        assert_eq!(frames[0], FRAMES_PER_BLOCK as u64);
+        assert_eq!(source.resyncs(), 1);
+        assert!(!source.is_finished());
+
+        file.write_all(&bytes[half..]).unwrap();
+        source.poll().unwrap();
+        let frames = drain(&mut source);
+        assert_eq!(frames.first(), Some(&(2 * FRAMES_PER_BLOCK as u64)));
+        assert_eq!(frames.len(), 10);
+        assert!(source.is_finished());
+
+        // Reads ending a few bytes into a keyframe header and into the
+        // index header wait for the rest of them.
+        let long = dir.join("long.felixr");
+        #[allow(clippy::cast_possible_truncation)]
+        let total = KEYFRAME_INTERVAL as usize + FRAMES_PER_BLOCK + 10;
+        {
+            let mut writer =
+                RecordingWriter::create(&long, &metadata, &RecordingOptions::default()).unwrap();
+            for i in 0..total {
+                writer.write_frame(&make_frame(i as u64)).unwrap();
+            }
+            writer.finish().unwrap();
+        }
+        let bytes = std::fs::read(&long).unwrap();
+        let mut starts = Vec::new();
+        let mut offset = 0;
+        while offset < bytes.len() {
+            let magic = u32::from_le_bytes(bytes[offset..offset + 4].try_into().unwrap());
+            starts.push((offset, magic));
+            offset += zstd::zstd_safe::find_frame_compressed_size(&bytes[offset..]).unwrap();
+        }
+        let start_of = |want: u32| starts.iter().rev().find(|&&(_, m)| m == want).unwrap().0;
+        let keyframe = start_of(KEYFRAME_MAGIC) + 5;
+        let index = start_of(SKIPPABLE_FRAME_MAGIC) + 5;
+
+        let mut file = std::fs::File::create(&growing).unwrap();
+        file.write_all(&bytes[..keyframe]).unwrap();
+        let mut source = FollowSource::open(&growing).unwrap();
+        source.poll().unwrap();
+        let mut frames = drain(&mut source);
+        assert_eq!(
+            frames.first(),
+            Some(&(KEYFRAME_INTERVAL - FRAMES_PER_BLOCK as u64))
+        );
+
+        file.write_all(&bytes[keyframe..index]).unwrap();
+        source.poll().unwrap();
+        frames.extend(drain(&mut source));
+        assert!(!source.is_finished());
+
+        file.write_all(&bytes[index..]).unwrap();
+        source.poll().unwrap();
+        frames.extend(drain(&mut source));
+        assert!(source.is_finished());
+        assert_eq!(source.resyncs(), 0);
+        let first = KEYFRAME_INTERVAL - FRAMES_PER_BLOCK as u64;
+        assert_eq!(frames, (first..total as u64).collect::<Vec<_>>());
+
+        std::fs::remove_file(&finished).ok();
+        std::fs::remove_file(&growing).ok();
+        std::fs::remove_file(&long).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn thread_index_answers_top_k_and_timelines() {
+        let dir = std::env::temp_dir().join("felix_recording_test_threads");
+        std::fs::create_dir_all(&dir).unwrap();
+        let finished = dir.join("finished.felixr");
+        let unfinished = dir.join("unfinished.felixr");
+
+        // Process 99 has a thread that only runs in the second block.
+        let frames: Vec<Frame> = (0..600u64)
+            .map(|i| {
+                let mut frame = make_frame(i);
+                if i % 2 == 1 {
+                    frame.pid = 99;
+                    frame.per_thread_deltas.truncate(1);
+                    if i < FRAMES_PER_BLOCK as u64 || i >= 2 * FRAMES_PER_BLOCK as u64 {
+                        frame.per_thread_deltas.clear();
+                    }
+                    for d in &mut frame.per_thread_deltas {
+                        d.tid = 7;
+                        d.cache_write_lock_time = 1000;
+                    }
+                }
+                frame
+            })
+            .collect();
+        for (path, finish) in [(&finished, true), (&unfinished, false)] {
+            let mut writer =
+                RecordingWriter::create(path, &make_metadata(), &RecordingOptions::default())
+                    .unwrap();
+            for frame in &frames {
+                writer.write_frame(frame).unwrap();
+            }
+            if finish {
+                writer.finish().unwrap();
+            } else {
+                writer.flush(true).unwrap();
+            }
+        }
+
+        let reader = RecordingReader::open(&finished).unwrap();
+        assert!(reader.has_thread_index());
+        let index = reader.thread_index(2).unwrap();
+        assert_eq!(index.blocks.len(), 3);
+        assert_eq!(index.blocks[1].first_frame, FRAMES_PER_BLOCK as u64);
+        assert_eq!(index.blocks[1].first_timestamp_ns, 256_000_000_000);
+
+        // Decoding the frames builds the same index.
+        let recovered = RecordingReader::open(&unfinished).unwrap();
+        assert!(!recovered.has_thread_index());
+        assert_eq!(recovered.thread_index(2).unwrap(), index);
+
+        let jit_of = |pid: i32, tid: u32| -> u64 {
+            frames
+                .iter()
+                .filter(|f| f.pid == pid)
+                .flat_map(|f| &f.per_thread_deltas)
+                .filter(|d| d.tid == tid)
+                .map(|d| d.jit_time)
+                .sum()
+        };
+        let top: Vec<_> = index
+            .top(Counter::JitTime, 2, None)
+            .iter()
+            .map(|t| (t.pid, t.tid, t.total(Counter::JitTime)))
+            .collect();
+        assert_eq!(top, [(1234, 1, jit_of(1234, 1)), (99, 7, jit_of(99, 7))]);
+        let top = index.top(Counter::CacheWriteLock, 1, None);
+        assert_eq!((top[0].pid, top[0].tid), (99, 7));
+        assert_eq!(top[0].frames, FRAMES_PER_BLOCK as u64 / 2);
+        assert_eq!(index.top(Counter::JitTime, 5, Some(99)).len(), 1);
+
+        let helper = index.thread(99, 7).unwrap();
+        let timeline: Vec<_> = helper.timeline(Counter::CacheWriteLock).collect();
+        assert_eq!(timeline, [(1, 128_000)]);
+        let main: Vec<_> = index
+            .thread(1234, 2)
+            .unwrap()
+            .timeline(Counter::JitTime)
+            .collect();
+        assert_eq!(main, [(0, 128 * 30), (1, 128 * 30), (2, 44 * 30)]);
+        assert_eq!(index.block_of(300), 1);
+        assert_eq!(index.block_of(599), 2);
+
+        std::fs::remove_dir_all(&dir).ok();
+    }
+
+    #[test]
+    fn long_recordings_write_the_thread_index_in_pieces() {
+        let dir = std::env::temp_dir().join("felix_recording_test_thread_segments");
+        std::fs::create_dir_all(&dir).unwrap();
+        let finished = dir.join("finished.felixr");
+        let unfinished = dir.join("unfinished.felixr");
+
+        // Two whole pieces and part of a third; thread 7 first runs in the
+        // second piece, so its block numbers must be offset when merged.
+        let blocks = 2 * THREAD_SEGMENT_BLOCKS + 1;
+        let frames: Vec<Frame> = (0..(blocks * FRAMES_PER_BLOCK + 10) as u64)
+            .map(|i| {
+                let mut frame = make_frame(i);
+                if i >= (THREAD_SEGMENT_BLOCKS * FRAMES_PER_BLOCK) as u64 && i % 3 == 0 {
+                    frame.per_thread_deltas[0].tid = 7;
+                }
+                frame
+            })
+            .collect();
+        for (path, finish) in [(&finished, true), (&unfinished, false)] {
+            let mut writer =
+                RecordingWriter::create(path, &make_metadata(), &RecordingOptions::default())
+                    .unwrap();
+            for frame in &frames {
+                writer.write_frame(frame).unwrap();
+            }
+            if finish {
+                writer.finish().unwrap();
+            } else {
+                writer.flush(true).unwrap();
+            }
+        }
+
+        let reader = RecordingReader::open(&finished).unwrap();
+        assert!(reader.has_thread_index());
+        let index = reader.thread_index(2).unwrap();
+        assert_eq!(index.blocks.len(), blocks + 1);
+        assert_eq!(
+            index.thread(1234, 7).unwrap().blocks[0] as usize,
+            THREAD_SEGMENT_BLOCKS
+        );
+
+        // Recovery walks over the pieces to every block.
+        let recovered = RecordingReader::open(&unfinished).unwrap();
+        assert!(!recovered.has_thread_index());
+        assert_eq!(recovered.frame_count(), frames.len());
+        assert_eq!(recovered.thread_index(2).unwrap(), index);
+
+        std::fs::remove_file(&finished).ok();
+        std::fs::remove_file(&unfinished).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn contention_is_summarized_per_process() {
+        let dir = std::env::temp_dir().join("felix_recording_test_contention");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("contention.felixr");
+        let metadata = make_metadata();
+        let acc = Accumulator::new(1e9, metadata.hardware_concurrency);
+
+        // Process 1234 has four threads that convoy on the write lock in
+        // frames 100..120 and 200..206; process 99 never takes the locks.
+        let frames: Vec<Frame> = (0..300u64)
+            .map(|i| {
+                let pid = if i % 2 == 0 { 1234 } else { 99 };
+                let convoy = (100..120).contains(&i) || (200..206).contains(&i);
+                let per_thread: Vec<ThreadDelta> = (1..=4u32)
+                    .map(|tid| ThreadDelta {
+                        tid,
+                        jit_time: 100_000_000,
+                        cache_write_lock_time: match (pid, convoy, tid) {
+                            (99, _, _) => 0,
+                            (_, true, _) => 60_000_000,
+                            (_, false, 1) => 1_000_000,
+                            _ => 0,
+                        },
+                        ..ThreadDelta::default()
+                    })
+                    .collect();
+                let sample = SampleResult {
+                    timestamp: std::time::Instant::now(),
+                    threads_sampled: per_thread.len(),
+                    rejected: 0,
+                    per_thread,
+                };
+                let mut computed = acc.compute_frame(
+                    &sample,
+                    &MemSnapshot::default(),
+                    1_000_000_000,
+                    i,
+                    CumulativeCountStats::default(),
+                );
+                computed.timestamp_ns = i * 1_000_000_000;
+                Frame {
+                    pid,
+                    computed,
+                    per_thread_deltas: sample.per_thread,
+                }
+            })
+            .collect();
+        let mut writer = RecordingWriter::create(
+            &path,
+            &metadata,
+            &RecordingOptions {
+                encoding: BlockEncoding::Columnar,
+                ..RecordingOptions::default()
+            },
+        )
+        .unwrap();
+        for frame in &frames {
+            writer.write_frame(frame).unwrap();
+        }
+        writer.finish().unwrap();
+
+        let reader = RecordingReader::open(&path).unwrap();
+        let processes = contention_by_process(&reader, 2).unwrap();
+        assert_eq!(processes.len(), 2);
+        let (pid, idle) = &processes[0];
+        assert_eq!((*pid, idle.frames, idle.convoy_count()), (99, 150, 0));
+        assert!(idle.contention_percent().unwrap().abs() < f64::EPSILON);
+
+        let (pid, busy) = &processes[1];
+        assert_eq!(*pid, 1234);
+        assert_eq!(busy.convoy_count(), 2);
+        assert_eq!(busy.convoy_frames(), 13);
+        let longest = busy.longest_convoy().unwrap();
+        assert_eq!((longest.frames, longest.peak_threads), (10, 4));
+        assert_eq!(longest.end_ns - longest.start_ns, 18_000_000_000);
+        // 13 frames of 240M lock cycles and 137 of 1M, over 400M JIT
+        // cycles a frame.
+        let expected = (13.0 * 240e6 + 137.0 * 1e6) / (150.0 * 400e6) * 100.0;
+        assert!((busy.contention_percent().unwrap() - expected).abs() < 1e-9);
+        let top = busy.top_threads(4);
+        assert_eq!(top[0].0.tid, 1);
+        assert_eq!(busy.thread_count(), 4);
+
+        let mut csv = Vec::new();
+        write_contention_rows(&mut csv, "run.felixr", &metadata, &processes).unwrap();
+        let csv = String::from_utf8(csv).unwrap();
+        let rows: Vec<&str> = csv.lines().collect();
+        assert_eq!(rows.len(), 2);
+        assert!(rows[0].starts_with("run.felixr,99,8,150,0,"));
+        assert!(rows[1].starts_with("run.felixr,1234,8,150,4,"));
+        assert!(rows[1].contains(",2,13,10,18000000000,"));
+
+        std::fs::remove_dir_all(&dir).ok();
+    }
+
+    #[test]
+    fn diff_aligns_recordings_after_skips() {
+        let dir = std::env::temp_dir().join("felix_recording_test_diff");
+        std::fs::create_dir_all(&dir).unwrap();
+        let paths = [dir.join("a.felixr"), dir.join("b.felixr")];
+
+        let frame = |i: u64, pid: i32, cache_misses: u64, jit_code: u64| {
+            let mut frame = make_frame(i);
+            frame.pid = pid;
+            frame.computed.total_jit_time = if pid == 1234 { 100 } else { 0 };
+            frame.computed.total_cache_miss_count = cache_misses;
+            frame.computed.mem.jit_code = jit_code;
+            frame
+        };
+        // B takes five more seconds to reach the scene, then misses twice
+        // as often, and runs a second process.
+        let a: Vec<Frame> = (0..60).map(|i| frame(i, 1234, 10, 1000)).collect();
+        let b: Vec<Frame> = (0..65)
+            .flat_map(|i| {
+                let main = frame(i, 1234, if i < 5 { 1000 } else { 20 }, 1000);
+                let helper = (i >= 5).then(|| frame(i, 99, 0, 500));
+                std::iter::once(main).chain(helper)
+            })
+            .collect();
+        for (path, frames) in paths.iter().zip([&a, &b]) {
+            let mut writer =
+                RecordingWriter::create(path, &make_metadata(), &RecordingOptions::default())
+                    .unwrap();
+            for f in frames {
+                writer.write_frame(f).unwrap();
+            }
+            writer.finish().unwrap();
+        }
+
+        let options = DiffOptions {
+            bucket: Duration::from_secs(1),
+            skip: [Duration::ZERO, Duration::from_secs(5)],
+            duration: None,
+            jobs: 4,
+        };
+        let series = load_pair([&paths[0], &paths[1]], &options).unwrap();
+        assert_eq!(series[0].frames, 60);
+        assert_eq!(series[1].frames, 120);
+        let summary = DiffSummary::new(&series, options.bucket);
+        assert_eq!(summary.aligned, 60);
+
+        let change = |name| {
+            summary.metrics[metric_index(name).unwrap()]
+                .change_percent()
+                .unwrap()
+        };
+        assert!((change("cache_misses") - 100.0).abs() < 1e-9);
+        assert!((change("mem_jit_code") - 50.0).abs() < 1e-9);
+        assert!(change("jit_time").abs() < 1e-9);
+
+        let limited = DiffOptions {
+            duration: Some(Duration::from_secs(10)),
+            ..options
+        };
+        let series = load_pair([&paths[0], &paths[1]], &limited).unwrap();
+        assert_eq!(series[0].buckets.len(), 10);
+        assert_eq!(series[1].frames, 20);
+
+        std::fs::remove_dir_all(&dir).ok();
+    }
+
+    #[test]
+    fn seeks_restore_playback_stats_from_keyframes() {
+        let dir = std::env::temp_dir().join("felix_recording_test_keyframes");
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("keyframes.felixr");
+        let recovered = dir.join("recovered.felixr");
+
+        // Two interleaved processes with varying load.
+        let frames: Vec<Frame> = (0..2600u64)
+            .map(|i| {
+                let mut frame = make_frame(i);
+                frame.pid = if i % 3 == 0 { 99 } else { 1234 };
+                #[allow(clippy::cast_precision_loss)]
+                {
+                    frame.computed.fex_load_percent = (i % 97) as f64;
+                }
+                frame.computed.sample_overhead_ns = 1_000 + i;
+                frame
+            })
+            .collect();
+        let mut writer =
+            RecordingWriter::create(&path, &make_metadata(), &RecordingOptions::default()).unwrap();
+        for frame in &frames {
+            writer.write_frame(frame).unwrap();
+        }
+        writer.finish().unwrap();
+
+        let reader = RecordingReader::open(&path).unwrap();
+        assert!(reader.keyframe_before(1000).is_none());
+        let keyframe = reader.keyframe_before(2500).unwrap();
+        assert_eq!(keyframe.frame, 2048);
+
+        // What playing from the start would have built.
+        let played = |end: usize, pid: Option<i32>| {
+            let mut stats = PlaybackStats::default();
+            for f in frames[..end]
+                .iter()
+                .filter(|f| pid.is_none_or(|p| p == f.pid))
+            {
+                stats.record(&f.computed);
+            }
+            postcard::to_stdvec(&stats).unwrap()
+        };
+        let mut source = ReplaySource::new(reader);
+        for pid in [None, Some(99)] {
+            source.set_pid_filter(pid);
+            for index in [2500, 2048, 1500, 10] {
+                let (stats, frame) = source.playback_at(index).unwrap();
+                assert_eq!(postcard::to_stdvec(&stats).unwrap(), played(index, pid));
+                let last = (0..index)
+                    .rev()
+                    .find(|&i| pid.is_none_or(|p| p == frames[i].pid))
+                    .unwrap();
+                assert_eq!(
+                    frame.unwrap().timestamp_ns,
+                    frames[last].computed.timestamp_ns
+                );
+            }
+        }
+
+        // Keyframes are found again when the index is missing, and
+        // followers step over them.
+        let bytes = std::fs::read(&path).unwrap();
+        std::fs::write(&recovered, &bytes[..bytes.len() - 16]).unwrap();
+        let reader = RecordingReader::open(&recovered).unwrap();
+        assert_eq!(reader.keyframe_before(2500), Some(keyframe));
+        let mut follow = FollowSource::open(&path).unwrap();
+        follow.poll().unwrap();
+        assert_eq!(follow.resyncs(), 0);
+        assert!(follow.is_finished() || follow.next_frame().is_some());
+
+        std::fs::remove_file(&path).ok();
+        std::fs::remove_file(&recovered).ok();
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    /// `cargo test --release -- --ignored bench_ --nocapture --test-threads=1`.
+    ///
+    /// Writes and then reads back in order recordings of 1k to 100k frames
+    /// in both encodings, reporting file MB/s and frames/s.
+    #[test]
+    #[ignore = "benchmark"]
+    fn bench_recording_throughput() {
+        let dir = std::env::temp_dir().join("felix_recording_bench");
+        std::fs::create_dir_all(&dir).unwrap();
+        let metadata = make_metadata();
+
+        #[allow(clippy::cast_precision_loss)]
+        let rates = |name: &str, frames: usize, bytes: u64, elapsed: std::time::Duration| {
+            let secs = elapsed.as_secs_f64();
+            eprintln!(
+                "{name} frames={frames}: {:.1} MB/s, {:.0} frames/s",
+                bytes as f64 / 1e6 / secs,
+                frames as f64 / secs,
+            );
+        };
+
+        for count in [1_000, 10_000, 100_000] {
+            let frames = make_computed_frames(&metadata, count);
+            for encoding in [BlockEncoding::Postcard, BlockEncoding::Columnar] {
+                let path = dir.join(format!("{encoding:?}.felixr"));
+                let start = std::time::Instant::now();
+                let mut writer = RecordingWriter::create(
+                    &path,
+                    &metadata,
+                    &RecordingOptions {
+                        encoding,
+                        ..RecordingOptions::default()
+                    },
+                )
+                .unwrap();
+                for frame in &frames {
+                    writer.write_frame(frame).unwrap();
+                }
+                writer.finish().unwrap();
+                let written = start.elapsed();
+                let bytes = std::fs::metadata(&path).unwrap().len();
+
+                let start = std::time::Instant::now();
+                let mut reader = RecordingReader::open(&path).unwrap();
+                for i in 0..reader.frame_count() {
+                    std::hint::black_box(reader.frame_at(i).expect("frame should exist"));
+                }
+                let read = start.elapsed();
+
+                let encoding = format!("{encoding:?}").to_lowercase();
+                rates(&format!("write_{encoding}"), frames.len(), bytes, written);
+                rates(&format!("read_{encoding}"), frames.len(), bytes, read);
+                std::fs::remove_file(&path).ok();
+            }
+        }
+
+        std::fs::remove_dir(&dir).ok();
+    }
+
+    #[test]
+    fn recompress_with_workers_and_a_dictionary() {
+        let dir = std::env::temp_dir().join("felix_recording_test_recompress");
+        std::fs::create_dir_all(&dir).unwrap();
+        let source = dir.join("source.felixr");
+        let archive = dir.join("archive.felixr");
+        let unfinished = dir.join("unfinished.felixr");
+
+        let metadata = make_metadata();
+        let frames = make_computed_frames(&metadata, KEYFRAME_INTERVAL * 2 + 5);
+        // Workers finish blocks out of order; the file must not.
+        let mut writer = RecordingWriter::create(
+            &source,
+            &metadata,
+            &RecordingOptions {
+                compression: CompressionOptions {
+                    workers: 3,
+                    ..CompressionOptions::default()
+                },
+                ..RecordingOptions::default()
+            },
+        )
+        .unwrap();
+        for frame in &frames {
+            writer.write_frame(frame).unwrap();
+        }
+        writer.finish().unwrap();
+
+        let reader = RecordingReader::open(&source).unwrap();
+        assert!(reader.dictionary().is_none());
+        let options = RecordingOptions {
+            encoding: BlockEncoding::Columnar,
+            compression: CompressionOptions {
+                level: ARCHIVE_LEVEL,
+                workers: 1,
+                dictionary: None,
+            },
+            ..RecordingOptions::default()
+        };
+        let summary = recompress(&reader, &source, &archive, options.clone(), true, 2).unwrap();
+        assert_eq!(summary.frames, frames.len() as u64);
+        assert!(summary.dictionary_bytes > 0);
+        assert!(
+            summary.output_bytes < summary.input_bytes,
+            "{summary:?} should shrink"
+        );
+        assert!(recompress(&reader, &source, &source, options, false, 1).is_err());
+
+        // Without the trailer, the index is recovered by walking the file.
+        let bytes = std::fs::read(&archive).unwrap();
+        std::fs::write(&unfinished, &bytes[..bytes.len() - 8]).unwrap();
+        for path in [&source, &archive, &unfinished] {
+            let mut reader = RecordingReader::open(path).unwrap();
+            assert_eq!(reader.dictionary().is_some(), path != &source);
+            assert_eq!(reader.frame_count(), frames.len());
+            assert_eq!(
+                reader.keyframe_before(frames.len()).map(|k| k.frame),
+                Some(KEYFRAME_INTERVAL * 2)
+            );
+            for (i, expected) in frames.iter().enumerate() {
+                let got = reader.frame_at(i).expect("frame should exist");
+                assert_eq!(
+                    postcard::to_stdvec(got).unwrap(),
+                    postcard::to_stdvec(expected).unwrap(),
+                    "{} frame {i} differs",
+                    path.display()
+                );
+            }
+        }
+
+        let mut follow = FollowSource::open(&archive).unwrap();
+        follow.poll().unwrap();
+        let last = std::iter::from_fn(|| follow.next_frame()).last().unwrap();
+        assert_eq!(
+            last.timestamp_ns,
+            frames.last().unwrap().computed.timestamp_ns
+        );
+        assert_eq!(follow.resyncs(), 0);
+
+        for path in [&source, &archive, &unfinished] {
+            std::fs::remove_file(path).ok();
+        }
+        std::fs::remove_dir(&dir).ok();
+    }
 }
@@ -1,25 +1,63 @@
 // SPDX-License-Identifier: MIT
 use std::fs::File;
 use std::io::{BufReader, Read};
+use std::ops::Range;
+use std::os::unix::fs::FileExt;
 use std::path::Path;
-use std::time::Instant;
+use std::sync::mpsc;
+use std::time::{Duration, Instant};
 
 use anyhow::{Context, Result, bail};
 
-use super::format::{EOF_MARKER, FORMAT_VERSION, MAGIC};
+use super::compression;
+use super::format::{
+    BLOCK_ENCODING_COLUMNAR, BLOCK_ENCODING_POSTCARD, BlockEntry, BlockIndex, EOF_MARKER,
+    FORMAT_VERSION, FRAMES_PER_BLOCK, HISTOGRAM_LEVEL, HISTOGRAM_MAGIC, INDEX_MAGIC,
+    KEYFRAME_INTERVAL, KEYFRAME_MAGIC, KeyframeEntry, MAGIC, MAX_BLOCK_LEN, PreHistogramBlockIndex,
+    SKIPPABLE_FRAME_MAGIC, SKIPPABLE_FRAME_MAGIC_MASK, SKIPPABLE_HEADER_LEN, STREAM_FORMAT_VERSION,
+    THREAD_INDEX_MAGIC, THREAD_SEGMENTS_MAGIC, TRAILER_LEN, ThreadIndexEntry,
+};
+use super::histogram_index::HistogramIndex;
+use super::keyframe::{self, KEYFRAME_HEADER_LEN, PlaybackStats};
+use super::thread_index::{BlockSpan, ThreadIndex, ThreadIndexBuilder, block_sums};
 use crate::datasource::{DataSource, SessionMetadata};
-use crate::recording::format::{FileHeader, Frame, LegacyFrame};
-use crate::sampler::accumulator::ComputedFrame;
+use crate::recording::columnar;
+use crate::recording::format::{FileHeader, Frame, LegacyFrame, V2Frame};
+use crate::recording::mapped::MappedRecording;
+use crate::sampler::accumulator::{Accumulator, ComputedFrame, HistogramEntry};
+use crate::sampler::histogram::HistogramPyramid;
+use crate::sampler::rolling::{ProcessStats, WINDOWS};
+
+const BLOCK_CACHE_CAPACITY: usize = 8;
+/// Decoded blocks each `map_blocks` worker may hold ahead of the consumer.
+const BLOCKS_AHEAD: usize = 2;
+/// Bytes read to find the end of the file header; headers are far smaller.
+const HEADER_READ_LEN: usize = 64 << 10;
+/// First read of each block while recovering an index; doubled until the
+/// block fits.
+const RECOVERY_WINDOW: usize = 64 << 10;
 
 pub struct RecordingReader {
     metadata: SessionMetadata,
-    frames: Vec<Frame>,
+    storage: Storage,
     #[allow(dead_code)]
     format_version: u8,
 }
 
+/// v1/v2 recordings are a single zstd stream and must be loaded eagerly; v3
+/// recordings are decoded one block at a time through the footer index.
+/// There is one per reader, so the size of `BlockStore` does not matter.
+#[allow(clippy::large_enum_variant)]
+enum Storage {
+    Loaded(Vec<Frame>),
+    Indexed(BlockStore),
+}
+
 impl RecordingReader {
-    /// Opens a recording file, validates the header, and reads all frames.
+    /// Opens a recording file and validates the header.
+    ///
+    /// Indexed (v3) recordings only read the footer index here; frames are
+    /// decoded on demand. Older stream recordings are read in full.
     ///
     /// # Errors
     ///
@@ -38,15 +76,24 @@ impl RecordingReader {
             bail!("invalid magic bytes in recording file");
         }
         let version = header.format_version;
-        if version != 1 && version != FORMAT_VERSION {
-            bail!("unsupported format version {version} (expected 1 or {FORMAT_VERSION})",);
+        if version == 0 || version > FORMAT_VERSION {
+            bail!("unsupported format version {version} (expected 1 to {FORMAT_VERSION})");
         }
 
-        let frames = Self::read_all_frames(&mut decoder, version)?;
+        let storage = if version <= STREAM_FORMAT_VERSION {
+            Storage::Loaded(Self::read_all_frames(
+                &mut decoder,
+                version,
+                header.metadata.pid,
+            )?)
+        } else {
+            let file = decoder.finish().into_inner().into_inner();
+            Storage::Indexed(BlockStore::open(file, &header.metadata)?)
+        };
 
         Ok(Self {
             metadata: header.metadata,
-            frames,
+            storage,
             format_version: version,
         })
     }
@@ -58,15 +105,184 @@ impl RecordingReader {
 
     #[must_use]
     pub fn frame_count(&self) -> usize {
-        self.frames.len()
+        match &self.storage {
+            Storage::Loaded(frames) => frames.len(),
+            Storage::Indexed(store) => store.frame_count,
+        }
+    }
+
+    /// Whole-recording statistics per process from the footer, sorted by
+    /// PID. Empty for v1/v2 recordings and unfinished ones.
+    #[must_use]
+    pub fn process_stats(&self) -> &[ProcessStats] {
+        match &self.storage {
+            Storage::Loaded(_) => &[],
+            Storage::Indexed(store) => &store.stats,
+        }
+    }
+
+    /// The dictionary the blocks are compressed against, for recording
+    /// more files with it.
+    #[must_use]
+    pub fn dictionary(&self) -> Option<&[u8]> {
+        match &self.storage {
+            Storage::Loaded(_) => None,
+            Storage::Indexed(store) => store.dictionary.as_deref(),
+        }
+    }
+
+    /// The last keyframe at or before frame `index`. `None` for v1/v2
+    /// recordings and before the first keyframe.
+    #[must_use]
+    pub fn keyframe_before(&self, index: usize) -> Option<KeyframeEntry> {
+        let Storage::Indexed(store) = &self.storage else {
+            return None;
+        };
+        let after = store.keyframes.partition_point(|k| k.frame <= index as u64);
+        after.checked_sub(1).map(|i| store.keyframes[i])
+    }
+
+    /// Reads the statistics `entry` holds for `pid`, or for every process.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the keyframe cannot be read or decoded.
+    pub fn read_keyframe(&self, entry: &KeyframeEntry, pid: Option<i32>) -> Result<PlaybackStats> {
+        match &self.storage {
+            Storage::Loaded(_) => bail!("stream recordings have no keyframes"),
+            Storage::Indexed(store) => keyframe::read_keyframe(&store.file, entry, pid),
+        }
+    }
+
+    /// The per-thread index, read from the file or, for recordings without
+    /// one (v1/v2, unfinished), built by decoding every block on up to
+    /// `jobs` threads.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the index cannot be read or the recording
+    /// cannot be decoded.
+    pub fn thread_index(&self, jobs: usize) -> Result<ThreadIndex> {
+        if let Storage::Indexed(BlockStore {
+            file,
+            threads: Some(entry),
+            ..
+        }) = &self.storage
+        {
+            return ThreadIndex::read(file, entry);
+        }
+        let mut builder = ThreadIndexBuilder::default();
+        self.map_blocks(
+            jobs,
+            |first, block| {
+                let span = BlockSpan {
+                    first_frame: first as u64,
+                    first_timestamp_ns: block.first().map_or(0, |f| f.computed.timestamp_ns),
+                };
+                Ok((span, block_sums(block)))
+            },
+            |(span, sums)| {
+                builder.push_block(span, &sums);
+                Ok(())
+            },
+        )?;
+        Ok(builder.finish())
+    }
+
+    /// The coarse histogram `finish` stores, if the recording has one.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the histogram cannot be read or decoded.
+    pub fn histogram_index(&self) -> Result<Option<HistogramIndex>> {
+        match &self.storage {
+            Storage::Indexed(BlockStore {
+                file,
+                histogram: Some(entry),
+                ..
+            }) => HistogramIndex::read(file, entry).map(Some),
+            _ => Ok(None),
+        }
     }
 
+    /// Whether the file carries a per-thread index, so `thread_index`
+    /// does not have to decode the recording.
     #[must_use]
-    pub fn frame_at(&self, index: usize) -> Option<&Frame> {
-        self.frames.get(index)
+    pub fn has_thread_index(&self) -> bool {
+        matches!(
+            &self.storage,
+            Storage::Indexed(BlockStore {
+                threads: Some(_),
+                ..
+            })
+        )
+    }
+
+    /// Returns the frame at `index`, decoding its block if necessary.
+    ///
+    /// Decode errors are treated as a missing frame; use `try_frame_at` to
+    /// observe them.
+    pub fn frame_at(&mut self, index: usize) -> Option<&Frame> {
+        self.try_frame_at(index).ok().flatten()
+    }
+
+    /// Returns the frame at `index`, decoding its block if necessary.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the containing block cannot be read or decoded.
+    pub fn try_frame_at(&mut self, index: usize) -> Result<Option<&Frame>> {
+        match &mut self.storage {
+            Storage::Loaded(frames) => Ok(frames.get(index)),
+            Storage::Indexed(store) => store.frame_at(index),
+        }
+    }
+
+    /// Calls `map` on each block of frames, with the index of its first
+    /// frame, on up to `jobs` threads, and passes the results to `sink` in
+    /// file order. Blocks decoded here bypass the LRU cache. v1/v2
+    /// recordings, already in memory, are split into `FRAMES_PER_BLOCK`
+    /// chunks.
+    ///
+    /// # Errors
+    ///
+    /// Returns the first error from reading or decoding a block, `map` or
+    /// `sink`.
+    pub fn map_blocks<T: Send>(
+        &self,
+        jobs: usize,
+        map: impl Fn(usize, &[Frame]) -> Result<T> + Sync,
+        sink: impl FnMut(T) -> Result<()>,
+    ) -> Result<()> {
+        match &self.storage {
+            Storage::Loaded(frames) => ordered_parallel(
+                jobs,
+                frames.len().div_ceil(FRAMES_PER_BLOCK),
+                || Ok(()),
+                |(), chunk| {
+                    let first = chunk * FRAMES_PER_BLOCK;
+                    let end = (first + FRAMES_PER_BLOCK).min(frames.len());
+                    map(first, &frames[first..end])
+                },
+                sink,
+            ),
+            Storage::Indexed(store) => ordered_parallel(
+                jobs,
+                store.blocks.len(),
+                || BlockDecoder::new(store.dictionary.as_deref()),
+                |decoder, block| {
+                    let frames =
+                        decoder.decode(&store.file, &store.blocks, block, &store.accumulator)?;
+                    #[allow(clippy::cast_possible_truncation)]
+                    let first = store.blocks[block].first_frame as usize;
+                    map(first, &frames)
+                },
+                sink,
+            ),
+        }
     }
 
-    fn read_header(reader: &mut impl Read) -> Result<FileHeader> {
+    pub(super) fn read_header(reader: &mut impl Read) -> Result<FileHeader> {
         let mut len_buf = [0u8; 4];
         reader
             .read_exact(&mut len_buf)
@@ -81,7 +297,7 @@ impl RecordingReader {
         postcard::from_bytes(&data).context("failed to deserialize file header")
     }
 
-    fn read_all_frames(reader: &mut impl Read, version: u8) -> Result<Vec<Frame>> {
+    fn read_all_frames(reader: &mut impl Read, version: u8, pid: i32) -> Result<Vec<Frame>> {
         let mut frames = Vec::new();
         let mut len_buf = [0u8; 4];
 
@@ -107,21 +323,435 @@ impl RecordingReader {
                     postcard::from_bytes(&data).context("failed to deserialize v1 frame")?;
                 Frame::from(legacy)
             } else {
-                postcard::from_bytes(&data).context("failed to deserialize frame")?
+                let v2: V2Frame =
+                    postcard::from_bytes(&data).context("failed to deserialize v2 frame")?;
+                Frame::from(v2)
             };
-            frames.push(frame);
+            frames.push(Frame { pid, ..frame });
         }
 
         Ok(frames)
     }
 }
 
+/// Random access to the blocks of a v3 recording with a small LRU of
+/// decoded blocks.
+struct BlockStore {
+    file: File,
+    blocks: Vec<BlockEntry>,
+    frame_count: usize,
+    stats: Vec<ProcessStats>,
+    keyframes: Vec<KeyframeEntry>,
+    threads: Option<ThreadIndexEntry>,
+    histogram: Option<ThreadIndexEntry>,
+    /// Every block is compressed against it, if present.
+    dictionary: Option<Box<[u8]>>,
+    decoder: BlockDecoder,
+    /// Decoded blocks, least recently used first.
+    cache: Vec<(usize, Vec<Frame>)>,
+    /// Recomputes derived fields of columnar blocks.
+    accumulator: Accumulator,
+}
+
+impl BlockStore {
+    fn open(file: File, metadata: &SessionMetadata) -> Result<Self> {
+        let accumulator = block_accumulator(metadata);
+        let dictionary = compression::read_dictionary(&file, header_len(&file)? as u64)?;
+        let index = match read_index(&file)? {
+            Some(index) => index,
+            None => recover_index(&file, &accumulator, dictionary.as_deref())?,
+        };
+
+        #[allow(clippy::cast_possible_truncation)]
+        let frame_count = index.frame_count as usize;
+
+        Ok(Self {
+            file,
+            blocks: index.blocks,
+            frame_count,
+            stats: index.stats,
+            keyframes: index.keyframes,
+            threads: index.threads,
+            histogram: index.histogram,
+            decoder: BlockDecoder::new(dictionary.as_deref())?,
+            dictionary: dictionary.map(Vec::into_boxed_slice),
+            cache: Vec::with_capacity(BLOCK_CACHE_CAPACITY),
+            accumulator,
+        })
+    }
+
+    fn frame_at(&mut self, index: usize) -> Result<Option<&Frame>> {
+        if index >= self.frame_count {
+            return Ok(None);
+        }
+
+        #[allow(clippy::cast_possible_truncation)]
+        let block = self
+            .blocks
+            .partition_point(|b| b.first_frame as usize <= index)
+            .saturating_sub(1);
+
+        if let Some(pos) = self.cache.iter().position(|(b, _)| *b == block) {
+            let entry = self.cache.remove(pos);
+            self.cache.push(entry);
+        } else {
+            let frames = self.load_block(block)?;
+            if self.cache.len() >= BLOCK_CACHE_CAPACITY {
+                self.cache.remove(0);
+            }
+            self.cache.push((block, frames));
+        }
+
+        #[allow(clippy::cast_possible_truncation)]
+        let first = self.blocks[block].first_frame as usize;
+        Ok(self
+            .cache
+            .last()
+            .and_then(|(_, frames)| frames.get(index - first)))
+    }
+
+    fn load_block(&mut self, block: usize) -> Result<Vec<Frame>> {
+        self.decoder
+            .decode(&self.file, &self.blocks, block, &self.accumulator)
+    }
+}
+
+/// The accumulator that recomputes derived fields of `metadata`'s columnar
+/// blocks.
+pub(super) fn block_accumulator(metadata: &SessionMetadata) -> Accumulator {
+    Accumulator::new(
+        #[allow(clippy::cast_precision_loss)]
+        {
+            metadata.cycle_counter_frequency as f64
+        },
+        metadata.hardware_concurrency,
+    )
+}
+
+/// Decompression context and buffers for reading blocks. Each thread
+/// decoding blocks needs its own.
+struct BlockDecoder {
+    decompressor: zstd::bulk::Decompressor<'static>,
+    compressed: Vec<u8>,
+    raw: Vec<u8>,
+}
+
+impl BlockDecoder {
+    fn new(dictionary: Option<&[u8]>) -> Result<Self> {
+        let decompressor = match dictionary {
+            Some(dictionary) => zstd::bulk::Decompressor::with_dictionary(dictionary),
+            None => zstd::bulk::Decompressor::new(),
+        };
+        Ok(Self {
+            decompressor: decompressor.context("failed to create zstd decompressor")?,
+            compressed: Vec::new(),
+            raw: Vec::new(),
+        })
+    }
+
+    fn decode(
+        &mut self,
+        file: &File,
+        blocks: &[BlockEntry],
+        block: usize,
+        accumulator: &Accumulator,
+    ) -> Result<Vec<Frame>> {
+        let entry = &blocks[block];
+
+        self.compressed.resize(entry.compressed_len as usize, 0);
+        file.read_exact_at(&mut self.compressed, entry.offset)
+            .with_context(|| format!("failed to read block {block}"))?;
+
+        self.raw.clear();
+        self.raw.reserve(entry.raw_len as usize);
+        self.decompressor
+            .decompress_to_buffer(&self.compressed, &mut self.raw)
+            .with_context(|| format!("failed to decompress block {block}"))?;
+
+        decode_block(&self.raw, accumulator)
+    }
+}
+
+/// Runs `work` on blocks `0..count` across `jobs` threads and hands the
+/// results to `sink` in block order. Worker `w` takes blocks `w`, `w + jobs`,
+/// ... and may run at most `BLOCKS_AHEAD` blocks ahead of `sink`, so memory
+/// stays bounded however large the recording is. Each worker builds its own
+/// state with `init`.
+fn ordered_parallel<W, T: Send>(
+    jobs: usize,
+    count: usize,
+    init: impl Fn() -> Result<W> + Sync,
+    work: impl Fn(&mut W, usize) -> Result<T> + Sync,
+    mut sink: impl FnMut(T) -> Result<()>,
+) -> Result<()> {
+    let jobs = jobs.clamp(1, count.max(1));
+    std::thread::scope(|scope| {
+        let receivers: Vec<_> = (0..jobs)
+            .map(|worker| {
+                let (tx, rx) = mpsc::sync_channel(BLOCKS_AHEAD);
+                let (init, work) = (&init, &work);
+                scope.spawn(move || {
+                    let mut state = match init() {
+                        Ok(state) => state,
+                        Err(e) => {
+                            let _ = tx.send(Err(e));
+                            return;
+                        }
+                    };
+                    for block in (worker..count).step_by(jobs) {
+                        let result = work(&mut state, block);
+                        let failed = result.is_err();
+                        // The receiver is gone once `sink` failed.
+                        if tx.send(result).is_err() || failed {
+                            return;
+                        }
+                    }
+                });
+                rx
+            })
+            .collect();
+
+        for block in 0..count {
+            let result = receivers[block % jobs]
+                .recv()
+                .with_context(|| format!("decode worker for block {block} exited"))?;
+            sink(result?)?;
+        }
+        Ok(())
+    })
+}
+
+/// Reads the footer index of a finished v3 recording. Returns `None` if the
+/// trailer is missing, e.g. because the writer never called `finish`.
+fn read_index(file: &File) -> Result<Option<BlockIndex>> {
+    let file_len = file
+        .metadata()
+        .context("failed to stat recording file")?
+        .len();
+    let Ok(file_len) = usize::try_from(file_len) else {
+        return Ok(None);
+    };
+    if file_len < TRAILER_LEN + SKIPPABLE_HEADER_LEN {
+        return Ok(None);
+    }
+
+    let mut trailer = [0u8; TRAILER_LEN];
+    file.read_exact_at(&mut trailer, (file_len - TRAILER_LEN) as u64)
+        .context("failed to read recording trailer")?;
+    if trailer[4..] != INDEX_MAGIC {
+        return Ok(None);
+    }
+
+    let index_len = u32::from_le_bytes([trailer[0], trailer[1], trailer[2], trailer[3]]) as usize;
+    let Some(index_start) = file_len.checked_sub(TRAILER_LEN + index_len) else {
+        return Ok(None);
+    };
+
+    let mut data = vec![0u8; index_len];
+    file.read_exact_at(&mut data, index_start as u64)
+        .context("failed to read block index")?;
+
+    postcard::from_bytes(&data)
+        .or_else(|_| postcard::from_bytes::<PreHistogramBlockIndex>(&data).map(BlockIndex::from))
+        .map(Some)
+        .context("failed to deserialize block index")
+}
+
+/// Compressed length of the file header, the first zstd frame.
+fn header_len(file: &File) -> Result<usize> {
+    let mut head = vec![0u8; HEADER_READ_LEN];
+    let n = file
+        .read_at(&mut head, 0)
+        .context("failed to read recording header")?;
+    zstd::zstd_safe::find_frame_compressed_size(&head[..n])
+        .map_err(|_| anyhow::anyhow!("corrupt recording header"))
+}
+
+/// Rebuilds the block index of an unfinished v3 recording by walking its
+/// zstd frames. A truncated final block is dropped. Only frame headers and
+/// one block at a time are read, so recovery needs no more memory than the
+/// largest block.
+fn recover_index(
+    file: &File,
+    accumulator: &Accumulator,
+    dictionary: Option<&[u8]>,
+) -> Result<BlockIndex> {
+    let file_len = file
+        .metadata()
+        .context("failed to stat recording file")?
+        .len();
+
+    let mut index = BlockIndex::default();
+    let mut offset = header_len(file)? as u64;
+    let mut head = [0u8; KEYFRAME_HEADER_LEN];
+    let mut window = Vec::new();
+
+    while offset < file_len {
+        let rest_len = file_len - offset;
+        if rest_len >= SKIPPABLE_HEADER_LEN as u64 {
+            #[allow(clippy::cast_possible_truncation)]
+            let head = &mut head[..rest_len.min(KEYFRAME_HEADER_LEN as u64) as usize];
+            file.read_exact_at(head, offset)
+                .context("failed to read recording for index recovery")?;
+            let magic = u32::from_le_bytes([head[0], head[1], head[2], head[3]]);
+            if magic & SKIPPABLE_FRAME_MAGIC_MASK == SKIPPABLE_FRAME_MAGIC {
+                let len = u32::from_le_bytes([head[4], head[5], head[6], head[7]]) as usize;
+                let complete = rest_len >= (SKIPPABLE_HEADER_LEN + len) as u64;
+                if magic == KEYFRAME_MAGIC
+                    && complete
+                    && keyframe::keyframe_frame(head) == Some(index.frame_count)
+                {
+                    #[allow(clippy::cast_possible_truncation)]
+                    index.keyframes.push(KeyframeEntry {
+                        frame: index.frame_count,
+                        offset,
+                        len: (SKIPPABLE_HEADER_LEN + len) as u32,
+                    });
+                }
+                // Written by `finish` after the last block.
+                #[allow(clippy::cast_possible_truncation)]
+                let entry = ThreadIndexEntry {
+                    offset,
+                    len: (SKIPPABLE_HEADER_LEN + len) as u32,
+                };
+                if (magic == THREAD_INDEX_MAGIC || magic == THREAD_SEGMENTS_MAGIC) && complete {
+                    index.threads = Some(entry);
+                }
+                if magic == HISTOGRAM_MAGIC && complete {
+                    index.histogram = Some(entry);
+                }
+                offset += (SKIPPABLE_HEADER_LEN + len) as u64;
+                continue;
+            }
+        }
+
+        let Some(block) = read_zstd_frame(file, offset, rest_len, &mut window)? else {
+            break;
+        };
+        let Ok(raw) = compression::decompress(block, dictionary) else {
+            break;
+        };
+        let compressed_len = block.len();
+        let frames = decode_block(&raw, accumulator)?;
+
+        #[allow(clippy::cast_possible_truncation)]
+        index.blocks.push(BlockEntry {
+            offset,
+            compressed_len: compressed_len as u32,
+            raw_len: raw.len() as u32,
+            first_frame: index.frame_count,
+            frame_count: frames.len() as u32,
+            first_timestamp_ns: frames.first().map_or(0, |f| f.computed.timestamp_ns),
+        });
+        index.frame_count += frames.len() as u64;
+        offset += compressed_len as u64;
+    }
+
+    Ok(index)
+}
+
+/// Reads the zstd frame at `offset` into `window`, starting with
+/// `RECOVERY_WINDOW` bytes and doubling the read until the frame fits.
+/// `None` if the frame runs past the `available` bytes or `MAX_BLOCK_LEN`.
+fn read_zstd_frame<'a>(
+    file: &File,
+    offset: u64,
+    available: u64,
+    window: &'a mut Vec<u8>,
+) -> Result<Option<&'a [u8]>> {
+    let available = usize::try_from(available).unwrap_or(usize::MAX);
+    window.clear();
+    let mut want = RECOVERY_WINDOW;
+    loop {
+        let read = window.len();
+        window.resize(want.min(available), 0);
+        file.read_exact_at(&mut window[read..], offset + read as u64)
+            .context("failed to read recording for index recovery")?;
+        if let Ok(len) = zstd::zstd_safe::find_frame_compressed_size(window) {
+            return Ok(Some(&window[..len]));
+        }
+        if window.len() == available || window.len() >= MAX_BLOCK_LEN {
+            return Ok(None);
+        }
+        want *= 2;
+    }
+}
+
+/// Decodes one decompressed block.
+pub(super) fn decode_block(raw: &[u8], accumulator: &Accumulator) -> Result<Vec<Frame>> {
+    let Some((&encoding, mut rest)) = raw.split_first() else {
+        return Ok(Vec::new());
+    };
+    match encoding {
+        BLOCK_ENCODING_POSTCARD => {}
+        BLOCK_ENCODING_COLUMNAR => return columnar::decode_block(rest, accumulator),
+        _ => bail!("unsupported block encoding {encoding}"),
+    }
+
+    let mut frames = Vec::new();
+    while rest.len() >= 4 {
+        let len = u32::from_le_bytes([rest[0], rest[1], rest[2], rest[3]]) as usize;
+        let Some(data) = rest.get(4..4 + len) else {
+            bail!("truncated frame in block");
+        };
+        frames.push(postcard::from_bytes(data).context("failed to deserialize frame")?);
+        rest = &rest[4 + len..];
+    }
+
+    Ok(frames)
+}
+
 pub struct ReplaySource {
     reader: RecordingReader,
+    mapped: Option<MappedRecording>,
     current_index: usize,
     playback_speed: f64,
     last_emitted: Instant,
     paused: bool,
+    /// Only frames of this process are emitted, for multiplexed recordings.
+    pid_filter: Option<i32>,
+    /// Where the frames of the histogram are in the recording; `None` when
+    /// it holds every frame in one pass.
+    histogram_frames: Option<HistogramFrames>,
+    /// The keyframe last restored, kept for seeks within its interval.
+    keyframe: Option<(KeyframeEntry, PlaybackStats)>,
+}
+
+enum HistogramFrames {
+    /// Built in one pass with a PID filter: the index of each frame.
+    Kept(Vec<usize>),
+    /// Built from the recording's coarse buckets.
+    Coarse(CoarseFrames),
+}
+
+struct CoarseFrames {
+    /// Index of the first frame of each coarse bucket.
+    starts: Vec<u64>,
+    /// Frames in the histogram.
+    frames: u64,
+    /// The frames `load_histogram` last decoded, ...
+    loaded: Range<usize>,
+    /// ... the position of the first of them in the histogram and, with a
+    /// PID filter, the index of each one the histogram holds.
+    first: u64,
+    kept: Vec<usize>,
+}
+
+impl CoarseFrames {
+    /// Frames of the histogram before frame `index`, exact within the
+    /// frames loaded and otherwise the start of the coarse bucket holding
+    /// it, until `load_histogram` decodes around it.
+    fn position(&self, index: usize, frame_count: usize) -> u64 {
+        if index >= frame_count {
+            return self.frames;
+        }
+        if self.loaded.contains(&index) {
+            return self.first + self.kept.partition_point(|&i| i < index) as u64;
+        }
+        let bucket = self.starts.partition_point(|&s| s <= index as u64);
+        let span = HistogramPyramid::frames_per_bucket(HISTOGRAM_LEVEL);
+        (bucket.saturating_sub(1) as u64 * span).min(self.frames)
+    }
 }
 
 impl ReplaySource {
@@ -129,13 +759,164 @@ impl ReplaySource {
     pub fn new(reader: RecordingReader) -> Self {
         Self {
             reader,
+            mapped: None,
             current_index: 0,
             playback_speed: 1.0,
             last_emitted: Instant::now(),
             paused: false,
+            pid_filter: None,
+            histogram_frames: None,
+            keyframe: None,
+        }
+    }
+
+    /// Serves frames from a memory-mapped replay cache instead of decoding
+    /// blocks, so `next_frame_into` does not allocate.
+    #[must_use]
+    pub fn with_mapped(reader: RecordingReader, mapped: MappedRecording) -> Self {
+        Self {
+            mapped: Some(mapped),
+            ..Self::new(reader)
+        }
+    }
+
+    /// Restricts playback to frames sampled from `pid`.
+    pub fn set_pid_filter(&mut self, pid: Option<i32>) {
+        self.pid_filter = pid;
+        self.keyframe = None;
+    }
+
+    /// Builds the load histogram of the whole recording (of the filtered
+    /// process), so the histogram can zoom out to the full session. The
+    /// coarse levels come from the buckets the recording stores, and
+    /// `load_histogram` decodes the finer ones for the part in view.
+    /// Recordings without them take one pass over the replay cache, or over
+    /// the blocks without one.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the stored buckets cannot be read or a block
+    /// cannot be decoded.
+    pub fn build_histogram(&mut self) -> Result<HistogramPyramid> {
+        if let Some(index) = self.reader.histogram_index()?
+            && let Some(group) = index.groups.into_iter().find(|g| g.pid == self.pid_filter)
+        {
+            let pyramid = group.pyramid();
+            self.histogram_frames = Some(HistogramFrames::Coarse(CoarseFrames {
+                starts: group.starts,
+                frames: group.frames,
+                loaded: 0..0,
+                first: 0,
+                kept: Vec::new(),
+            }));
+            return Ok(pyramid);
+        }
+
+        let mut pyramid = HistogramPyramid::unbounded();
+        let mut kept = Vec::new();
+        for index in 0..self.reader.frame_count() {
+            let Some((pid, entry)) = self.histogram_entry(index)? else {
+                break;
+            };
+            if self.wanted(pid) {
+                pyramid.push(&entry);
+                if self.pid_filter.is_some() {
+                    kept.push(index);
+                }
+            }
+        }
+        self.histogram_frames = self.pid_filter.map(|_| HistogramFrames::Kept(kept));
+        Ok(pyramid)
+    }
+
+    /// Decodes the frames `pyramid`, from `build_histogram`, needs below its
+    /// coarse levels for `view(level, end, width)`, and as many again ahead
+    /// so playback does not decode on every frame. Returns whether it
+    /// loaded any.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if a block cannot be decoded.
+    pub fn load_histogram(
+        &mut self,
+        pyramid: &mut HistogramPyramid,
+        level: usize,
+        end: u64,
+        width: usize,
+    ) -> Result<bool> {
+        let Some(HistogramFrames::Coarse(coarse)) = &self.histogram_frames else {
+            return Ok(false);
+        };
+        let Some(missing) = pyramid.missing(level, end, width) else {
+            return Ok(false);
+        };
+        let to = (missing.end + (missing.end - missing.start)).min(pyramid.len());
+        let span = HistogramPyramid::frames_per_bucket(HISTOGRAM_LEVEL);
+        let frame_count = self.reader.frame_count();
+        #[allow(clippy::cast_possible_truncation)]
+        let start_of = |position: u64| match coarse.starts.get((position / span) as usize) {
+            Some(&start) if position < pyramid.len() => start as usize,
+            _ => frame_count,
+        };
+        let loaded = start_of(missing.start)..start_of(to);
+
+        let mut entries = Vec::with_capacity(loaded.len());
+        let mut kept = Vec::new();
+        for index in loaded.clone() {
+            let Some((pid, entry)) = self.histogram_entry(index)? else {
+                break;
+            };
+            if self.wanted(pid) {
+                entries.push(entry);
+                if self.pid_filter.is_some() {
+                    kept.push(index);
+                }
+            }
+        }
+        pyramid.fill(missing.start, &entries);
+        if let Some(HistogramFrames::Coarse(coarse)) = &mut self.histogram_frames {
+            coarse.loaded = loaded;
+            coarse.first = missing.start;
+            coarse.kept = kept;
+        }
+        Ok(true)
+    }
+
+    /// The PID and histogram entry of frame `index`, from the replay cache
+    /// or the blocks.
+    fn histogram_entry(&mut self, index: usize) -> Result<Option<(i32, HistogramEntry)>> {
+        if let Some(ref mapped) = self.mapped {
+            return Ok(mapped.frame(index).map(|view| {
+                let r = view.record;
+                let entry = HistogramEntry::from_flags(r.histogram_load_percent, r.histogram_flags);
+                (r.pid, entry)
+            }));
+        }
+        Ok(self
+            .reader
+            .try_frame_at(index)?
+            .map(|frame| (frame.pid, frame.computed.histogram_entry.clone())))
+    }
+
+    /// Frames of the `build_histogram` pyramid played so far.
+    #[must_use]
+    pub fn histogram_position(&self) -> u64 {
+        match &self.histogram_frames {
+            _ if self.pid_filter.is_none() => self.current_index as u64,
+            Some(HistogramFrames::Kept(kept)) => {
+                kept.partition_point(|&i| i < self.current_index) as u64
+            }
+            Some(HistogramFrames::Coarse(coarse)) => {
+                coarse.position(self.current_index, self.reader.frame_count())
+            }
+            None => self.current_index as u64,
         }
     }
 
+    fn wanted(&self, pid: i32) -> bool {
+        self.pid_filter.is_none_or(|want| want == pid)
+    }
+
     pub fn set_speed(&mut self, speed: f64) {
         self.playback_speed = speed;
     }
@@ -152,6 +933,120 @@ impl ReplaySource {
         self.last_emitted = Instant::now();
     }
 
+    /// The statistics of playing frames `..index` and the last frame
+    /// played, for restoring the UI after a seek. They come from the
+    /// nearest keyframe, brought forward by at most `KEYFRAME_INTERVAL`
+    /// frames. Recordings without keyframes replay only the longest rolling
+    /// window before `index`, so their timing statistics start there.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if a keyframe or block cannot be read.
+    pub fn playback_at(&mut self, index: usize) -> Result<(PlaybackStats, Option<ComputedFrame>)> {
+        let index = index.min(self.reader.frame_count());
+        let (start, mut stats) = match self.reader.keyframe_before(index) {
+            Some(entry) => {
+                let stats = match self.keyframe.take() {
+                    Some((cached, stats)) if cached == entry => stats,
+                    _ => self.reader.read_keyframe(&entry, self.pid_filter)?,
+                };
+                self.keyframe = Some((entry, stats.clone()));
+                #[allow(clippy::cast_possible_truncation)]
+                (entry.frame as usize, stats)
+            }
+            None => (self.window_start(index)?, PlaybackStats::default()),
+        };
+
+        let pid_filter = self.pid_filter;
+        let wanted = |pid| pid_filter.is_none_or(|want| want == pid);
+        let mut latest = None;
+        for i in start..index {
+            let Some(frame) = self.reader.try_frame_at(i)? else {
+                break;
+            };
+            if wanted(frame.pid) {
+                stats.record(&frame.computed);
+                latest = Some(i);
+            }
+        }
+        // Landing right at a keyframe, the frame shown comes from before it.
+        #[allow(clippy::cast_possible_truncation)]
+        let earliest = start.saturating_sub(KEYFRAME_INTERVAL as usize);
+        for i in (earliest..start.min(index)).rev() {
+            if latest.is_some() {
+                break;
+            }
+            let Some(frame) = self.reader.try_frame_at(i)? else {
+                break;
+            };
+            if wanted(frame.pid) {
+                latest = Some(i);
+            }
+        }
+        let latest = match latest {
+            Some(i) => self.reader.try_frame_at(i)?.map(|f| f.computed.clone()),
+            None => None,
+        };
+        Ok((stats, latest))
+    }
+
+    /// First frame within the longest rolling window before frame `index`.
+    fn window_start(&mut self, index: usize) -> Result<usize> {
+        let Some(end) = index.checked_sub(1) else {
+            return Ok(0);
+        };
+        let Some(last) = self.reader.try_frame_at(end)? else {
+            return Ok(0);
+        };
+        #[allow(clippy::cast_possible_truncation)]
+        let from_ns = last
+            .computed
+            .timestamp_ns
+            .saturating_sub(WINDOWS[WINDOWS.len() - 1].as_nanos() as u64);
+        let (mut lo, mut hi) = (0, end);
+        while lo < hi {
+            let mid = usize::midpoint(lo, hi);
+            match self.reader.try_frame_at(mid)? {
+                Some(f) if f.computed.timestamp_ns < from_ns => lo = mid + 1,
+                _ => hi = mid,
+            }
+        }
+        Ok(lo)
+    }
+
+    fn is_due(&self, sample_period_ns: u64) -> bool {
+        self.last_emitted.elapsed() >= self.playback_interval(sample_period_ns)
+    }
+
+    fn playback_interval(&self, sample_period_ns: u64) -> Duration {
+        #[allow(clippy::cast_precision_loss)]
+        let required_ns = sample_period_ns as f64 / self.playback_speed;
+        #[allow(clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+        let required = Duration::from_nanos(required_ns as u64);
+        required
+    }
+
+    /// How long until the next frame is due, so the caller can block instead
+    /// of polling. `None` while paused or past the last frame.
+    pub fn time_until_next(&mut self) -> Option<Duration> {
+        if self.paused {
+            return None;
+        }
+        let sample_period_ns = match self.mapped {
+            Some(ref mapped) => mapped.frame(self.current_index)?.record.sample_period_ns,
+            None => {
+                self.reader
+                    .frame_at(self.current_index)?
+                    .computed
+                    .sample_period_ns
+            }
+        };
+        Some(
+            self.playback_interval(sample_period_ns)
+                .saturating_sub(self.last_emitted.elapsed()),
+        )
+    }
+
     #[must_use]
     pub fn is_paused(&self) -> bool {
         self.paused
@@ -181,24 +1076,61 @@ impl DataSource for ReplaySource {
             return None;
         }
 
-        let frame = self.reader.frame_at(self.current_index)?;
-
-        let sample_period_ns = frame.computed.sample_period_ns;
-        #[allow(clippy::cast_precision_loss)]
-        let required_ns = sample_period_ns as f64 / self.playback_speed;
-        let elapsed_ns = self.last_emitted.elapsed().as_nanos();
-
-        #[allow(clippy::cast_possible_truncation, clippy::cast_sign_loss)]
-        if elapsed_ns < required_ns as u128 {
+        loop {
+            let pid = self.reader.frame_at(self.current_index)?.pid;
+            if self.wanted(pid) {
+                break;
+            }
+            self.current_index += 1;
+        }
+        let sample_period_ns = self
+            .reader
+            .frame_at(self.current_index)?
+            .computed
+            .sample_period_ns;
+        if !self.is_due(sample_period_ns) {
             return None;
         }
 
-        let computed = frame.computed.clone();
+        let computed = self.reader.frame_at(self.current_index)?.computed.clone();
         self.current_index += 1;
         self.last_emitted = Instant::now();
         Some(computed)
     }
 
+    fn next_frame_into(&mut self, out: &mut ComputedFrame) -> bool {
+        let Some(ref mapped) = self.mapped else {
+            return match self.next_frame() {
+                Some(next) => {
+                    *out = next;
+                    true
+                }
+                None => false,
+            };
+        };
+
+        if self.paused {
+            return false;
+        }
+        let view = loop {
+            let Some(view) = mapped.frame(self.current_index) else {
+                return false;
+            };
+            if self.wanted(view.record.pid) {
+                break view;
+            }
+            self.current_index += 1;
+        };
+        if !self.is_due(view.record.sample_period_ns) {
+            return false;
+        }
+
+        view.copy_into(out);
+        self.current_index += 1;
+        self.last_emitted = Instant::now();
+        true
+    }
+
     fn metadata(&self) -> &SessionMetadata {
         self.reader.metadata()
     }
@@ -0,0 +1,406 @@
+// SPDX-License-Identifier: MIT
+//! Per-thread index: for every thread of a recording, the sums of its
+//! `ThreadDelta` counters over each block it ran in, one column per
+//! counter, and over the whole session. `RecordingWriter::finish` writes it
+//! in a skippable frame (`THREAD_INDEX_MAGIC`) before the block index;
+//! recordings without one get it built from their blocks on first use. Top-K
+//! and per-thread timeline queries then never touch the frames.
+//!
+//! So the writer's memory does not grow with the recording, it writes the
+//! index in pieces (`THREAD_SEGMENT_MAGIC`) of `THREAD_SEGMENT_BLOCKS`
+//! blocks as it goes, and `finish` then writes their list
+//! (`THREAD_SEGMENTS_MAGIC`) instead; `ThreadIndex::read` merges them.
+
+use std::collections::HashMap;
+use std::fs::File;
+use std::os::unix::fs::FileExt;
+
+use anyhow::{Context, Result, bail};
+use serde::{Deserialize, Serialize};
+
+use super::format::{
+    Frame, SKIPPABLE_HEADER_LEN, THREAD_INDEX_MAGIC, THREAD_SEGMENT_BLOCKS, THREAD_SEGMENT_MAGIC,
+    THREAD_SEGMENTS_MAGIC, ThreadIndexEntry,
+};
+use crate::sampler::thread_stats::ThreadDelta;
+
+const COMPRESSION_LEVEL: i32 = 3;
+pub const COUNTER_COUNT: usize = 9;
+
+/// A `ThreadDelta` counter.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, clap::ValueEnum)]
+pub enum Counter {
+    JitTime,
+    SignalTime,
+    Sigbus,
+    Smc,
+    FloatFallback,
+    CacheMiss,
+    CacheReadLock,
+    CacheWriteLock,
+    JitCount,
+}
+
+impl Counter {
+    pub const ALL: [Self; COUNTER_COUNT] = [
+        Self::JitTime,
+        Self::SignalTime,
+        Self::Sigbus,
+        Self::Smc,
+        Self::FloatFallback,
+        Self::CacheMiss,
+        Self::CacheReadLock,
+        Self::CacheWriteLock,
+        Self::JitCount,
+    ];
+
+    /// Column name, as in the per-thread CSV export.
+    #[must_use]
+    pub fn name(self) -> &'static str {
+        match self {
+            Self::JitTime => "jit_time",
+            Self::SignalTime => "signal_time",
+            Self::Sigbus => "sigbus_count",
+            Self::Smc => "smc_count",
+            Self::FloatFallback => "float_fallback_count",
+            Self::CacheMiss => "cache_miss_count",
+            Self::CacheReadLock => "cache_read_lock_time",
+            Self::CacheWriteLock => "cache_write_lock_time",
+            Self::JitCount => "jit_count",
+        }
+    }
+
+    /// Whether the counter is a time in cycles rather than a count.
+    #[must_use]
+    pub fn is_cycles(self) -> bool {
+        matches!(
+            self,
+            Self::JitTime | Self::SignalTime | Self::CacheReadLock | Self::CacheWriteLock
+        )
+    }
+
+    fn of(d: &ThreadDelta) -> [u64; COUNTER_COUNT] {
+        [
+            d.jit_time,
+            d.signal_time,
+            d.sigbus_count,
+            d.smc_count,
+            d.float_fallback_count,
+            d.cache_miss_count,
+            d.cache_read_lock_time,
+            d.cache_write_lock_time,
+            d.jit_count,
+        ]
+    }
+}
+
+/// Where a block starts, for placing timelines in the recording.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct BlockSpan {
+    pub first_frame: u64,
+    pub first_timestamp_ns: u64,
+}
+
+#[derive(Clone, Debug, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct ThreadTimeline {
+    pub pid: i32,
+    pub tid: u32,
+    /// Frames with a delta of this thread.
+    pub frames: u64,
+    /// In `Counter::ALL` order.
+    pub totals: [u64; COUNTER_COUNT],
+    /// Indexes into `ThreadIndex::blocks` of the blocks the thread ran in,
+    /// ascending.
+    pub blocks: Vec<u32>,
+    /// `columns[c][i]` is the sum of counter `c` over block `blocks[i]`.
+    pub columns: [Vec<u64>; COUNTER_COUNT],
+}
+
+impl ThreadTimeline {
+    #[must_use]
+    pub fn total(&self, counter: Counter) -> u64 {
+        self.totals[counter as usize]
+    }
+
+    /// Sum of `counter` over each block the thread ran in, by block index.
+    pub fn timeline(&self, counter: Counter) -> impl Iterator<Item = (u32, u64)> + '_ {
+        self.blocks
+            .iter()
+            .copied()
+            .zip(self.columns[counter as usize].iter().copied())
+    }
+
+    fn add(&mut self, block: u32, frames: u64, values: &[u64; COUNTER_COUNT]) {
+        if self.blocks.last() != Some(&block) {
+            self.blocks.push(block);
+            for column in &mut self.columns {
+                column.push(0);
+            }
+        }
+        self.frames += frames;
+        for (c, &value) in values.iter().enumerate() {
+            self.totals[c] += value;
+            *self.columns[c].last_mut().expect("pushed above") += value;
+        }
+    }
+}
+
+#[derive(Clone, Debug, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct ThreadIndex {
+    pub blocks: Vec<BlockSpan>,
+    /// Sorted by PID, then TID.
+    pub threads: Vec<ThreadTimeline>,
+}
+
+impl ThreadIndex {
+    /// The `k` threads with the highest total of `counter`, of process
+    /// `pid` or of every process; ties go to the lower PID and TID.
+    #[must_use]
+    pub fn top(&self, counter: Counter, k: usize, pid: Option<i32>) -> Vec<&ThreadTimeline> {
+        let mut threads: Vec<_> = self
+            .threads
+            .iter()
+            .filter(|t| pid.is_none_or(|p| p == t.pid))
+            .collect();
+        threads.sort_by_key(|t| std::cmp::Reverse(t.total(counter)));
+        threads.truncate(k);
+        threads
+    }
+
+    #[must_use]
+    pub fn thread(&self, pid: i32, tid: u32) -> Option<&ThreadTimeline> {
+        self.threads
+            .binary_search_by_key(&(pid, tid), |t| (t.pid, t.tid))
+            .ok()
+            .map(|i| &self.threads[i])
+    }
+
+    /// Index of the block holding frame `frame`.
+    #[must_use]
+    pub fn block_of(&self, frame: u64) -> usize {
+        self.blocks
+            .partition_point(|b| b.first_frame <= frame)
+            .saturating_sub(1)
+    }
+
+    /// Encodes the index as a skippable frame.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the index cannot be encoded.
+    pub fn encode(&self) -> Result<Vec<u8>> {
+        self.encode_as(THREAD_INDEX_MAGIC)
+    }
+
+    /// Encodes the index as a piece of a larger one, for
+    /// `encode_segments`.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the index cannot be encoded.
+    pub fn encode_segment(&self) -> Result<Vec<u8>> {
+        self.encode_as(THREAD_SEGMENT_MAGIC)
+    }
+
+    fn encode_as(&self, magic: u32) -> Result<Vec<u8>> {
+        let serialized = postcard::to_stdvec(self).context("failed to serialize thread index")?;
+        let compressed = zstd::bulk::compress(&serialized, COMPRESSION_LEVEL)
+            .context("failed to compress thread index")?;
+        Ok(skippable_frame(magic, &compressed))
+    }
+
+    /// Encodes the list of the pieces `encode_segment` wrote, in file
+    /// order, as the frame the block index points at.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the list cannot be encoded.
+    pub fn encode_segments(segments: &[ThreadIndexEntry]) -> Result<Vec<u8>> {
+        let serialized =
+            postcard::to_stdvec(segments).context("failed to serialize thread index list")?;
+        Ok(skippable_frame(THREAD_SEGMENTS_MAGIC, &serialized))
+    }
+
+    /// Reads the index `entry` locates in `file`, merging its pieces if it
+    /// was written in several.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the index cannot be read or decoded.
+    pub fn read(file: &File, entry: &ThreadIndexEntry) -> Result<Self> {
+        let (magic, payload) = read_frame(file, entry)?;
+        match magic {
+            THREAD_INDEX_MAGIC => decode(&payload),
+            THREAD_SEGMENTS_MAGIC => {
+                let segments: Vec<ThreadIndexEntry> = postcard::from_bytes(&payload)
+                    .context("failed to deserialize thread index list")?;
+                let mut builder = ThreadIndexBuilder::default();
+                for segment in &segments {
+                    let (magic, payload) = read_frame(file, segment)?;
+                    if magic != THREAD_SEGMENT_MAGIC {
+                        bail!(
+                            "thread index piece at offset {} does not match the list",
+                            segment.offset
+                        );
+                    }
+                    builder.append(decode(&payload)?);
+                }
+                Ok(builder.finish())
+            }
+            _ => bail!(
+                "thread index at offset {} does not match the index",
+                entry.offset
+            ),
+        }
+    }
+}
+
+fn skippable_frame(magic: u32, payload: &[u8]) -> Vec<u8> {
+    let mut out = Vec::with_capacity(SKIPPABLE_HEADER_LEN + payload.len());
+    out.extend_from_slice(&magic.to_le_bytes());
+    #[allow(clippy::cast_possible_truncation)]
+    out.extend_from_slice(&(payload.len() as u32).to_le_bytes());
+    out.extend_from_slice(payload);
+    out
+}
+
+/// The magic and payload of the skippable frame `entry` locates.
+fn read_frame(file: &File, entry: &ThreadIndexEntry) -> Result<(u32, Vec<u8>)> {
+    let mut data = vec![0u8; entry.len as usize];
+    file.read_exact_at(&mut data, entry.offset)
+        .context("failed to read thread index")?;
+    if data.len() < SKIPPABLE_HEADER_LEN {
+        bail!("thread index at offset {} is truncated", entry.offset);
+    }
+    let magic = u32::from_le_bytes([data[0], data[1], data[2], data[3]]);
+    data.drain(..SKIPPABLE_HEADER_LEN);
+    Ok((magic, data))
+}
+
+fn decode(compressed: &[u8]) -> Result<ThreadIndex> {
+    let raw = zstd::stream::decode_all(compressed).context("failed to decompress thread index")?;
+    postcard::from_bytes(&raw).context("failed to deserialize thread index")
+}
+
+/// One thread's sums over a block.
+pub struct ThreadSums {
+    pid: i32,
+    tid: u32,
+    frames: u64,
+    values: [u64; COUNTER_COUNT],
+}
+
+/// Sums the deltas of each thread over `frames`, for
+/// `ThreadIndexBuilder::push_block`.
+#[must_use]
+pub fn block_sums(frames: &[Frame]) -> Vec<ThreadSums> {
+    let mut sums: Vec<ThreadSums> = Vec::new();
+    let mut lookup = HashMap::new();
+    for frame in frames {
+        for d in &frame.per_thread_deltas {
+            let i = *lookup.entry((frame.pid, d.tid)).or_insert_with(|| {
+                sums.push(ThreadSums {
+                    pid: frame.pid,
+                    tid: d.tid,
+                    frames: 0,
+                    values: [0; COUNTER_COUNT],
+                });
+                sums.len() - 1
+            });
+            sums[i].frames += 1;
+            for (sum, value) in sums[i].values.iter_mut().zip(Counter::of(d)) {
+                *sum += value;
+            }
+        }
+    }
+    sums
+}
+
+/// Builds a `ThreadIndex` block by block, in file order.
+#[derive(Default)]
+pub struct ThreadIndexBuilder {
+    index: ThreadIndex,
+    lookup: HashMap<(i32, u32), usize>,
+}
+
+impl ThreadIndexBuilder {
+    /// Starts the next block; frames recorded from here on belong to it.
+    pub fn start_block(&mut self, span: BlockSpan) {
+        self.index.blocks.push(span);
+    }
+
+    /// Adds `frame`'s deltas to the current block.
+    pub fn record(&mut self, frame: &Frame) {
+        for d in &frame.per_thread_deltas {
+            self.add(frame.pid, d.tid, 1, &Counter::of(d));
+        }
+    }
+
+    /// Adds a whole block of sums from `block_sums`.
+    pub fn push_block(&mut self, span: BlockSpan, sums: &[ThreadSums]) {
+        self.start_block(span);
+        for s in sums {
+            self.add(s.pid, s.tid, s.frames, &s.values);
+        }
+    }
+
+    /// Appends `segment`, an index of the blocks that follow the ones
+    /// added so far.
+    pub fn append(&mut self, segment: ThreadIndex) {
+        #[allow(clippy::cast_possible_truncation)]
+        let base = self.index.blocks.len() as u32;
+        self.index.blocks.extend(segment.blocks);
+        for thread in segment.threads {
+            let i = self.thread(thread.pid, thread.tid);
+            let timeline = &mut self.index.threads[i];
+            timeline.frames += thread.frames;
+            for (total, value) in timeline.totals.iter_mut().zip(thread.totals) {
+                *total += value;
+            }
+            timeline
+                .blocks
+                .extend(thread.blocks.iter().map(|block| block + base));
+            for (column, values) in timeline.columns.iter_mut().zip(thread.columns) {
+                column.extend(values);
+            }
+        }
+    }
+
+    /// Whether the blocks started so far make a whole
+    /// `THREAD_SEGMENT_BLOCKS` piece.
+    #[must_use]
+    pub fn segment_full(&self) -> bool {
+        self.index.blocks.len() >= THREAD_SEGMENT_BLOCKS
+    }
+
+    /// Whether no block has been started.
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.index.blocks.is_empty()
+    }
+
+    fn add(&mut self, pid: i32, tid: u32, frames: u64, values: &[u64; COUNTER_COUNT]) {
+        #[allow(clippy::cast_possible_truncation)]
+        let block = self.index.blocks.len().saturating_sub(1) as u32;
+        let i = self.thread(pid, tid);
+        self.index.threads[i].add(block, frames, values);
+    }
+
+    fn thread(&mut self, pid: i32, tid: u32) -> usize {
+        let threads = &mut self.index.threads;
+        *self.lookup.entry((pid, tid)).or_insert_with(|| {
+            threads.push(ThreadTimeline {
+                pid,
+                tid,
+                ..ThreadTimeline::default()
+            });
+            threads.len() - 1
+        })
+    }
+
+    #[must_use]
+    pub fn finish(mut self) -> ThreadIndex {
+        self.index.threads.sort_by_key(|t| (t.pid, t.tid));
+        self.index
+    }
+}
@@ -1,16 +1,159 @@
 // SPDX-License-Identifier: MIT
+use std::collections::VecDeque;
 use std::fs::File;
 use std::io::{BufWriter, Write};
 use std::path::Path;
+use std::sync::mpsc::{Receiver, TryRecvError};
 
 use anyhow::{Context, Result};
 
-use super::format::{EOF_MARKER, FORMAT_VERSION, MAGIC};
+use super::async_writer::OverflowPolicy;
+use super::columnar::ColumnarEncoder;
+use super::compression::{CompressionOptions, CompressionPool, encode_dictionary};
+use super::flight::FlightOptions;
+use super::format::{
+    BLOCK_ENCODING_POSTCARD, BlockEntry, BlockIndex, FORMAT_VERSION, FRAMES_PER_BLOCK, INDEX_MAGIC,
+    KeyframeEntry, MAGIC, SKIPPABLE_FRAME_MAGIC, ThreadIndexEntry,
+};
+use super::histogram_index::HistogramIndexBuilder;
+use super::keyframe::KeyframeTracker;
+use super::thread_index::{BlockSpan, ThreadIndex, ThreadIndexBuilder};
 use crate::datasource::SessionMetadata;
 use crate::recording::format::{FileHeader, Frame};
+use crate::sampler::rolling::ProcessStats;
+
+const HEADER_COMPRESSION_LEVEL: i32 = 3;
+
+/// How frames are laid out inside each block before compression.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, clap::ValueEnum)]
+pub enum BlockEncoding {
+    /// Length-prefixed postcard frames; stores every field verbatim.
+    #[default]
+    Postcard,
+    /// Delta-encoded columns of raw counters; derived fields are recomputed
+    /// on read, so frames must come from `Accumulator::compute_frame`.
+    Columnar,
+}
+
+#[derive(Clone, Debug, Default)]
+pub struct RecordingOptions {
+    pub encoding: BlockEncoding,
+    pub compression: CompressionOptions,
+    /// Only used by `AsyncRecordingWriter`.
+    pub overflow: OverflowPolicy,
+    /// Only used by `AsyncRecordingWriter`: hold frames and write them only
+    /// around triggers.
+    pub flight: Option<FlightOptions>,
+    /// Only used by `AsyncRecordingWriter`: end partial blocks after a
+    /// second, for `replay --follow`.
+    pub followable: bool,
+}
+
+/// Lays frames out in the payload of one block.
+pub struct BlockBuilder {
+    encoding: BlockEncoding,
+    columnar: ColumnarEncoder,
+    raw: Vec<u8>,
+    frames: u32,
+}
+
+impl BlockBuilder {
+    #[must_use]
+    pub fn new(encoding: BlockEncoding) -> Self {
+        Self {
+            encoding,
+            columnar: ColumnarEncoder::new(),
+            raw: Vec::new(),
+            frames: 0,
+        }
+    }
+
+    /// Appends `frame` to the block.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the frame cannot be serialized.
+    pub fn push(&mut self, frame: &Frame) -> Result<()> {
+        match self.encoding {
+            BlockEncoding::Postcard => {
+                if self.raw.is_empty() {
+                    self.raw.push(BLOCK_ENCODING_POSTCARD);
+                }
+
+                // Reserve the length prefix, serialize in place, then patch the length.
+                let len_pos = self.raw.len();
+                self.raw.extend_from_slice(&[0u8; 4]);
+                self.raw = postcard::to_extend(frame, std::mem::take(&mut self.raw))
+                    .context("failed to serialize frame")?;
+
+                #[allow(clippy::cast_possible_truncation)]
+                let len = (self.raw.len() - len_pos - 4) as u32;
+                self.raw[len_pos..len_pos + 4].copy_from_slice(&len.to_le_bytes());
+            }
+            BlockEncoding::Columnar => self.columnar.push(frame),
+        }
+        self.frames += 1;
+        Ok(())
+    }
+
+    /// Frames pushed since the block started.
+    #[must_use]
+    pub fn frames(&self) -> u32 {
+        self.frames
+    }
+
+    /// Ends the block and returns its payload; the next push starts a new
+    /// one.
+    pub fn finish(&mut self) -> Vec<u8> {
+        if self.encoding == BlockEncoding::Columnar {
+            self.columnar.finish_into(&mut self.raw);
+        }
+        self.frames = 0;
+        std::mem::take(&mut self.raw)
+    }
+}
+
+/// A block or keyframe waiting for the ones before it to be written.
+enum Pending {
+    Block {
+        /// Complete but for where the block lands in the file.
+        entry: BlockEntry,
+        compressed: Compressed,
+    },
+    Keyframe {
+        frame: u64,
+        data: Vec<u8>,
+    },
+    /// A piece of the per-thread index, after the blocks it covers.
+    ThreadSegment(Vec<u8>),
+}
+
+enum Compressed {
+    Done(Vec<u8>),
+    /// With a `CompressionPool` worker.
+    Queued(Receiver<Result<Vec<u8>>>),
+}
 
 pub struct RecordingWriter {
-    encoder: zstd::Encoder<'static, BufWriter<File>>,
+    file: BufWriter<File>,
+    block: BlockBuilder,
+    /// Compresses blocks on this thread when there is no pool.
+    compressor: zstd::bulk::Compressor<'static>,
+    pool: Option<CompressionPool>,
+    /// In file order.
+    pending: VecDeque<Pending>,
+    offset: u64,
+    block_first_timestamp_ns: u64,
+    frame_count: u64,
+    index: Vec<BlockEntry>,
+    /// Sorted by PID.
+    stats: Vec<ProcessStats>,
+    keyframes: KeyframeTracker,
+    keyframe_index: Vec<KeyframeEntry>,
+    /// Blocks since the last piece of the per-thread index was queued.
+    threads: ThreadIndexBuilder,
+    thread_segments: Vec<ThreadIndexEntry>,
+    histogram: HistogramIndexBuilder,
 }
 
 impl RecordingWriter {
@@ -19,12 +162,14 @@ impl RecordingWriter {
     /// # Errors
     ///
     /// Returns an error if the file cannot be created or the header cannot be written.
-    pub fn create(path: &Path, metadata: &SessionMetadata) -> Result<Self> {
+    pub fn create(
+        path: &Path,
+        metadata: &SessionMetadata,
+        options: &RecordingOptions,
+    ) -> Result<Self> {
         let file = File::create(path)
             .with_context(|| format!("failed to create recording file: {}", path.display()))?;
-        let buf_writer = BufWriter::new(file);
-        let mut encoder =
-            zstd::Encoder::new(buf_writer, 3).context("failed to create zstd encoder")?;
+        let mut file = BufWriter::new(file);
 
         let header = FileHeader {
             magic: MAGIC,
@@ -36,52 +181,281 @@ impl RecordingWriter {
 
         #[allow(clippy::cast_possible_truncation)]
         let len = serialized.len() as u32;
-        encoder
-            .write_all(&len.to_le_bytes())
-            .context("failed to write header length")?;
-        encoder
-            .write_all(&serialized)
-            .context("failed to write header data")?;
-
-        Ok(Self { encoder })
+        let mut raw = Vec::with_capacity(4 + serialized.len());
+        raw.extend_from_slice(&len.to_le_bytes());
+        raw.extend_from_slice(&serialized);
+
+        let mut compressed = zstd::bulk::compress(&raw, HEADER_COMPRESSION_LEVEL)
+            .context("failed to compress file header")?;
+        let compression = &options.compression;
+        if let Some(dictionary) = &compression.dictionary {
+            compressed.extend_from_slice(&encode_dictionary(dictionary));
+        }
+        file.write_all(&compressed)
+            .context("failed to write file header")?;
+        // Followers need the header, and the dictionary, before the first
+        // block.
+        file.flush().context("failed to flush file header")?;
+
+        Ok(Self {
+            file,
+            block: BlockBuilder::new(options.encoding),
+            compressor: compression.compressor()?,
+            pool: (compression.workers > 0)
+                .then(|| CompressionPool::new(compression))
+                .transpose()?,
+            pending: VecDeque::new(),
+            offset: compressed.len() as u64,
+            block_first_timestamp_ns: 0,
+            frame_count: 0,
+            index: Vec::new(),
+            stats: Vec::new(),
+            keyframes: KeyframeTracker::default(),
+            keyframe_index: Vec::new(),
+            threads: ThreadIndexBuilder::default(),
+            thread_segments: Vec::new(),
+            histogram: HistogramIndexBuilder::default(),
+        })
     }
 
-    /// Writes a single frame to the recording.
+    /// Appends a single frame to the current block, compressing and writing
+    /// the block out once it holds `FRAMES_PER_BLOCK` frames. With
+    /// compression workers, blocks are written once compressed, in order.
     ///
     /// # Errors
     ///
-    /// Returns an error if serialization or writing fails.
+    /// Returns an error if serialization, compression or writing fails.
     pub fn write_frame(&mut self, frame: &Frame) -> Result<()> {
-        let serialized = postcard::to_stdvec(frame).context("failed to serialize frame")?;
+        if self.block.frames() == 0 {
+            if self.keyframes.is_due(self.frame_count) {
+                self.queue_keyframe()?;
+            }
+            self.block_first_timestamp_ns = frame.computed.timestamp_ns;
+            if self.threads.segment_full() {
+                self.queue_thread_segment()?;
+            }
+            self.threads.start_block(BlockSpan {
+                first_frame: self.frame_count,
+                first_timestamp_ns: frame.computed.timestamp_ns,
+            });
+        }
 
-        #[allow(clippy::cast_possible_truncation)]
-        let len = serialized.len() as u32;
-        self.encoder
-            .write_all(&len.to_le_bytes())
-            .context("failed to write frame length")?;
-        self.encoder
-            .write_all(&serialized)
-            .context("failed to write frame data")?;
+        self.block.push(frame)?;
+        self.histogram.record(self.frame_count, frame);
+        self.frame_count += 1;
+        self.record_stats(frame);
+        self.keyframes.record(frame);
+        self.threads.record(frame);
+
+        if self.block.frames() as usize >= FRAMES_PER_BLOCK {
+            self.flush_block()?;
+        }
 
         Ok(())
     }
 
-    /// Writes the EOF marker, finishes compression, and flushes the file.
+    /// Frames in the current, not yet written, block.
+    #[must_use]
+    pub fn pending_frames(&self) -> u32 {
+        self.block.frames()
+    }
+
+    /// Pushes every complete block to the file and, with `end_block`, the
+    /// current partial block too, so `replay --follow` sees frames that
+    /// would otherwise wait for a full block.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if writing or flushing fails.
+    pub fn flush(&mut self, end_block: bool) -> Result<()> {
+        if end_block {
+            self.flush_block()?;
+        }
+        self.write_pending(0)?;
+        self.file.flush().context("failed to flush recording file")
+    }
+
+    /// Writes any partial block, the per-thread index, the coarse
+    /// histogram, the footer index and the trailer, then flushes the file.
     ///
     /// # Errors
     ///
     /// Returns an error if writing or flushing fails.
     pub fn finish(mut self) -> Result<()> {
-        self.encoder
-            .write_all(&EOF_MARKER)
-            .context("failed to write EOF marker")?;
-        let mut buf_writer = self
-            .encoder
-            .finish()
-            .context("failed to finish zstd encoder")?;
-        buf_writer
+        self.flush_block()?;
+        self.write_pending(0)?;
+
+        // A recording short enough to never have written a piece gets the
+        // whole index in one frame, as before pieces existed.
+        let threads = if self.thread_segments.is_empty() {
+            std::mem::take(&mut self.threads).finish().encode()?
+        } else {
+            if !self.threads.is_empty() {
+                self.queue_thread_segment()?;
+                self.write_pending(0)?;
+            }
+            ThreadIndex::encode_segments(&self.thread_segments)?
+        };
+        self.file
+            .write_all(&threads)
+            .context("failed to write thread index")?;
+        #[allow(clippy::cast_possible_truncation)]
+        let threads = ThreadIndexEntry {
+            offset: self.offset,
+            len: threads.len() as u32,
+        };
+        self.offset += u64::from(threads.len);
+        let histogram = std::mem::take(&mut self.histogram).finish().encode()?;
+        self.file
+            .write_all(&histogram)
+            .context("failed to write histogram")?;
+        #[allow(clippy::cast_possible_truncation)]
+        let histogram = ThreadIndexEntry {
+            offset: self.offset,
+            len: histogram.len() as u32,
+        };
+
+        let index = BlockIndex {
+            frame_count: self.frame_count,
+            blocks: std::mem::take(&mut self.index),
+            stats: std::mem::take(&mut self.stats),
+            keyframes: std::mem::take(&mut self.keyframe_index),
+            threads: Some(threads),
+            histogram: Some(histogram),
+        };
+        let serialized = postcard::to_stdvec(&index).context("failed to serialize index")?;
+
+        // The index travels inside a zstd skippable frame so decoders that
+        // walk the file frame by frame simply step over it.
+        #[allow(clippy::cast_possible_truncation)]
+        let index_len = serialized.len() as u32;
+        #[allow(clippy::cast_possible_truncation)]
+        let payload_len = (serialized.len() + 8) as u32;
+        self.file
+            .write_all(&SKIPPABLE_FRAME_MAGIC.to_le_bytes())
+            .and_then(|()| self.file.write_all(&payload_len.to_le_bytes()))
+            .and_then(|()| self.file.write_all(&serialized))
+            .and_then(|()| self.file.write_all(&index_len.to_le_bytes()))
+            .and_then(|()| self.file.write_all(&INDEX_MAGIC))
+            .context("failed to write block index")?;
+
+        self.file
             .flush()
             .context("failed to flush recording file")?;
         Ok(())
     }
+
+    fn record_stats(&mut self, frame: &Frame) {
+        let i = match self.stats.binary_search_by_key(&frame.pid, |s| s.pid) {
+            Ok(i) => i,
+            Err(i) => {
+                self.stats.insert(i, ProcessStats::new(frame.pid));
+                i
+            }
+        };
+        self.stats[i].record(&frame.computed);
+    }
+
+    /// Queues a keyframe between the last block and the next.
+    fn queue_keyframe(&mut self) -> Result<()> {
+        let data = self.keyframes.encode(self.frame_count)?;
+        self.pending.push_back(Pending::Keyframe {
+            frame: self.frame_count,
+            data,
+        });
+        Ok(())
+    }
+
+    /// Queues the per-thread index of the blocks since the last piece,
+    /// after them, and starts the next piece.
+    fn queue_thread_segment(&mut self) -> Result<()> {
+        let data = std::mem::take(&mut self.threads)
+            .finish()
+            .encode_segment()?;
+        self.pending.push_back(Pending::ThreadSegment(data));
+        Ok(())
+    }
+
+    fn flush_block(&mut self) -> Result<()> {
+        let frames = self.block.frames();
+        if frames == 0 {
+            return Ok(());
+        }
+        let raw = self.block.finish();
+
+        #[allow(clippy::cast_possible_truncation)]
+        let entry = BlockEntry {
+            offset: 0,
+            compressed_len: 0,
+            raw_len: raw.len() as u32,
+            first_frame: self.frame_count - u64::from(frames),
+            frame_count: frames,
+            first_timestamp_ns: self.block_first_timestamp_ns,
+        };
+        let compressed = match &self.pool {
+            Some(pool) => Compressed::Queued(pool.submit(raw)?),
+            None => Compressed::Done(
+                self.compressor
+                    .compress(&raw)
+                    .context("failed to compress frame block")?,
+            ),
+        };
+        self.pending.push_back(Pending::Block { entry, compressed });
+        self.write_pending(self.pool.as_ref().map_or(0, CompressionPool::depth))
+    }
+
+    /// Writes pending blocks and keyframes in order: all that are ready,
+    /// then, waiting on compression, until at most `keep` are left.
+    fn write_pending(&mut self, keep: usize) -> Result<()> {
+        loop {
+            let wait = self.pending.len() > keep;
+            let data = match self.pending.front_mut() {
+                None => return Ok(()),
+                Some(
+                    Pending::Keyframe { data, .. }
+                    | Pending::ThreadSegment(data)
+                    | Pending::Block {
+                        compressed: Compressed::Done(data),
+                        ..
+                    },
+                ) => std::mem::take(data),
+                Some(Pending::Block {
+                    compressed: Compressed::Queued(result),
+                    ..
+                }) => {
+                    let result = if wait {
+                        result.recv().ok()
+                    } else {
+                        match result.try_recv() {
+                            Err(TryRecvError::Empty) => return Ok(()),
+                            result => result.ok(),
+                        }
+                    };
+                    result.context("compression worker exited")??
+                }
+            };
+
+            self.file
+                .write_all(&data)
+                .context("failed to write recording")?;
+            #[allow(clippy::cast_possible_truncation)]
+            match self.pending.pop_front().expect("matched above") {
+                Pending::Block { mut entry, .. } => {
+                    entry.offset = self.offset;
+                    entry.compressed_len = data.len() as u32;
+                    self.index.push(entry);
+                }
+                Pending::Keyframe { frame, .. } => self.keyframe_index.push(KeyframeEntry {
+                    frame,
+                    offset: self.offset,
+                    len: data.len() as u32,
+                }),
+                Pending::ThreadSegment(_) => self.thread_segments.push(ThreadIndexEntry {
+                    offset: self.offset,
+                    len: data.len() as u32,
+                }),
+            }
+            self.offset += data.len() as u64;
+        }
+    }
 }
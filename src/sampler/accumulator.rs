@@ -9,6 +9,9 @@ const NANOSECONDS_IN_SECOND: f64 = 1_000_000_000.0;
 const HIGH_SMC_THRESHOLD: u64 = 500;
 const HIGH_SIGBUS_THRESHOLD: u64 = 5_000;
 const HIGH_SOFTFLOAT_THRESHOLD: u64 = 1_000_000;
+/// Share of the sample period a thread must spend on the code cache write
+/// lock for it to count towards `write_lock_spikes`.
+pub const WRITE_LOCK_SPIKE_PERCENT: f64 = 5.0;
 
 #[derive(Clone, Debug, Default, Serialize, Deserialize)]
 pub struct CumulativeCountStats {
@@ -36,6 +39,42 @@ pub struct HistogramEntry {
     pub high_softfloat: bool,
 }
 
+pub const FLAG_HIGH_JIT_LOAD: u8 = 1 << 0;
+pub const FLAG_HIGH_SMC: u8 = 1 << 1;
+pub const FLAG_HIGH_SIGBUS: u8 = 1 << 2;
+pub const FLAG_HIGH_SOFTFLOAT: u8 = 1 << 3;
+
+impl HistogramEntry {
+    /// Builds an entry from a load and `FLAG_*` bits.
+    #[must_use]
+    pub fn from_flags(load_percent: f32, flags: u8) -> Self {
+        Self {
+            load_percent,
+            high_jit_load: flags & FLAG_HIGH_JIT_LOAD != 0,
+            high_invalidation_or_smc: flags & FLAG_HIGH_SMC != 0,
+            high_sigbus: flags & FLAG_HIGH_SIGBUS != 0,
+            high_softfloat: flags & FLAG_HIGH_SOFTFLOAT != 0,
+        }
+    }
+
+    /// The `high_*` flags as `FLAG_*` bits.
+    #[must_use]
+    pub fn flags(&self) -> u8 {
+        let mut flags = 0;
+        for (set, bit) in [
+            (self.high_jit_load, FLAG_HIGH_JIT_LOAD),
+            (self.high_invalidation_or_smc, FLAG_HIGH_SMC),
+            (self.high_sigbus, FLAG_HIGH_SIGBUS),
+            (self.high_softfloat, FLAG_HIGH_SOFTFLOAT),
+        ] {
+            if set {
+                flags |= bit;
+            }
+        }
+        flags
+    }
+}
+
 #[derive(Clone, Debug, Default, Serialize, Deserialize)]
 pub struct ComputedFrame {
     pub timestamp_ns: u64,
@@ -53,7 +92,30 @@ pub struct ComputedFrame {
     pub total_jit_invocations: u64,
     pub fex_load_percent: f64,
     pub thread_loads: Vec<ThreadLoad>,
+    /// Threads that spent time on the code cache locks, busiest first;
+    /// `total_cycles` is read plus write lock time.
+    pub lock_loads: Vec<ThreadLoad>,
+    /// Threads that spent at least `WRITE_LOCK_SPIKE_PERCENT` of the period
+    /// on the write lock.
+    pub write_lock_spikes: u32,
     pub mem: MemSnapshot,
+    /// How old `mem` was when the frame was taken (0 if unknown).
+    pub mem_age_ns: u64,
+    /// How late the sample was taken against its schedule.
+    pub sample_lateness_ns: u64,
+    /// Time spent taking the sample.
+    pub sample_overhead_ns: u64,
+    /// Part of `sample_overhead_ns` spent copying thread entries from SHM.
+    pub shm_read_ns: u64,
+    /// Time this process's memory sampler spent reading smaps since the
+    /// previous frame.
+    pub smaps_ns: u64,
+    /// Time the recording writer spent serializing, compressing and writing
+    /// since the previous frame; 0 when not recording.
+    pub record_ns: u64,
+    /// Thread entries that changed while being copied from SHM, plus those
+    /// rejected because their counters went backwards.
+    pub torn_reads: u32,
     pub histogram_entry: HistogramEntry,
     pub cumulative: CumulativeCountStats,
 }
@@ -81,7 +143,34 @@ impl Accumulator {
         total_jit_invocations: u64,
         cumulative: CumulativeCountStats,
     ) -> ComputedFrame {
-        let mut frame = ComputedFrame {
+        let mut frame = ComputedFrame::default();
+        self.compute_frame_into(
+            sample,
+            mem,
+            sample_period_ns,
+            total_jit_invocations,
+            cumulative,
+            &mut frame,
+        );
+        frame
+    }
+
+    /// Like `compute_frame`, but overwrites `frame` in place so its
+    /// `thread_loads` and `lock_loads` buffers are reused across samples.
+    pub fn compute_frame_into(
+        &self,
+        sample: &SampleResult,
+        mem: &MemSnapshot,
+        sample_period_ns: u64,
+        total_jit_invocations: u64,
+        cumulative: CumulativeCountStats,
+        frame: &mut ComputedFrame,
+    ) {
+        let mut thread_loads = std::mem::take(&mut frame.thread_loads);
+        thread_loads.clear();
+        let mut lock_loads = std::mem::take(&mut frame.lock_loads);
+        lock_loads.clear();
+        *frame = ComputedFrame {
             sample_period_ns,
             threads_sampled: sample.threads_sampled,
             total_jit_invocations,
@@ -90,9 +179,6 @@ impl Accumulator {
             ..ComputedFrame::default()
         };
 
-        let mut per_thread_total_time: Vec<(u32, u64)> =
-            Vec::with_capacity(sample.per_thread.len());
-
         for delta in &sample.per_thread {
             frame.total_jit_time += delta.jit_time;
             frame.total_signal_time += delta.signal_time;
@@ -104,11 +190,28 @@ impl Accumulator {
             frame.total_cache_write_lock_time += delta.cache_write_lock_time;
             frame.total_jit_count += delta.jit_count;
 
-            let total_time = delta.jit_time + delta.signal_time;
-            per_thread_total_time.push((delta.tid, total_time));
+            thread_loads.push(ThreadLoad {
+                tid: delta.tid,
+                load_percent: 0.0,
+                total_cycles: delta.jit_time + delta.signal_time,
+            });
+            let lock_time = delta.cache_read_lock_time + delta.cache_write_lock_time;
+            if lock_time > 0 {
+                lock_loads.push(ThreadLoad {
+                    tid: delta.tid,
+                    load_percent: 0.0,
+                    total_cycles: lock_time,
+                });
+            }
         }
 
-        per_thread_total_time.sort_by(|a, b| b.1.cmp(&a.1));
+        // Unstable sort never allocates; the TID tiebreak keeps it deterministic.
+        thread_loads.sort_unstable_by(|a, b| {
+            b.total_cycles
+                .cmp(&a.total_cycles)
+                .then_with(|| a.tid.cmp(&b.tid))
+        });
+        thread_loads.truncate(self.hardware_concurrency);
 
         let total_jit_time_all = frame.total_jit_time + frame.total_signal_time;
 
@@ -134,25 +237,19 @@ impl Accumulator {
                 (total_time_f64 / (max_cycles_in_sample_period * max_cores_threads)) * 100.0;
         }
 
-        let cap = self.hardware_concurrency.min(per_thread_total_time.len());
-        frame.thread_loads = per_thread_total_time[..cap]
-            .iter()
-            .map(|&(tid, total_cycles)| {
+        if max_cycles_in_sample_period > 0.0 {
+            for load in &mut thread_loads {
+                #[allow(clippy::cast_precision_loss)]
+                let tc = load.total_cycles as f64;
                 #[allow(clippy::cast_possible_truncation)]
-                let load_percent = if max_cycles_in_sample_period > 0.0 {
-                    #[allow(clippy::cast_precision_loss)]
-                    let tc = total_cycles as f64;
-                    (tc / max_cycles_in_sample_period * 100.0) as f32
-                } else {
-                    0.0
-                };
-                ThreadLoad {
-                    tid,
-                    load_percent,
-                    total_cycles,
-                }
-            })
-            .collect();
+                let pct = (tc / max_cycles_in_sample_period * 100.0) as f32;
+                load.load_percent = pct;
+            }
+            frame.write_lock_spikes =
+                finish_lock_loads(sample, &mut lock_loads, max_cycles_in_sample_period);
+        }
+        frame.thread_loads = thread_loads;
+        frame.lock_loads = lock_loads;
 
         #[allow(clippy::cast_possible_truncation)]
         let load_pct_f32 = frame.fex_load_percent as f32;
@@ -167,9 +264,42 @@ impl Accumulator {
             high_sigbus: frame.total_sigbus_count >= HIGH_SIGBUS_THRESHOLD,
             high_softfloat: frame.total_float_fallback_count >= HIGH_SOFTFLOAT_THRESHOLD,
         };
+    }
+}
 
-        frame
+/// Sorts `lock_loads` busiest first and fills in their load; returns how
+/// many threads of `sample` spiked on the write lock.
+fn finish_lock_loads(
+    sample: &SampleResult,
+    lock_loads: &mut [ThreadLoad],
+    max_cycles_in_sample_period: f64,
+) -> u32 {
+    lock_loads.sort_unstable_by(|a, b| {
+        b.total_cycles
+            .cmp(&a.total_cycles)
+            .then_with(|| a.tid.cmp(&b.tid))
+    });
+    for load in lock_loads {
+        #[allow(clippy::cast_precision_loss)]
+        let tc = load.total_cycles as f64;
+        #[allow(clippy::cast_possible_truncation)]
+        let pct = (tc / max_cycles_in_sample_period * 100.0) as f32;
+        load.load_percent = pct;
     }
+
+    let spike_cycles = max_cycles_in_sample_period * WRITE_LOCK_SPIKE_PERCENT / 100.0;
+    let spikes = sample
+        .per_thread
+        .iter()
+        .filter(|d| {
+            #[allow(clippy::cast_precision_loss)]
+            let write = d.cache_write_lock_time as f64;
+            write >= spike_cycles
+        })
+        .count();
+    #[allow(clippy::cast_possible_truncation)]
+    let spikes = spikes as u32;
+    spikes
 }
 
 #[cfg(test)]
@@ -185,6 +315,7 @@ mod tests {
             timestamp: Instant::now(),
             per_thread: deltas,
             threads_sampled: count,
+            rejected: 0,
         }
     }
 
@@ -288,6 +419,51 @@ mod tests {
         assert_eq!(frame.thread_loads[1].tid, 2);
     }
 
+    #[test]
+    fn lock_loads_and_write_lock_spikes() {
+        // 1000 cycles per period: a spike is at least 50 write lock cycles.
+        let acc = Accumulator::new(1_000.0, 1);
+        let deltas = vec![
+            ThreadDelta {
+                tid: 1,
+                jit_time: 500,
+                cache_read_lock_time: 10,
+                ..ThreadDelta::default()
+            },
+            ThreadDelta {
+                tid: 2,
+                cache_write_lock_time: 50,
+                ..ThreadDelta::default()
+            },
+            ThreadDelta {
+                tid: 3,
+                jit_time: 900,
+                ..ThreadDelta::default()
+            },
+            ThreadDelta {
+                tid: 4,
+                cache_read_lock_time: 100,
+                cache_write_lock_time: 200,
+                ..ThreadDelta::default()
+            },
+        ];
+        let frame = acc.compute_frame(
+            &make_sample(deltas),
+            &MemSnapshot::default(),
+            1_000_000_000,
+            0,
+            CumulativeCountStats::default(),
+        );
+
+        // Not capped at hardware concurrency, and idle threads are left out.
+        let tids: Vec<_> = frame.lock_loads.iter().map(|l| l.tid).collect();
+        assert_eq!(tids, [4, 2, 1]);
+        assert_eq!(frame.lock_loads[0].total_cycles, 300);
+        assert!((frame.lock_loads[0].load_percent - 30.0).abs() < 0.01);
+        assert_eq!(frame.write_lock_spikes, 2);
+        assert_eq!(frame.thread_loads.len(), 1);
+    }
+
     #[test]
     fn totals_are_summed_across_threads() {
         let acc = Accumulator::new(1_000_000_000.0, 4);
@@ -363,4 +539,48 @@ mod tests {
         assert_eq!(frame.cumulative.cache_miss, 400);
         assert_eq!(frame.cumulative.jit, 500);
     }
+
+    /// `cargo test --release -- --ignored bench_ --nocapture --test-threads=1`.
+    ///
+    /// Frames of 10 to 10,000 threads, reusing the frame as the live
+    /// pipeline does.
+    #[test]
+    #[ignore = "benchmark"]
+    fn bench_compute_frame() {
+        let acc = Accumulator::new(1_000_000_000.0, 8);
+        for threads in [10u32, 100, 1000, 10_000] {
+            let sample = make_sample(
+                (0..threads)
+                    .map(|i| ThreadDelta {
+                        tid: 1000 + i,
+                        jit_time: u64::from(i) * 997 % 1_000_000,
+                        signal_time: u64::from(i % 7),
+                        jit_count: u64::from(i % 11),
+                        ..ThreadDelta::default()
+                    })
+                    .collect(),
+            );
+            let mem = MemSnapshot::default();
+            let mut frame = ComputedFrame::default();
+            let iters = (1_000_000 / threads).clamp(10, 10_000);
+
+            let start = Instant::now();
+            for _ in 0..iters {
+                acc.compute_frame_into(
+                    std::hint::black_box(&sample),
+                    &mem,
+                    100_000_000,
+                    0,
+                    CumulativeCountStats::default(),
+                    &mut frame,
+                );
+            }
+            let per_iter = start.elapsed() / iters;
+            assert_eq!(frame.threads_sampled, threads as usize);
+            eprintln!(
+                "compute_frame threads={threads}: {} ns/iter",
+                per_iter.as_nanos()
+            );
+        }
+    }
 }
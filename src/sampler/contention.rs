@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: MIT
+//! Code cache lock contention: how much of the JIT's time goes to the cache
+//! read and write locks, which threads it goes to, and convoys, runs of
+//! frames in which at least `CONVOY_MIN_THREADS` threads spike on the write
+//! lock together (see `ComputedFrame::write_lock_spikes`). A convoy is a run
+//! of consecutive frames, so each `ContentionStats` should see the frames of
+//! one process.
+
+use std::collections::VecDeque;
+
+use serde::{Deserialize, Serialize};
+
+use super::accumulator::ComputedFrame;
+use super::rolling::DdSketch;
+
+/// Threads that must spike on the write lock in one frame for it to be
+/// part of a convoy.
+pub const CONVOY_MIN_THREADS: u32 = 3;
+/// Frames kept for the contention histogram; wider than any terminal.
+const HISTORY_LEN: usize = 1024;
+/// Finished convoys kept for display.
+const RECENT_CONVOYS: usize = 4;
+
+/// Lock time as a percentage of JIT time; `None` without JIT time.
+#[must_use]
+pub fn contention_percent(lock_time: u64, jit_time: u64) -> Option<f64> {
+    #[allow(clippy::cast_precision_loss)]
+    (jit_time > 0).then(|| lock_time as f64 / jit_time as f64 * 100.0)
+}
+
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct Convoy {
+    pub start_ns: u64,
+    /// Timestamp of its last frame.
+    pub end_ns: u64,
+    pub frames: u64,
+    /// Most threads spiking in one of its frames.
+    pub peak_threads: u32,
+}
+
+/// One frame of the contention histogram.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Serialize, Deserialize)]
+pub struct HistoryEntry {
+    pub contention_percent: f32,
+    pub write_lock_spikes: u32,
+}
+
+impl HistoryEntry {
+    #[must_use]
+    pub fn in_convoy(self) -> bool {
+        self.write_lock_spikes >= CONVOY_MIN_THREADS
+    }
+}
+
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct ThreadLockTime {
+    pub tid: u32,
+    /// Read plus write lock time, in cycles.
+    pub lock_time: u64,
+}
+
+/// Lock contention of the frames seen so far.
+#[derive(Clone, Debug, Default, Serialize, Deserialize)]
+pub struct ContentionStats {
+    pub frames: u64,
+    pub jit_time: u64,
+    pub read_lock_time: u64,
+    pub write_lock_time: u64,
+    /// Per-frame `contention_percent`, of frames with JIT time.
+    pub contention: DdSketch,
+    /// Sorted by TID.
+    threads: Vec<ThreadLockTime>,
+    history: VecDeque<HistoryEntry>,
+    current: Option<Convoy>,
+    recent: VecDeque<Convoy>,
+    longest: Option<Convoy>,
+    finished: u64,
+    convoy_frames: u64,
+}
+
+impl ContentionStats {
+    pub fn record(&mut self, frame: &ComputedFrame) {
+        let lock_time = frame.total_cache_read_lock_time + frame.total_cache_write_lock_time;
+        let percent = contention_percent(lock_time, frame.total_jit_time);
+        self.frames += 1;
+        self.jit_time += frame.total_jit_time;
+        self.read_lock_time += frame.total_cache_read_lock_time;
+        self.write_lock_time += frame.total_cache_write_lock_time;
+        if let Some(p) = percent {
+            self.contention.add(p);
+        }
+
+        for load in &frame.lock_loads {
+            match self.threads.binary_search_by_key(&load.tid, |t| t.tid) {
+                Ok(i) => self.threads[i].lock_time += load.total_cycles,
+                Err(i) => self.threads.insert(
+                    i,
+                    ThreadLockTime {
+                        tid: load.tid,
+                        lock_time: load.total_cycles,
+                    },
+                ),
+            }
+        }
+
+        if self.history.len() == HISTORY_LEN {
+            self.history.pop_front();
+        }
+        #[allow(clippy::cast_possible_truncation)]
+        self.history.push_back(HistoryEntry {
+            contention_percent: percent.unwrap_or(0.0) as f32,
+            write_lock_spikes: frame.write_lock_spikes,
+        });
+
+        if frame.write_lock_spikes >= CONVOY_MIN_THREADS {
+            self.convoy_frames += 1;
+            let convoy = self.current.get_or_insert(Convoy {
+                start_ns: frame.timestamp_ns,
+                ..Convoy::default()
+            });
+            convoy.end_ns = frame.timestamp_ns;
+            convoy.frames += 1;
+            convoy.peak_threads = convoy.peak_threads.max(frame.write_lock_spikes);
+        } else if let Some(convoy) = self.current.take() {
+            self.finished += 1;
+            if self.longest.is_none_or(|l| convoy.frames > l.frames) {
+                self.longest = Some(convoy);
+            }
+            if self.recent.len() == RECENT_CONVOYS {
+                self.recent.pop_front();
+            }
+            self.recent.push_back(convoy);
+        }
+    }
+
+    #[must_use]
+    pub fn lock_time(&self) -> u64 {
+        self.read_lock_time + self.write_lock_time
+    }
+
+    /// Lock time as a percentage of JIT time over all frames.
+    #[must_use]
+    pub fn contention_percent(&self) -> Option<f64> {
+        contention_percent(self.lock_time(), self.jit_time)
+    }
+
+    /// Threads that spent time on the locks.
+    #[must_use]
+    pub fn thread_count(&self) -> usize {
+        self.threads.len()
+    }
+
+    /// The `k` threads with the most lock time, each with its share of
+    /// all of it in percent; ties go to the lower TID.
+    #[must_use]
+    pub fn top_threads(&self, k: usize) -> Vec<(ThreadLockTime, f64)> {
+        let mut threads = self.threads.clone();
+        threads.sort_by_key(|t| std::cmp::Reverse(t.lock_time));
+        threads.truncate(k);
+        let total = self.lock_time().max(1);
+        threads
+            .into_iter()
+            .map(|t| {
+                #[allow(clippy::cast_precision_loss)]
+                let share = t.lock_time as f64 / total as f64 * 100.0;
+                (t, share)
+            })
+            .collect()
+    }
+
+    /// The last `HISTORY_LEN` frames, oldest first.
+    #[must_use]
+    pub fn history(&self) -> &VecDeque<HistoryEntry> {
+        &self.history
+    }
+
+    /// The convoy the latest frame is part of.
+    #[must_use]
+    pub fn current_convoy(&self) -> Option<&Convoy> {
+        self.current.as_ref()
+    }
+
+    /// The last few finished convoys, oldest first.
+    #[must_use]
+    pub fn recent_convoys(&self) -> &VecDeque<Convoy> {
+        &self.recent
+    }
+
+    /// The convoy of the most frames, including one still going on.
+    #[must_use]
+    pub fn longest_convoy(&self) -> Option<Convoy> {
+        match (self.longest, self.current) {
+            (Some(l), Some(c)) if c.frames > l.frames => Some(c),
+            (None, current) => current,
+            (longest, _) => longest,
+        }
+    }
+
+    /// Convoys so far, including one still going on.
+    #[must_use]
+    pub fn convoy_count(&self) -> u64 {
+        self.finished + u64::from(self.current.is_some())
+    }
+
+    /// Frames that were part of a convoy.
+    #[must_use]
+    pub fn convoy_frames(&self) -> u64 {
+        self.convoy_frames
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::sampler::accumulator::ThreadLoad;
+
+    fn frame(timestamp_ns: u64, jit: u64, locks: &[(u32, u64)], spikes: u32) -> ComputedFrame {
+        ComputedFrame {
+            timestamp_ns,
+            total_jit_time: jit,
+            total_cache_write_lock_time: locks.iter().map(|l| l.1).sum(),
+            lock_loads: locks
+                .iter()
+                .map(|&(tid, total_cycles)| ThreadLoad {
+                    tid,
+                    load_percent: 0.0,
+                    total_cycles,
+                })
+                .collect(),
+            write_lock_spikes: spikes,
+            ..ComputedFrame::default()
+        }
+    }
+
+    #[test]
+    fn shares_and_ratio_add_up_over_frames() {
+        let mut stats = ContentionStats::default();
+        stats.record(&frame(0, 1000, &[(7, 100), (3, 50)], 0));
+        stats.record(&frame(1, 1000, &[(3, 150)], 0));
+        stats.record(&frame(2, 0, &[], 0));
+
+        assert_eq!(stats.frames, 3);
+        assert_eq!(stats.thread_count(), 2);
+        assert!((stats.contention_percent().unwrap() - 15.0).abs() < f64::EPSILON);
+        let top = stats.top_threads(5);
+        assert_eq!(top.len(), 2);
+        assert_eq!(top[0].0.tid, 3);
+        assert!((top[0].1 - 200.0 / 3.0).abs() < 1e-9);
+        // The frame without JIT time has no ratio but is still charted.
+        assert_eq!(stats.contention.count(), 2);
+        assert_eq!(stats.history().len(), 3);
+        assert!(contention_percent(5, 0).is_none());
+    }
+
+    #[test]
+    fn convoys_are_runs_of_spiking_frames() {
+        let mut stats = ContentionStats::default();
+        let spikes = [0, 3, 4, 0, 2, 5, 5, 5, 0, 3];
+        for (i, &s) in spikes.iter().enumerate() {
+            stats.record(&frame(i as u64 * 10, 100, &[], s));
+        }
+
+        assert_eq!(stats.convoy_count(), 3);
+        assert_eq!(stats.convoy_frames(), 6);
+        assert_eq!(
+            stats.longest_convoy(),
+            Some(Convoy {
+                start_ns: 50,
+                end_ns: 70,
+                frames: 3,
+                peak_threads: 5,
+            })
+        );
+        assert_eq!(stats.recent_convoys().len(), 2);
+        assert_eq!(stats.recent_convoys()[0].peak_threads, 4);
+        assert_eq!(stats.current_convoy().map(|c| c.start_ns), Some(90));
+        assert!(stats.history().back().unwrap().in_convoy());
+    }
+
+    #[test]
+    fn history_keeps_the_latest_frames() {
+        let mut stats = ContentionStats::default();
+        for i in 0..HISTORY_LEN as u64 + 10 {
+            stats.record(&frame(i, 100, &[(1, i)], 0));
+        }
+        assert_eq!(stats.history().len(), HISTORY_LEN);
+        assert!((stats.history()[0].contention_percent - 10.0).abs() < f32::EPSILON);
+    }
+}
@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: MIT
+//! Absolute-deadline scheduling for the headless sampler. Deadlines are
+//! multiples of the period from a fixed start on the monotonic counter, so
+//! sleep overshoot on one iteration does not push back every later one.
+
+use std::time::Duration;
+
+use crate::fex::platform::{monotonic_counter, monotonic_counter_frequency};
+
+const NANOS_PER_SEC: u128 = 1_000_000_000;
+
+pub struct DeadlineTimer {
+    freq: u64,
+    period_ticks: u64,
+    spin_ticks: u64,
+    next: u64,
+    missed: u64,
+}
+
+impl DeadlineTimer {
+    /// Starts a timer whose first deadline is one `period` from now. Each
+    /// wait sleeps until `spin` before the deadline and busy-polls the rest.
+    #[must_use]
+    pub fn new(period: Duration, spin: Duration) -> Self {
+        let freq = monotonic_counter_frequency();
+        let period_ticks = duration_to_ticks(period, freq).max(1);
+        let start = monotonic_counter();
+        Self {
+            freq,
+            period_ticks,
+            spin_ticks: duration_to_ticks(spin, freq),
+            next: start + period_ticks,
+            missed: 0,
+        }
+    }
+
+    /// Blocks until the next deadline and returns how late, in nanoseconds,
+    /// it woke up. Deadlines already passed by more than a period are
+    /// skipped and counted in `missed`, rather than fired back to back.
+    ///
+    /// The sleep is left to `idle`, called with the time left to sleep
+    /// until it has all passed, and at least once, with zero if there is
+    /// none. `idle` may return early, e.g. to handle an event, and is
+    /// called again with what remains.
+    pub fn wait_with(&mut self, mut idle: impl FnMut(Duration)) -> u64 {
+        let mut now = monotonic_counter();
+        if now >= self.next + self.period_ticks {
+            let behind = (now - self.next) / self.period_ticks;
+            self.missed += behind;
+            self.next += behind * self.period_ticks;
+        }
+
+        let sleep_until = self.next.saturating_sub(self.spin_ticks);
+        loop {
+            idle(ticks_to_duration(
+                sleep_until.saturating_sub(now),
+                self.freq,
+            ));
+            now = monotonic_counter();
+            if now >= sleep_until {
+                break;
+            }
+        }
+        while now < self.next {
+            std::hint::spin_loop();
+            now = monotonic_counter();
+        }
+
+        let late = ticks_to_duration(now - self.next, self.freq);
+        self.next += self.period_ticks;
+        u64::try_from(late.as_nanos()).unwrap_or(u64::MAX)
+    }
+
+    /// Deadlines skipped because the sampler was more than a period late.
+    #[must_use]
+    pub fn missed(&self) -> u64 {
+        self.missed
+    }
+}
+
+fn duration_to_ticks(d: Duration, freq: u64) -> u64 {
+    let ticks = d.as_nanos() * u128::from(freq) / NANOS_PER_SEC;
+    u64::try_from(ticks).unwrap_or(u64::MAX)
+}
+
+fn ticks_to_duration(ticks: u64, freq: u64) -> Duration {
+    let ns = u128::from(ticks) * NANOS_PER_SEC / u128::from(freq);
+    Duration::from_nanos(u64::try_from(ns).unwrap_or(u64::MAX))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn sleep(timeout: Duration) {
+        std::thread::sleep(timeout);
+    }
+
+    #[test]
+    fn tick_conversions_round_trip() {
+        let freq = 24_000_000;
+        let d = Duration::from_micros(250);
+        assert_eq!(duration_to_ticks(d, freq), 6_000);
+        assert_eq!(ticks_to_duration(6_000, freq), d);
+    }
+
+    #[test]
+    fn deadlines_do_not_drift() {
+        let freq = monotonic_counter_frequency();
+        let start = monotonic_counter();
+        let mut timer = DeadlineTimer::new(Duration::from_millis(2), Duration::from_micros(200));
+        for k in 1..=10u32 {
+            let late = timer.wait_with(sleep);
+            let woke = ticks_to_duration(monotonic_counter() - start, freq);
+            // Never early: each wake-up is anchored to start + k * period.
+            assert!(woke >= Duration::from_millis(2) * k, "sample {k} early");
+            assert!(woke >= Duration::from_millis(2) * k + Duration::from_nanos(late));
+        }
+    }
+
+    #[test]
+    fn idle_may_return_early() {
+        let mut timer = DeadlineTimer::new(Duration::from_millis(5), Duration::ZERO);
+        let mut calls = 0;
+        timer.wait_with(|timeout| {
+            calls += 1;
+            std::thread::sleep(timeout.min(Duration::from_millis(1)));
+        });
+        // Called until the whole sleep has passed.
+        assert!(calls >= 4, "{calls} calls");
+
+        // Late: called once, with nothing left to wait.
+        std::thread::sleep(Duration::from_millis(6));
+        let mut timeouts = Vec::new();
+        timer.wait_with(|timeout| timeouts.push(timeout));
+        assert_eq!(timeouts, [Duration::ZERO]);
+    }
+
+    #[test]
+    fn late_sampler_skips_missed_deadlines() {
+        let mut timer = DeadlineTimer::new(Duration::from_millis(1), Duration::ZERO);
+        std::thread::sleep(Duration::from_millis(6));
+        let late = timer.wait_with(sleep);
+        assert!(timer.missed() >= 4, "missed {}", timer.missed());
+        // Lateness is against the deadline actually waited for, not the
+        // first one ~5 ms ago.
+        assert!(late < 5_000_000, "late {late} ns");
+    }
+}
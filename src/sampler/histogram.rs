@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: MIT
+//! Multi-resolution JIT load history. Level 0 holds one bucket per frame and
+//! each level above aggregates `FANOUT` buckets of the one below into their
+//! mean, max and OR-ed `high_*` flags. Levels are extended as frames arrive,
+//! so a view of any zoom is `O(width)` to produce no matter how long the
+//! session is. Replay builds the coarse levels from buckets stored in the
+//! recording and loads the finer ones only for the frames in view.
+
+use std::collections::VecDeque;
+use std::ops::Range;
+
+use serde::{Deserialize, Serialize};
+
+use super::accumulator::HistogramEntry;
+
+/// Buckets of one level that make up a bucket of the next.
+pub const FANOUT: usize = 4;
+
+/// Aggregate of a run of frames.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Serialize, Deserialize)]
+pub struct Bucket {
+    pub mean: f32,
+    pub max: f32,
+    /// `FLAG_*` bits of any frame in the run.
+    pub flags: u8,
+}
+
+impl Bucket {
+    #[must_use]
+    pub fn from_entry(entry: &HistogramEntry) -> Self {
+        Self {
+            mean: entry.load_percent,
+            max: entry.load_percent,
+            flags: entry.flags(),
+        }
+    }
+}
+
+/// Running aggregate of buckets of possibly different sizes.
+#[derive(Clone, Copy, Default)]
+struct Partial {
+    sum: f64,
+    count: u64,
+    max: f32,
+    flags: u8,
+}
+
+impl Partial {
+    fn add(&mut self, bucket: &Bucket, frames: u64) {
+        #[allow(clippy::cast_precision_loss)]
+        let weight = frames as f64;
+        self.sum += f64::from(bucket.mean) * weight;
+        self.count += frames;
+        self.max = self.max.max(bucket.max);
+        self.flags |= bucket.flags;
+    }
+
+    fn bucket(&self) -> Option<Bucket> {
+        #[allow(clippy::cast_precision_loss, clippy::cast_possible_truncation)]
+        let mean = (self.sum / self.count as f64) as f32;
+        (self.count > 0).then_some(Bucket {
+            mean,
+            max: self.max,
+            flags: self.flags,
+        })
+    }
+}
+
+struct Level {
+    buckets: VecDeque<Bucket>,
+    /// Index of `buckets[0]` among all buckets of this level, counting any
+    /// already dropped.
+    first: u64,
+}
+
+impl Level {
+    fn get(&self, index: u64) -> Option<&Bucket> {
+        let offset = usize::try_from(index.checked_sub(self.first)?).ok()?;
+        self.buckets.get(offset)
+    }
+}
+
+pub struct HistogramPyramid {
+    levels: Vec<Level>,
+    len: u64,
+    /// Buckets kept per level; `None` keeps everything.
+    capacity: Option<usize>,
+    /// For a pyramid from `from_coarse`, the level it was built from.
+    coarse: Option<Coarse>,
+}
+
+struct Coarse {
+    level: usize,
+    /// Frames whose buckets below `level` are loaded.
+    loaded: Range<u64>,
+}
+
+impl HistogramPyramid {
+    /// A pyramid keeping only the last `capacity` buckets of each level,
+    /// for live sessions: every zoom level still reaches back `capacity`
+    /// columns, and the coarsest covers the whole session.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `capacity` is less than `FANOUT`.
+    #[must_use]
+    pub fn rolling(capacity: usize) -> Self {
+        assert!(capacity >= FANOUT, "capacity must hold a full bucket");
+        Self {
+            levels: Vec::new(),
+            len: 0,
+            capacity: Some(capacity),
+            coarse: None,
+        }
+    }
+
+    /// A pyramid keeping every bucket, for replay.
+    #[must_use]
+    pub fn unbounded() -> Self {
+        Self {
+            levels: Vec::new(),
+            len: 0,
+            capacity: None,
+            coarse: None,
+        }
+    }
+
+    /// A replay pyramid of `len` frames whose levels from `level` up are
+    /// folded from `buckets`, the complete buckets of `level`. The finer
+    /// levels start empty; `missing` and `fill` load them for the frames in
+    /// view.
+    #[must_use]
+    pub fn from_coarse(level: usize, buckets: &[Bucket], len: u64) -> Self {
+        let mut pyramid = Self::unbounded();
+        pyramid.len = len;
+        pyramid.coarse = Some(Coarse {
+            level,
+            loaded: 0..0,
+        });
+        // The levels a pyramid pushed `len` frames would have.
+        for below in 0..level {
+            if len >= Self::frames_per_bucket(below) {
+                pyramid.levels.push(Level {
+                    buckets: VecDeque::new(),
+                    first: 0,
+                });
+            }
+        }
+        for (n, bucket) in (1..).zip(buckets) {
+            pyramid.push_bucket(level, *bucket);
+            pyramid.fold(level, n);
+        }
+        pyramid
+    }
+
+    /// Frames pushed so far.
+    #[must_use]
+    pub fn len(&self) -> u64 {
+        self.len
+    }
+
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Number of distinct zoom levels with data.
+    #[must_use]
+    pub fn levels(&self) -> usize {
+        self.levels.len()
+    }
+
+    /// Frames aggregated by one bucket of `level`.
+    #[must_use]
+    pub fn frames_per_bucket(level: usize) -> u64 {
+        let level = u32::try_from(level).unwrap_or(u32::MAX);
+        (FANOUT as u64).saturating_pow(level)
+    }
+
+    pub fn push(&mut self, entry: &HistogramEntry) {
+        self.push_bucket(0, Bucket::from_entry(entry));
+        self.len += 1;
+        self.fold(0, self.len);
+    }
+
+    /// Each time a level completes FANOUT buckets, they fold into one
+    /// bucket of the next; `n` buckets of `level` have been pushed.
+    fn fold(&mut self, mut level: usize, mut n: u64) {
+        while n.is_multiple_of(FANOUT as u64) {
+            n /= FANOUT as u64;
+            let below = &self.levels[level].buckets;
+            let mut mean = 0.0;
+            let mut merged = Bucket::default();
+            for b in below.range(below.len() - FANOUT..) {
+                mean += b.mean;
+                merged.max = merged.max.max(b.max);
+                merged.flags |= b.flags;
+            }
+            #[allow(clippy::cast_precision_loss)]
+            {
+                merged.mean = mean / FANOUT as f32;
+            }
+            level += 1;
+            self.push_bucket(level, merged);
+        }
+    }
+
+    fn push_bucket(&mut self, level: usize, bucket: Bucket) {
+        if level == self.levels.len() {
+            self.levels.push(Level {
+                buckets: VecDeque::new(),
+                first: 0,
+            });
+        }
+        let l = &mut self.levels[level];
+        if self.capacity.is_some_and(|cap| l.buckets.len() >= cap) {
+            l.buckets.pop_front();
+            l.first += 1;
+        }
+        l.buckets.push_back(bucket);
+    }
+
+    /// Frames to `fill` before `view(level, end, width)` of a pyramid from
+    /// `from_coarse`, aligned to its coarse buckets: those of the columns
+    /// below the coarse level and of the coarse bucket holding frame `end`.
+    /// `None` if they are loaded, or the pyramid has every level.
+    #[must_use]
+    pub fn missing(&self, level: usize, end: u64, width: usize) -> Option<Range<u64>> {
+        let coarse = self.coarse.as_ref()?;
+        let span = Self::frames_per_bucket(coarse.level);
+        let end = end.min(self.len);
+        let first = if level < coarse.level {
+            end.saturating_sub(width as u64 * Self::frames_per_bucket(level))
+        } else {
+            end
+        };
+        let from = first / span * span;
+        let to = (end / span + 1).saturating_mul(span).min(self.len);
+        (from < to && !(coarse.loaded.start <= from && to <= coarse.loaded.end)).then_some(from..to)
+    }
+
+    /// Replaces the levels below the coarse one with the buckets of
+    /// `entries`, the frames from `from` on; `from` is the start of a coarse
+    /// bucket, as `missing` returns. A no-op for pyramids with every level.
+    pub fn fill(&mut self, from: u64, entries: &[HistogramEntry]) {
+        let Some(coarse) = &mut self.coarse else {
+            return;
+        };
+        let mut window = Self::unbounded();
+        for entry in entries {
+            window.push(entry);
+        }
+        for (below, level) in self.levels.iter_mut().enumerate().take(coarse.level) {
+            level.first = from / Self::frames_per_bucket(below);
+            level.buckets = window
+                .levels
+                .get_mut(below)
+                .map(|l| std::mem::take(&mut l.buckets))
+                .unwrap_or_default();
+        }
+        coarse.loaded = from..from + window.len;
+    }
+
+    /// Fills `out` with up to `width` buckets of `level`, oldest first,
+    /// ending with the one holding frame `end - 1`. A last bucket that is
+    /// still filling is aggregated from the levels below. Buckets no longer
+    /// kept are left out.
+    pub fn view(&self, level: usize, end: u64, width: usize, out: &mut Vec<Bucket>) {
+        out.clear();
+        let end = end.min(self.len);
+        if width == 0 || end == 0 || level >= self.levels.len() {
+            return;
+        }
+        let span = Self::frames_per_bucket(level);
+        let complete = end / span;
+        let partial = self.partial(level, complete * span, end);
+        let wanted = width as u64 - u64::from(partial.is_some());
+        let from = complete.saturating_sub(wanted);
+        let l = &self.levels[level];
+        out.extend((from..complete).filter_map(|i| l.get(i)).copied());
+        out.extend(partial);
+    }
+
+    /// Aggregates frames `from..end`, which lie within one bucket of
+    /// `level`, from complete buckets of the finer levels.
+    fn partial(&self, level: usize, mut from: u64, end: u64) -> Option<Bucket> {
+        let mut acc = Partial::default();
+        for below in (0..level).rev() {
+            let span = Self::frames_per_bucket(below);
+            while from + span <= end {
+                if let Some(b) = self.levels[below].get(from / span) {
+                    acc.add(b, span);
+                }
+                from += span;
+            }
+        }
+        acc.bucket()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::sampler::accumulator::FLAG_HIGH_SIGBUS;
+
+    fn entry(load: f32) -> HistogramEntry {
+        HistogramEntry {
+            load_percent: load,
+            ..HistogramEntry::default()
+        }
+    }
+
+    #[test]
+    fn levels_hold_mean_max_and_flags() {
+        let mut pyramid = HistogramPyramid::unbounded();
+        for i in 0..16u16 {
+            let mut e = entry(f32::from(i));
+            e.high_sigbus = i == 5;
+            pyramid.push(&e);
+        }
+        assert_eq!(pyramid.levels(), 3);
+
+        let mut out = Vec::new();
+        pyramid.view(1, 16, 80, &mut out);
+        assert_eq!(out.len(), 4);
+        assert!((out[1].mean - 5.5).abs() < f32::EPSILON);
+        assert!((out[1].max - 7.0).abs() < f32::EPSILON);
+        assert_eq!(out[1].flags, FLAG_HIGH_SIGBUS);
+        assert_eq!(out[0].flags, 0);
+
+        pyramid.view(2, 16, 80, &mut out);
+        assert_eq!(out.len(), 1);
+        assert!((out[0].mean - 7.5).abs() < f32::EPSILON);
+        assert!((out[0].max - 15.0).abs() < f32::EPSILON);
+    }
+
+    #[test]
+    fn filling_bucket_is_aggregated_from_finer_levels() {
+        let mut pyramid = HistogramPyramid::unbounded();
+        for _ in 0..16 {
+            pyramid.push(&entry(10.0));
+        }
+        // 16 + 4 + 1 frames: the second level-2 bucket is 5/16 full.
+        for _ in 0..5 {
+            pyramid.push(&entry(40.0));
+        }
+        let mut out = Vec::new();
+        pyramid.view(2, pyramid.len(), 80, &mut out);
+        assert_eq!(out.len(), 2);
+        assert!((out[1].mean - 40.0).abs() < f32::EPSILON);
+        assert!((out[1].max - 40.0).abs() < f32::EPSILON);
+
+        // Ending the view in the middle of the history, as replay does.
+        pyramid.view(0, 10, 3, &mut out);
+        assert_eq!(out.len(), 3);
+        pyramid.view(1, 10, 80, &mut out);
+        assert_eq!(out.len(), 3);
+    }
+
+    #[test]
+    fn coarse_pyramid_matches_once_the_view_is_loaded() {
+        let entries: Vec<_> = (0..1000u16)
+            .map(|i| {
+                let mut e = entry(f32::from(i % 37));
+                e.high_sigbus = i % 101 == 0;
+                e
+            })
+            .collect();
+        // The level-3 buckets kept as a recording writer does.
+        let mut full = HistogramPyramid::unbounded();
+        let mut rolling = HistogramPyramid::rolling(FANOUT);
+        let mut buckets = Vec::new();
+        let mut last = Vec::new();
+        for (n, e) in (1..).zip(&entries) {
+            full.push(e);
+            rolling.push(e);
+            if n % 64 == 0 {
+                rolling.view(3, n, 1, &mut last);
+                buckets.extend(last.pop());
+            }
+        }
+        let mut pyramid = HistogramPyramid::from_coarse(3, &buckets, 1000);
+        assert_eq!(pyramid.levels(), full.levels());
+
+        let (mut want, mut got) = (Vec::new(), Vec::new());
+        for (level, end, width) in [(4, 1000, 80), (1, 500, 20), (0, 999, 30), (3, 640, 5)] {
+            if let Some(range) = pyramid.missing(level, end, width) {
+                #[allow(clippy::cast_possible_truncation)]
+                let frames = range.start as usize..range.end as usize;
+                pyramid.fill(range.start, &entries[frames]);
+            }
+            assert_eq!(pyramid.missing(level, end, width), None);
+            full.view(level, end, width, &mut want);
+            pyramid.view(level, end, width, &mut got);
+            assert_eq!(got, want, "level {level}, end {end}");
+        }
+    }
+
+    #[test]
+    fn rolling_pyramid_still_spans_the_session() {
+        let mut pyramid = HistogramPyramid::rolling(8);
+        for i in 0..1000u16 {
+            pyramid.push(&entry(f32::from(i % 100)));
+        }
+        let mut out = Vec::new();
+        pyramid.view(0, pyramid.len(), 80, &mut out);
+        assert_eq!(out.len(), 8);
+        assert!((out[7].mean - 99.0).abs() < f32::EPSILON);
+
+        let top = pyramid.levels() - 1;
+        pyramid.view(top, pyramid.len(), 80, &mut out);
+        let covered = out.len() as u64 * HistogramPyramid::frames_per_bucket(top);
+        assert!(covered >= 1000 - HistogramPyramid::frames_per_bucket(top));
+    }
+}
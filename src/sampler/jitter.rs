@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: MIT
+//! Sampler timing statistics: how late each sample ran against its schedule,
+//! how long taking it cost, and how many thread entries it read torn.
+
+use serde::{Deserialize, Serialize};
+
+use super::accumulator::ComputedFrame;
+
+/// Sub-buckets per power of two; bounds the relative error to 1/8.
+const SUB_BUCKETS: usize = 8;
+const SUB_BITS: u32 = SUB_BUCKETS.trailing_zeros();
+const BUCKETS: usize = (64 - SUB_BITS as usize + 1) * SUB_BUCKETS;
+
+/// Fixed-size log-linear histogram of nanosecond durations. Recording is a
+/// couple of integer ops and never allocates, so it can sit on the sampling
+/// path.
+#[derive(Clone, Serialize, Deserialize)]
+pub struct DurationHistogram {
+    #[serde(with = "boxed_buckets")]
+    buckets: Box<[u64; BUCKETS]>,
+    count: u64,
+    max: u64,
+}
+
+impl Default for DurationHistogram {
+    fn default() -> Self {
+        Self {
+            buckets: Box::new([0; BUCKETS]),
+            count: 0,
+            max: 0,
+        }
+    }
+}
+
+impl DurationHistogram {
+    pub fn record(&mut self, ns: u64) {
+        self.buckets[bucket_index(ns)] += 1;
+        self.count += 1;
+        self.max = self.max.max(ns);
+    }
+
+    #[must_use]
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    /// Upper bound of the bucket holding the `q` quantile (`0.0..=1.0`),
+    /// capped at the largest recorded value. 0 if nothing was recorded.
+    #[must_use]
+    pub fn percentile(&self, q: f64) -> u64 {
+        if self.count == 0 {
+            return 0;
+        }
+        #[allow(
+            clippy::cast_possible_truncation,
+            clippy::cast_sign_loss,
+            clippy::cast_precision_loss
+        )]
+        let rank = ((q.clamp(0.0, 1.0) * self.count as f64).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (i, &n) in self.buckets.iter().enumerate() {
+            seen += n;
+            if seen >= rank {
+                return bucket_upper(i).min(self.max);
+            }
+        }
+        self.max
+    }
+}
+
+/// Serde only derives arrays of up to 32 elements.
+mod boxed_buckets {
+    use serde::de::Error;
+    use serde::{Deserialize, Deserializer, Serializer};
+
+    use super::BUCKETS;
+
+    #[allow(clippy::borrowed_box)]
+    pub fn serialize<S: Serializer>(
+        buckets: &Box<[u64; BUCKETS]>,
+        s: S,
+    ) -> Result<S::Ok, S::Error> {
+        s.collect_seq(buckets.iter())
+    }
+
+    pub fn deserialize<'de, D: Deserializer<'de>>(d: D) -> Result<Box<[u64; BUCKETS]>, D::Error> {
+        let buckets = Vec::<u64>::deserialize(d)?;
+        let len = buckets.len();
+        buckets
+            .into_boxed_slice()
+            .try_into()
+            .map_err(|_| D::Error::invalid_length(len, &"one count per bucket"))
+    }
+}
+
+fn bucket_index(ns: u64) -> usize {
+    if ns < SUB_BUCKETS as u64 {
+        #[allow(clippy::cast_possible_truncation)]
+        return ns as usize;
+    }
+    let exp = 63 - ns.leading_zeros();
+    #[allow(clippy::cast_possible_truncation)]
+    let sub = ((ns >> (exp - SUB_BITS)) as usize) & (SUB_BUCKETS - 1);
+    (exp - SUB_BITS + 1) as usize * SUB_BUCKETS + sub
+}
+
+fn bucket_upper(index: usize) -> u64 {
+    if index < SUB_BUCKETS {
+        return index as u64;
+    }
+    #[allow(clippy::cast_possible_truncation)]
+    let shift = (index / SUB_BUCKETS) as u32 - 1;
+    let sub = (index % SUB_BUCKETS) as u64;
+    let lower = (SUB_BUCKETS as u64 + sub) << shift;
+    lower + ((1u64 << shift) - 1)
+}
+
+/// Lateness and overhead distributions over a run of frames.
+#[derive(Clone, Default, Serialize, Deserialize)]
+pub struct SamplerTiming {
+    pub lateness: DurationHistogram,
+    pub overhead: DurationHistogram,
+    pub torn_reads: u64,
+}
+
+impl SamplerTiming {
+    /// Adds a frame's timing. Frames from recordings that predate these
+    /// fields carry no overhead and are skipped.
+    pub fn record(&mut self, frame: &ComputedFrame) {
+        if frame.sample_overhead_ns == 0 {
+            return;
+        }
+        self.lateness.record(frame.sample_lateness_ns);
+        self.overhead.record(frame.sample_overhead_ns);
+        self.torn_reads += u64::from(frame.torn_reads);
+    }
+
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.overhead.count() == 0
+    }
+}
+
+/// Formats nanoseconds as microseconds, or milliseconds from 10 ms up.
+#[must_use]
+pub fn format_duration_ns(ns: u64) -> String {
+    if ns >= 10_000_000 {
+        format!("{}ms", ns / 1_000_000)
+    } else {
+        format!("{}\u{b5}s", ns / 1_000)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn buckets_are_contiguous_and_bounded() {
+        let mut prev = 0;
+        for ns in (0..100_000u64).chain([u64::MAX / 3, u64::MAX]) {
+            let i = bucket_index(ns);
+            assert!(i < BUCKETS);
+            assert!(i >= prev || ns > 100_000);
+            prev = i;
+            let upper = bucket_upper(i);
+            assert!(upper >= ns, "{ns} above bucket bound {upper}");
+            // Relative error at most one sub-bucket.
+            assert!(upper - ns <= ns / SUB_BUCKETS as u64 + 1);
+        }
+    }
+
+    #[test]
+    fn percentiles_track_distribution() {
+        let mut h = DurationHistogram::default();
+        assert_eq!(h.percentile(0.5), 0);
+        for _ in 0..98 {
+            h.record(10_000);
+        }
+        h.record(1_000_000);
+        h.record(5_000_000);
+        let p50 = h.percentile(0.5);
+        assert!((10_000..=11_250).contains(&p50), "p50 {p50}");
+        let p99 = h.percentile(0.99);
+        assert!((1_000_000..=1_125_000).contains(&p99), "p99 {p99}");
+        assert_eq!(h.percentile(1.0), 5_000_000);
+    }
+
+    #[test]
+    fn timing_skips_frames_without_overhead() {
+        let mut t = SamplerTiming::default();
+        t.record(&ComputedFrame::default());
+        assert!(t.is_empty());
+        t.record(&ComputedFrame {
+            sample_lateness_ns: 5,
+            sample_overhead_ns: 7,
+            torn_reads: 2,
+            ..ComputedFrame::default()
+        });
+        assert_eq!(t.torn_reads, 2);
+        assert_eq!(t.lateness.percentile(0.5), 5);
+        assert_eq!(t.overhead.percentile(0.5), 7);
+    }
+}
@@ -1,41 +1,197 @@
 // SPDX-License-Identifier: MIT
-use std::sync::atomic::{AtomicBool, Ordering};
-use std::sync::{Arc, Mutex};
+use std::cell::UnsafeCell;
+use std::sync::atomic::{AtomicBool, AtomicU8, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
 use std::thread;
-use std::time::Duration;
+use std::time::{Duration, Instant};
 
 use crate::fex::smaps::{MemSampler, MemSnapshot};
 
+/// Default `MemPeriods::min`, in milliseconds.
+pub const MIN_MEM_PERIOD_MS: u64 = 100;
+
+/// Bounds of the memory sampling interval.
+#[derive(Debug, Clone, Copy)]
+pub struct MemPeriods {
+    /// Memory is never sampled more often than this, however short the
+    /// thread-stats period is: the cap on how often `/proc` is read.
+    pub min: Duration,
+    /// Longest the sampler backs off to while memory is stable.
+    pub max: Duration,
+}
+
+/// A memory snapshot and when it was taken.
+#[derive(Debug, Clone, Default)]
+pub struct MemSample {
+    pub snapshot: MemSnapshot,
+    /// `None` until the first sample completes.
+    pub sampled_at: Option<Instant>,
+    /// Total time spent sampling this process's memory so far.
+    pub busy_ns: u64,
+}
+
+impl MemSample {
+    /// Nanoseconds between the sample and `now`, or 0 if there is none yet.
+    #[must_use]
+    pub fn age_ns(&self, now: Instant) -> u64 {
+        self.sampled_at.map_or(0, |t| {
+            #[allow(clippy::cast_possible_truncation)]
+            let ns = now.saturating_duration_since(t).as_nanos() as u64;
+            ns
+        })
+    }
+}
+
+/// Adaptive interval between memory samples: doubles while the snapshot is
+/// unchanged, holds while it changes, and drops back to the minimum as soon
+/// as JIT code or the lookup cache grows.
+#[derive(Debug, Clone)]
+pub struct MemCadence {
+    min: Duration,
+    max: Duration,
+    current: Duration,
+}
+
+impl MemCadence {
+    /// Starts at `period`, floored at `limits.min`.
+    #[must_use]
+    pub fn new(period: Duration, limits: MemPeriods) -> Self {
+        let min = period.max(limits.min);
+        Self {
+            min,
+            max: limits.max.max(min),
+            current: min,
+        }
+    }
+
+    /// Returns the delay before the next sample, given the previous and the
+    /// newly taken snapshot.
+    pub fn next(&mut self, prev: Option<&MemSnapshot>, new: &MemSnapshot) -> Duration {
+        self.current = match prev {
+            Some(p) if new.jit_code > p.jit_code || new.lookup > p.lookup => self.min,
+            Some(p) if p == new => (self.current * 2).min(self.max),
+            _ => self.current,
+        };
+        self.current
+    }
+}
+
+/// Set in `TripleBuffer::middle` when the middle slot holds a value the
+/// reader has not taken yet.
+const FRESH: u8 = 0b100;
+const INDEX_MASK: u8 = 0b011;
+
+/// Wait-free single-writer/single-reader publication. Writer and reader each
+/// own one of three slots; publishing and taking are a single atomic swap of
+/// the shared middle slot, so neither side ever blocks the other.
+struct TripleBuffer<T> {
+    slots: [UnsafeCell<T>; 3],
+    /// Index of the middle slot, plus `FRESH`.
+    middle: AtomicU8,
+}
+
+// SAFETY: each slot is owned by exactly one of writer, middle or reader at a
+// time; ownership changes only through `middle.swap` with AcqRel ordering.
+unsafe impl<T: Send> Sync for TripleBuffer<T> {}
+
+pub struct TripleBufferWriter<T> {
+    shared: Arc<TripleBuffer<T>>,
+    slot: u8,
+}
+
+pub struct TripleBufferReader<T> {
+    shared: Arc<TripleBuffer<T>>,
+    slot: u8,
+}
+
+/// Creates a connected writer/reader pair, all slots starting as `initial`.
+#[must_use]
+pub fn triple_buffer<T: Clone>(initial: T) -> (TripleBufferWriter<T>, TripleBufferReader<T>) {
+    let shared = Arc::new(TripleBuffer {
+        slots: [
+            UnsafeCell::new(initial.clone()),
+            UnsafeCell::new(initial.clone()),
+            UnsafeCell::new(initial),
+        ],
+        middle: AtomicU8::new(1),
+    });
+    (
+        TripleBufferWriter {
+            shared: Arc::clone(&shared),
+            slot: 0,
+        },
+        TripleBufferReader { shared, slot: 2 },
+    )
+}
+
+impl<T> TripleBufferWriter<T> {
+    /// Publishes `value`, replacing any value the reader has not taken yet.
+    pub fn publish(&mut self, value: T) {
+        // SAFETY: the writer exclusively owns its slot.
+        unsafe { *self.shared.slots[usize::from(self.slot)].get() = value };
+        let prev = self.shared.middle.swap(self.slot | FRESH, Ordering::AcqRel);
+        self.slot = prev & INDEX_MASK;
+    }
+}
+
+impl<T> TripleBufferReader<T> {
+    /// Takes the most recently published value if there is a new one.
+    /// Returns whether the value changed since the last call.
+    pub fn update(&mut self) -> bool {
+        if self.shared.middle.load(Ordering::Relaxed) & FRESH == 0 {
+            return false;
+        }
+        let prev = self.shared.middle.swap(self.slot, Ordering::AcqRel);
+        self.slot = prev & INDEX_MASK;
+        true
+    }
+
+    /// The value taken by the last `update`.
+    #[must_use]
+    pub fn get(&self) -> &T {
+        // SAFETY: the reader exclusively owns its slot, and `&self` keeps
+        // `update` from handing it back while the reference is alive.
+        unsafe { &*self.shared.slots[usize::from(self.slot)].get() }
+    }
+}
+
 pub struct MemStatsWorker {
-    latest: Arc<Mutex<MemSnapshot>>,
+    latest: TripleBufferReader<MemSample>,
     shutdown: Arc<AtomicBool>,
     handle: Option<thread::JoinHandle<()>>,
 }
 
 impl MemStatsWorker {
-    /// Spawns a background thread that periodically samples `/proc/{pid}/smaps`.
+    /// Spawns a background thread that samples FEX region Rss, starting at
+    /// `sample_period` and backing off to at most `limits.max` while memory
+    /// is stable.
     ///
     /// # Errors
     ///
     /// Returns an error if the initial `MemSampler` cannot be created.
-    pub fn spawn(pid: i32, sample_period: Duration) -> anyhow::Result<Self> {
-        let mut sampler = MemSampler::new(pid)?;
-        let latest = Arc::new(Mutex::new(MemSnapshot::default()));
+    pub fn spawn(pid: i32, sample_period: Duration, limits: MemPeriods) -> anyhow::Result<Self> {
+        let (publisher, latest) = triple_buffer(MemSample::default());
         let shutdown = Arc::new(AtomicBool::new(false));
+        let mut job = MemJob {
+            sampler: MemSampler::new(pid)?,
+            cadence: MemCadence::new(sample_period, limits),
+            prev: None,
+            due: Instant::now(),
+            publisher,
+            // Only read by `MemPool`; this worker stops on `shutdown`.
+            alive: Arc::new(AtomicBool::new(true)),
+            busy_ns: 0,
+        };
 
-        let latest_clone = Arc::clone(&latest);
         let shutdown_clone = Arc::clone(&shutdown);
 
         let handle = thread::Builder::new()
             .name("mem-sampler".into())
             .spawn(move || {
                 while !shutdown_clone.load(Ordering::Relaxed) {
-                    if let Ok(snap) = sampler.sample()
-                        && let Ok(mut guard) = latest_clone.lock()
-                    {
-                        *guard = snap;
-                    }
-                    thread::sleep(sample_period);
+                    job.run();
+                    // Woken early by `shutdown`.
+                    thread::park_timeout(job.due.saturating_duration_since(Instant::now()));
                 }
             })
             .map_err(|e| anyhow::anyhow!("failed to spawn mem-sampler thread: {e}"))?;
@@ -47,16 +203,17 @@ impl MemStatsWorker {
         })
     }
 
-    #[must_use]
-    pub fn latest(&self) -> MemSnapshot {
-        self.latest
-            .lock()
-            .map_or_else(|_| MemSnapshot::default(), |guard| guard.clone())
+    /// The most recent memory sample. Never blocks; only swaps a buffer
+    /// index when the worker has published since the last call.
+    pub fn latest(&mut self) -> &MemSample {
+        self.latest.update();
+        self.latest.get()
     }
 
     pub fn shutdown(&mut self) {
         self.shutdown.store(true, Ordering::Relaxed);
         if let Some(handle) = self.handle.take() {
+            handle.thread().unpark();
             let _ = handle.join();
         }
     }
@@ -67,3 +224,337 @@ impl Drop for MemStatsWorker {
         self.shutdown();
     }
 }
+
+/// A process's memory sampling job inside a `MemPool`.
+struct MemJob {
+    sampler: MemSampler,
+    cadence: MemCadence,
+    prev: Option<MemSnapshot>,
+    due: Instant,
+    publisher: TripleBufferWriter<MemSample>,
+    /// Cleared when the owning `MemHandle` is dropped.
+    alive: Arc<AtomicBool>,
+    busy_ns: u64,
+}
+
+impl MemJob {
+    /// Takes one sample and schedules the next.
+    fn run(&mut self) {
+        let started = Instant::now();
+        let sample = self.sampler.sample();
+        #[allow(clippy::cast_possible_truncation)]
+        let cost = started.elapsed().as_nanos() as u64;
+        self.busy_ns += cost;
+        let delay = if let Ok(snap) = sample {
+            let delay = self.cadence.next(self.prev.as_ref(), &snap);
+            self.publisher.publish(MemSample {
+                snapshot: snap.clone(),
+                sampled_at: Some(Instant::now()),
+                busy_ns: self.busy_ns,
+            });
+            self.prev = Some(snap);
+            delay
+        } else {
+            self.cadence.min
+        };
+        self.due = Instant::now() + delay;
+    }
+}
+
+#[derive(Default)]
+struct PoolQueue {
+    /// Jobs waiting for their next due time; a job being sampled is owned
+    /// by its worker and not in here.
+    jobs: Vec<MemJob>,
+    shutdown: bool,
+}
+
+struct PoolShared {
+    queue: Mutex<PoolQueue>,
+    wake: Condvar,
+}
+
+/// Memory sampling for many processes on a fixed number of threads. Each
+/// process keeps its own adaptive cadence; workers take whichever job is due
+/// next.
+pub struct MemPool {
+    shared: Arc<PoolShared>,
+    handles: Vec<thread::JoinHandle<()>>,
+    sample_period: Duration,
+    limits: MemPeriods,
+}
+
+/// One process's view of a `MemPool`: its latest sample, and its job's
+/// lifetime. Dropping the handle retires the job.
+pub struct MemHandle {
+    latest: TripleBufferReader<MemSample>,
+    alive: Arc<AtomicBool>,
+}
+
+impl MemPool {
+    /// Starts `threads` workers. Jobs added later start at `sample_period`
+    /// and stay within `limits`.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if a worker thread cannot be spawned.
+    pub fn new(
+        threads: usize,
+        sample_period: Duration,
+        limits: MemPeriods,
+    ) -> anyhow::Result<Self> {
+        let shared = Arc::new(PoolShared {
+            queue: Mutex::new(PoolQueue::default()),
+            wake: Condvar::new(),
+        });
+        let mut pool = Self {
+            shared,
+            handles: Vec::new(),
+            sample_period,
+            limits,
+        };
+        for i in 0..threads.max(1) {
+            let shared = Arc::clone(&pool.shared);
+            let handle = thread::Builder::new()
+                .name(format!("mem-pool-{i}"))
+                .spawn(move || pool_worker(&shared))
+                .map_err(|e| anyhow::anyhow!("failed to spawn mem-pool thread: {e}"))?;
+            pool.handles.push(handle);
+        }
+        Ok(pool)
+    }
+
+    /// Adds a process to the pool; its first sample is taken right away.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the process's `MemSampler` cannot be created.
+    pub fn add(&self, pid: i32) -> anyhow::Result<MemHandle> {
+        let sampler = MemSampler::new(pid)?;
+        let (publisher, latest) = triple_buffer(MemSample::default());
+        let alive = Arc::new(AtomicBool::new(true));
+        let job = MemJob {
+            sampler,
+            cadence: MemCadence::new(self.sample_period, self.limits),
+            prev: None,
+            due: Instant::now(),
+            publisher,
+            alive: Arc::clone(&alive),
+            busy_ns: 0,
+        };
+        lock(&self.shared.queue).jobs.push(job);
+        self.shared.wake.notify_one();
+        Ok(MemHandle { latest, alive })
+    }
+
+    pub fn shutdown(&mut self) {
+        lock(&self.shared.queue).shutdown = true;
+        self.shared.wake.notify_all();
+        for handle in self.handles.drain(..) {
+            let _ = handle.join();
+        }
+    }
+}
+
+impl Drop for MemPool {
+    fn drop(&mut self) {
+        self.shutdown();
+    }
+}
+
+impl MemHandle {
+    /// The most recent memory sample for this process. Never blocks.
+    pub fn latest(&mut self) -> &MemSample {
+        self.latest.update();
+        self.latest.get()
+    }
+}
+
+impl Drop for MemHandle {
+    fn drop(&mut self) {
+        self.alive.store(false, Ordering::Relaxed);
+    }
+}
+
+fn lock(queue: &Mutex<PoolQueue>) -> std::sync::MutexGuard<'_, PoolQueue> {
+    // A worker panicking mid-sample leaves the queue itself consistent.
+    queue
+        .lock()
+        .unwrap_or_else(std::sync::PoisonError::into_inner)
+}
+
+fn pool_worker(shared: &PoolShared) {
+    let mut queue = lock(&shared.queue);
+    loop {
+        if queue.shutdown {
+            return;
+        }
+        queue.jobs.retain(|j| j.alive.load(Ordering::Relaxed));
+
+        let now = Instant::now();
+        let next = queue
+            .jobs
+            .iter()
+            .enumerate()
+            .min_by_key(|(_, j)| j.due)
+            .map(|(i, j)| (i, j.due));
+        match next {
+            Some((i, due)) if due <= now => {
+                let mut job = queue.jobs.swap_remove(i);
+                drop(queue);
+                job.run();
+                queue = lock(&shared.queue);
+                queue.jobs.push(job);
+            }
+            Some((_, due)) => {
+                queue = shared
+                    .wake
+                    .wait_timeout(queue, due - now)
+                    .unwrap_or_else(std::sync::PoisonError::into_inner)
+                    .0;
+            }
+            None => {
+                queue = shared
+                    .wake
+                    .wait(queue)
+                    .unwrap_or_else(std::sync::PoisonError::into_inner);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn mem_pool_samples_added_processes_and_retires_dropped_ones() {
+        #[allow(clippy::cast_possible_wrap)]
+        let pid = std::process::id() as i32;
+        let mut pool = MemPool::new(2, MIN_MEM_PERIOD, periods(MIN_MEM_PERIOD)).unwrap();
+        let mut a = pool.add(pid).unwrap();
+        let b = pool.add(pid).unwrap();
+
+        let deadline = Instant::now() + Duration::from_secs(5);
+        while a.latest().sampled_at.is_none() {
+            assert!(Instant::now() < deadline, "pool never sampled");
+            thread::sleep(Duration::from_millis(5));
+        }
+
+        let b_alive = Arc::clone(&b.alive);
+        drop(b);
+        // The retired job is dropped the next time a worker looks at the queue.
+        let deadline = Instant::now() + Duration::from_secs(5);
+        while Arc::strong_count(&b_alive) > 1 {
+            assert!(Instant::now() < deadline, "dropped job was not retired");
+            thread::sleep(Duration::from_millis(5));
+        }
+        pool.shutdown();
+    }
+
+    #[test]
+    fn triple_buffer_reports_only_new_values() {
+        let (mut w, mut r) = triple_buffer(0u32);
+        assert!(!r.update());
+        assert_eq!(*r.get(), 0);
+        w.publish(1);
+        w.publish(2);
+        assert!(r.update());
+        assert_eq!(*r.get(), 2);
+        assert!(!r.update());
+        assert_eq!(*r.get(), 2);
+        w.publish(3);
+        assert!(r.update());
+        assert_eq!(*r.get(), 3);
+    }
+
+    #[test]
+    fn triple_buffer_values_are_never_torn() {
+        const N: u64 = 100_000;
+        let (mut w, mut r) = triple_buffer([0u64; 8]);
+        let writer = thread::spawn(move || {
+            for i in 1..=N {
+                w.publish([i; 8]);
+            }
+        });
+        let mut last = 0;
+        while last < N {
+            r.update();
+            let v = *r.get();
+            assert!(v.iter().all(|&x| x == v[0]), "torn value {v:?}");
+            assert!(v[0] >= last);
+            last = v[0];
+        }
+        writer.join().unwrap();
+    }
+
+    fn snap(jit_code: u64, lookup: u64, misc: u64) -> MemSnapshot {
+        MemSnapshot {
+            jit_code,
+            lookup,
+            misc,
+            ..MemSnapshot::default()
+        }
+    }
+
+    const MIN_MEM_PERIOD: Duration = Duration::from_millis(MIN_MEM_PERIOD_MS);
+
+    fn periods(max: Duration) -> MemPeriods {
+        MemPeriods {
+            min: MIN_MEM_PERIOD,
+            max,
+        }
+    }
+
+    #[test]
+    fn cadence_backs_off_while_stable_up_to_cap() {
+        let mut c = MemCadence::new(
+            Duration::from_millis(200),
+            periods(Duration::from_millis(1000)),
+        );
+        let s = snap(1, 1, 1);
+        assert_eq!(c.next(None, &s), Duration::from_millis(200));
+        assert_eq!(c.next(Some(&s), &s), Duration::from_millis(400));
+        assert_eq!(c.next(Some(&s), &s), Duration::from_millis(800));
+        assert_eq!(c.next(Some(&s), &s), Duration::from_millis(1000));
+        assert_eq!(c.next(Some(&s), &s), Duration::from_millis(1000));
+    }
+
+    #[test]
+    fn cadence_resets_on_jit_or_lookup_growth() {
+        let mut c = MemCadence::new(Duration::from_millis(200), periods(Duration::from_secs(10)));
+        let s = snap(1, 1, 1);
+        c.next(Some(&s), &s);
+        c.next(Some(&s), &s);
+        assert_eq!(c.next(Some(&s), &snap(2, 1, 1)), Duration::from_millis(200));
+        c.next(Some(&s), &s);
+        assert_eq!(c.next(Some(&s), &snap(1, 2, 1)), Duration::from_millis(200));
+    }
+
+    #[test]
+    fn cadence_holds_on_other_changes() {
+        let mut c = MemCadence::new(Duration::from_millis(200), periods(Duration::from_secs(10)));
+        let s = snap(1, 1, 1);
+        c.next(Some(&s), &s);
+        assert_eq!(c.next(Some(&s), &snap(1, 1, 5)), Duration::from_millis(400));
+        // Shrinking JIT code (e.g. a cache flush) is not growth.
+        assert_eq!(c.next(Some(&s), &snap(0, 1, 1)), Duration::from_millis(400));
+    }
+
+    #[test]
+    fn cadence_enforces_minimum_period() {
+        let mut c = MemCadence::new(Duration::from_millis(10), periods(Duration::from_millis(5)));
+        assert_eq!(c.next(None, &MemSnapshot::default()), MIN_MEM_PERIOD);
+        let s = MemSnapshot::default();
+        assert_eq!(c.next(Some(&s), &s), MIN_MEM_PERIOD);
+
+        // The floor is configurable either way.
+        let limits = MemPeriods {
+            min: Duration::from_millis(20),
+            max: Duration::from_millis(30),
+        };
+        let mut c = MemCadence::new(Duration::from_millis(10), limits);
+        assert_eq!(c.next(None, &s), Duration::from_millis(20));
+        assert_eq!(c.next(Some(&s), &s), Duration::from_millis(30));
+    }
+}
@@ -0,0 +1,647 @@
+// SPDX-License-Identifier: MIT
+//! Pre-aggregated metrics for `felix serve`. `MetricsSource` wraps any
+//! `FrameSource` and folds every frame into per-process counters, gauges
+//! and a load histogram on the sampling thread. A copy is published to a
+//! shared snapshot every `PUBLISH_INTERVAL`, only if the lock is free, so
+//! a scrape holding the snapshot never delays a sample.
+
+use std::fmt::Write;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+use anyhow::Result;
+
+use super::accumulator::{ComputedFrame, CumulativeCountStats};
+use super::jitter::{DurationHistogram, SamplerTiming};
+use super::multi::TrackEvent;
+use super::rolling::{RateEvent, RollingStats, WINDOWS};
+use super::session::{Emit, FrameSource};
+use crate::fex::smaps::MemSnapshot;
+
+/// How stale a scraped snapshot may be.
+pub const PUBLISH_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Bounds of the exposed `fex_load_percent` histogram buckets.
+const LOAD_BUCKET_BOUNDS: [u32; 9] = [1, 5, 10, 25, 50, 75, 90, 95, 100];
+/// Quantiles of `fex_load_percent` and sampler timing exposed as summaries.
+const QUANTILES: [f64; 3] = [0.5, 0.9, 0.99];
+/// One bin per whole percent, plus one for loads above 100%.
+const LOAD_BINS: usize = 102;
+
+type Counter = fn(&ProcessMetrics) -> u64;
+
+/// Snapshot shared between the sampler and the HTTP server.
+pub type SharedMetrics = Arc<Mutex<MetricsSnapshot>>;
+
+/// `fex_load_percent` in 1% bins: bin `i` holds loads in `(i - 1, i]`.
+#[derive(Clone)]
+pub struct LoadHistogram {
+    bins: [u64; LOAD_BINS],
+    count: u64,
+    sum: f64,
+}
+
+impl Default for LoadHistogram {
+    fn default() -> Self {
+        Self {
+            bins: [0; LOAD_BINS],
+            count: 0,
+            sum: 0.0,
+        }
+    }
+}
+
+impl LoadHistogram {
+    pub fn record(&mut self, load: f64) {
+        #[allow(clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+        let bin = (load.max(0.0).ceil() as usize).min(LOAD_BINS - 1);
+        self.bins[bin] += 1;
+        self.count += 1;
+        self.sum += load;
+    }
+
+    #[must_use]
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    /// Loads at or below `bound` percent.
+    #[must_use]
+    pub fn count_le(&self, bound: u32) -> u64 {
+        let end = (bound as usize + 1).min(LOAD_BINS);
+        self.bins[..end].iter().sum()
+    }
+
+    /// Upper bound of the 1% bin holding the `q` quantile; 0 if empty.
+    #[must_use]
+    pub fn quantile(&self, q: f64) -> f64 {
+        if self.count == 0 {
+            return 0.0;
+        }
+        #[allow(
+            clippy::cast_possible_truncation,
+            clippy::cast_sign_loss,
+            clippy::cast_precision_loss
+        )]
+        let rank = ((q.clamp(0.0, 1.0) * self.count as f64).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (i, &n) in self.bins.iter().enumerate() {
+            seen += n;
+            if seen >= rank {
+                #[allow(clippy::cast_precision_loss)]
+                return i as f64;
+            }
+        }
+        100.0
+    }
+}
+
+/// Everything known about one sampled process.
+#[derive(Clone, Default)]
+pub struct ProcessMetrics {
+    pub pid: i32,
+    pub frames: u64,
+    /// Sums of FEX's own cumulative counters over the live threads, as of
+    /// the last frame. They drop when a thread exits, which Prometheus
+    /// treats as a counter reset.
+    pub cumulative: CumulativeCountStats,
+    pub jit_invocations: u64,
+    pub threads: usize,
+    pub torn_reads: u64,
+    pub load: LoadHistogram,
+    pub mem: MemSnapshot,
+    pub rolling: RollingStats,
+}
+
+impl ProcessMetrics {
+    fn record(&mut self, frame: &ComputedFrame) {
+        self.frames += 1;
+        self.cumulative.clone_from(&frame.cumulative);
+        self.jit_invocations = frame.total_jit_invocations;
+        self.threads = frame.threads_sampled;
+        self.torn_reads += u64::from(frame.torn_reads);
+        self.load.record(frame.fex_load_percent);
+        self.mem.clone_from(&frame.mem);
+        self.rolling.record(frame);
+    }
+}
+
+#[derive(Clone, Default)]
+pub struct MetricsSnapshot {
+    /// Sorted by PID.
+    pub processes: Vec<ProcessMetrics>,
+    pub timing: SamplerTiming,
+    /// Frames sampled across all processes, including exited ones.
+    pub frames: u64,
+}
+
+impl MetricsSnapshot {
+    fn record(&mut self, pid: i32, frame: &ComputedFrame) {
+        self.frames += 1;
+        self.timing.record(frame);
+        let i = match self.processes.binary_search_by_key(&pid, |p| p.pid) {
+            Ok(i) => i,
+            Err(i) => {
+                self.processes.insert(
+                    i,
+                    ProcessMetrics {
+                        pid,
+                        ..ProcessMetrics::default()
+                    },
+                );
+                i
+            }
+        };
+        self.processes[i].record(frame);
+    }
+
+    fn remove(&mut self, pid: i32) {
+        self.processes.retain(|p| p.pid != pid);
+    }
+
+    /// Renders the snapshot in the `OpenMetrics` text format, ending with
+    /// `# EOF`.
+    #[must_use]
+    pub fn render_openmetrics(&self) -> String {
+        let mut out = String::with_capacity(4096 + 2048 * self.processes.len());
+        // Writing into a String cannot fail.
+        let _ = self.write_openmetrics(&mut out);
+        out
+    }
+
+    fn write_openmetrics(&self, out: &mut String) -> std::fmt::Result {
+        family(
+            out,
+            "felix_processes",
+            "gauge",
+            "FEX processes being sampled",
+        )?;
+        writeln!(out, "felix_processes {}", self.processes.len())?;
+        family(
+            out,
+            "felix_frames",
+            "counter",
+            "Frames sampled, all processes",
+        )?;
+        writeln!(out, "felix_frames_total {}", self.frames)?;
+        write_duration_summary(
+            out,
+            "felix_sample_lateness_seconds",
+            "How late samples ran against their deadline",
+            &self.timing.lateness,
+        )?;
+        write_duration_summary(
+            out,
+            "felix_sample_overhead_seconds",
+            "Time taken to read and compute one sample",
+            &self.timing.overhead,
+        )?;
+        self.write_counters(out)?;
+        self.write_load(out)?;
+        self.write_windows(out)?;
+        self.write_memory(out)?;
+        writeln!(out, "# EOF")
+    }
+
+    fn write_counters(&self, out: &mut String) -> std::fmt::Result {
+        let counters: [(&str, &str, Counter); 8] = [
+            ("felix_process_frames", "Frames sampled", |p| p.frames),
+            ("felix_sigbus", "SIGBUS events handled", |p| {
+                p.cumulative.sigbus
+            }),
+            ("felix_smc", "Self-modifying code invalidations", |p| {
+                p.cumulative.smc
+            }),
+            ("felix_float_fallback", "Softfloat fallbacks", |p| {
+                p.cumulative.float_fallback
+            }),
+            ("felix_cache_miss", "JIT lookup cache misses", |p| {
+                p.cumulative.cache_miss
+            }),
+            ("felix_jit", "Blocks compiled by the JIT", |p| {
+                p.cumulative.jit
+            }),
+            (
+                "felix_jit_invocations",
+                "JIT invocations seen by felix",
+                |p| p.jit_invocations,
+            ),
+            ("felix_torn_reads", "Thread entries read torn", |p| {
+                p.torn_reads
+            }),
+        ];
+        for (name, help, value) in counters {
+            family(out, name, "counter", help)?;
+            for p in &self.processes {
+                writeln!(out, "{name}_total{{pid=\"{}\"}} {}", p.pid, value(p))?;
+            }
+        }
+
+        family(
+            out,
+            "felix_threads",
+            "gauge",
+            "Threads sampled in the last frame",
+        )?;
+        for p in &self.processes {
+            writeln!(out, "felix_threads{{pid=\"{}\"}} {}", p.pid, p.threads)?;
+        }
+
+        Ok(())
+    }
+
+    fn write_load(&self, out: &mut String) -> std::fmt::Result {
+        family(
+            out,
+            "felix_fex_load_percent",
+            "histogram",
+            "FEX (JIT and signal) load per frame, in percent of all cores",
+        )?;
+        for p in &self.processes {
+            for bound in LOAD_BUCKET_BOUNDS {
+                writeln!(
+                    out,
+                    "felix_fex_load_percent_bucket{{pid=\"{}\",le=\"{bound}.0\"}} {}",
+                    p.pid,
+                    p.load.count_le(bound)
+                )?;
+            }
+            writeln!(
+                out,
+                "felix_fex_load_percent_bucket{{pid=\"{}\",le=\"+Inf\"}} {}",
+                p.pid,
+                p.load.count()
+            )?;
+            writeln!(
+                out,
+                "felix_fex_load_percent_count{{pid=\"{}\"}} {}",
+                p.pid,
+                p.load.count()
+            )?;
+            writeln!(
+                out,
+                "felix_fex_load_percent_sum{{pid=\"{}\"}} {}",
+                p.pid, p.load.sum
+            )?;
+        }
+
+        family(
+            out,
+            "felix_fex_load_quantile_percent",
+            "summary",
+            "Quantiles of FEX load per frame, to 1%",
+        )?;
+        for p in &self.processes {
+            for q in QUANTILES {
+                writeln!(
+                    out,
+                    "felix_fex_load_quantile_percent{{pid=\"{}\",quantile=\"{q}\"}} {}",
+                    p.pid,
+                    p.load.quantile(q)
+                )?;
+            }
+            writeln!(
+                out,
+                "felix_fex_load_quantile_percent_count{{pid=\"{}\"}} {}",
+                p.pid,
+                p.load.count()
+            )?;
+        }
+
+        Ok(())
+    }
+
+    fn write_windows(&self, out: &mut String) -> std::fmt::Result {
+        family(
+            out,
+            "felix_fex_load_window_percent",
+            "gauge",
+            "Quantiles of FEX load over a sliding window, to 1%",
+        )?;
+        for p in &self.processes {
+            for (i, window) in WINDOWS.iter().enumerate() {
+                let sketch = p.rolling.load(i);
+                for q in QUANTILES {
+                    writeln!(
+                        out,
+                        "felix_fex_load_window_percent{{pid=\"{}\",window=\"{}s\",quantile=\"{q}\"}} {}",
+                        p.pid,
+                        window.as_secs(),
+                        sketch.quantile(q)
+                    )?;
+                }
+            }
+        }
+
+        family(
+            out,
+            "felix_fex_load_window_samples",
+            "gauge",
+            "Frames in each sliding load window",
+        )?;
+        for p in &self.processes {
+            for (i, window) in WINDOWS.iter().enumerate() {
+                writeln!(
+                    out,
+                    "felix_fex_load_window_samples{{pid=\"{}\",window=\"{}s\"}} {}",
+                    p.pid,
+                    window.as_secs(),
+                    p.rolling.load(i).sketch().count()
+                )?;
+            }
+        }
+
+        family(
+            out,
+            "felix_event_rate",
+            "gauge",
+            "Events per second over a sliding window",
+        )?;
+        for p in &self.processes {
+            for event in RateEvent::ALL {
+                for (i, window) in WINDOWS.iter().enumerate() {
+                    writeln!(
+                        out,
+                        "felix_event_rate{{pid=\"{}\",event=\"{}\",window=\"{}s\"}} {}",
+                        p.pid,
+                        event.name(),
+                        window.as_secs(),
+                        p.rolling.rate(event, i)
+                    )?;
+                }
+            }
+        }
+
+        family(
+            out,
+            "felix_jit_peak_per_second",
+            "gauge",
+            "Most blocks compiled in one second of the last minute",
+        )?;
+        for p in &self.processes {
+            writeln!(
+                out,
+                "felix_jit_peak_per_second{{pid=\"{}\"}} {}",
+                p.pid,
+                p.rolling.jit_peak_per_sec()
+            )?;
+        }
+        Ok(())
+    }
+
+    fn write_memory(&self, out: &mut String) -> std::fmt::Result {
+        family(
+            out,
+            "felix_memory_bytes",
+            "gauge",
+            "Resident FEX memory by region",
+        )?;
+        for p in &self.processes {
+            let m = &p.mem;
+            for (region, bytes) in [
+                ("total_anon", m.total_anon),
+                ("jit_code", m.jit_code),
+                ("op_dispatcher", m.op_dispatcher),
+                ("frontend", m.frontend),
+                ("cpu_backend", m.cpu_backend),
+                ("lookup", m.lookup),
+                ("lookup_l1", m.lookup_l1),
+                ("thread_states", m.thread_states),
+                ("block_links", m.block_links),
+                ("misc", m.misc),
+                ("jemalloc", m.jemalloc),
+                ("unaccounted", m.unaccounted),
+            ] {
+                writeln!(
+                    out,
+                    "felix_memory_bytes{{pid=\"{}\",region=\"{region}\"}} {bytes}",
+                    p.pid
+                )?;
+            }
+        }
+        Ok(())
+    }
+}
+
+fn family(out: &mut String, name: &str, kind: &str, help: &str) -> std::fmt::Result {
+    writeln!(out, "# TYPE {name} {kind}")?;
+    writeln!(out, "# HELP {name} {help}.")
+}
+
+fn write_duration_summary(
+    out: &mut String,
+    name: &str,
+    help: &str,
+    histogram: &DurationHistogram,
+) -> std::fmt::Result {
+    family(out, name, "summary", help)?;
+    for q in QUANTILES {
+        #[allow(clippy::cast_precision_loss)]
+        let secs = histogram.percentile(q) as f64 / 1e9;
+        writeln!(out, "{name}{{quantile=\"{q}\"}} {secs}")?;
+    }
+    writeln!(out, "{name}_count {}", histogram.count())
+}
+
+/// Aggregates the frames of `S` into a `SharedMetrics` snapshot, then
+/// passes them on unchanged.
+pub struct MetricsSource<S> {
+    inner: S,
+    metrics: MetricsSnapshot,
+    shared: SharedMetrics,
+    last_publish: Option<Instant>,
+    persistent: bool,
+}
+
+impl<S: FrameSource> MetricsSource<S> {
+    #[must_use]
+    pub fn new(inner: S, shared: SharedMetrics) -> Self {
+        Self {
+            inner,
+            metrics: MetricsSnapshot::default(),
+            shared,
+            last_publish: None,
+            persistent: false,
+        }
+    }
+
+    /// Keeps sampling after the inner source runs dry, for a daemon that
+    /// waits for new processes.
+    #[must_use]
+    pub fn persistent(mut self) -> Self {
+        self.persistent = true;
+        self
+    }
+
+    /// Copies the working metrics into the shared snapshot unless a scrape
+    /// holds it; the next sample tries again.
+    fn publish(&mut self) {
+        if let Ok(mut shared) = self.shared.try_lock() {
+            shared.clone_from(&self.metrics);
+            self.last_publish = Some(Instant::now());
+        }
+    }
+}
+
+impl<S: FrameSource> FrameSource for MetricsSource<S> {
+    fn sample(&mut self, lateness_ns: u64, emit: &mut Emit<'_>) -> Result<()> {
+        let metrics = &mut self.metrics;
+        self.inner
+            .sample(lateness_ns, &mut |pid, frame, per_thread| {
+                metrics.record(pid, frame);
+                emit(pid, frame, per_thread)
+            })?;
+        if self
+            .last_publish
+            .is_none_or(|t| t.elapsed() >= PUBLISH_INTERVAL)
+        {
+            self.publish();
+        }
+        Ok(())
+    }
+
+    fn exhausted(&mut self) -> bool {
+        !self.persistent && self.inner.exhausted()
+    }
+
+    fn idle(&mut self, timeout: Duration, event: &mut dyn FnMut(TrackEvent)) {
+        let metrics = &mut self.metrics;
+        self.inner.idle(timeout, &mut |e| {
+            if let TrackEvent::Exited(pid) | TrackEvent::Failed(pid, _) = &e {
+                metrics.remove(*pid);
+            }
+            event(e);
+        });
+    }
+
+    fn shutdown(&mut self) {
+        self.inner.shutdown();
+        self.publish();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn frame(load: f64, sigbus: u64) -> ComputedFrame {
+        ComputedFrame {
+            fex_load_percent: load,
+            threads_sampled: 3,
+            cumulative: CumulativeCountStats {
+                sigbus,
+                ..CumulativeCountStats::default()
+            },
+            ..ComputedFrame::default()
+        }
+    }
+
+    /// One process whose SIGBUS count is the number of samples taken.
+    struct OneProcess {
+        frame: ComputedFrame,
+    }
+
+    impl FrameSource for OneProcess {
+        fn sample(&mut self, _lateness_ns: u64, emit: &mut Emit<'_>) -> Result<()> {
+            self.frame.cumulative.sigbus += 1;
+            emit(7, &mut self.frame, &[])
+        }
+
+        fn exhausted(&mut self) -> bool {
+            true
+        }
+
+        fn idle(&mut self, _timeout: Duration, event: &mut dyn FnMut(TrackEvent)) {
+            if self.frame.cumulative.sigbus == 3 {
+                event(TrackEvent::Exited(7));
+            }
+        }
+
+        fn shutdown(&mut self) {}
+    }
+
+    #[test]
+    fn held_snapshot_is_skipped_not_waited_for() {
+        let shared = SharedMetrics::default();
+        let mut source = MetricsSource::new(
+            OneProcess {
+                frame: ComputedFrame::default(),
+            },
+            Arc::clone(&shared),
+        );
+        let mut sink = |_: i32, _: &mut ComputedFrame, _: &[_]| Ok(());
+        source.sample(0, &mut sink).unwrap();
+        assert_eq!(shared.lock().unwrap().frames, 1);
+
+        // A scrape holding the lock: sampling carries on without publishing.
+        {
+            let _scrape = shared.lock().unwrap();
+            source.last_publish = None;
+            source.sample(0, &mut sink).unwrap();
+        }
+        assert_eq!(shared.lock().unwrap().frames, 1);
+        source.last_publish = None;
+        source.sample(0, &mut sink).unwrap();
+        assert_eq!(shared.lock().unwrap().processes[0].cumulative.sigbus, 3);
+
+        // Exited processes leave the snapshot; shutdown publishes that.
+        let mut events = 0;
+        source.idle(Duration::ZERO, &mut |_| events += 1);
+        assert_eq!(events, 1);
+        assert!(source.exhausted());
+        source.shutdown();
+        let snapshot = shared.lock().unwrap();
+        assert!(snapshot.processes.is_empty());
+        assert_eq!(snapshot.frames, 3);
+        drop(snapshot);
+        assert!(!source.persistent().exhausted());
+    }
+
+    #[test]
+    fn load_quantiles_use_percent_bins() {
+        let mut h = LoadHistogram::default();
+        for i in 1..=100u16 {
+            h.record(f64::from(i) - 0.5);
+        }
+        assert_eq!(h.count(), 100);
+        assert!((h.quantile(0.5) - 50.0).abs() < f64::EPSILON);
+        assert!((h.quantile(0.99) - 99.0).abs() < f64::EPSILON);
+        assert_eq!(h.count_le(10), 10);
+        assert_eq!(h.count_le(100), 100);
+        h.record(250.0);
+        assert_eq!(h.count_le(100), 100);
+        assert!((h.quantile(1.0) - 101.0).abs() < f64::EPSILON);
+    }
+
+    #[test]
+    fn snapshot_renders_openmetrics() {
+        let mut snapshot = MetricsSnapshot::default();
+        snapshot.record(20, &frame(10.0, 1));
+        snapshot.record(10, &frame(30.0, 7));
+        snapshot.record(20, &frame(60.0, 4));
+        assert_eq!(snapshot.processes[0].pid, 10);
+
+        let text = snapshot.render_openmetrics();
+        assert!(text.ends_with("# EOF\n"));
+        assert!(text.contains("felix_frames_total 3\n"));
+        assert!(text.contains("felix_sigbus_total{pid=\"20\"} 4\n"));
+        assert!(text.contains("felix_threads{pid=\"10\"} 3\n"));
+        assert!(text.contains("felix_fex_load_percent_bucket{pid=\"20\",le=\"25.0\"} 1\n"));
+        assert!(text.contains("felix_fex_load_percent_bucket{pid=\"20\",le=\"+Inf\"} 2\n"));
+        assert!(
+            text.contains("felix_fex_load_quantile_percent{pid=\"20\",quantile=\"0.99\"} 60\n")
+        );
+        assert!(text.contains("felix_memory_bytes{pid=\"10\",region=\"jit_code\"} 0\n"));
+        assert!(text.contains(
+            "felix_fex_load_window_percent{pid=\"10\",window=\"10s\",quantile=\"0.5\"} "
+        ));
+        assert!(text.contains("felix_event_rate{pid=\"20\",event=\"smc\",window=\"60s\"} "));
+        assert!(text.contains("felix_jit_peak_per_second{pid=\"20\"} 0\n"));
+        assert!(text.contains("felix_fex_load_window_samples{pid=\"20\",window=\"1s\"} 2\n"));
+        // Every family is declared once, before its samples.
+        assert_eq!(text.matches("# TYPE felix_sigbus counter").count(), 1);
+
+        snapshot.remove(20);
+        assert!(!snapshot.render_openmetrics().contains("pid=\"20\""));
+    }
+}
@@ -1,4 +1,14 @@
 // SPDX-License-Identifier: MIT
 pub mod accumulator;
+pub mod contention;
+pub mod deadline;
+pub mod histogram;
+pub mod jitter;
 pub mod mem_stats;
+pub mod metrics;
+pub mod multi;
+pub mod overhead;
+pub mod pipeline;
+pub mod rolling;
+pub mod session;
 pub mod thread_stats;
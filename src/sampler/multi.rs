@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: MIT
+//! Sampling every FEX process in a scope for one multiplexed recording.
+//! Thread stats of all processes are read on the caller's thread, one
+//! `SamplePipeline` per process; memory sampling shares a small `MemPool`
+//! instead of a thread per process. Processes that start later are attached
+//! as soon as their segment appears, or by the next periodic discovery pass
+//! when inotify is unavailable.
+
+use std::time::{Duration, Instant};
+
+use anyhow::Result;
+
+use super::accumulator::ComputedFrame;
+use super::mem_stats::{MemHandle, MemPeriods, MemPool};
+use super::pipeline::SamplePipeline;
+use super::thread_stats::ThreadDelta;
+use crate::datasource::SessionMetadata;
+use crate::fex::discovery::{
+    SegmentWatcher, find_all_fex_processes, is_in_tree, process_alive, segment_ready,
+};
+use crate::fex::shm::ShmReader;
+
+/// How often `/dev/shm` is rescanned regardless of inotify, which also
+/// notices exited processes.
+pub const DISCOVERY_INTERVAL: Duration = Duration::from_secs(1);
+/// Rescan interval while a new segment has not been initialized yet.
+const UNREADY_RETRY_INTERVAL: Duration = Duration::from_millis(5);
+/// How long a new segment is retried at `UNREADY_RETRY_INTERVAL` before
+/// falling back to `DISCOVERY_INTERVAL`.
+const UNREADY_FAST_RETRY: Duration = Duration::from_secs(1);
+const MEM_POOL_THREADS: usize = 2;
+
+/// Which processes a `MultiSampler` attaches to.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Scope {
+    /// Every process with a stats segment.
+    All,
+    /// The given process and its descendants.
+    Tree(i32),
+}
+
+impl Scope {
+    #[must_use]
+    pub fn contains(self, pid: i32) -> bool {
+        match self {
+            Self::All => true,
+            Self::Tree(root) => is_in_tree(pid, root),
+        }
+    }
+}
+
+/// A change in the set of sampled processes.
+#[derive(Debug)]
+pub enum TrackEvent {
+    Attached(i32),
+    /// The process's segment could not be used; it is not retried.
+    Skipped(i32, anyhow::Error),
+    Exited(i32),
+    /// Sampling the process failed and it was dropped.
+    Failed(i32, anyhow::Error),
+}
+
+struct Track {
+    pid: i32,
+    metadata: SessionMetadata,
+    shm: ShmReader,
+    pipeline: SamplePipeline,
+    mem: MemHandle,
+    frame: ComputedFrame,
+}
+
+pub struct MultiSampler {
+    scope: Scope,
+    sample_period: Duration,
+    start: Instant,
+    tracks: Vec<Track>,
+    /// PIDs whose segment was rejected, so they are not reopened on every
+    /// pass. Entries are dropped once the process exits.
+    ignored: Vec<i32>,
+    /// Segments seen before FEX initialized them, with when they were first
+    /// seen.
+    unready: Vec<(i32, Instant)>,
+    watcher: SegmentWatcher,
+    pool: MemPool,
+    last_discovery: Option<Instant>,
+    events: Vec<TrackEvent>,
+}
+
+impl MultiSampler {
+    /// Creates a sampler with no processes attached yet; call `discover`.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the memory sampling pool cannot be started.
+    pub fn new(scope: Scope, sample_period: Duration, mem_periods: MemPeriods) -> Result<Self> {
+        Ok(Self {
+            scope,
+            sample_period,
+            start: Instant::now(),
+            tracks: Vec::new(),
+            ignored: Vec::new(),
+            unready: Vec::new(),
+            watcher: SegmentWatcher::new(),
+            pool: MemPool::new(MEM_POOL_THREADS, sample_period, mem_periods)?,
+            last_discovery: None,
+            events: Vec::new(),
+        })
+    }
+
+    /// Waits up to `timeout` until a stats segment is created, a new
+    /// segment is due to be re-checked, or `DISCOVERY_INTERVAL` has passed
+    /// since the last `discover`, and returns whether one did. Blocking on
+    /// inotify attaches a new segment as soon as it is ready instead of
+    /// after the next sample; a zero `timeout` is one non-blocking `poll`.
+    pub fn wait_for_discovery(&mut self, timeout: Duration) -> bool {
+        let rescan = self.until_rescan();
+        if rescan.is_zero() {
+            return true;
+        }
+        let timeout = timeout.min(rescan);
+        if self.watcher.is_event_driven() {
+            self.watcher.wait(timeout) || self.until_rescan().is_zero()
+        } else {
+            if !timeout.is_zero() {
+                std::thread::sleep(timeout);
+            }
+            self.until_rescan().is_zero()
+        }
+    }
+
+    /// Time until the periodic rescan, or the retry of a segment that was
+    /// not initialized yet, is due.
+    fn until_rescan(&self) -> Duration {
+        let interval = if self.unready.is_empty() {
+            DISCOVERY_INTERVAL
+        } else {
+            UNREADY_RETRY_INTERVAL
+        };
+        self.last_discovery
+            .map_or(Duration::ZERO, |t| interval.saturating_sub(t.elapsed()))
+    }
+
+    /// Whether new processes are noticed through inotify rather than the
+    /// periodic rescan.
+    #[must_use]
+    pub fn is_event_driven(&self) -> bool {
+        self.watcher.is_event_driven()
+    }
+
+    /// Drops processes that exited and attaches new ones in scope. The
+    /// changes are queued for `take_events`.
+    pub fn discover(&mut self) {
+        self.last_discovery = Some(Instant::now());
+
+        let events = &mut self.events;
+        self.tracks.retain(|t| {
+            let alive = process_alive(t.pid);
+            if !alive {
+                events.push(TrackEvent::Exited(t.pid));
+            }
+            alive
+        });
+        self.ignored.retain(|&pid| process_alive(pid));
+
+        let now = Instant::now();
+        let mut unready = std::mem::take(&mut self.unready);
+        for pid in find_all_fex_processes() {
+            if self.tracks.iter().any(|t| t.pid == pid)
+                || self.ignored.contains(&pid)
+                || !self.scope.contains(pid)
+            {
+                continue;
+            }
+            if !segment_ready(pid) {
+                if !unready.iter().any(|&(p, _)| p == pid) {
+                    unready.push((pid, now));
+                }
+                continue;
+            }
+            unready.retain(|&(p, _)| p != pid);
+            match self.attach(pid) {
+                Ok(track) => {
+                    self.tracks.push(track);
+                    self.events.push(TrackEvent::Attached(pid));
+                }
+                Err(e) => {
+                    self.ignored.push(pid);
+                    self.events.push(TrackEvent::Skipped(pid, e));
+                }
+            }
+        }
+        // Segments that stay uninitialized, or vanished, drop back to the
+        // regular rescan.
+        unready.retain(|&(pid, seen)| {
+            process_alive(pid) && now.duration_since(seen) < UNREADY_FAST_RETRY
+        });
+        self.unready = unready;
+    }
+
+    fn attach(&self, pid: i32) -> Result<Track> {
+        let shm = ShmReader::open(pid)?;
+        let metadata = SessionMetadata::from_shm(&shm, pid)?;
+        let pipeline = SamplePipeline::with_start(&metadata, self.sample_period, self.start);
+        let mem = self.pool.add(pid)?;
+        Ok(Track {
+            pid,
+            metadata,
+            shm,
+            pipeline,
+            mem,
+            frame: ComputedFrame::default(),
+        })
+    }
+
+    /// Samples every attached process in turn and hands each frame to
+    /// `emit`, which may swap it for another to be overwritten. A process
+    /// whose sample fails is dropped with a `TrackEvent::Failed`.
+    ///
+    /// # Errors
+    ///
+    /// Returns the first error from `emit`.
+    pub fn sample_all(
+        &mut self,
+        lateness_ns: u64,
+        mut emit: impl FnMut(i32, &mut ComputedFrame, &[ThreadDelta]) -> Result<()>,
+    ) -> Result<()> {
+        let mut i = 0;
+        while i < self.tracks.len() {
+            let t = &mut self.tracks[i];
+            if let Err(e) =
+                t.pipeline
+                    .sample_into(&mut t.shm, t.mem.latest(), lateness_ns, &mut t.frame)
+            {
+                let pid = t.pid;
+                self.tracks.remove(i);
+                self.events.push(TrackEvent::Failed(pid, e));
+                continue;
+            }
+            emit(t.pid, &mut t.frame, t.pipeline.per_thread())?;
+            i += 1;
+        }
+        Ok(())
+    }
+
+    /// Attachment changes since the last call.
+    pub fn take_events(&mut self) -> std::vec::Drain<'_, TrackEvent> {
+        self.events.drain(..)
+    }
+
+    /// Metadata of the earliest attached process still being sampled.
+    #[must_use]
+    pub fn first_metadata(&self) -> Option<&SessionMetadata> {
+        self.tracks.first().map(|t| &t.metadata)
+    }
+
+    #[must_use]
+    pub fn len(&self) -> usize {
+        self.tracks.len()
+    }
+
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.tracks.is_empty()
+    }
+
+    pub fn shutdown(&mut self) {
+        self.tracks.clear();
+        self.pool.shutdown();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn tree_scope_follows_parents() {
+        #[allow(clippy::cast_possible_wrap)]
+        let me = std::process::id() as i32;
+        assert!(Scope::All.contains(me));
+        assert!(Scope::Tree(me).contains(me));
+        assert!(!Scope::Tree(me).contains(1));
+    }
+
+    #[test]
+    fn discovery_runs_on_interval() {
+        let mut sampler = MultiSampler::new(
+            Scope::Tree(0),
+            Duration::from_millis(10),
+            MemPeriods {
+                min: Duration::from_millis(10),
+                max: Duration::from_millis(10),
+            },
+        )
+        .unwrap();
+        assert!(sampler.wait_for_discovery(Duration::ZERO));
+        // No process descends from pid 0, so nothing is attached.
+        sampler.discover();
+        assert!(sampler.is_empty());
+        assert!(!sampler.wait_for_discovery(Duration::ZERO));
+        assert_eq!(sampler.take_events().count(), 0);
+
+        // Waiting stops at the timeout, well before the next rescan.
+        let start = Instant::now();
+        assert!(!sampler.wait_for_discovery(Duration::from_millis(20)));
+        assert!(start.elapsed() < DISCOVERY_INTERVAL / 2);
+    }
+}
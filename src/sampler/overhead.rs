@@ -0,0 +1,301 @@
+// SPDX-License-Identifier: MIT
+//! felix's own cost. Frames carry the time each sampling stage took (SHM
+//! read, accumulate, smaps, record) and the UI times its own draws;
+//! `OverheadStats` keeps a `DurationHistogram` and a running total per
+//! stage. `SelfUsage` reads felix's CPU time, RSS and I/O, so the cost of
+//! the profiler can be weighed against the load it reports.
+
+use std::time::{Duration, Instant};
+
+use anyhow::{Context, Result};
+use serde::{Deserialize, Serialize};
+
+use super::accumulator::ComputedFrame;
+use super::jitter::DurationHistogram;
+
+/// Shortest interval between two `UsageMeter` readings.
+pub const USAGE_INTERVAL: Duration = Duration::from_secs(1);
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Stage {
+    /// Copying thread entries out of SHM.
+    ShmRead,
+    /// Per-thread deltas and frame computation.
+    Accumulate,
+    /// Parsing smaps, on the memory sampler threads.
+    Smaps,
+    /// Serializing, compressing and writing, on the writer thread.
+    Record,
+    /// Rendering and flushing a TUI frame.
+    Draw,
+}
+
+impl Stage {
+    pub const ALL: [Self; 5] = [
+        Self::ShmRead,
+        Self::Accumulate,
+        Self::Smaps,
+        Self::Record,
+        Self::Draw,
+    ];
+
+    #[must_use]
+    pub fn name(self) -> &'static str {
+        match self {
+            Self::ShmRead => "SHM read",
+            Self::Accumulate => "Accumulate",
+            Self::Smaps => "smaps",
+            Self::Record => "Record",
+            Self::Draw => "Draw",
+        }
+    }
+}
+
+/// Per-stage duration distributions and totals.
+#[derive(Clone, Default, Serialize, Deserialize)]
+pub struct OverheadStats {
+    stages: [DurationHistogram; Stage::ALL.len()],
+    totals: [u64; Stage::ALL.len()],
+}
+
+impl OverheadStats {
+    pub fn record(&mut self, stage: Stage, ns: u64) {
+        self.stages[stage as usize].record(ns);
+        self.totals[stage as usize] += ns;
+    }
+
+    /// Adds the sampling stages of `frame`. Smaps and record time accrue on
+    /// other threads, so frames during which they did not run are skipped
+    /// for those stages; frames from recordings without stage times are
+    /// skipped entirely.
+    pub fn record_frame(&mut self, frame: &ComputedFrame) {
+        if frame.sample_overhead_ns == 0 {
+            return;
+        }
+        self.record(Stage::ShmRead, frame.shm_read_ns);
+        self.record(
+            Stage::Accumulate,
+            frame.sample_overhead_ns.saturating_sub(frame.shm_read_ns),
+        );
+        if frame.smaps_ns > 0 {
+            self.record(Stage::Smaps, frame.smaps_ns);
+        }
+        if frame.record_ns > 0 {
+            self.record(Stage::Record, frame.record_ns);
+        }
+    }
+
+    /// Takes the sampling stages of `other`, keeping this one's draw
+    /// times, as after a replay seek.
+    pub fn restore_sampling(&mut self, other: &Self) {
+        for stage in Stage::ALL.into_iter().filter(|&s| s != Stage::Draw) {
+            self.stages[stage as usize] = other.stages[stage as usize].clone();
+            self.totals[stage as usize] = other.totals[stage as usize];
+        }
+    }
+
+    #[must_use]
+    pub fn stage(&self, stage: Stage) -> &DurationHistogram {
+        &self.stages[stage as usize]
+    }
+
+    /// Time spent in `stage` so far.
+    #[must_use]
+    pub fn total_ns(&self, stage: Stage) -> u64 {
+        self.totals[stage as usize]
+    }
+}
+
+/// felix's resource use at one point in time.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct SelfUsage {
+    /// User plus system CPU time of every felix thread.
+    pub cpu_ns: u64,
+    pub rss_bytes: u64,
+    /// Bytes read and written through syscalls, including procfs reads.
+    pub read_bytes: u64,
+    pub written_bytes: u64,
+}
+
+impl SelfUsage {
+    /// Reads the current usage from `getrusage` and `/proc/self`. I/O
+    /// counters are left at 0 where `/proc/self/io` is not readable.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the CPU time or RSS cannot be read.
+    pub fn read() -> Result<Self> {
+        let mut usage = std::mem::MaybeUninit::<libc::rusage>::uninit();
+        // SAFETY: getrusage fills the struct it is given.
+        let rc = unsafe { libc::getrusage(libc::RUSAGE_SELF, usage.as_mut_ptr()) };
+        if rc != 0 {
+            return Err(std::io::Error::last_os_error()).context("getrusage failed");
+        }
+        // SAFETY: getrusage succeeded, so the struct is initialized.
+        let usage = unsafe { usage.assume_init() };
+        let cpu_ns = timeval_ns(usage.ru_utime) + timeval_ns(usage.ru_stime);
+
+        let statm = std::fs::read_to_string("/proc/self/statm").context("failed to read statm")?;
+        let pages: u64 = statm
+            .split_ascii_whitespace()
+            .nth(1)
+            .and_then(|v| v.parse().ok())
+            .context("malformed statm")?;
+        // SAFETY: sysconf has no preconditions.
+        let page_size = u64::try_from(unsafe { libc::sysconf(libc::_SC_PAGESIZE) }).unwrap_or(4096);
+
+        let (read_bytes, written_bytes) = std::fs::read_to_string("/proc/self/io")
+            .map(|io| parse_io(&io))
+            .unwrap_or_default();
+
+        Ok(Self {
+            cpu_ns,
+            rss_bytes: pages * page_size,
+            read_bytes,
+            written_bytes,
+        })
+    }
+}
+
+fn timeval_ns(tv: libc::timeval) -> u64 {
+    let secs = u64::try_from(tv.tv_sec).unwrap_or(0);
+    let micros = u64::try_from(tv.tv_usec).unwrap_or(0);
+    secs * 1_000_000_000 + micros * 1_000
+}
+
+/// `rchar` and `wchar` of a `/proc/<pid>/io` file.
+fn parse_io(text: &str) -> (u64, u64) {
+    let field = |name: &str| {
+        text.lines()
+            .find_map(|l| l.strip_prefix(name)?.trim().parse().ok())
+            .unwrap_or(0)
+    };
+    (field("rchar:"), field("wchar:"))
+}
+
+/// Usage over the last `USAGE_INTERVAL` or so.
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+pub struct UsageRates {
+    /// CPU time in percent of one core.
+    pub cpu_percent: f64,
+    pub rss_bytes: u64,
+    pub read_per_sec: u64,
+    pub written_per_sec: u64,
+}
+
+/// Turns periodic `SelfUsage` readings into rates.
+#[derive(Default)]
+pub struct UsageMeter {
+    last: Option<(Instant, SelfUsage)>,
+    rates: Option<UsageRates>,
+}
+
+impl UsageMeter {
+    /// Takes a reading if `USAGE_INTERVAL` has passed since the last one.
+    /// Returns whether the rates changed.
+    pub fn poll(&mut self, now: Instant) -> bool {
+        if self
+            .last
+            .is_some_and(|(at, _)| now.saturating_duration_since(at) < USAGE_INTERVAL)
+        {
+            return false;
+        }
+        let Ok(usage) = SelfUsage::read() else {
+            return false;
+        };
+        self.update(now, usage)
+    }
+
+    fn update(&mut self, now: Instant, usage: SelfUsage) -> bool {
+        let previous = self.last.replace((now, usage));
+        let Some((at, before)) = previous else {
+            return false;
+        };
+        let secs = now.saturating_duration_since(at).as_secs_f64();
+        if secs <= 0.0 {
+            return false;
+        }
+        #[allow(clippy::cast_precision_loss)]
+        let per_sec = |after: u64, before: u64| {
+            #[allow(clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+            let rate = (after.saturating_sub(before) as f64 / secs) as u64;
+            rate
+        };
+        #[allow(clippy::cast_precision_loss)]
+        let cpu_percent = usage.cpu_ns.saturating_sub(before.cpu_ns) as f64 / 1e9 / secs * 100.0;
+        self.rates = Some(UsageRates {
+            cpu_percent,
+            rss_bytes: usage.rss_bytes,
+            read_per_sec: per_sec(usage.read_bytes, before.read_bytes),
+            written_per_sec: per_sec(usage.written_bytes, before.written_bytes),
+        });
+        true
+    }
+
+    /// `None` until two readings have been taken.
+    #[must_use]
+    pub fn rates(&self) -> Option<&UsageRates> {
+        self.rates.as_ref()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn frames_split_into_stages() {
+        let mut stats = OverheadStats::default();
+        let mut frame = ComputedFrame {
+            sample_overhead_ns: 50_000,
+            shm_read_ns: 30_000,
+            ..ComputedFrame::default()
+        };
+        stats.record_frame(&frame);
+        frame.smaps_ns = 2_000_000;
+        frame.record_ns = 7_000;
+        stats.record_frame(&frame);
+        // Frames that predate stage times are left out.
+        stats.record_frame(&ComputedFrame::default());
+
+        assert_eq!(stats.stage(Stage::ShmRead).count(), 2);
+        assert_eq!(stats.total_ns(Stage::Accumulate), 40_000);
+        assert_eq!(stats.stage(Stage::Smaps).count(), 1);
+        assert_eq!(stats.total_ns(Stage::Record), 7_000);
+        assert_eq!(stats.stage(Stage::Draw).count(), 0);
+    }
+
+    #[test]
+    fn meter_reports_rates_between_readings() {
+        let mut meter = UsageMeter::default();
+        let t0 = Instant::now();
+        let usage = SelfUsage {
+            cpu_ns: 1_000_000_000,
+            rss_bytes: 10 << 20,
+            read_bytes: 4096,
+            written_bytes: 0,
+        };
+        assert!(!meter.update(t0, usage));
+        assert!(meter.rates().is_none());
+
+        let later = SelfUsage {
+            cpu_ns: 1_100_000_000,
+            rss_bytes: 12 << 20,
+            read_bytes: 4096 + 2 * 8192,
+            written_bytes: 2 * 1000,
+        };
+        assert!(meter.update(t0 + Duration::from_secs(2), later));
+        let rates = meter.rates().unwrap();
+        assert!((rates.cpu_percent - 5.0).abs() < 1e-9);
+        assert_eq!(rates.rss_bytes, 12 << 20);
+        assert_eq!(rates.read_per_sec, 8192);
+        assert_eq!(rates.written_per_sec, 1000);
+
+        assert_eq!(
+            parse_io("rchar: 12\nwchar: 34\nsyscr: 5\nread_bytes: 0\n"),
+            (12, 34)
+        );
+        let own = SelfUsage::read().unwrap();
+        assert!(own.rss_bytes > 0);
+    }
+}
@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: MIT
+//! The per-sample path shared by live and headless recording: read the SHM
+//! thread list, diff it against the previous sample and compute a frame.
+//! Every buffer is owned here or by the caller and reused, so a steady-state
+//! sample does not allocate.
+
+use std::time::{Duration, Instant};
+
+use anyhow::Result;
+
+use super::accumulator::{Accumulator, ComputedFrame, CumulativeCountStats};
+use super::mem_stats::MemSample;
+use super::thread_stats::{SampleResult, ThreadDelta, ThreadSampler};
+use crate::datasource::SessionMetadata;
+use crate::fex::platform::store_memory_barrier;
+use crate::fex::shm::ShmReader;
+use crate::fex::types::ThreadStats;
+
+pub struct SamplePipeline {
+    thread_sampler: ThreadSampler,
+    accumulator: Accumulator,
+    raw_stats: Vec<ThreadStats>,
+    sample: SampleResult,
+    total_jit_invocations: u64,
+    /// `MemSample::busy_ns` as of the previous sample.
+    smaps_busy_ns: u64,
+    /// Nominal period, used for the first sample only.
+    period_ns: u64,
+    start: Instant,
+    has_previous: bool,
+}
+
+impl SamplePipeline {
+    #[must_use]
+    pub fn new(metadata: &SessionMetadata, sample_period: Duration) -> Self {
+        Self::with_start(metadata, sample_period, Instant::now())
+    }
+
+    /// Like `new`, but frame timestamps count from `start`, so pipelines
+    /// writing into one recording share a time base.
+    #[must_use]
+    pub fn with_start(metadata: &SessionMetadata, sample_period: Duration, start: Instant) -> Self {
+        #[allow(clippy::cast_precision_loss)]
+        let cycle_freq = metadata.cycle_counter_frequency as f64;
+        #[allow(clippy::cast_possible_truncation)]
+        let period_ns = sample_period.as_nanos() as u64;
+        Self {
+            thread_sampler: ThreadSampler::new(),
+            accumulator: Accumulator::new(cycle_freq, metadata.hardware_concurrency),
+            raw_stats: Vec::new(),
+            sample: SampleResult::new(Instant::now()),
+            total_jit_invocations: 0,
+            smaps_busy_ns: 0,
+            period_ns,
+            start,
+            has_previous: false,
+        }
+    }
+
+    /// Takes one sample from `shm` and overwrites `frame` with the result.
+    /// `lateness_ns` is how late the caller's schedule ran this sample; it
+    /// is recorded alongside the sample's own cost. Loads are computed over
+    /// the measured interval since the previous sample, not the nominal
+    /// period.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the SHM region grew and could not be remapped.
+    pub fn sample_into(
+        &mut self,
+        shm: &mut ShmReader,
+        mem: &MemSample,
+        lateness_ns: u64,
+        frame: &mut ComputedFrame,
+    ) -> Result<()> {
+        let started = Instant::now();
+        store_memory_barrier();
+        shm.read_thread_stats_into(&mut self.raw_stats)?;
+        let now = Instant::now();
+        let shm_read_ns = duration_ns(now.saturating_duration_since(started));
+        let previous = self.sample.timestamp;
+        self.thread_sampler
+            .sample_into(&self.raw_stats, now, &mut self.sample);
+        let period_ns = if self.has_previous {
+            duration_ns(now.saturating_duration_since(previous))
+        } else {
+            self.period_ns
+        };
+        self.has_previous = true;
+
+        self.total_jit_invocations = self.total_jit_invocations.wrapping_add(
+            self.sample
+                .per_thread
+                .iter()
+                .map(|d| d.jit_count)
+                .sum::<u64>(),
+        );
+
+        let raw_stats = &self.raw_stats;
+        let cumulative = CumulativeCountStats {
+            sigbus: raw_stats.iter().map(|s| s.sigbus_count).sum(),
+            smc: raw_stats.iter().map(|s| s.smc_count).sum(),
+            float_fallback: raw_stats.iter().map(|s| s.float_fallback_count).sum(),
+            cache_miss: raw_stats
+                .iter()
+                .map(|s| s.accumulated_cache_miss_count)
+                .sum(),
+            jit: raw_stats.iter().map(|s| s.accumulated_jit_count).sum(),
+        };
+
+        self.accumulator.compute_frame_into(
+            &self.sample,
+            &mem.snapshot,
+            period_ns,
+            self.total_jit_invocations,
+            cumulative,
+            frame,
+        );
+        frame.timestamp_ns = duration_ns(now.saturating_duration_since(self.start));
+        frame.mem_age_ns = mem.age_ns(now);
+        frame.sample_lateness_ns = lateness_ns;
+        frame.torn_reads = shm.torn_reads() + self.sample.rejected;
+        frame.shm_read_ns = shm_read_ns;
+        frame.smaps_ns = mem.busy_ns.saturating_sub(self.smaps_busy_ns);
+        self.smaps_busy_ns = mem.busy_ns;
+        frame.sample_overhead_ns = duration_ns(started.elapsed());
+        Ok(())
+    }
+
+    /// Per-thread deltas of the last sample, for recording.
+    #[must_use]
+    pub fn per_thread(&self) -> &[ThreadDelta] {
+        &self.sample.per_thread
+    }
+}
+
+fn duration_ns(d: Duration) -> u64 {
+    #[allow(clippy::cast_possible_truncation)]
+    let ns = d.as_nanos() as u64;
+    ns
+}
+
+#[cfg(test)]
+mod tests {
+    use std::alloc::{GlobalAlloc, Layout, System};
+    use std::cell::Cell;
+    use std::time::SystemTime;
+
+    use super::*;
+    use crate::fex::shm::test_segment::{TestSegment, linked_segment};
+    use crate::fex::types::AppType;
+
+    thread_local! {
+        static ALLOCATIONS: Cell<usize> = const { Cell::new(0) };
+    }
+
+    /// Counts allocations made by the current thread, so concurrently
+    /// running tests do not disturb the count.
+    struct CountingAllocator;
+
+    // SAFETY: defers to `System`; the counter is a const-initialized
+    // thread-local without a destructor, so touching it never allocates.
+    unsafe impl GlobalAlloc for CountingAllocator {
+        unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+            let _ = ALLOCATIONS.try_with(|c| c.set(c.get() + 1));
+            unsafe { System.alloc(layout) }
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+            unsafe { System.dealloc(ptr, layout) }
+        }
+
+        unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+            let _ = ALLOCATIONS.try_with(|c| c.set(c.get() + 1));
+            unsafe { System.realloc(ptr, layout, new_size) }
+        }
+    }
+
+    #[global_allocator]
+    static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+    #[test]
+    fn steady_state_sample_does_not_allocate() {
+        let segment = TestSegment::create(&linked_segment(64, 64));
+        let pid = segment.pid;
+        let mut shm = ShmReader::open(pid).unwrap();
+
+        let metadata = SessionMetadata {
+            pid,
+            fex_version: String::new(),
+            app_type: AppType::Linux64,
+            stats_version: 0,
+            cycle_counter_frequency: 1_000_000_000,
+            hardware_concurrency: 8,
+            recording_start: SystemTime::now(),
+            head: 0,
+            size: 0,
+        };
+        let mut pipeline = SamplePipeline::new(&metadata, Duration::from_millis(100));
+        let mem = MemSample::default();
+        let mut frame = ComputedFrame::default();
+
+        // The first samples size the thread table and the reused buffers.
+        for _ in 0..2 {
+            pipeline.sample_into(&mut shm, &mem, 0, &mut frame).unwrap();
+        }
+        assert_eq!(pipeline.per_thread().len(), 64);
+        assert_eq!(frame.thread_loads.len(), 8);
+
+        let before = ALLOCATIONS.with(Cell::get);
+        for _ in 0..1000 {
+            pipeline.sample_into(&mut shm, &mem, 0, &mut frame).unwrap();
+        }
+        let allocations = ALLOCATIONS.with(Cell::get) - before;
+        assert_eq!(allocations, 0, "steady-state sampling allocated");
+        assert_eq!(frame.threads_sampled, 64);
+        assert!(frame.sample_overhead_ns > 0);
+        assert!(frame.timestamp_ns > 0);
+    }
+}
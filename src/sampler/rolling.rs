@@ -0,0 +1,633 @@
+// SPDX-License-Identifier: MIT
+//! Incremental statistics over sliding windows of frames. Windows are rings
+//! of time slots keyed by frame timestamps, not the wall clock, so replay
+//! computes what live sampling showed. A window also keeps the running
+//! aggregate of its slots: recording adds to both, and a slot that falls out
+//! is subtracted once, so both updates and queries are O(1) per value.
+//!
+//! Quantiles use a `DDSketch` with bins of fixed relative width, which is
+//! mergeable and, unlike most sketches, subtractable.
+
+use std::time::Duration;
+
+use serde::{Deserialize, Serialize};
+
+use super::accumulator::ComputedFrame;
+
+/// `ln((1 + a) / (1 - a))` for a relative accuracy `a` of 1%; fixed so
+/// every sketch uses the same bins and can be merged.
+const LN_GAMMA: f64 = 0.020_000_666_706_669_435;
+/// Values at or below this count as zero.
+const MIN_VALUE: f64 = 1e-3;
+/// Slots per window; a window's edge moves in steps of `window / SLOTS`.
+const SLOTS: usize = 10;
+
+/// Windows kept by `RollingStats`.
+pub const WINDOWS: [Duration; 3] = [
+    Duration::from_secs(1),
+    Duration::from_secs(10),
+    Duration::from_secs(60),
+];
+/// Window of the per-thread load quantiles.
+pub const THREAD_WINDOW: Duration = Duration::from_secs(10);
+
+/// Quantile sketch of non-negative values, accurate to 1%.
+#[derive(Clone, Debug, Default, PartialEq, Serialize, Deserialize)]
+pub struct DdSketch {
+    /// Key of `bins[0]`.
+    offset: i32,
+    bins: Vec<u64>,
+    zero: u64,
+    count: u64,
+}
+
+impl DdSketch {
+    #[must_use]
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    pub fn add(&mut self, value: f64) {
+        self.count += 1;
+        if value <= MIN_VALUE || value.is_nan() {
+            self.zero += 1;
+            return;
+        }
+        #[allow(clippy::cast_possible_truncation)]
+        let key = (value.ln() / LN_GAMMA).ceil() as i32;
+        *self.bin_mut(key) += 1;
+    }
+
+    fn bin_mut(&mut self, key: i32) -> &mut u64 {
+        if self.bins.is_empty() {
+            self.offset = key;
+        }
+        if key < self.offset {
+            let grow = (self.offset - key).unsigned_abs() as usize;
+            self.bins.splice(0..0, std::iter::repeat_n(0, grow));
+            self.offset = key;
+        }
+        let i = (key - self.offset).unsigned_abs() as usize;
+        if i >= self.bins.len() {
+            self.bins.resize(i + 1, 0);
+        }
+        &mut self.bins[i]
+    }
+
+    /// Adds every value of `other`.
+    pub fn merge(&mut self, other: &Self) {
+        self.combine(other, |a, b| *a += b);
+        self.zero += other.zero;
+        self.count += other.count;
+    }
+
+    /// Removes values previously merged from `other`.
+    pub fn subtract(&mut self, other: &Self) {
+        self.combine(other, |a, b| *a = a.saturating_sub(b));
+        self.zero = self.zero.saturating_sub(other.zero);
+        self.count = self.count.saturating_sub(other.count);
+    }
+
+    fn combine(&mut self, other: &Self, op: impl Fn(&mut u64, u64)) {
+        for (i, &n) in other.bins.iter().enumerate() {
+            if n > 0 {
+                #[allow(clippy::cast_possible_truncation, clippy::cast_possible_wrap)]
+                let key = other.offset + i as i32;
+                op(self.bin_mut(key), n);
+            }
+        }
+    }
+
+    /// Keeps the bins' memory for reuse.
+    pub fn clear(&mut self) {
+        self.bins.clear();
+        self.zero = 0;
+        self.count = 0;
+    }
+
+    /// The `q` quantile (`0.0..=1.0`), within 1% of a
+    /// recorded value; 0 if empty.
+    #[must_use]
+    pub fn quantile(&self, q: f64) -> f64 {
+        if self.count == 0 {
+            return 0.0;
+        }
+        #[allow(
+            clippy::cast_possible_truncation,
+            clippy::cast_sign_loss,
+            clippy::cast_precision_loss
+        )]
+        let rank = ((q.clamp(0.0, 1.0) * self.count as f64).ceil() as u64).max(1);
+        let mut seen = self.zero;
+        if seen >= rank {
+            return 0.0;
+        }
+        for (i, &n) in self.bins.iter().enumerate() {
+            seen += n;
+            if seen >= rank {
+                #[allow(clippy::cast_precision_loss)]
+                let key = f64::from(self.offset) + i as f64;
+                // Midpoint, in relative terms, of (gamma^(k-1), gamma^k].
+                let gamma = LN_GAMMA.exp();
+                return 2.0 * (key * LN_GAMMA).exp() / (1.0 + gamma);
+            }
+        }
+        0.0
+    }
+}
+
+/// Where a ring of `SLOTS` slots stands.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+struct SlotClock {
+    slot_ns: u64,
+    /// Slot of the latest value, counted from timestamp 0.
+    current: Option<u64>,
+}
+
+impl SlotClock {
+    fn new(window: Duration, slots: usize) -> Self {
+        #[allow(clippy::cast_possible_truncation)]
+        let window_ns = window.as_nanos() as u64;
+        Self {
+            slot_ns: (window_ns / slots as u64).max(1),
+            current: None,
+        }
+    }
+
+    /// Moves to the slot of `timestamp_ns` and returns how many slots,
+    /// oldest first, fell out of the window (at most `slots`). Time going
+    /// backwards, as after a replay seek, expires everything.
+    fn advance(&mut self, timestamp_ns: u64, slots: usize) -> (usize, usize) {
+        let slot = timestamp_ns / self.slot_ns;
+        let Some(current) = self.current else {
+            self.current = Some(slot);
+            return (0, 0);
+        };
+        self.current = Some(slot);
+        if slot < current {
+            return (0, slots);
+        }
+        let steps = usize::try_from(slot - current)
+            .unwrap_or(usize::MAX)
+            .min(slots);
+        // Slots current+1..=slot are reused, starting after the current one.
+        #[allow(clippy::cast_possible_truncation)]
+        let first = ((current + 1) % slots as u64) as usize;
+        (first, steps)
+    }
+
+    #[allow(clippy::cast_possible_truncation)]
+    fn index(&self, slots: usize) -> usize {
+        self.current.map_or(0, |c| (c % slots as u64) as usize)
+    }
+}
+
+/// Quantiles of the values of the last `window`.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct RollingSketch {
+    clock: SlotClock,
+    slots: Vec<DdSketch>,
+    window: DdSketch,
+}
+
+impl RollingSketch {
+    #[must_use]
+    pub fn new(window: Duration) -> Self {
+        Self {
+            clock: SlotClock::new(window, SLOTS),
+            slots: vec![DdSketch::default(); SLOTS],
+            window: DdSketch::default(),
+        }
+    }
+
+    pub fn record(&mut self, timestamp_ns: u64, value: f64) {
+        let (first, expired) = self.clock.advance(timestamp_ns, SLOTS);
+        for i in 0..expired {
+            let slot = &mut self.slots[(first + i) % SLOTS];
+            self.window.subtract(slot);
+            slot.clear();
+        }
+        if expired == SLOTS {
+            // Nothing is left; also resets the span of bins kept.
+            self.window.clear();
+        }
+        let i = self.clock.index(SLOTS);
+        self.slots[i].add(value);
+        self.window.add(value);
+    }
+
+    /// Values in the window; slots expire only as newer values arrive.
+    #[must_use]
+    pub fn sketch(&self) -> &DdSketch {
+        &self.window
+    }
+
+    #[must_use]
+    pub fn quantile(&self, q: f64) -> f64 {
+        self.window.quantile(q)
+    }
+}
+
+/// Sum of counts over the last `window`, in `slots` slots.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct RollingCounter {
+    clock: SlotClock,
+    window: Duration,
+    slots: Vec<u64>,
+    sum: u64,
+    /// Timestamp of the first count, to scale rates while the first window
+    /// is still filling.
+    first_ns: Option<u64>,
+    last_ns: u64,
+}
+
+impl RollingCounter {
+    #[must_use]
+    pub fn new(window: Duration, slots: usize) -> Self {
+        Self {
+            clock: SlotClock::new(window, slots),
+            window,
+            slots: vec![0; slots],
+            sum: 0,
+            first_ns: None,
+            last_ns: 0,
+        }
+    }
+
+    pub fn record(&mut self, timestamp_ns: u64, count: u64) {
+        let n = self.slots.len();
+        let (first, expired) = self.clock.advance(timestamp_ns, n);
+        for i in 0..expired {
+            let slot = &mut self.slots[(first + i) % n];
+            self.sum -= *slot;
+            *slot = 0;
+        }
+        if timestamp_ns < self.last_ns {
+            self.first_ns = None;
+        }
+        self.first_ns.get_or_insert(timestamp_ns);
+        self.last_ns = timestamp_ns;
+        let i = self.clock.index(n);
+        self.slots[i] += count;
+        self.sum += count;
+    }
+
+    /// Counts per second over the window, or over the time seen so far
+    /// while that is shorter.
+    #[must_use]
+    pub fn rate_per_sec(&self) -> f64 {
+        let Some(first) = self.first_ns else {
+            return 0.0;
+        };
+        #[allow(clippy::cast_precision_loss)]
+        let seen = (self.last_ns - first) as f64 / 1e9 + self.clock.slot_ns as f64 / 1e9;
+        #[allow(clippy::cast_precision_loss)]
+        let secs = seen.min(self.window.as_secs_f64());
+        #[allow(clippy::cast_precision_loss)]
+        let rate = self.sum as f64 / secs;
+        rate
+    }
+
+    /// Largest single slot in the window.
+    #[must_use]
+    pub fn max_slot(&self) -> u64 {
+        self.slots.iter().copied().max().unwrap_or(0)
+    }
+}
+
+/// Highest count seen in any whole second since the start.
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct PeakRate {
+    second: Option<u64>,
+    current: u64,
+    peak: u64,
+}
+
+impl PeakRate {
+    pub fn record(&mut self, timestamp_ns: u64, count: u64) {
+        let second = timestamp_ns / 1_000_000_000;
+        if self.second != Some(second) {
+            self.second = Some(second);
+            self.current = 0;
+        }
+        self.current += count;
+        self.peak = self.peak.max(self.current);
+    }
+
+    #[must_use]
+    pub fn peak(&self) -> u64 {
+        self.peak
+    }
+}
+
+/// Event counters with rolling rates.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum RateEvent {
+    Sigbus,
+    Smc,
+    /// Blocks compiled.
+    Jit,
+}
+
+impl RateEvent {
+    pub const ALL: [Self; 3] = [Self::Sigbus, Self::Smc, Self::Jit];
+
+    #[must_use]
+    pub fn name(self) -> &'static str {
+        match self {
+            Self::Sigbus => "sigbus",
+            Self::Smc => "smc",
+            Self::Jit => "jit",
+        }
+    }
+
+    fn count(self, frame: &ComputedFrame) -> u64 {
+        match self {
+            Self::Sigbus => frame.total_sigbus_count,
+            Self::Smc => frame.total_smc_count,
+            Self::Jit => frame.total_jit_count,
+        }
+    }
+}
+
+#[derive(Clone, Debug, Serialize, Deserialize)]
+struct ThreadWindow {
+    tid: u32,
+    load: RollingSketch,
+    /// Last frame listing the thread.
+    last_ns: u64,
+}
+
+/// Rolling statistics of one process, fed one frame at a time.
+#[derive(Clone, Debug, Serialize, Deserialize)]
+pub struct RollingStats {
+    /// `fex_load_percent` over each of `WINDOWS`.
+    load: [RollingSketch; WINDOWS.len()],
+    /// Indexed by `RateEvent`, then by window.
+    rates: [[RollingCounter; WINDOWS.len()]; RateEvent::ALL.len()],
+    /// Blocks compiled per second, for the peak over the longest window.
+    jit_seconds: RollingCounter,
+    /// Per-thread load over `THREAD_WINDOW`, sorted by TID.
+    threads: Vec<ThreadWindow>,
+    last_ns: Option<u64>,
+}
+
+impl Default for RollingStats {
+    fn default() -> Self {
+        let longest = WINDOWS[WINDOWS.len() - 1];
+        Self {
+            load: WINDOWS.map(RollingSketch::new),
+            rates: RateEvent::ALL.map(|_| WINDOWS.map(|w| RollingCounter::new(w, SLOTS))),
+            #[allow(clippy::cast_possible_truncation)]
+            jit_seconds: RollingCounter::new(longest, longest.as_secs() as usize),
+            threads: Vec::new(),
+            last_ns: None,
+        }
+    }
+}
+
+impl RollingStats {
+    pub fn record(&mut self, frame: &ComputedFrame) {
+        let ts = frame.timestamp_ns;
+        if self.last_ns.is_some_and(|last| ts < last) {
+            // A replay seek backwards: the windows no longer apply.
+            *self = Self::default();
+        }
+        self.last_ns = Some(ts);
+
+        for sketch in &mut self.load {
+            sketch.record(ts, frame.fex_load_percent);
+        }
+        for (event, counters) in RateEvent::ALL.iter().zip(&mut self.rates) {
+            let count = event.count(frame);
+            for counter in counters {
+                counter.record(ts, count);
+            }
+        }
+        self.jit_seconds.record(ts, frame.total_jit_count);
+
+        for tl in &frame.thread_loads {
+            let i = match self.threads.binary_search_by_key(&tl.tid, |t| t.tid) {
+                Ok(i) => i,
+                Err(i) => {
+                    self.threads.insert(
+                        i,
+                        ThreadWindow {
+                            tid: tl.tid,
+                            load: RollingSketch::new(THREAD_WINDOW),
+                            last_ns: ts,
+                        },
+                    );
+                    i
+                }
+            };
+            let t = &mut self.threads[i];
+            t.load.record(ts, f64::from(tl.load_percent));
+            t.last_ns = ts;
+        }
+        // `thread_loads` lists only the busiest threads. The rest ran
+        // little or not at all this frame; without a 0 their quantiles
+        // would only count the frames they were busy in.
+        #[allow(clippy::cast_possible_truncation)]
+        let horizon = ts.saturating_sub(THREAD_WINDOW.as_nanos() as u64);
+        self.threads.retain_mut(|t| {
+            if t.last_ns != ts {
+                t.load.record(ts, 0.0);
+            }
+            t.last_ns >= horizon
+        });
+    }
+
+    /// `fex_load_percent` over `WINDOWS[window]`.
+    #[must_use]
+    pub fn load(&self, window: usize) -> &RollingSketch {
+        &self.load[window]
+    }
+
+    /// Events per second over `WINDOWS[window]`.
+    #[must_use]
+    pub fn rate(&self, event: RateEvent, window: usize) -> f64 {
+        self.rates[event as usize][window].rate_per_sec()
+    }
+
+    /// Most blocks compiled in one second of the longest window.
+    #[must_use]
+    pub fn jit_peak_per_sec(&self) -> u64 {
+        self.jit_seconds.max_slot()
+    }
+
+    /// Load of thread `tid` over `THREAD_WINDOW`, if it ran recently.
+    #[must_use]
+    pub fn thread_load(&self, tid: u32) -> Option<&RollingSketch> {
+        self.threads
+            .binary_search_by_key(&tid, |t| t.tid)
+            .ok()
+            .map(|i| &self.threads[i].load)
+    }
+}
+
+/// Whole-session statistics of one process, small enough for the
+/// recording footer.
+#[derive(Clone, Debug, Default, PartialEq, Serialize, Deserialize)]
+pub struct ProcessStats {
+    pub pid: i32,
+    pub frames: u64,
+    pub fex_load: DdSketch,
+    pub jit_peak: PeakRate,
+    pub sigbus: u64,
+    pub smc: u64,
+}
+
+impl ProcessStats {
+    #[must_use]
+    pub fn new(pid: i32) -> Self {
+        Self {
+            pid,
+            ..Self::default()
+        }
+    }
+
+    pub fn record(&mut self, frame: &ComputedFrame) {
+        self.frames += 1;
+        self.fex_load.add(frame.fex_load_percent);
+        self.jit_peak
+            .record(frame.timestamp_ns, frame.total_jit_count);
+        self.sigbus += frame.total_sigbus_count;
+        self.smc += frame.total_smc_count;
+    }
+
+    /// Folds in the statistics of another process. Load quantiles and
+    /// counts are exact; the JIT peak is the larger of the two, as the
+    /// seconds they fell in are not kept.
+    pub fn merge(&mut self, other: &Self) {
+        self.frames += other.frames;
+        self.fex_load.merge(&other.fex_load);
+        if other.jit_peak.peak() > self.jit_peak.peak() {
+            self.jit_peak = other.jit_peak;
+        }
+        self.sigbus += other.sigbus;
+        self.smc += other.smc;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const MS: u64 = 1_000_000;
+    const RELATIVE_ACCURACY: f64 = 0.01;
+
+    #[test]
+    fn sketch_quantiles_are_relatively_accurate() {
+        let mut sketch = DdSketch::default();
+        for i in 1..=1000u32 {
+            sketch.add(f64::from(i) / 10.0);
+        }
+        for (q, exact) in [(0.5, 50.0), (0.95, 95.0), (0.99, 99.0)] {
+            let got = sketch.quantile(q);
+            assert!(
+                (got - exact).abs() <= exact * RELATIVE_ACCURACY,
+                "q{q}: {got}"
+            );
+        }
+
+        let mut low = DdSketch::default();
+        low.add(0.0);
+        low.add(0.5);
+        let mut merged = sketch.clone();
+        merged.merge(&low);
+        assert_eq!(merged.count(), 1002);
+        assert!(merged.quantile(0.0).abs() < f64::EPSILON);
+        merged.subtract(&low);
+        assert_eq!(merged.count(), 1000);
+        assert!((merged.quantile(0.5) - sketch.quantile(0.5)).abs() < f64::EPSILON);
+    }
+
+    #[test]
+    fn windows_forget_old_values() {
+        let mut sketch = RollingSketch::new(Duration::from_secs(1));
+        // 1 s of high load, then 1 s of low load.
+        for t in 0..10 {
+            sketch.record(t * 100 * MS, 90.0);
+        }
+        assert!((sketch.quantile(0.5) - 90.0).abs() < 1.0);
+        for t in 10..20 {
+            sketch.record(t * 100 * MS, 10.0);
+        }
+        assert_eq!(sketch.sketch().count(), 10);
+        assert!((sketch.quantile(0.99) - 10.0).abs() < 0.2);
+
+        // A gap longer than the window clears it; going back resets it.
+        sketch.record(60_000 * MS, 50.0);
+        assert_eq!(sketch.sketch().count(), 1);
+        sketch.record(0, 20.0);
+        assert_eq!(sketch.sketch().count(), 1);
+    }
+
+    #[test]
+    fn counter_rates_and_peaks() {
+        let mut counter = RollingCounter::new(Duration::from_secs(10), 10);
+        for t in 0..100u64 {
+            // 10 events every 100 ms: 100 per second.
+            counter.record(t * 100 * MS, 10);
+        }
+        assert!((counter.rate_per_sec() - 100.0).abs() < 1.0);
+        assert_eq!(counter.max_slot(), 100);
+
+        counter.record(10_500 * MS, 500);
+        assert_eq!(counter.max_slot(), 500);
+        // 900 + 500 events over the full 10 s.
+        assert!((counter.rate_per_sec() - 140.0).abs() < 1.0);
+
+        let mut peak = PeakRate::default();
+        peak.record(100 * MS, 7);
+        peak.record(900 * MS, 8);
+        peak.record(1_100 * MS, 9);
+        assert_eq!(peak.peak(), 15);
+    }
+
+    #[test]
+    fn stats_track_threads_and_events() {
+        let mut stats = RollingStats::default();
+        let mut frame = ComputedFrame::default();
+        for t in 0..50u64 {
+            frame.timestamp_ns = t * 100 * MS;
+            frame.fex_load_percent = 40.0;
+            frame.total_smc_count = 2;
+            frame.total_jit_count = if t == 20 { 300 } else { 1 };
+            frame.thread_loads = vec![crate::sampler::accumulator::ThreadLoad {
+                tid: 7,
+                load_percent: 25.0,
+                total_cycles: 0,
+            }];
+            stats.record(&frame);
+        }
+        assert!((stats.load(0).quantile(0.95) - 40.0).abs() < 0.5);
+        assert!((stats.rate(RateEvent::Smc, 0) - 20.0).abs() < 0.5);
+        assert!(stats.rate(RateEvent::Sigbus, 2).abs() < f64::EPSILON);
+        assert_eq!(stats.jit_peak_per_sec(), 309);
+        assert!((stats.thread_load(7).unwrap().quantile(0.5) - 25.0).abs() < 0.3);
+
+        // Frames a thread is left out of count as idle: thread 9 was busy
+        // in one frame of ten.
+        for t in 50..60u64 {
+            frame.timestamp_ns = t * 100 * MS;
+            frame.thread_loads = vec![crate::sampler::accumulator::ThreadLoad {
+                tid: if t == 50 { 9 } else { 7 },
+                load_percent: 80.0,
+                total_cycles: 0,
+            }];
+            stats.record(&frame);
+        }
+        let idle = stats.thread_load(9).unwrap();
+        assert!(idle.quantile(0.5).abs() < 0.3);
+        assert!((idle.quantile(1.0) - 80.0).abs() < 1.0);
+
+        // Threads drop out once idle for a whole window.
+        frame.thread_loads.clear();
+        frame.timestamp_ns = 20_000 * MS;
+        stats.record(&frame);
+        assert!(stats.thread_load(7).is_none());
+        assert!(stats.thread_load(9).is_none());
+    }
+}
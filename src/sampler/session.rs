@@ -0,0 +1,512 @@
+// SPDX-License-Identifier: MIT
+//! The sampling thread shared by `live`, `record` and `watch`. It owns the
+//! SHM readers, pipelines and recording writer and samples on absolute
+//! deadlines. Consumers get `Update`s over a bounded channel that is only
+//! ever `try_send`-ed, so a slow terminal or a stalled stdout never delays a
+//! sample; the UI coalesces whatever is queued into one redraw.
+
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::mpsc::{Receiver, SyncSender, TrySendError, sync_channel};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use anyhow::{Context, Result};
+
+use super::accumulator::ComputedFrame;
+use super::deadline::DeadlineTimer;
+use super::jitter::SamplerTiming;
+use super::mem_stats::{MemPeriods, MemStatsWorker};
+use super::multi::{MultiSampler, TrackEvent};
+use super::pipeline::SamplePipeline;
+use super::thread_stats::ThreadDelta;
+use crate::datasource::SessionMetadata;
+use crate::fex::discovery::process_alive;
+use crate::fex::platform::{minimize_timer_slack, pin_current_thread};
+use crate::fex::shm::ShmReader;
+use crate::recording::async_writer::{AsyncRecordingWriter, QueueStats};
+use crate::recording::flight::FlightStats;
+use crate::recording::format::Frame;
+
+/// Frames handed back by the consumer for reuse.
+const RECYCLE_CAPACITY: usize = 8;
+
+/// Receives each process's frame and per-thread deltas.
+pub type Emit<'a> = dyn FnMut(i32, &mut ComputedFrame, &[ThreadDelta]) -> Result<()> + 'a;
+
+/// Something that can be sampled on a schedule: one process, or every
+/// process in a scope.
+pub trait FrameSource: Send {
+    /// Takes one sample and hands each process's frame to `emit`, which may
+    /// swap the frame out for a spare of its own.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if sampling fails or from `emit`.
+    fn sample(&mut self, lateness_ns: u64, emit: &mut Emit<'_>) -> Result<()>;
+
+    /// Whether there is nothing left to sample.
+    fn exhausted(&mut self) -> bool;
+
+    /// Waits up to `timeout` before the next deadline, doing work such as
+    /// discovering new processes as soon as it arrives; it may return
+    /// early. Attachment changes are reported through `event`.
+    fn idle(&mut self, timeout: Duration, _event: &mut dyn FnMut(TrackEvent)) {
+        if !timeout.is_zero() {
+            thread::sleep(timeout);
+        }
+    }
+
+    /// Stops helper threads.
+    fn shutdown(&mut self);
+}
+
+/// A single FEX process.
+pub struct ProcessSource {
+    pid: i32,
+    metadata: SessionMetadata,
+    shm: ShmReader,
+    pipeline: SamplePipeline,
+    mem_worker: MemStatsWorker,
+    frame: ComputedFrame,
+}
+
+impl ProcessSource {
+    /// Opens `pid`'s stats segment and starts its memory sampler.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the segment cannot be opened or is not a FEX
+    /// stats segment, or if the memory sampler cannot be started.
+    pub fn open(pid: i32, sample_period: Duration, mem_periods: MemPeriods) -> Result<Self> {
+        let shm = ShmReader::open(pid)?;
+        let metadata = SessionMetadata::from_shm(&shm, pid)?;
+        let mem_worker = MemStatsWorker::spawn(pid, sample_period, mem_periods)?;
+        let pipeline = SamplePipeline::new(&metadata, sample_period);
+        Ok(Self {
+            pid,
+            metadata,
+            shm,
+            pipeline,
+            mem_worker,
+            frame: ComputedFrame::default(),
+        })
+    }
+
+    #[must_use]
+    pub fn metadata(&self) -> &SessionMetadata {
+        &self.metadata
+    }
+}
+
+impl FrameSource for ProcessSource {
+    fn sample(&mut self, lateness_ns: u64, emit: &mut Emit<'_>) -> Result<()> {
+        self.pipeline.sample_into(
+            &mut self.shm,
+            self.mem_worker.latest(),
+            lateness_ns,
+            &mut self.frame,
+        )?;
+        emit(self.pid, &mut self.frame, self.pipeline.per_thread())
+    }
+
+    fn exhausted(&mut self) -> bool {
+        !process_alive(self.pid)
+    }
+
+    fn shutdown(&mut self) {
+        self.mem_worker.shutdown();
+    }
+}
+
+impl FrameSource for MultiSampler {
+    fn sample(&mut self, lateness_ns: u64, emit: &mut Emit<'_>) -> Result<()> {
+        self.sample_all(lateness_ns, emit)
+    }
+
+    fn exhausted(&mut self) -> bool {
+        self.is_empty()
+    }
+
+    fn idle(&mut self, timeout: Duration, event: &mut dyn FnMut(TrackEvent)) {
+        // Discovery walks /dev/shm and /proc, so it runs while waiting for
+        // a deadline and only when due.
+        if self.wait_for_discovery(timeout) {
+            self.discover();
+        }
+        self.take_events().for_each(event);
+    }
+
+    fn shutdown(&mut self) {
+        MultiSampler::shutdown(self);
+    }
+}
+
+#[derive(Clone, Copy, Default)]
+pub struct SessionConfig {
+    pub sample_period: Duration,
+    /// Busy-poll this long before each deadline.
+    pub spin: Duration,
+    /// Pin the sampling thread to this CPU.
+    pub pin_cpu: Option<usize>,
+    /// Stop after this long.
+    pub max_duration: Option<Duration>,
+    /// Send every frame to the consumer, for a UI.
+    pub forward_frames: bool,
+    /// Send an `Update::Status` this often, for headless progress.
+    pub status_interval: Option<Duration>,
+}
+
+/// Recording progress, as of an `Update::Status`.
+pub struct Progress {
+    pub elapsed: Duration,
+    pub frames: u64,
+    pub queue: QueueStats,
+}
+
+pub enum Update {
+    Frame {
+        /// Boxed so updates stay small; hand it back with `Session::recycle`.
+        frame: Box<ComputedFrame>,
+        /// Recording queue status after this frame was submitted.
+        recorder: Option<QueueStats>,
+    },
+    Track(TrackEvent),
+    Status(Progress),
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum StopReason {
+    /// `Session::join` was called or the shutdown flag was raised.
+    Requested,
+    /// The sampled processes all exited.
+    Exhausted,
+    DurationLimit,
+}
+
+pub struct SessionSummary {
+    pub reason: StopReason,
+    /// Frames sampled, including any the recording queue dropped.
+    pub frames: u64,
+    /// Frames the recording queue dropped.
+    pub dropped: u64,
+    /// Triggers and unwritten frames, in flight-recorder mode.
+    pub flight: Option<FlightStats>,
+    /// Frames not delivered to the consumer because it fell behind.
+    pub consumer_dropped: u64,
+    /// Deadlines skipped because the sampler was more than a period late.
+    pub missed: u64,
+    pub timing: SamplerTiming,
+}
+
+/// A running sampling thread.
+pub struct Session {
+    stop: Arc<AtomicBool>,
+    recycle: SyncSender<Box<ComputedFrame>>,
+    handle: thread::JoinHandle<Result<SessionSummary>>,
+}
+
+impl Session {
+    /// Starts sampling `source` on its own thread, recording into `writer`
+    /// if given, until `shutdown` is raised, `join` is called, the source
+    /// is exhausted or the duration limit passes. `Update`s go to `updates`
+    /// and are dropped if it is full.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the thread cannot be spawned.
+    pub fn spawn<S, T>(
+        source: S,
+        writer: Option<AsyncRecordingWriter>,
+        config: SessionConfig,
+        shutdown: Arc<AtomicBool>,
+        updates: SyncSender<T>,
+    ) -> Result<Self>
+    where
+        S: FrameSource + 'static,
+        T: From<Update> + Send + 'static,
+    {
+        let stop = Arc::new(AtomicBool::new(false));
+        let (recycle, recycled) = sync_channel(RECYCLE_CAPACITY);
+        let worker = Worker {
+            source,
+            writer,
+            config,
+            stop: Arc::clone(&stop),
+            shutdown,
+            updates,
+            recycled,
+            consumer_dropped: 0,
+        };
+        let handle = thread::Builder::new()
+            .name("felix-sampler".into())
+            .spawn(move || worker.run())
+            .context("failed to spawn sampler thread")?;
+        Ok(Self {
+            stop,
+            recycle,
+            handle,
+        })
+    }
+
+    /// Hands a frame from an `Update::Frame` back for reuse.
+    pub fn recycle(&self, frame: Box<ComputedFrame>) {
+        let _ = self.recycle.try_send(frame);
+    }
+
+    /// Whether the thread has stopped on its own.
+    #[must_use]
+    pub fn is_finished(&self) -> bool {
+        self.handle.is_finished()
+    }
+
+    /// Stops sampling, finishes the recording and returns the summary.
+    ///
+    /// # Errors
+    ///
+    /// Returns the error that stopped sampling or finishing the recording.
+    ///
+    /// # Panics
+    ///
+    /// Panics if the sampler thread panicked.
+    pub fn join(self) -> Result<SessionSummary> {
+        self.stop.store(true, Ordering::Relaxed);
+        self.handle.join().expect("sampler thread panicked")
+    }
+}
+
+struct Worker<S, T> {
+    source: S,
+    writer: Option<AsyncRecordingWriter>,
+    config: SessionConfig,
+    stop: Arc<AtomicBool>,
+    shutdown: Arc<AtomicBool>,
+    updates: SyncSender<T>,
+    recycled: Receiver<Box<ComputedFrame>>,
+    consumer_dropped: u64,
+}
+
+impl<S: FrameSource, T: From<Update>> Worker<S, T> {
+    fn run(mut self) -> Result<SessionSummary> {
+        let result = self.sample_loop();
+        self.source.shutdown();
+        let finished = self
+            .writer
+            .take()
+            .map(AsyncRecordingWriter::finish)
+            .transpose();
+        let mut summary = result?;
+        let stats = finished?.unwrap_or_default();
+        summary.dropped = stats.dropped;
+        summary.flight = stats.flight;
+        summary.consumer_dropped = self.consumer_dropped;
+        Ok(summary)
+    }
+
+    fn sample_loop(&mut self) -> Result<SessionSummary> {
+        let config = self.config;
+        // Helper threads are already running, so only this thread is
+        // pinned.
+        if let Some(cpu) = config.pin_cpu {
+            pin_current_thread(cpu)?;
+        }
+        if config.sample_period < Duration::from_millis(1) {
+            minimize_timer_slack();
+        }
+
+        let start = Instant::now();
+        let mut timer = DeadlineTimer::new(config.sample_period, config.spin);
+        let mut timing = SamplerTiming::default();
+        let mut last_status = Instant::now();
+        let mut frames: u64 = 0;
+        let mut record_busy_ns = 0;
+
+        let reason = loop {
+            if self.stop.load(Ordering::Relaxed) || self.shutdown.load(Ordering::Relaxed) {
+                break StopReason::Requested;
+            }
+            if self.source.exhausted() {
+                break StopReason::Exhausted;
+            }
+            if config
+                .max_duration
+                .is_some_and(|max| start.elapsed() >= max)
+            {
+                break StopReason::DurationLimit;
+            }
+
+            let updates = &self.updates;
+            let consumer_dropped = &mut self.consumer_dropped;
+            let source = &mut self.source;
+            let lateness_ns = timer.wait_with(|timeout| {
+                source.idle(timeout, &mut |e| {
+                    try_send(updates, consumer_dropped, Update::Track(e));
+                });
+            });
+
+            let writer = &mut self.writer;
+            let recycled = &self.recycled;
+            self.source
+                .sample(lateness_ns, &mut |pid, frame, per_thread| {
+                    timing.record(frame);
+                    frames += 1;
+                    let recorder = match writer {
+                        Some(w) => {
+                            // Whatever the writer spent since the last frame
+                            // is charged to this one.
+                            let busy = w.busy_ns();
+                            frame.record_ns = busy - record_busy_ns;
+                            record_busy_ns = busy;
+                            // Recorded frames are moved into the writer queue,
+                            // so each one is a fresh allocation.
+                            w.submit(Frame {
+                                pid,
+                                computed: frame.clone(),
+                                per_thread_deltas: per_thread.to_vec(),
+                            })?;
+                            Some(w.stats())
+                        }
+                        None => None,
+                    };
+                    if config.forward_frames {
+                        // The consumer gets this frame and the source keeps a
+                        // recycled one to overwrite on the next sample.
+                        let mut spare = recycled.try_recv().unwrap_or_default();
+                        std::mem::swap(frame, &mut *spare);
+                        let update = Update::Frame {
+                            frame: spare,
+                            recorder,
+                        };
+                        try_send(updates, consumer_dropped, update);
+                    }
+                    Ok(())
+                })?;
+
+            if let Some(interval) = config.status_interval
+                && last_status.elapsed() >= interval
+                && let Some(w) = &self.writer
+            {
+                let progress = Progress {
+                    elapsed: start.elapsed(),
+                    frames,
+                    queue: w.stats(),
+                };
+                try_send(
+                    &self.updates,
+                    &mut self.consumer_dropped,
+                    Update::Status(progress),
+                );
+                last_status = Instant::now();
+            }
+        };
+
+        Ok(SessionSummary {
+            reason,
+            frames,
+            dropped: 0,
+            flight: None,
+            consumer_dropped: 0,
+            missed: timer.missed(),
+            timing,
+        })
+    }
+}
+
+/// Queues `update` unless the consumer is full or gone; a full queue is
+/// counted in `dropped`.
+fn try_send<T: From<Update>>(updates: &SyncSender<T>, dropped: &mut u64, update: Update) {
+    if let Err(TrySendError::Full(_)) = updates.try_send(T::from(update)) {
+        *dropped += 1;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Emits `remaining` frames numbered by `timestamp_ns`, then runs dry.
+    struct CountingSource {
+        remaining: u64,
+        emitted: u64,
+        frame: ComputedFrame,
+    }
+
+    impl FrameSource for CountingSource {
+        fn sample(&mut self, _lateness_ns: u64, emit: &mut Emit<'_>) -> Result<()> {
+            // Like a pipeline, overwrite whatever frame was swapped in.
+            self.remaining -= 1;
+            self.emitted += 1;
+            self.frame.timestamp_ns = self.emitted;
+            emit(1, &mut self.frame, &[])
+        }
+
+        fn exhausted(&mut self) -> bool {
+            self.remaining == 0
+        }
+
+        fn shutdown(&mut self) {}
+    }
+
+    fn config() -> SessionConfig {
+        SessionConfig {
+            sample_period: Duration::from_micros(200),
+            forward_frames: true,
+            ..SessionConfig::default()
+        }
+    }
+
+    fn source(frames: u64) -> CountingSource {
+        CountingSource {
+            remaining: frames,
+            emitted: 0,
+            frame: ComputedFrame::default(),
+        }
+    }
+
+    #[test]
+    fn frames_reach_the_consumer_in_order() {
+        let (tx, rx) = sync_channel::<Update>(64);
+        let shutdown = Arc::new(AtomicBool::new(false));
+        let session = Session::spawn(source(20), None, config(), shutdown, tx).unwrap();
+
+        let mut seen = Vec::new();
+        for update in rx {
+            if let Update::Frame { frame, .. } = update {
+                seen.push(frame.timestamp_ns);
+                session.recycle(frame);
+            }
+        }
+        let summary = session.join().unwrap();
+        assert_eq!(summary.reason, StopReason::Exhausted);
+        assert_eq!(summary.frames, 20);
+        assert_eq!(summary.consumer_dropped, 0);
+        assert_eq!(seen, (1..=20).collect::<Vec<_>>());
+    }
+
+    #[test]
+    fn stalled_consumer_does_not_block_sampling() {
+        let (tx, rx) = sync_channel::<Update>(4);
+        let shutdown = Arc::new(AtomicBool::new(false));
+        let session = Session::spawn(source(50), None, config(), shutdown, tx).unwrap();
+
+        // Nothing is received until the sampler is done.
+        while !session.is_finished() {
+            std::thread::sleep(Duration::from_millis(1));
+        }
+        let summary = session.join().unwrap();
+        assert_eq!(summary.frames, 50);
+        assert_eq!(summary.consumer_dropped, 46);
+        assert_eq!(rx.iter().count(), 4);
+    }
+
+    #[test]
+    fn join_stops_sampling() {
+        let (tx, _rx) = sync_channel::<Update>(1);
+        let shutdown = Arc::new(AtomicBool::new(false));
+        let session = Session::spawn(source(u64::MAX), None, config(), shutdown, tx).unwrap();
+        std::thread::sleep(Duration::from_millis(5));
+        let summary = session.join().unwrap();
+        assert_eq!(summary.reason, StopReason::Requested);
+        assert!(summary.frames > 0);
+    }
+}
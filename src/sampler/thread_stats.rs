@@ -1,5 +1,4 @@
 // SPDX-License-Identifier: MIT
-use std::collections::BTreeMap;
 use std::time::{Duration, Instant};
 
 use serde::{Deserialize, Serialize};
@@ -23,88 +22,152 @@ pub struct ThreadDelta {
 }
 
 pub struct SampleResult {
-    #[allow(dead_code)]
     pub timestamp: Instant,
     pub per_thread: Vec<ThreadDelta>,
     pub threads_sampled: usize,
+    /// Threads whose counters went backwards, so their deltas were zeroed.
+    pub rejected: u32,
+}
+
+/// Per-thread state, kept in a `Vec` sorted by TID so steady-state sampling
+/// is a binary search per thread with no allocation.
+struct TrackedThread {
+    tid: u32,
+    previous: ThreadStats,
+    last_seen: Instant,
+    /// The last sample went backwards and was rejected.
+    regressed: bool,
 }
 
 pub struct ThreadSampler {
-    previous: BTreeMap<u32, ThreadStats>,
-    last_seen: BTreeMap<u32, Instant>,
+    threads: Vec<TrackedThread>,
     stale_timeout: Duration,
 }
 
+impl SampleResult {
+    #[must_use]
+    pub fn new(timestamp: Instant) -> Self {
+        Self {
+            timestamp,
+            per_thread: Vec::new(),
+            threads_sampled: 0,
+            rejected: 0,
+        }
+    }
+}
+
 impl ThreadSampler {
     #[must_use]
     pub fn new() -> Self {
         Self {
-            previous: BTreeMap::new(),
-            last_seen: BTreeMap::new(),
+            threads: Vec::new(),
             stale_timeout: DEFAULT_STALE_TIMEOUT,
         }
     }
 
-    pub fn sample(&mut self, raw_stats: &[ThreadStats], now: Instant) -> SampleResult {
-        let mut deltas = Vec::with_capacity(raw_stats.len());
+    /// Computes per-thread deltas against the previous sample into `out`,
+    /// reusing its buffer. Threads not seen for the stale timeout are
+    /// forgotten.
+    ///
+    /// Every counter is cumulative, so one that went backwards means a torn
+    /// read on one side or a reused TID. Such a thread gets a zero delta
+    /// instead of a wrapped-around one, and its previous snapshot is kept;
+    /// only when the next sample is also behind is it taken as the new
+    /// baseline.
+    pub fn sample_into(&mut self, raw_stats: &[ThreadStats], now: Instant, out: &mut SampleResult) {
+        out.timestamp = now;
+        out.per_thread.clear();
+        out.rejected = 0;
 
         for stat in raw_stats {
             let tid = stat.tid;
-            self.last_seen.insert(tid, now);
-
-            let delta = if let Some(prev) = self.previous.get(&tid) {
-                ThreadDelta {
-                    tid,
-                    jit_time: stat
-                        .accumulated_jit_time
-                        .wrapping_sub(prev.accumulated_jit_time),
-                    signal_time: stat
-                        .accumulated_signal_time
-                        .wrapping_sub(prev.accumulated_signal_time),
-                    sigbus_count: stat.sigbus_count.wrapping_sub(prev.sigbus_count),
-                    smc_count: stat.smc_count.wrapping_sub(prev.smc_count),
-                    float_fallback_count: stat
-                        .float_fallback_count
-                        .wrapping_sub(prev.float_fallback_count),
-                    cache_miss_count: stat
-                        .accumulated_cache_miss_count
-                        .wrapping_sub(prev.accumulated_cache_miss_count),
-                    cache_read_lock_time: stat
-                        .accumulated_cache_read_lock_time
-                        .wrapping_sub(prev.accumulated_cache_read_lock_time),
-                    cache_write_lock_time: stat
-                        .accumulated_cache_write_lock_time
-                        .wrapping_sub(prev.accumulated_cache_write_lock_time),
-                    jit_count: stat
-                        .accumulated_jit_count
-                        .wrapping_sub(prev.accumulated_jit_count),
+            let delta = match self.threads.binary_search_by_key(&tid, |t| t.tid) {
+                Ok(i) if regressed(stat, &self.threads[i].previous) => {
+                    let t = &mut self.threads[i];
+                    if t.regressed {
+                        t.previous = *stat;
+                    }
+                    t.regressed = !t.regressed;
+                    t.last_seen = now;
+                    out.rejected += 1;
+                    ThreadDelta {
+                        tid,
+                        ..ThreadDelta::default()
+                    }
                 }
-            } else {
-                ThreadDelta {
-                    tid,
-                    ..ThreadDelta::default()
+                Ok(i) => {
+                    let t = &mut self.threads[i];
+                    let prev = &t.previous;
+                    let delta = ThreadDelta {
+                        tid,
+                        jit_time: stat
+                            .accumulated_jit_time
+                            .wrapping_sub(prev.accumulated_jit_time),
+                        signal_time: stat
+                            .accumulated_signal_time
+                            .wrapping_sub(prev.accumulated_signal_time),
+                        sigbus_count: stat.sigbus_count.wrapping_sub(prev.sigbus_count),
+                        smc_count: stat.smc_count.wrapping_sub(prev.smc_count),
+                        float_fallback_count: stat
+                            .float_fallback_count
+                            .wrapping_sub(prev.float_fallback_count),
+                        cache_miss_count: stat
+                            .accumulated_cache_miss_count
+                            .wrapping_sub(prev.accumulated_cache_miss_count),
+                        cache_read_lock_time: stat
+                            .accumulated_cache_read_lock_time
+                            .wrapping_sub(prev.accumulated_cache_read_lock_time),
+                        cache_write_lock_time: stat
+                            .accumulated_cache_write_lock_time
+                            .wrapping_sub(prev.accumulated_cache_write_lock_time),
+                        jit_count: stat
+                            .accumulated_jit_count
+                            .wrapping_sub(prev.accumulated_jit_count),
+                    };
+                    t.previous = *stat;
+                    t.last_seen = now;
+                    t.regressed = false;
+                    delta
+                }
+                Err(i) => {
+                    self.threads.insert(
+                        i,
+                        TrackedThread {
+                            tid,
+                            previous: *stat,
+                            last_seen: now,
+                            regressed: false,
+                        },
+                    );
+                    ThreadDelta {
+                        tid,
+                        ..ThreadDelta::default()
+                    }
                 }
             };
-
-            self.previous.insert(tid, *stat);
-            deltas.push(delta);
+            out.per_thread.push(delta);
         }
 
-        let threads_sampled = deltas.len();
+        out.threads_sampled = out.per_thread.len();
 
-        self.last_seen
-            .retain(|_, seen| now.duration_since(*seen) < self.stale_timeout);
-        self.previous
-            .retain(|tid, _| self.last_seen.contains_key(tid));
-
-        SampleResult {
-            timestamp: now,
-            per_thread: deltas,
-            threads_sampled,
-        }
+        self.threads
+            .retain(|t| now.duration_since(t.last_seen) < self.stale_timeout);
     }
 }
 
+/// Whether any cumulative counter in `stat` is below `prev`.
+fn regressed(stat: &ThreadStats, prev: &ThreadStats) -> bool {
+    stat.accumulated_jit_time < prev.accumulated_jit_time
+        || stat.accumulated_signal_time < prev.accumulated_signal_time
+        || stat.sigbus_count < prev.sigbus_count
+        || stat.smc_count < prev.smc_count
+        || stat.float_fallback_count < prev.float_fallback_count
+        || stat.accumulated_cache_miss_count < prev.accumulated_cache_miss_count
+        || stat.accumulated_cache_read_lock_time < prev.accumulated_cache_read_lock_time
+        || stat.accumulated_cache_write_lock_time < prev.accumulated_cache_write_lock_time
+        || stat.accumulated_jit_count < prev.accumulated_jit_count
+}
+
 impl Default for ThreadSampler {
     fn default() -> Self {
         Self::new()
@@ -115,6 +178,14 @@ impl Default for ThreadSampler {
 mod tests {
     use super::*;
 
+    impl ThreadSampler {
+        fn sample(&mut self, raw_stats: &[ThreadStats], now: Instant) -> SampleResult {
+            let mut out = SampleResult::new(now);
+            self.sample_into(raw_stats, now, &mut out);
+            out
+        }
+    }
+
     fn make_stats(tid: u32, jit_time: u64, signal_time: u64) -> ThreadStats {
         ThreadStats {
             tid,
@@ -160,7 +231,7 @@ mod tests {
         let result = sampler.sample(&[make_stats(1, 200, 60)], t1);
 
         assert_eq!(result.threads_sampled, 1);
-        assert!(!sampler.previous.contains_key(&2));
+        assert!(!sampler.threads.iter().any(|t| t.tid == 2));
     }
 
     #[test]
@@ -178,4 +249,76 @@ mod tests {
         assert_eq!(result.per_thread[1].tid, 20);
         assert_eq!(result.per_thread[1].jit_time, 1000);
     }
+
+    #[test]
+    fn table_stays_sorted_when_threads_arrive_out_of_order() {
+        let mut sampler = ThreadSampler::new();
+        let t0 = Instant::now();
+        sampler.sample(&[make_stats(30, 0, 0), make_stats(10, 0, 0)], t0);
+        sampler.sample(&[make_stats(20, 0, 0), make_stats(30, 5, 0)], t0);
+        let tids: Vec<u32> = sampler.threads.iter().map(|t| t.tid).collect();
+        assert_eq!(tids, vec![10, 20, 30]);
+
+        let result = sampler.sample(&[make_stats(30, 9, 0), make_stats(10, 7, 0)], t0);
+        // Output keeps the SHM order, not the table order.
+        assert_eq!(result.per_thread[0].tid, 30);
+        assert_eq!(result.per_thread[0].jit_time, 4);
+        assert_eq!(result.per_thread[1].tid, 10);
+        assert_eq!(result.per_thread[1].jit_time, 7);
+    }
+
+    #[test]
+    fn backwards_counters_are_rejected_then_rebased() {
+        let mut sampler = ThreadSampler::new();
+        let t0 = Instant::now();
+        sampler.sample(&[make_stats(1, 1000, 500)], t0);
+
+        // A torn low read: zeroed, and the good baseline is kept.
+        let result = sampler.sample(&[make_stats(1, 900, 600)], t0);
+        assert_eq!(result.rejected, 1);
+        assert_eq!(result.per_thread[0].jit_time, 0);
+        let result = sampler.sample(&[make_stats(1, 1200, 700)], t0);
+        assert_eq!(result.rejected, 0);
+        assert_eq!(result.per_thread[0].jit_time, 200);
+
+        // A reused TID stays behind: rejected twice, then rebased on.
+        assert_eq!(sampler.sample(&[make_stats(1, 10, 0)], t0).rejected, 1);
+        assert_eq!(sampler.sample(&[make_stats(1, 20, 0)], t0).rejected, 1);
+        let result = sampler.sample(&[make_stats(1, 50, 0)], t0);
+        assert_eq!(result.rejected, 0);
+        assert_eq!(result.per_thread[0].jit_time, 30);
+    }
+
+    /// `cargo test --release -- --ignored bench_ --nocapture --test-threads=1`.
+    ///
+    /// Steady-state deltas of 10 to 10,000 threads, every counter moving.
+    #[test]
+    #[ignore = "benchmark"]
+    fn bench_thread_sampler() {
+        for threads in [10u32, 100, 1000, 10_000] {
+            let mut stats: Vec<ThreadStats> = (0..threads)
+                .map(|i| make_stats(1000 + i, u64::from(i), 0))
+                .collect();
+            let mut sampler = ThreadSampler::new();
+            let now = Instant::now();
+            let mut out = SampleResult::new(now);
+            let iters = (1_000_000 / threads).clamp(10, 10_000);
+
+            sampler.sample_into(&stats, now, &mut out);
+            let start = Instant::now();
+            for _ in 0..iters {
+                for s in &mut stats {
+                    s.accumulated_jit_time += 1000;
+                    s.sigbus_count += 1;
+                }
+                sampler.sample_into(std::hint::black_box(&stats), now, &mut out);
+            }
+            let per_iter = start.elapsed() / iters;
+            assert_eq!(out.per_thread.len(), threads as usize);
+            eprintln!(
+                "thread_sampler threads={threads}: {} ns/iter",
+                per_iter.as_nanos()
+            );
+        }
+    }
 }
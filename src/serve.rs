@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: MIT
+//! Minimal HTTP/1.1 endpoint for `felix serve`: `GET /metrics` returns the
+//! latest `MetricsSnapshot` in the `OpenMetrics` text format. Connections are
+//! handled one at a time on a dedicated thread and closed after each
+//! response; the sampler only ever try-locks the snapshot, so a slow
+//! scraper cannot delay a sample.
+
+use std::io::{self, Read, Write};
+use std::net::{Ipv4Addr, Ipv6Addr, SocketAddr, TcpListener, TcpStream};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::thread;
+use std::time::Duration;
+
+use anyhow::{Context, Result};
+
+use crate::sampler::metrics::SharedMetrics;
+
+const CONTENT_TYPE: &str = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+/// How long a client may take to send its request or read the response.
+const IO_TIMEOUT: Duration = Duration::from_secs(5);
+/// Longest request head accepted.
+const MAX_REQUEST: usize = 8192;
+
+pub struct MetricsServer {
+    addr: SocketAddr,
+    stop: Arc<AtomicBool>,
+    handle: thread::JoinHandle<()>,
+}
+
+impl MetricsServer {
+    /// Listens on `addr` and serves `metrics` until `shutdown`.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the address cannot be bound or the thread cannot
+    /// be spawned.
+    pub fn spawn(addr: SocketAddr, metrics: SharedMetrics) -> Result<Self> {
+        let listener =
+            TcpListener::bind(addr).with_context(|| format!("failed to listen on {addr}"))?;
+        let addr = listener
+            .local_addr()
+            .context("failed to get listening address")?;
+        let stop = Arc::new(AtomicBool::new(false));
+        let handle = {
+            let stop = Arc::clone(&stop);
+            thread::Builder::new()
+                .name("felix-http".into())
+                .spawn(move || {
+                    for stream in listener.incoming() {
+                        if stop.load(Ordering::Relaxed) {
+                            break;
+                        }
+                        // A client that misbehaves only loses its own
+                        // response.
+                        if let Ok(stream) = stream {
+                            let _ = serve_connection(stream, &metrics);
+                        }
+                    }
+                })
+                .context("failed to spawn HTTP thread")?
+        };
+        Ok(Self { addr, stop, handle })
+    }
+
+    /// The bound address, with the actual port if 0 was asked for.
+    #[must_use]
+    pub fn local_addr(&self) -> SocketAddr {
+        self.addr
+    }
+
+    /// Stops accepting connections and waits for the thread.
+    pub fn shutdown(self) {
+        self.stop.store(true, Ordering::Relaxed);
+        // Wake the blocking accept with a connection of our own.
+        let mut wake = self.addr;
+        if wake.ip().is_unspecified() {
+            wake.set_ip(if wake.is_ipv4() {
+                Ipv4Addr::LOCALHOST.into()
+            } else {
+                Ipv6Addr::LOCALHOST.into()
+            });
+        }
+        if TcpStream::connect_timeout(&wake, IO_TIMEOUT).is_ok() {
+            let _ = self.handle.join();
+        }
+    }
+}
+
+fn serve_connection(mut stream: TcpStream, metrics: &SharedMetrics) -> io::Result<()> {
+    stream.set_read_timeout(Some(IO_TIMEOUT))?;
+    stream.set_write_timeout(Some(IO_TIMEOUT))?;
+
+    let Some(head) = read_request_head(&mut stream)? else {
+        return respond(
+            &mut stream,
+            "400 Bad Request",
+            "text/plain",
+            b"bad request\n",
+        );
+    };
+    let mut parts = head.split_ascii_whitespace();
+    let method = parts.next().unwrap_or_default();
+    let target = parts.next().unwrap_or_default();
+    let path = target.split('?').next().unwrap_or_default();
+
+    match (method, path) {
+        ("GET" | "HEAD", "/metrics") => {
+            let body = metrics
+                .lock()
+                .map(|m| m.render_openmetrics())
+                .unwrap_or_default();
+            let body = if method == "HEAD" { "" } else { &body };
+            respond(&mut stream, "200 OK", CONTENT_TYPE, body.as_bytes())
+        }
+        ("GET" | "HEAD", _) => respond(&mut stream, "404 Not Found", "text/plain", b"not found\n"),
+        _ => respond(
+            &mut stream,
+            "405 Method Not Allowed",
+            "text/plain",
+            b"method not allowed\n",
+        ),
+    }
+}
+
+/// Reads up to the blank line ending the request head and returns the
+/// request line, or `None` if the client sent something else.
+fn read_request_head(stream: &mut TcpStream) -> io::Result<Option<String>> {
+    let mut buf = Vec::with_capacity(1024);
+    let mut chunk = [0u8; 1024];
+    while !buf.windows(4).any(|w| w == b"\r\n\r\n") {
+        let n = stream.read(&mut chunk)?;
+        if n == 0 || buf.len() + n > MAX_REQUEST {
+            return Ok(None);
+        }
+        buf.extend_from_slice(&chunk[..n]);
+    }
+    let line = buf.split(|&b| b == b'\n').next().unwrap_or_default();
+    Ok(std::str::from_utf8(line)
+        .ok()
+        .map(|l| l.trim_end().to_owned()))
+}
+
+fn respond(
+    stream: &mut TcpStream,
+    status: &str,
+    content_type: &str,
+    body: &[u8],
+) -> io::Result<()> {
+    write!(
+        stream,
+        "HTTP/1.1 {status}\r\nContent-Type: {content_type}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n",
+        body.len()
+    )?;
+    stream.write_all(body)?;
+    stream.flush()
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Mutex;
+
+    use super::*;
+    use crate::sampler::metrics::MetricsSnapshot;
+
+    fn get(addr: SocketAddr, request: &str) -> String {
+        let mut stream = TcpStream::connect(addr).unwrap();
+        stream.write_all(request.as_bytes()).unwrap();
+        let mut response = String::new();
+        stream.read_to_string(&mut response).unwrap();
+        response
+    }
+
+    #[test]
+    fn serves_metrics_and_rejects_other_paths() {
+        let metrics = Arc::new(Mutex::new(MetricsSnapshot::default()));
+        let server = MetricsServer::spawn("127.0.0.1:0".parse().unwrap(), metrics).unwrap();
+        let addr = server.local_addr();
+
+        let response = get(addr, "GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n");
+        assert!(response.starts_with("HTTP/1.1 200 OK\r\n"));
+        assert!(response.contains(CONTENT_TYPE));
+        assert!(response.contains("felix_processes 0\n"));
+        assert!(response.ends_with("# EOF\n"));
+
+        let response = get(addr, "GET /other HTTP/1.1\r\n\r\n");
+        assert!(response.starts_with("HTTP/1.1 404"));
+        let response = get(addr, "POST /metrics HTTP/1.1\r\n\r\n");
+        assert!(response.starts_with("HTTP/1.1 405"));
+
+        server.shutdown();
+    }
+}
@@ -0,0 +1,665 @@
+// SPDX-License-Identifier: MIT
+//! Remote viewing: `felix record --stream` serves frames to one
+//! `felix live --connect` client at a time, so the device only samples and
+//! encodes while rendering happens elsewhere.
+//!
+//! On connect the server sends `STREAM_MAGIC`, `PROTOCOL_VERSION` and the
+//! length-prefixed postcard `SessionMetadata`. Frames follow in batches: a
+//! `u32` payload length, then the frame count (`u32`), the total frames
+//! lost so far on the server (`u64`), and the frames as length-prefixed
+//! postcard `Frame`s, as in a postcard recording block. Batches are sent
+//! once they hold `BATCH_FRAMES` frames or `BATCH_INTERVAL` has passed. The
+//! socket is written blocking, so a slow client fills the recording queue
+//! and `--on-overflow` decides between stalling and dropping; frames taken
+//! while no client is connected are lost and counted too.
+
+use std::fmt;
+use std::fs;
+use std::io::{self, Read, Write};
+use std::net::{Shutdown, TcpListener, TcpStream};
+use std::os::unix::fs::FileTypeExt;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::PathBuf;
+use std::str::FromStr;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::mpsc::{Receiver, SyncSender, TryRecvError, TrySendError, sync_channel};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+use anyhow::{Context, Result, anyhow, bail};
+
+use crate::datasource::{DataSource, SessionMetadata};
+use crate::recording::async_writer::{FrameSink, QueueStats};
+use crate::recording::format::Frame;
+use crate::sampler::accumulator::ComputedFrame;
+
+const STREAM_MAGIC: [u8; 4] = *b"FLXS";
+/// Bumped whenever `Frame` or the batch layout changes.
+const PROTOCOL_VERSION: u8 = 1;
+const BATCH_FRAMES: u32 = 64;
+const BATCH_INTERVAL: Duration = Duration::from_millis(50);
+/// Bytes in a batch before its frames: count and lost total.
+const BATCH_HEADER_LEN: usize = 12;
+/// Largest batch or metadata a client accepts.
+const MAX_MESSAGE_LEN: usize = 64 << 20;
+/// Shortest interval between checks for a waiting client.
+const ACCEPT_INTERVAL: Duration = Duration::from_millis(100);
+/// How long a write to the client may block before it is dropped.
+const WRITE_TIMEOUT: Duration = Duration::from_secs(5);
+/// Frames the client buffers for the UI before dropping.
+const CLIENT_QUEUE_CAPACITY: usize = 1024;
+
+/// `tcp://host:port` or `unix:/path`.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub enum StreamAddr {
+    Tcp(String),
+    Unix(PathBuf),
+}
+
+impl FromStr for StreamAddr {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        if let Some(addr) = s.strip_prefix("tcp://") {
+            Ok(Self::Tcp(addr.to_owned()))
+        } else if let Some(path) = s
+            .strip_prefix("unix://")
+            .or_else(|| s.strip_prefix("unix:"))
+        {
+            Ok(Self::Unix(PathBuf::from(path)))
+        } else {
+            Err(format!("expected tcp://host:port or unix:/path, got {s:?}"))
+        }
+    }
+}
+
+impl fmt::Display for StreamAddr {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Self::Tcp(addr) => write!(f, "tcp://{addr}"),
+            Self::Unix(path) => write!(f, "unix:{}", path.display()),
+        }
+    }
+}
+
+/// A connected socket of either kind.
+enum Connection {
+    Tcp(TcpStream),
+    Unix(UnixStream),
+}
+
+impl Connection {
+    fn connect(addr: &StreamAddr) -> io::Result<Self> {
+        match addr {
+            StreamAddr::Tcp(addr) => {
+                let stream = TcpStream::connect(addr)?;
+                stream.set_nodelay(true)?;
+                Ok(Self::Tcp(stream))
+            }
+            StreamAddr::Unix(path) => UnixStream::connect(path).map(Self::Unix),
+        }
+    }
+
+    fn try_clone(&self) -> io::Result<Self> {
+        match self {
+            Self::Tcp(s) => s.try_clone().map(Self::Tcp),
+            Self::Unix(s) => s.try_clone().map(Self::Unix),
+        }
+    }
+
+    fn prepare_for_writing(&self) -> io::Result<()> {
+        match self {
+            Self::Tcp(s) => {
+                s.set_nonblocking(false)?;
+                s.set_nodelay(true)?;
+                s.set_write_timeout(Some(WRITE_TIMEOUT))
+            }
+            Self::Unix(s) => {
+                s.set_nonblocking(false)?;
+                s.set_write_timeout(Some(WRITE_TIMEOUT))
+            }
+        }
+    }
+
+    fn shutdown(&self) {
+        let _ = match self {
+            Self::Tcp(s) => s.shutdown(Shutdown::Both),
+            Self::Unix(s) => s.shutdown(Shutdown::Both),
+        };
+    }
+}
+
+impl Read for Connection {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        match self {
+            Self::Tcp(s) => s.read(buf),
+            Self::Unix(s) => s.read(buf),
+        }
+    }
+}
+
+impl Write for Connection {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        match self {
+            Self::Tcp(s) => s.write(buf),
+            Self::Unix(s) => s.write(buf),
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        match self {
+            Self::Tcp(s) => s.flush(),
+            Self::Unix(s) => s.flush(),
+        }
+    }
+}
+
+enum Listener {
+    Tcp(TcpListener),
+    Unix(UnixListener, PathBuf),
+}
+
+impl Listener {
+    fn accept(&self) -> io::Result<Connection> {
+        match self {
+            Self::Tcp(l) => l.accept().map(|(s, _)| Connection::Tcp(s)),
+            Self::Unix(l, _) => l.accept().map(|(s, _)| Connection::Unix(s)),
+        }
+    }
+}
+
+/// Counters of a `StreamWriter`, shared with whoever reports progress.
+#[derive(Default)]
+pub struct StreamStats {
+    pub connected: AtomicBool,
+    /// Clients served so far, including the current one.
+    pub clients: AtomicU64,
+    pub sent: AtomicU64,
+    /// Frames taken without a client to send them to, or lost with one
+    /// that disconnected.
+    pub unsent: AtomicU64,
+}
+
+/// The server side: a `FrameSink` that sends frames to the connected
+/// client instead of writing a file.
+pub struct StreamWriter {
+    listener: Listener,
+    client: Option<Connection>,
+    last_accept: Option<Instant>,
+    /// Magic, version and metadata, sent to every new client.
+    hello: Vec<u8>,
+    /// Encoded frames of the current batch, after room for its header.
+    batch: Vec<u8>,
+    batch_frames: u32,
+    batch_started: Instant,
+    queue_dropped: u64,
+    stats: Arc<StreamStats>,
+}
+
+impl StreamWriter {
+    /// Listens on `addr`. A stale socket file at a Unix address is
+    /// replaced.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the address cannot be bound or the metadata
+    /// cannot be encoded.
+    pub fn bind(
+        addr: &StreamAddr,
+        metadata: &SessionMetadata,
+        stats: Arc<StreamStats>,
+    ) -> Result<Self> {
+        let listener = match addr {
+            StreamAddr::Tcp(a) => {
+                let l =
+                    TcpListener::bind(a).with_context(|| format!("failed to listen on {addr}"))?;
+                l.set_nonblocking(true)
+                    .context("failed to make the listener non-blocking")?;
+                Listener::Tcp(l)
+            }
+            StreamAddr::Unix(path) => {
+                if fs::symlink_metadata(path).is_ok_and(|m| m.file_type().is_socket()) {
+                    let _ = fs::remove_file(path);
+                }
+                let l = UnixListener::bind(path)
+                    .with_context(|| format!("failed to listen on {addr}"))?;
+                l.set_nonblocking(true)
+                    .context("failed to make the listener non-blocking")?;
+                Listener::Unix(l, path.clone())
+            }
+        };
+
+        let encoded = postcard::to_stdvec(metadata).context("failed to serialize metadata")?;
+        let mut hello = Vec::with_capacity(9 + encoded.len());
+        hello.extend_from_slice(&STREAM_MAGIC);
+        hello.push(PROTOCOL_VERSION);
+        #[allow(clippy::cast_possible_truncation)]
+        hello.extend_from_slice(&(encoded.len() as u32).to_le_bytes());
+        hello.extend_from_slice(&encoded);
+
+        Ok(Self {
+            listener,
+            client: None,
+            last_accept: None,
+            hello,
+            batch: vec![0; 4 + BATCH_HEADER_LEN],
+            batch_frames: 0,
+            batch_started: Instant::now(),
+            queue_dropped: 0,
+            stats,
+        })
+    }
+
+    /// The bound address, with the actual port if 0 was asked for.
+    #[cfg(test)]
+    fn local_addr(&self) -> StreamAddr {
+        match &self.listener {
+            Listener::Tcp(l) => StreamAddr::Tcp(l.local_addr().unwrap().to_string()),
+            Listener::Unix(_, path) => StreamAddr::Unix(path.clone()),
+        }
+    }
+
+    /// Takes a waiting client, if there is one and it has been long enough
+    /// since the last look.
+    fn accept(&mut self) {
+        let now = Instant::now();
+        if self
+            .last_accept
+            .is_some_and(|at| now.duration_since(at) < ACCEPT_INTERVAL)
+        {
+            return;
+        }
+        self.last_accept = Some(now);
+        let Ok(mut client) = self.listener.accept() else {
+            return;
+        };
+        if client.prepare_for_writing().is_err() || client.write_all(&self.hello).is_err() {
+            return;
+        }
+        self.client = Some(client);
+        self.stats.connected.store(true, Ordering::Relaxed);
+        self.stats.clients.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn send_batch(&mut self) {
+        if self.batch_frames == 0 {
+            return;
+        }
+        let frames = u64::from(self.batch_frames);
+        let lost = self.queue_dropped + self.stats.unsent.load(Ordering::Relaxed);
+        #[allow(clippy::cast_possible_truncation)]
+        let len = (self.batch.len() - 4) as u32;
+        self.batch[..4].copy_from_slice(&len.to_le_bytes());
+        self.batch[4..8].copy_from_slice(&self.batch_frames.to_le_bytes());
+        self.batch[8..16].copy_from_slice(&lost.to_le_bytes());
+
+        let sent = self
+            .client
+            .as_mut()
+            .is_some_and(|c| c.write_all(&self.batch).is_ok());
+        if sent {
+            self.stats.sent.fetch_add(frames, Ordering::Relaxed);
+        } else {
+            // The client is gone (or never was); wait for the next one.
+            self.client = None;
+            self.stats.connected.store(false, Ordering::Relaxed);
+            self.stats.unsent.fetch_add(frames, Ordering::Relaxed);
+        }
+        self.batch.truncate(4 + BATCH_HEADER_LEN);
+        self.batch_frames = 0;
+    }
+}
+
+impl FrameSink for StreamWriter {
+    fn write_frame(&mut self, frame: &Frame) -> Result<()> {
+        if self.client.is_none() {
+            self.accept();
+            if self.client.is_none() {
+                self.stats.unsent.fetch_add(1, Ordering::Relaxed);
+                return Ok(());
+            }
+        }
+        if self.batch_frames == 0 {
+            self.batch_started = Instant::now();
+        }
+
+        let len_pos = self.batch.len();
+        self.batch.extend_from_slice(&[0u8; 4]);
+        self.batch = postcard::to_extend(frame, std::mem::take(&mut self.batch))
+            .context("failed to serialize frame")?;
+        #[allow(clippy::cast_possible_truncation)]
+        let len = (self.batch.len() - len_pos - 4) as u32;
+        self.batch[len_pos..len_pos + 4].copy_from_slice(&len.to_le_bytes());
+        self.batch_frames += 1;
+
+        if self.batch_frames >= BATCH_FRAMES || self.batch_started.elapsed() >= BATCH_INTERVAL {
+            self.send_batch();
+        }
+        Ok(())
+    }
+
+    fn pending_frames(&self) -> u32 {
+        self.batch_frames
+    }
+
+    fn flush(&mut self, _end_block: bool) -> Result<()> {
+        self.send_batch();
+        if self.client.is_none() {
+            self.accept();
+        }
+        Ok(())
+    }
+
+    fn finish(mut self) -> Result<()> {
+        self.send_batch();
+        if let Some(client) = self.client.take() {
+            client.shutdown();
+        }
+        self.stats.connected.store(false, Ordering::Relaxed);
+        if let Listener::Unix(_, path) = &self.listener {
+            let _ = fs::remove_file(path);
+        }
+        Ok(())
+    }
+
+    fn set_queue_dropped(&mut self, dropped: u64) {
+        self.queue_dropped = dropped;
+    }
+}
+
+/// Counters of a `StreamSource`'s reader thread.
+#[derive(Default)]
+struct ClientStats {
+    received: AtomicU64,
+    /// Lost on the server, as last reported.
+    remote_lost: AtomicU64,
+    /// Dropped here because the UI fell behind.
+    local_dropped: AtomicU64,
+    /// Frames decoded but not yet taken by the UI.
+    queued: AtomicUsize,
+}
+
+/// The client side: frames from a `StreamWriter`, decoded on a reader
+/// thread.
+pub struct StreamSource {
+    metadata: SessionMetadata,
+    frames: Receiver<ComputedFrame>,
+    stats: Arc<ClientStats>,
+    /// Shut down to unblock the reader thread.
+    connection: Connection,
+    reader: Option<JoinHandle<Result<()>>>,
+    /// Why the stream ended, once it has.
+    ended: Option<Result<()>>,
+}
+
+impl StreamSource {
+    /// Connects to `addr` and reads the session metadata.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the connection fails or the server does not
+    /// speak this protocol version.
+    pub fn connect(addr: &StreamAddr) -> Result<Self> {
+        let mut connection =
+            Connection::connect(addr).with_context(|| format!("failed to connect to {addr}"))?;
+        let mut head = [0u8; 5];
+        connection
+            .read_exact(&mut head)
+            .context("failed to read stream header")?;
+        if head[..4] != STREAM_MAGIC {
+            bail!("{addr} is not a felix stream");
+        }
+        if head[4] != PROTOCOL_VERSION {
+            bail!(
+                "stream protocol version {} (expected {PROTOCOL_VERSION})",
+                head[4]
+            );
+        }
+        let data = read_message(&mut connection)?.context("stream ended before its metadata")?;
+        let metadata: SessionMetadata =
+            postcard::from_bytes(&data).context("failed to deserialize metadata")?;
+
+        let stats = Arc::new(ClientStats::default());
+        let (tx, frames) = sync_channel(CLIENT_QUEUE_CAPACITY);
+        let reader = {
+            let stats = Arc::clone(&stats);
+            let input = connection
+                .try_clone()
+                .context("failed to clone connection")?;
+            thread::Builder::new()
+                .name("felix-stream".into())
+                .spawn(move || read_batches(input, &tx, &stats))
+                .context("failed to spawn stream reader thread")?
+        };
+
+        Ok(Self {
+            metadata,
+            frames,
+            stats,
+            connection,
+            reader: Some(reader),
+            ended: None,
+        })
+    }
+
+    /// Returns `Ok(false)` once the server has closed the stream.
+    ///
+    /// # Errors
+    ///
+    /// Returns the reader thread's error if the stream broke.
+    pub fn poll(&mut self) -> Result<bool> {
+        if self.ended.is_none() && self.reader.as_ref().is_some_and(JoinHandle::is_finished) {
+            self.ended = Some(self.join());
+        }
+        match &self.ended {
+            None => Ok(true),
+            Some(Ok(())) => Ok(false),
+            Some(Err(e)) => Err(anyhow!("{e:#}")),
+        }
+    }
+
+    fn join(&mut self) -> Result<()> {
+        match self.reader.take().map(JoinHandle::join) {
+            None | Some(Ok(Ok(()))) => Ok(()),
+            Some(Ok(Err(e))) => Err(e),
+            Some(Err(_)) => Err(anyhow!("stream reader thread panicked")),
+        }
+    }
+
+    #[must_use]
+    pub fn received(&self) -> u64 {
+        self.stats.received.load(Ordering::Relaxed)
+    }
+
+    /// Frames lost on either end.
+    #[must_use]
+    pub fn lost(&self) -> u64 {
+        self.stats.remote_lost.load(Ordering::Relaxed)
+            + self.stats.local_dropped.load(Ordering::Relaxed)
+    }
+
+    /// The client-side queue, with losses on both ends as dropped.
+    #[must_use]
+    pub fn queue_stats(&self) -> QueueStats {
+        QueueStats {
+            depth: self.stats.queued.load(Ordering::Relaxed),
+            capacity: CLIENT_QUEUE_CAPACITY,
+            dropped: self.lost(),
+            flight: None,
+        }
+    }
+}
+
+impl Drop for StreamSource {
+    fn drop(&mut self) {
+        self.connection.shutdown();
+        let _ = self.join();
+    }
+}
+
+impl DataSource for StreamSource {
+    fn next_frame(&mut self) -> Option<ComputedFrame> {
+        match self.frames.try_recv() {
+            Ok(frame) => {
+                self.stats.queued.fetch_sub(1, Ordering::Relaxed);
+                Some(frame)
+            }
+            Err(TryRecvError::Empty | TryRecvError::Disconnected) => None,
+        }
+    }
+
+    fn metadata(&self) -> &SessionMetadata {
+        &self.metadata
+    }
+
+    fn is_live(&self) -> bool {
+        true
+    }
+}
+
+/// Reads a `u32` length and that many bytes; `None` at a clean end of
+/// stream.
+fn read_message(input: &mut impl Read) -> Result<Option<Vec<u8>>> {
+    let mut len = [0u8; 4];
+    match input.read_exact(&mut len) {
+        Ok(()) => {}
+        Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => return Ok(None),
+        Err(e) => return Err(e).context("failed to read from stream"),
+    }
+    let len = u32::from_le_bytes(len) as usize;
+    if len > MAX_MESSAGE_LEN {
+        bail!("stream message of {len} bytes is too large");
+    }
+    let mut data = vec![0u8; len];
+    input
+        .read_exact(&mut data)
+        .context("stream ended inside a message")?;
+    Ok(Some(data))
+}
+
+fn read_batches(
+    mut input: Connection,
+    tx: &SyncSender<ComputedFrame>,
+    stats: &ClientStats,
+) -> Result<()> {
+    while let Some(batch) = read_message(&mut input)? {
+        let Some((header, mut rest)) = batch.split_at_checked(BATCH_HEADER_LEN) else {
+            bail!("truncated stream batch");
+        };
+        let count = u32::from_le_bytes([header[0], header[1], header[2], header[3]]);
+        let lost = u64::from_le_bytes(header[4..].try_into().unwrap_or_default());
+        stats.remote_lost.store(lost, Ordering::Relaxed);
+        for _ in 0..count {
+            let Some((len, tail)) = rest.split_at_checked(4) else {
+                bail!("truncated frame in stream batch");
+            };
+            let len = u32::from_le_bytes([len[0], len[1], len[2], len[3]]) as usize;
+            let Some((data, tail)) = tail.split_at_checked(len) else {
+                bail!("truncated frame in stream batch");
+            };
+            let frame: Frame = postcard::from_bytes(data).context("failed to deserialize frame")?;
+            rest = tail;
+            stats.received.fetch_add(1, Ordering::Relaxed);
+            // Counted first so `next_frame` never sees it below zero.
+            stats.queued.fetch_add(1, Ordering::Relaxed);
+            match tx.try_send(frame.computed) {
+                Ok(()) => {}
+                Err(TrySendError::Full(_)) => {
+                    stats.queued.fetch_sub(1, Ordering::Relaxed);
+                    stats.local_dropped.fetch_add(1, Ordering::Relaxed);
+                }
+                Err(TrySendError::Disconnected(_)) => return Ok(()),
+            }
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::SystemTime;
+
+    use super::*;
+    use crate::fex::types::AppType;
+
+    fn metadata() -> SessionMetadata {
+        SessionMetadata {
+            pid: 42,
+            fex_version: "FEX-2501".to_string(),
+            app_type: AppType::Linux64,
+            stats_version: 3,
+            cycle_counter_frequency: 1_000_000_000,
+            hardware_concurrency: 8,
+            recording_start: SystemTime::UNIX_EPOCH,
+            head: 0,
+            size: 0,
+        }
+    }
+
+    fn frame(index: u64) -> Frame {
+        Frame {
+            pid: 42,
+            computed: ComputedFrame {
+                timestamp_ns: index,
+                ..ComputedFrame::default()
+            },
+            per_thread_deltas: Vec::new(),
+        }
+    }
+
+    #[test]
+    fn addresses_parse_and_print() {
+        let tcp: StreamAddr = "tcp://127.0.0.1:7000".parse().unwrap();
+        assert_eq!(tcp, StreamAddr::Tcp("127.0.0.1:7000".into()));
+        assert_eq!(tcp.to_string(), "tcp://127.0.0.1:7000");
+        let unix: StreamAddr = "unix:///tmp/felix.sock".parse().unwrap();
+        assert_eq!(unix, StreamAddr::Unix("/tmp/felix.sock".into()));
+        assert_eq!(unix, "unix:/tmp/felix.sock".parse().unwrap());
+        assert!("udp://x".parse::<StreamAddr>().is_err());
+    }
+
+    #[test]
+    fn frames_reach_the_client_with_losses_counted() {
+        let stats = Arc::new(StreamStats::default());
+        let mut server = StreamWriter::bind(
+            &"tcp://127.0.0.1:0".parse().unwrap(),
+            &metadata(),
+            Arc::clone(&stats),
+        )
+        .unwrap();
+        // Nobody is connected yet.
+        server.write_frame(&frame(0)).unwrap();
+        assert_eq!(stats.unsent.load(Ordering::Relaxed), 1);
+
+        let addr = server.local_addr();
+        let client = thread::spawn(move || StreamSource::connect(&addr).unwrap());
+        let deadline = Instant::now() + Duration::from_secs(5);
+        while !stats.connected.load(Ordering::Relaxed) {
+            assert!(Instant::now() < deadline, "client never connected");
+            thread::sleep(ACCEPT_INTERVAL);
+            server.flush(false).unwrap();
+        }
+        let mut client = client.join().unwrap();
+        assert_eq!(client.metadata().pid, 42);
+
+        server.set_queue_dropped(5);
+        let total = u64::from(BATCH_FRAMES) + 3;
+        for i in 1..=total {
+            server.write_frame(&frame(i)).unwrap();
+        }
+        assert_eq!(server.pending_frames(), 3);
+        server.finish().unwrap();
+
+        let mut timestamps = Vec::new();
+        while client.poll().unwrap() || (timestamps.len() as u64) < total {
+            assert!(Instant::now() < deadline, "frames never arrived");
+            timestamps.extend(std::iter::from_fn(|| client.next_frame()).map(|f| f.timestamp_ns));
+            thread::sleep(Duration::from_millis(5));
+        }
+        assert_eq!(timestamps, (1..=total).collect::<Vec<_>>());
+        assert_eq!(client.received(), total);
+        assert_eq!(client.lost(), 6);
+        assert_eq!(stats.sent.load(Ordering::Relaxed), total);
+    }
+}
@@ -1,30 +1,81 @@
 // SPDX-License-Identifier: MIT
-use std::collections::VecDeque;
+use std::time::{Duration, Instant};
 
+use ratatui::buffer::Buffer;
 use ratatui::layout::{Constraint, Direction, Layout};
-use ratatui::widgets::{Block, Borders, Paragraph};
+use ratatui::widgets::{Block, Borders, Paragraph, Widget};
 
 use super::input::Action;
 use super::layout::{PanelState, build_layout};
-use super::panels::{header, histogram, jit_stats, mem_stats};
+use super::panels::{contention, header, histogram, jit_stats, mem_stats, overhead, threads};
 use super::replay_controls::{self, ReplayControls};
 use super::theme::{COLLAPSED_MARKER, SELECTED_MARKER, Theme};
 use crate::datasource::SessionMetadata;
-use crate::sampler::accumulator::{ComputedFrame, HistogramEntry};
+use crate::recording::async_writer::QueueStats;
+use crate::recording::keyframe::PlaybackStats;
+use crate::recording::thread_index::ThreadIndex;
+use crate::sampler::accumulator::ComputedFrame;
+use crate::sampler::contention::ContentionStats;
+use crate::sampler::histogram::HistogramPyramid;
+use crate::sampler::jitter::SamplerTiming;
+use crate::sampler::overhead::{OverheadStats, Stage, UsageMeter};
+use crate::sampler::rolling::{ProcessStats, RollingStats};
 
-const HISTOGRAM_CAPACITY: usize = 200;
+/// Buckets kept per histogram zoom level in live mode; wider than any
+/// terminal.
+const HISTOGRAM_CAPACITY: usize = 1024;
+const JIT_STATS_PANEL: usize = 0;
+const MEM_PANEL: usize = 1;
+const HISTOGRAM_PANEL: usize = 2;
+const OVERHEAD_PANEL: usize = 3;
+const CONTENTION_PANEL: usize = 4;
+/// Only in replay, once `set_thread_index` adds it.
+const THREADS_PANEL: usize = 5;
 const REPLAY_BAR_HEIGHT: u16 = 4;
+pub const DEFAULT_MAX_FPS: u32 = 30;
+
+/// A panel's last rendering, reused until its inputs change or it moves.
+#[derive(Default)]
+struct PanelCache {
+    buf: Buffer,
+    stale: bool,
+}
 
 pub struct App {
     pub panels: Vec<PanelState>,
     pub selected_panel: usize,
     pub latest_frame: Option<ComputedFrame>,
-    pub histogram: VecDeque<HistogramEntry>,
+    pub histogram: HistogramPyramid,
+    /// Histogram zoom level: each column covers `FANOUT^zoom` frames.
+    histogram_zoom: usize,
+    /// In replay, the histogram is built from the whole recording and ends
+    /// at this frame instead of the latest one.
+    histogram_cursor: Option<u64>,
     pub metadata: SessionMetadata,
     pub is_replay: bool,
     pub should_quit: bool,
     pub theme: Theme,
+    /// Recording queue status, set by the live loop while recording.
+    pub recorder_stats: Option<QueueStats>,
+    /// Lateness and overhead of every frame shown so far.
+    pub sampler_timing: SamplerTiming,
+    /// Windowed quantiles and rates of the frames shown so far.
+    pub rolling: RollingStats,
+    /// felix's own per-stage cost: from the frames, and of drawing them.
+    pub overhead: OverheadStats,
+    /// Code cache lock contention of the frames shown so far.
+    pub contention: ContentionStats,
+    usage: UsageMeter,
+    /// Whole-recording statistics from the footer, in replay.
+    recording_stats: Option<ProcessStats>,
+    /// The recording's per-thread index and the process shown, in replay.
+    thread_index: Option<(ThreadIndex, Option<i32>)>,
     replay_controls: Option<ReplayControls>,
+    /// Something visible changed since the last `render`.
+    dirty: bool,
+    caches: Vec<PanelCache>,
+    min_draw_interval: Duration,
+    last_draw: Option<Instant>,
 }
 
 impl App {
@@ -34,7 +85,7 @@ impl App {
             PanelState {
                 name: "FEX JIT Stats",
                 collapsed: false,
-                min_height: 26,
+                min_height: 32,
             },
             PanelState {
                 name: "FEX Memory Usage",
@@ -46,6 +97,16 @@ impl App {
                 collapsed: false,
                 min_height: 12,
             },
+            PanelState {
+                name: "felix Overhead",
+                collapsed: true,
+                min_height: 10,
+            },
+            PanelState {
+                name: "Cache Lock Contention",
+                collapsed: true,
+                min_height: 16,
+            },
         ];
 
         let replay_controls = if is_replay {
@@ -54,27 +115,221 @@ impl App {
             None
         };
 
+        let caches = panels
+            .iter()
+            .map(|_| PanelCache {
+                stale: true,
+                ..PanelCache::default()
+            })
+            .collect();
+
         Self {
             panels,
             selected_panel: 0,
             latest_frame: None,
-            histogram: VecDeque::with_capacity(HISTOGRAM_CAPACITY),
+            histogram: HistogramPyramid::rolling(HISTOGRAM_CAPACITY),
+            histogram_zoom: 0,
+            histogram_cursor: None,
             metadata,
             is_replay,
             should_quit: false,
             theme: Theme::default(),
+            recorder_stats: None,
+            sampler_timing: SamplerTiming::default(),
+            rolling: RollingStats::default(),
+            overhead: OverheadStats::default(),
+            contention: ContentionStats::default(),
+            usage: UsageMeter::default(),
+            recording_stats: None,
+            thread_index: None,
             replay_controls,
+            dirty: true,
+            caches,
+            min_draw_interval: fps_interval(DEFAULT_MAX_FPS),
+            last_draw: None,
+        }
+    }
+
+    /// Caps redraws at `fps` per second; changes arriving faster are shown
+    /// together on the next draw. Zero means uncapped.
+    pub fn set_max_fps(&mut self, fps: u32) {
+        self.min_draw_interval = fps_interval(fps);
+    }
+
+    /// Forces every panel to be re-rendered, e.g. after a terminal resize.
+    pub fn mark_all_dirty(&mut self) {
+        self.dirty = true;
+        for cache in &mut self.caches {
+            cache.stale = true;
+        }
+    }
+
+    /// Marks panel `index` unless it is collapsed: a collapsed panel shows
+    /// only its title, which frames do not change.
+    fn mark_expanded_dirty(&mut self, index: usize) {
+        if self.panels.get(index).is_some_and(|p| !p.collapsed) {
+            self.mark_panel_dirty(index);
         }
     }
 
-    pub fn update_frame(&mut self, frame: ComputedFrame) {
-        let entry = frame.histogram_entry.clone();
-        self.latest_frame = Some(frame);
+    fn mark_panel_dirty(&mut self, index: usize) {
+        self.dirty = true;
+        if let Some(cache) = self.caches.get_mut(index) {
+            cache.stale = true;
+        }
+    }
 
-        if self.histogram.len() >= HISTOGRAM_CAPACITY {
-            self.histogram.pop_front();
+    /// How long until a redraw is allowed, or `None` when nothing changed
+    /// since the last one. Event loops use it to bound how long they block.
+    #[must_use]
+    pub fn until_draw(&self) -> Option<Duration> {
+        if !self.dirty {
+            return None;
         }
-        self.histogram.push_back(entry);
+        Some(self.last_draw.map_or(Duration::ZERO, |t| {
+            self.min_draw_interval.saturating_sub(t.elapsed())
+        }))
+    }
+
+    /// Whether something changed and the FPS cap allows drawing it now.
+    #[must_use]
+    pub fn draw_due(&self) -> bool {
+        self.until_draw() == Some(Duration::ZERO)
+    }
+
+    /// Lets `fill` overwrite the latest frame in place, reusing its buffers.
+    /// `fill` returns `false` if it had no new frame, leaving state untouched.
+    /// Only the panels drawn from what changed are re-rendered.
+    pub fn update_frame_with(&mut self, fill: impl FnOnce(&mut ComputedFrame) -> bool) -> bool {
+        let had_frame = self.latest_frame.is_some();
+        let prev_mem = self
+            .latest_frame
+            .as_ref()
+            .map(|f| (f.mem.clone(), f.mem_age_ns));
+        let slot = self.latest_frame.get_or_insert_with(ComputedFrame::default);
+        if !fill(slot) {
+            if !had_frame {
+                self.latest_frame = None;
+            }
+            return false;
+        }
+
+        self.sampler_timing.record(slot);
+        self.rolling.record(slot);
+        self.overhead.record_frame(slot);
+        self.contention.record(slot);
+        self.usage.poll(Instant::now());
+        // The memory sampler runs slower than frames; between its samples
+        // only the age grows.
+        let mem_changed =
+            prev_mem.is_none_or(|(mem, age)| mem != slot.mem || slot.mem_age_ns < age);
+        let live_histogram = self.histogram_cursor.is_none();
+        if live_histogram {
+            self.histogram.push(&slot.histogram_entry);
+        }
+
+        self.dirty = true;
+        for panel in [JIT_STATS_PANEL, OVERHEAD_PANEL, CONTENTION_PANEL] {
+            self.mark_expanded_dirty(panel);
+        }
+        if mem_changed {
+            self.mark_expanded_dirty(MEM_PANEL);
+        }
+        // In replay the histogram and threads follow the cursor instead.
+        if live_histogram {
+            self.mark_expanded_dirty(HISTOGRAM_PANEL);
+        }
+        true
+    }
+
+    /// Records how long the last draw took, including the terminal flush.
+    /// Shown with the next frame, so timing a draw never causes one.
+    pub fn record_draw(&mut self, elapsed: Duration) {
+        #[allow(clippy::cast_possible_truncation)]
+        self.overhead.record(Stage::Draw, elapsed.as_nanos() as u64);
+    }
+
+    /// Replaces everything accumulated from the frames played, and the
+    /// frame shown, after a replay seek.
+    pub fn restore_playback(&mut self, stats: PlaybackStats, frame: Option<ComputedFrame>) {
+        self.rolling = stats.rolling;
+        self.sampler_timing = stats.timing;
+        self.overhead.restore_sampling(&stats.overhead);
+        self.contention = stats.contention;
+        self.latest_frame = frame;
+        self.mark_all_dirty();
+    }
+
+    /// Shows `pyramid`, built from a whole recording, instead of
+    /// accumulating frames as they are played.
+    pub fn set_replay_histogram(&mut self, pyramid: HistogramPyramid) {
+        self.histogram = pyramid;
+        self.histogram_cursor = Some(0);
+        self.mark_panel_dirty(HISTOGRAM_PANEL);
+    }
+
+    /// Lets `load` decode what the replay histogram needs for its view,
+    /// given the pyramid, the zoom level and the frame the view ends at,
+    /// and redraws the panel if it returns true.
+    ///
+    /// # Errors
+    ///
+    /// Returns the error of `load`.
+    pub fn load_replay_histogram<E>(
+        &mut self,
+        load: impl FnOnce(&mut HistogramPyramid, usize, u64) -> Result<bool, E>,
+    ) -> Result<bool, E> {
+        let Some(end) = self.histogram_cursor else {
+            return Ok(false);
+        };
+        let level = self
+            .histogram_zoom
+            .min(self.histogram.levels().saturating_sub(1));
+        let loaded = load(&mut self.histogram, level, end)?;
+        if loaded {
+            self.mark_panel_dirty(HISTOGRAM_PANEL);
+        }
+        Ok(loaded)
+    }
+
+    /// Ends the replay histogram at `position` frames into the recording.
+    pub fn set_histogram_cursor(&mut self, position: u64) {
+        if let Some(cursor) = self.histogram_cursor.filter(|&c| c != position) {
+            self.histogram_cursor = Some(position);
+            self.mark_panel_dirty(HISTOGRAM_PANEL);
+            if let Some((index, _)) = &self.thread_index
+                && index.block_of(cursor) != index.block_of(position)
+            {
+                self.mark_panel_dirty(THREADS_PANEL);
+            }
+        }
+    }
+
+    /// Adds the Hot Threads panel, showing the threads of process `pid`, or
+    /// of every process, from the recording's per-thread index.
+    pub fn set_thread_index(&mut self, index: ThreadIndex, pid: Option<i32>) {
+        if self.thread_index.is_none() {
+            self.panels.push(PanelState {
+                name: "Hot Threads",
+                collapsed: true,
+                min_height: 12,
+            });
+            self.caches.push(PanelCache::default());
+        }
+        self.thread_index = Some((index, pid));
+        self.mark_all_dirty();
+    }
+
+    /// Shows whole-recording `stats` next to the rolling ones.
+    pub fn set_recording_stats(&mut self, stats: Option<ProcessStats>) {
+        self.recording_stats = stats;
+        self.mark_panel_dirty(JIT_STATS_PANEL);
+    }
+
+    /// Records new recording-queue status, redrawing the header only.
+    pub fn set_recorder_stats(&mut self, stats: QueueStats) {
+        self.recorder_stats = Some(stats);
+        self.dirty = true;
     }
 
     pub fn set_replay_total_frames(&mut self, total: usize) {
@@ -88,11 +343,33 @@ impl App {
         self.replay_controls.as_ref()
     }
 
+    /// Mutable access to the replay bar, which is redrawn on the next draw.
     pub fn replay_controls_mut(&mut self) -> Option<&mut ReplayControls> {
+        self.dirty = true;
         self.replay_controls.as_mut()
     }
 
     pub fn handle_action(&mut self, action: &Action) {
+        let selected = self.selected_panel;
+        self.apply_action(action);
+        match *action {
+            Action::PanelUp | Action::PanelDown => {
+                if self.selected_panel != selected {
+                    self.mark_panel_dirty(selected);
+                    self.mark_panel_dirty(self.selected_panel);
+                }
+            }
+            // Collapsing resizes every panel.
+            Action::ToggleCollapse => self.mark_all_dirty(),
+            Action::ZoomIn | Action::ZoomOut => self.mark_panel_dirty(HISTOGRAM_PANEL),
+            Action::IncreaseSamplePeriod | Action::DecreaseSamplePeriod | Action::None => {}
+            // Replay actions only change the replay bar; a new frame, if
+            // any, marks the panels itself.
+            _ => self.dirty |= self.replay_controls.is_some(),
+        }
+    }
+
+    fn apply_action(&mut self, action: &Action) {
         match *action {
             Action::Quit => self.should_quit = true,
             Action::PanelUp => {
@@ -147,11 +424,23 @@ impl App {
                     controls.seek_end();
                 }
             }
+            Action::ZoomIn => self.histogram_zoom = self.histogram_zoom.saturating_sub(1),
+            Action::ZoomOut => {
+                // One level past the coarsest would show the same columns.
+                if self.histogram_zoom + 1 < self.histogram.levels() {
+                    self.histogram_zoom += 1;
+                }
+            }
             Action::IncreaseSamplePeriod | Action::DecreaseSamplePeriod | Action::None => {}
         }
     }
 
-    pub fn render(&self, frame: &mut ratatui::Frame) {
+    /// Draws the header and replay bar, re-renders panels whose inputs
+    /// changed or that moved, and copies the rest from their last rendering.
+    pub fn render(&mut self, frame: &mut ratatui::Frame) {
+        self.dirty = false;
+        self.last_draw = Some(Instant::now());
+
         let outer = frame.area();
         if outer.height < 2 || outer.width < 5 {
             return;
@@ -185,6 +474,8 @@ impl App {
             &self.metadata,
             self.is_replay,
             sample_period_ns,
+            self.recorder_stats.as_ref(),
+            (!self.sampler_timing.is_empty()).then_some(&self.sampler_timing),
             &self.theme,
         );
 
@@ -196,59 +487,250 @@ impl App {
 
         let areas = build_layout(&self.panels, body_area);
 
-        for (i, (panel, area)) in self.panels.iter().zip(areas.iter()).enumerate() {
-            let is_selected = i == self.selected_panel;
-
-            let sel_mark = if is_selected {
-                SELECTED_MARKER[1]
-            } else {
-                SELECTED_MARKER[0]
-            };
-            let col_mark = if panel.collapsed {
-                COLLAPSED_MARKER[1]
-            } else {
-                COLLAPSED_MARKER[0]
-            };
-
-            let title = format!("{sel_mark} {col_mark} {}", panel.name);
-
-            let border_style = if is_selected {
-                self.theme.border_selected
-            } else {
-                self.theme.border_normal
-            };
-
-            let block = Block::default()
-                .title(title)
-                .borders(Borders::ALL)
-                .border_style(border_style)
-                .title_style(self.theme.title);
-
-            if panel.collapsed {
-                frame.render_widget(block, *area);
-            } else {
-                let inner = block.inner(*area);
-                frame.render_widget(block, *area);
-
-                if inner.width < 2 || inner.height < 1 {
-                    continue;
+        for (i, area) in areas.iter().enumerate() {
+            let cache = &mut self.caches[i];
+            if cache.stale || cache.buf.area != *area {
+                cache.stale = false;
+                let mut buf = std::mem::take(&mut cache.buf);
+                if buf.area == *area {
+                    buf.reset();
+                } else {
+                    buf = Buffer::empty(*area);
                 }
+                self.render_panel(i, &mut buf);
+                self.caches[i].buf = buf;
+            }
+            blit(&self.caches[i].buf, frame.buffer_mut());
+        }
+    }
+
+    fn render_panel(&self, i: usize, buf: &mut Buffer) {
+        let panel = &self.panels[i];
+        let area = buf.area;
+        let is_selected = i == self.selected_panel;
+
+        let sel_mark = if is_selected {
+            SELECTED_MARKER[1]
+        } else {
+            SELECTED_MARKER[0]
+        };
+        let col_mark = if panel.collapsed {
+            COLLAPSED_MARKER[1]
+        } else {
+            COLLAPSED_MARKER[0]
+        };
+
+        let title = format!("{sel_mark} {col_mark} {}", panel.name);
+
+        let border_style = if is_selected {
+            self.theme.border_selected
+        } else {
+            self.theme.border_normal
+        };
+
+        let block = Block::default()
+            .title(title)
+            .borders(Borders::ALL)
+            .border_style(border_style)
+            .title_style(self.theme.title);
+
+        if panel.collapsed {
+            block.render(area, buf);
+            return;
+        }
+        let inner = block.inner(area);
+        block.render(area, buf);
 
-                match (i, &self.latest_frame) {
-                    (0, Some(data)) => {
-                        jit_stats::render(frame, inner, data, &self.metadata, &self.theme);
-                    }
-                    (1, Some(data)) => {
-                        mem_stats::render(frame, inner, data, &self.theme);
-                    }
-                    (2, _) => {
-                        histogram::render(frame, inner, &self.histogram, &self.theme);
-                    }
-                    _ => {
-                        frame.render_widget(Paragraph::new("Waiting for data..."), inner);
-                    }
+        if inner.width < 2 || inner.height < 1 {
+            return;
+        }
+
+        #[allow(clippy::cast_precision_loss)]
+        let cycle_freq = self.metadata.cycle_counter_frequency as f64;
+        match (i, &self.latest_frame) {
+            (JIT_STATS_PANEL, Some(data)) => {
+                jit_stats::render(
+                    buf,
+                    inner,
+                    data,
+                    &self.rolling,
+                    self.recording_stats.as_ref(),
+                    &self.metadata,
+                    &self.theme,
+                );
+            }
+            (MEM_PANEL, Some(data)) => {
+                mem_stats::render(buf, inner, data, &self.theme);
+            }
+            (OVERHEAD_PANEL, data) => {
+                let elapsed_ns = data.as_ref().map_or(0, |f| f.timestamp_ns);
+                overhead::render(
+                    buf,
+                    inner,
+                    &self.overhead,
+                    elapsed_ns,
+                    self.usage.rates(),
+                    &self.theme,
+                );
+            }
+            (CONTENTION_PANEL, data) => {
+                contention::render(
+                    buf,
+                    inner,
+                    &self.contention,
+                    data.as_ref(),
+                    cycle_freq,
+                    &self.theme,
+                );
+            }
+            (THREADS_PANEL, _) => {
+                if let Some((index, pid)) = &self.thread_index {
+                    let cursor = self.histogram_cursor.unwrap_or(0);
+                    threads::render(
+                        buf,
+                        inner,
+                        index,
+                        *pid,
+                        index.block_of(cursor),
+                        cycle_freq,
+                        &self.theme,
+                    );
                 }
             }
+            (HISTOGRAM_PANEL, _) => {
+                let end = self.histogram_cursor.unwrap_or(self.histogram.len());
+                histogram::render(
+                    buf,
+                    inner,
+                    &self.histogram,
+                    self.histogram_zoom,
+                    end,
+                    &self.theme,
+                );
+            }
+            _ => {
+                Paragraph::new("Waiting for data...").render(inner, buf);
+            }
         }
     }
 }
+
+fn fps_interval(fps: u32) -> Duration {
+    if fps == 0 {
+        Duration::ZERO
+    } else {
+        Duration::from_secs(1) / fps
+    }
+}
+
+/// Copies `src` into the same cells of `dst`, clipped to `dst`.
+fn blit(src: &Buffer, dst: &mut Buffer) {
+    let area = src.area.intersection(dst.area);
+    for y in area.top()..area.bottom() {
+        for x in area.left()..area.right() {
+            dst[(x, y)].clone_from(&src[(x, y)]);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::SystemTime;
+
+    use ratatui::Terminal;
+    use ratatui::backend::TestBackend;
+
+    use super::*;
+    use crate::fex::types::AppType;
+
+    fn make_app() -> App {
+        let metadata = SessionMetadata {
+            pid: 1234,
+            fex_version: String::new(),
+            app_type: AppType::Linux64,
+            stats_version: 0,
+            cycle_counter_frequency: 1_000_000_000,
+            hardware_concurrency: 8,
+            recording_start: SystemTime::UNIX_EPOCH,
+            head: 0,
+            size: 0,
+        };
+        App::new(metadata, false)
+    }
+
+    fn stale(app: &App) -> Vec<bool> {
+        app.caches.iter().map(|c| c.stale).collect()
+    }
+
+    #[test]
+    fn only_changed_panels_are_rerendered() {
+        let mut terminal = Terminal::new(TestBackend::new(80, 60)).unwrap();
+        let mut app = make_app();
+        app.set_max_fps(0);
+        assert!(app.draw_due());
+
+        terminal.draw(|f| app.render(f)).unwrap();
+        assert_eq!(app.until_draw(), None);
+        assert_eq!(stale(&app), [false; 5]);
+
+        app.handle_action(&Action::PanelDown);
+        assert_eq!(stale(&app), [true, true, false, false, false]);
+        assert!(app.draw_due());
+        terminal.draw(|f| app.render(f)).unwrap();
+
+        // A key that changes nothing visible, and a source with no new
+        // frame, leave the screen alone.
+        app.handle_action(&Action::SpeedUp);
+        assert!(!app.update_frame_with(|_| false));
+        assert_eq!(app.until_draw(), None);
+
+        // Timing a draw does not ask for another.
+        app.record_draw(Duration::from_micros(300));
+        assert_eq!(app.until_draw(), None);
+
+        // The first frame replaces every "waiting" panel except the
+        // collapsed ones.
+        assert!(app.update_frame_with(|_| true));
+        assert_eq!(stale(&app), [true, true, true, false, false]);
+        assert_eq!(app.overhead.stage(Stage::Draw).count(), 1);
+        terminal.draw(|f| app.render(f)).unwrap();
+
+        // A frame carrying the same memory sample, only older, leaves the
+        // memory panel alone.
+        assert!(app.update_frame_with(|f| {
+            f.mem_age_ns += 100_000_000;
+            true
+        }));
+        assert_eq!(stale(&app), [true, false, true, false, false]);
+        terminal.draw(|f| app.render(f)).unwrap();
+
+        // A new sample redraws it, even if it reads the same.
+        assert!(app.update_frame_with(|f| {
+            f.mem_age_ns = 0;
+            true
+        }));
+        assert_eq!(stale(&app), [true, true, true, false, false]);
+        terminal.draw(|f| app.render(f)).unwrap();
+
+        // Expanded, the overhead panel follows the frames too.
+        app.handle_action(&Action::PanelDown);
+        app.handle_action(&Action::PanelDown);
+        app.handle_action(&Action::ToggleCollapse);
+        terminal.draw(|f| app.render(f)).unwrap();
+        assert!(app.update_frame_with(|_| true));
+        assert_eq!(stale(&app), [true, false, true, true, false]);
+    }
+
+    #[test]
+    fn redraws_are_capped() {
+        let mut terminal = Terminal::new(TestBackend::new(80, 60)).unwrap();
+        let mut app = make_app();
+        app.set_max_fps(1);
+        terminal.draw(|f| app.render(f)).unwrap();
+
+        app.handle_action(&Action::ToggleCollapse);
+        let wait = app.until_draw().unwrap();
+        assert!(wait > Duration::from_millis(500), "{wait:?}");
+        assert!(!app.draw_due());
+    }
+}
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: MIT
+//! `felix diff` view: every metric of both recordings side by side, and
+//! the selected one's aligned buckets charted together.
+
+use crossterm::event::KeyCode;
+use ratatui::Frame;
+use ratatui::layout::{Constraint, Layout, Rect};
+use ratatui::style::{Color, Modifier, Style};
+use ratatui::symbols::Marker;
+use ratatui::text::Line;
+use ratatui::widgets::{
+    Axis, Block, Borders, Chart, Dataset, GraphType, Paragraph, Row, Table, TableState,
+};
+
+use super::panels::mem_stats::format_bytes;
+use super::theme::Theme;
+use crate::recording::diff::{DiffSummary, MetricDiff, Series};
+
+pub struct DiffView {
+    title: String,
+    summary: DiffSummary,
+    series: [Series; 2],
+    state: TableState,
+    pub should_quit: bool,
+    theme: Theme,
+}
+
+impl DiffView {
+    #[must_use]
+    pub fn new(title: String, summary: DiffSummary, series: [Series; 2]) -> Self {
+        Self {
+            title,
+            summary,
+            series,
+            state: TableState::default().with_selected(Some(0)),
+            should_quit: false,
+            theme: Theme::default(),
+        }
+    }
+
+    pub fn handle_key(&mut self, key: KeyCode) {
+        let last = self.summary.metrics.len() - 1;
+        let selected = self.state.selected().unwrap_or(0);
+        match key {
+            KeyCode::Char('q') | KeyCode::Esc => self.should_quit = true,
+            KeyCode::Up => self.state.select(Some(selected.saturating_sub(1))),
+            KeyCode::Down => self.state.select(Some((selected + 1).min(last))),
+            KeyCode::Home => self.state.select(Some(0)),
+            KeyCode::End => self.state.select(Some(last)),
+            _ => {}
+        }
+    }
+
+    pub fn render(&mut self, frame: &mut Frame) {
+        let [title, table, chart, status] = Layout::vertical([
+            Constraint::Length(1),
+            Constraint::Percentage(55),
+            Constraint::Min(6),
+            Constraint::Length(1),
+        ])
+        .areas(frame.area());
+
+        frame.render_widget(
+            Paragraph::new(self.title.as_str()).style(self.theme.title),
+            title,
+        );
+        self.render_table(frame, table);
+        let selected = self.state.selected().unwrap_or(0);
+        self.render_chart(frame, chart, selected);
+        frame.render_widget(
+            Paragraph::new(format!(
+                " {} buckets of {} ms aligned | Up/Down: metric | q: quit",
+                self.summary.aligned,
+                self.summary.bucket.as_millis()
+            ))
+            .style(self.theme.status_bar),
+            status,
+        );
+    }
+
+    fn render_table(&mut self, frame: &mut Frame, area: Rect) {
+        let rows = self.summary.metrics.iter().map(|m| {
+            let change = m.change_percent();
+            let style = match change {
+                Some(c) if c > 0.5 => self.theme.load_high,
+                Some(c) if c < -0.5 => self.theme.load_normal,
+                _ => Style::default(),
+            };
+            Row::new([
+                m.metric.name.to_string(),
+                format_value(m, m.a.mean),
+                format_value(m, m.b.mean),
+                change.map_or_else(|| "-".to_string(), |c| format!("{c:+.1}%")),
+                format_value(m, m.a.p99),
+                format_value(m, m.b.p99),
+            ])
+            .style(style)
+        });
+        let widths = [
+            Constraint::Length(18),
+            Constraint::Fill(1),
+            Constraint::Fill(1),
+            Constraint::Length(10),
+            Constraint::Fill(1),
+            Constraint::Fill(1),
+        ];
+        let table = Table::new(rows, widths)
+            .header(
+                Row::new(["Metric", "A mean", "B mean", "Change", "A p99", "B p99"])
+                    .style(self.theme.title),
+            )
+            .row_highlight_style(Style::default().add_modifier(Modifier::REVERSED))
+            .block(
+                Block::default()
+                    .borders(Borders::ALL)
+                    .border_style(self.theme.border_normal),
+            );
+        frame.render_stateful_widget(table, area, &mut self.state);
+    }
+
+    fn render_chart(&self, frame: &mut Frame, area: Rect, metric: usize) {
+        let m = &self.summary.metrics[metric];
+        let bucket_secs = self.summary.bucket.as_secs_f64();
+        let points: Vec<Vec<(f64, f64)>> = self
+            .series
+            .iter()
+            .map(|s| {
+                s.buckets
+                    .iter()
+                    .enumerate()
+                    .filter_map(|(i, b)| {
+                        #[allow(clippy::cast_precision_loss)]
+                        let x = i as f64 * bucket_secs;
+                        Some((x, b.as_ref()?[metric]))
+                    })
+                    .collect()
+            })
+            .collect();
+        #[allow(clippy::cast_precision_loss)]
+        let x_max = self.summary.buckets.into_iter().max().unwrap_or(1) as f64 * bucket_secs;
+        let y_max = m.a.max.max(m.b.max).max(f64::MIN_POSITIVE) * 1.1;
+
+        let datasets = [
+            ("A", Color::Cyan, &points[0]),
+            ("B", Color::Magenta, &points[1]),
+        ]
+        .into_iter()
+        .map(|(name, color, data)| {
+            Dataset::default()
+                .name(name)
+                .marker(Marker::Braille)
+                .graph_type(GraphType::Line)
+                .style(Style::default().fg(color))
+                .data(data)
+        })
+        .collect();
+        let chart = Chart::new(datasets)
+            .block(
+                Block::default()
+                    .borders(Borders::ALL)
+                    .border_style(self.theme.border_selected)
+                    .title(format!(" {} ({}) ", m.metric.name, m.metric.unit)),
+            )
+            .x_axis(
+                Axis::default()
+                    .bounds([0.0, x_max.max(bucket_secs)])
+                    .labels([Line::from("0s"), Line::from(format!("{x_max:.0}s"))]),
+            )
+            .y_axis(
+                Axis::default()
+                    .bounds([0.0, y_max])
+                    .labels([Line::from("0"), Line::from(format_value(m, y_max))]),
+            );
+        frame.render_widget(chart, area);
+    }
+}
+
+fn format_value(m: &MetricDiff, value: f64) -> String {
+    if m.metric.unit == "B" {
+        #[allow(clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+        return format_bytes(value as u64);
+    }
+    format!("{value:.1}")
+}
@@ -15,6 +15,8 @@ pub enum Action {
     SeekEnd,
     IncreaseSamplePeriod,
     DecreaseSamplePeriod,
+    ZoomIn,
+    ZoomOut,
     None,
 }
 
@@ -27,6 +29,8 @@ pub fn handle_key(key: KeyCode, is_replay: bool) -> Action {
         KeyCode::Right => Action::ToggleCollapse,
         KeyCode::Char('+' | '=') => Action::IncreaseSamplePeriod,
         KeyCode::Char('-' | '_') => Action::DecreaseSamplePeriod,
+        KeyCode::Char('<' | ',') => Action::ZoomIn,
+        KeyCode::Char('>' | '.') => Action::ZoomOut,
         KeyCode::Char(' ') if is_replay => Action::TogglePause,
         KeyCode::Left if is_replay => Action::SeekBackward,
         KeyCode::Char(']') if is_replay => Action::SpeedUp,
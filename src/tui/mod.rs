@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: MIT
 pub mod app;
+pub mod diff_view;
 pub mod input;
 pub mod layout;
 pub mod panels;
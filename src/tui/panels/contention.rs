@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: MIT
+use std::fmt::Write;
+
+use ratatui::buffer::Buffer;
+use ratatui::layout::Rect;
+use ratatui::text::{Line, Span};
+use ratatui::widgets::{Paragraph, Widget};
+
+use crate::sampler::accumulator::ComputedFrame;
+use crate::sampler::contention::{CONVOY_MIN_THREADS, ContentionStats};
+use crate::sampler::jitter::format_duration_ns;
+use crate::tui::theme::{BLOCK_CHARS, Theme};
+
+/// Threads listed above the histogram.
+const THREAD_ROWS: usize = 4;
+/// Rows the histogram needs, with its legend, to be drawn at all.
+const MIN_HISTOGRAM_HEIGHT: u16 = 3;
+
+/// Lock time against JIT time, convoys, the threads holding the locks over
+/// the frames seen so far and in `frame`, and a histogram of each recent
+/// frame's lock share with convoy frames marked.
+pub fn render(
+    buf: &mut Buffer,
+    area: Rect,
+    stats: &ContentionStats,
+    frame: Option<&ComputedFrame>,
+    cycle_freq: f64,
+    theme: &Theme,
+) {
+    if area.height < 2 || area.width < 10 {
+        return;
+    }
+    let seconds = |cycles: u64| {
+        #[allow(clippy::cast_precision_loss)]
+        let s = cycles as f64 / cycle_freq.max(1.0);
+        s
+    };
+    let percent = |p: Option<f64>| p.map_or_else(|| "-".to_string(), |p| format!("{p:.1}%"));
+
+    let mut lines = vec![Line::from(format!(
+        "Lock time {} of JIT (p50 {:.1}%, p99 {:.1}%) | read {:.3}s, write {:.3}s | now {}",
+        percent(stats.contention_percent()),
+        stats.contention.quantile(0.5),
+        stats.contention.quantile(0.99),
+        seconds(stats.read_lock_time),
+        seconds(stats.write_lock_time),
+        percent(
+            stats
+                .history()
+                .back()
+                .map(|h| f64::from(h.contention_percent))
+        ),
+    ))];
+
+    let mut convoys = format!(
+        "Convoys: {} ({} frames)",
+        stats.convoy_count(),
+        stats.convoy_frames()
+    );
+    if let Some(longest) = stats.longest_convoy() {
+        let _ = write!(
+            convoys,
+            ", longest {} frames over {}, up to {} threads",
+            longest.frames,
+            format_duration_ns(longest.end_ns - longest.start_ns),
+            longest.peak_threads
+        );
+    }
+    let in_convoy = stats.current_convoy().map(|c| {
+        Span::styled(
+            format!(
+                " | IN CONVOY for {} frames: {} threads spiking",
+                c.frames,
+                frame.map_or(c.peak_threads, |f| f.write_lock_spikes)
+            ),
+            theme.load_high,
+        )
+    });
+    lines.push(Line::from(
+        std::iter::once(Span::raw(convoys))
+            .chain(in_convoy)
+            .collect::<Vec<_>>(),
+    ));
+    if !stats.recent_convoys().is_empty() {
+        let recent: Vec<String> = stats
+            .recent_convoys()
+            .iter()
+            .rev()
+            .map(|c| format!("{} ({} frames)", format_seconds(c.start_ns), c.frames))
+            .collect();
+        lines.push(Line::from(format!("Recent: {}", recent.join(", "))));
+    }
+
+    lines.push(Line::from(format!(
+        "{:>8} {:>10} {:>7} {:>9}",
+        "TID", "lock", "share", "this frame"
+    )));
+    for (t, share) in stats.top_threads(THREAD_ROWS) {
+        let now = frame
+            .and_then(|f| f.lock_loads.iter().find(|l| l.tid == t.tid))
+            .map_or(0.0, |l| l.load_percent);
+        lines.push(Line::from(format!(
+            "{:>8} {:>9.3}s {:>6.1}% {:>9.1}%",
+            t.tid,
+            seconds(t.lock_time),
+            share,
+            now
+        )));
+    }
+
+    #[allow(clippy::cast_possible_truncation)]
+    let text_height = (lines.len() as u16).min(area.height);
+    Paragraph::new(lines).render(
+        Rect {
+            height: text_height,
+            ..area
+        },
+        buf,
+    );
+
+    let chart = Rect {
+        y: area.y + text_height,
+        height: area.height - text_height,
+        ..area
+    };
+    if chart.height >= MIN_HISTOGRAM_HEIGHT {
+        render_histogram(buf, chart, stats, theme);
+    }
+}
+
+fn format_seconds(ns: u64) -> String {
+    #[allow(clippy::cast_precision_loss)]
+    let s = ns as f64 / 1e9;
+    format!("{s:.1}s")
+}
+
+/// One column per frame, newest at the right edge, scaled to the highest
+/// share shown.
+fn render_histogram(buf: &mut Buffer, area: Rect, stats: &ContentionStats, theme: &Theme) {
+    let height = area.height - 1;
+    let history = stats.history();
+    let shown = history.len().min(usize::from(area.width));
+    let recent = history.range(history.len() - shown..);
+    let scale = recent
+        .clone()
+        .map(|h| h.contention_percent)
+        .fold(0.0f32, f32::max);
+
+    for (j, entry) in recent.rev().enumerate() {
+        #[allow(clippy::cast_possible_truncation)]
+        let x = area.right() - 1 - j as u16;
+        let style = if entry.in_convoy() {
+            theme.load_high
+        } else {
+            theme.histo_jit_load
+        };
+        for (i, c) in column(entry.contention_percent, scale, height)
+            .into_iter()
+            .enumerate()
+        {
+            if c != ' ' {
+                #[allow(clippy::cast_possible_truncation)]
+                let y = area.y + height - 1 - i as u16;
+                buf[(x, y)].set_char(c).set_style(style);
+            }
+        }
+    }
+
+    let legend = Line::from(vec![
+        Span::styled(
+            format!("\u{25A0} Convoy (\u{2265}{CONVOY_MIN_THREADS} threads spiking)"),
+            theme.load_high,
+        ),
+        Span::raw(format!("  scale 0-{scale:.1}% of JIT time")),
+    ]);
+    Paragraph::new(legend).render(
+        Rect {
+            y: area.y + height,
+            height: 1,
+            ..area
+        },
+        buf,
+    );
+}
+
+/// The cells of a `height`-row bar of `value` out of `scale`, bottom first.
+fn column(value: f32, scale: f32, height: u16) -> Vec<char> {
+    let steps = BLOCK_CHARS.len() - 1;
+    let filled = if scale > 0.0 {
+        #[allow(
+            clippy::cast_possible_truncation,
+            clippy::cast_sign_loss,
+            clippy::cast_precision_loss
+        )]
+        let filled = (value / scale * f32::from(height) * steps as f32).round() as usize;
+        filled
+    } else {
+        0
+    };
+    (0..usize::from(height))
+        .map(|row| BLOCK_CHARS[filled.saturating_sub(row * steps).min(steps)])
+        .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::sampler::accumulator::ThreadLoad;
+
+    #[test]
+    fn columns_fill_from_the_bottom() {
+        let full = BLOCK_CHARS[BLOCK_CHARS.len() - 1];
+        assert_eq!(column(10.0, 10.0, 3), [full, full, full]);
+        assert_eq!(column(5.0, 10.0, 2), [full, ' ']);
+        assert_eq!(column(2.5, 10.0, 2), [BLOCK_CHARS[5], ' ']);
+        assert_eq!(column(0.0, 0.0, 2), [' ', ' ']);
+    }
+
+    #[test]
+    fn renders_convoys_and_the_histogram() {
+        let mut stats = ContentionStats::default();
+        for i in 0..200u64 {
+            let spikes = if (50..60).contains(&i) { 4 } else { 0 };
+            stats.record(&ComputedFrame {
+                timestamp_ns: i * 100_000_000,
+                total_jit_time: 1000,
+                total_cache_write_lock_time: i,
+                lock_loads: vec![ThreadLoad {
+                    tid: 42,
+                    load_percent: 1.0,
+                    total_cycles: i,
+                }],
+                write_lock_spikes: spikes,
+                ..ComputedFrame::default()
+            });
+        }
+        let area = Rect::new(0, 0, 100, 12);
+        let mut buf = Buffer::empty(area);
+        render(&mut buf, area, &stats, None, 1e9, &Theme::default());
+
+        let row = |y| {
+            (0..area.width)
+                .map(|x| buf[(x, y)].symbol())
+                .collect::<String>()
+        };
+        assert!(row(1).starts_with("Convoys: 1 (10 frames), longest 10 frames"));
+        assert!(row(2).starts_with("Recent: 5.0s (10 frames)"));
+        assert!(row(4).trim_start().starts_with("42"));
+        assert!(row(11).contains("scale 0-19.9% of JIT time"));
+        // The newest frame has the highest share.
+        assert_eq!(row(10).chars().last(), Some(BLOCK_CHARS[9]));
+
+        // Too small for the histogram, or for anything.
+        for height in [3, 1] {
+            let area = Rect::new(0, 0, 100, height);
+            render(
+                &mut Buffer::empty(area),
+                area,
+                &stats,
+                None,
+                1e9,
+                &Theme::default(),
+            );
+        }
+    }
+}
@@ -4,14 +4,19 @@ use ratatui::text::{Line, Span};
 use ratatui::widgets::Paragraph;
 
 use crate::datasource::SessionMetadata;
+use crate::recording::async_writer::QueueStats;
+use crate::sampler::jitter::{SamplerTiming, format_duration_ns};
 use crate::tui::theme::Theme;
 
+#[allow(clippy::too_many_arguments)]
 pub fn render(
     frame: &mut ratatui::Frame,
     area: Rect,
     metadata: &SessionMetadata,
     is_replay: bool,
     sample_period_ns: Option<u64>,
+    recorder: Option<&QueueStats>,
+    timing: Option<&SamplerTiming>,
     theme: &Theme,
 ) {
     if area.height == 0 || area.width == 0 {
@@ -20,16 +25,40 @@ pub fn render(
 
     let version = env!("CARGO_PKG_VERSION");
 
+    let timing_part = timing.map_or_else(String::new, |t| {
+        let torn = if t.torn_reads > 0 {
+            format!(" Torn: {}", t.torn_reads)
+        } else {
+            String::new()
+        };
+        format!(
+            " | Late p50/p99: {}/{} Cost p99: {}{torn}",
+            format_duration_ns(t.lateness.percentile(0.5)),
+            format_duration_ns(t.lateness.percentile(0.99)),
+            format_duration_ns(t.overhead.percentile(0.99)),
+        )
+    });
+
     let text = if is_replay {
         format!(
-            "felix v{version} | REPLAY | FEX: {} | Type: {} | Head: {:#x} | Size: {:#x}",
+            "felix v{version} | REPLAY | FEX: {} | Type: {} | Head: {:#x} | Size: {:#x}{timing_part}",
             metadata.fex_version, metadata.app_type, metadata.head, metadata.size,
         )
     } else {
-        let sample_part = sample_period_ns
-            .map_or_else(String::new, |ns| format!(" | Sample: {}ms", ns / 1_000_000));
+        let sample_part = sample_period_ns.map_or_else(String::new, |ns| {
+            format!(" | Sample: {}", format_duration_ns(ns))
+        });
+        let rec_part = recorder.map_or_else(String::new, |q| {
+            let flight = q.flight.map_or_else(String::new, |f| {
+                format!(" Triggers: {} Held: {}", f.triggers, f.held)
+            });
+            format!(
+                " | Rec: {}/{} Dropped: {}{flight}",
+                q.depth, q.capacity, q.dropped
+            )
+        });
         format!(
-            "felix v{version} | PID: {} | FEX: {} | Type: {} | Head: {:#x} | Size: {:#x}{sample_part}",
+            "felix v{version} | PID: {} | FEX: {} | Type: {} | Head: {:#x} | Size: {:#x}{sample_part}{timing_part}{rec_part}",
             metadata.pid, metadata.fex_version, metadata.app_type, metadata.head, metadata.size,
         )
     };
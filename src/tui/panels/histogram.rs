@@ -1,17 +1,23 @@
 // SPDX-License-Identifier: MIT
-use std::collections::VecDeque;
-
 use ratatui::buffer::Buffer;
 use ratatui::layout::Rect;
 use ratatui::style::Style;
 use ratatui::text::{Line, Span};
 use ratatui::widgets::{Paragraph, Widget};
 
-use crate::sampler::accumulator::HistogramEntry;
+use crate::sampler::accumulator::{
+    FLAG_HIGH_JIT_LOAD, FLAG_HIGH_SIGBUS, FLAG_HIGH_SMC, FLAG_HIGH_SOFTFLOAT,
+};
+use crate::sampler::histogram::{Bucket, HistogramPyramid};
 use crate::tui::theme::{BLOCK_CHARS, BLOCK_FULL, Theme};
 
+/// Marks the peak load of a column that aggregates several frames.
+const MAX_MARKER: char = '\u{2594}';
+
 struct HistogramWidget<'a> {
-    entries: &'a VecDeque<HistogramEntry>,
+    /// Oldest first; the last one is drawn at the right edge.
+    columns: &'a [Bucket],
+    frames_per_column: u64,
     theme: &'a Theme,
 }
 
@@ -29,28 +35,25 @@ impl Widget for HistogramWidget<'_> {
         }
 
         let chart_width = area.width as usize;
-        let num_columns = chart_width.min(self.entries.len());
+        let num_columns = chart_width.min(self.columns.len());
 
         for j in 0..num_columns {
-            let entry_idx = self.entries.len() - 1 - j;
-            let entry = &self.entries[entry_idx];
+            let column = &self.columns[self.columns.len() - 1 - j];
             let col_x = area.x + area.width - 1 - j as u16;
 
             let mut pip_stack: Vec<(char, Style)> = Vec::new();
-            if entry.high_jit_load {
-                pip_stack.push((BLOCK_FULL, self.theme.histo_jit_load));
-            }
-            if entry.high_invalidation_or_smc {
-                pip_stack.push((BLOCK_FULL, self.theme.histo_smc));
-            }
-            if entry.high_sigbus {
-                pip_stack.push((BLOCK_FULL, self.theme.histo_sigbus));
-            }
-            if entry.high_softfloat {
-                pip_stack.push((BLOCK_FULL, self.theme.histo_softfloat));
+            for (bit, style) in [
+                (FLAG_HIGH_JIT_LOAD, self.theme.histo_jit_load),
+                (FLAG_HIGH_SMC, self.theme.histo_smc),
+                (FLAG_HIGH_SIGBUS, self.theme.histo_sigbus),
+                (FLAG_HIGH_SOFTFLOAT, self.theme.histo_softfloat),
+            ] {
+                if column.flags & bit != 0 {
+                    pip_stack.push((BLOCK_FULL, style));
+                }
             }
 
-            let load = entry.load_percent.clamp(0.0, 100.0);
+            let load = column.mean.clamp(0.0, 100.0);
             let bar_style = if load >= 75.0 {
                 self.theme.load_high
             } else if load >= 50.0 {
@@ -64,6 +67,10 @@ impl Widget for HistogramWidget<'_> {
             let tens_digit = (rounded_down / 10.0) as usize;
             #[allow(clippy::cast_possible_truncation, clippy::cast_sign_loss)]
             let digit_percent = (load - rounded_down).floor() as usize;
+            // The peak row, when it is above the mean's bar.
+            #[allow(clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+            let max_row = (column.max.clamp(0.0, 100.0) / 10.0).floor() as usize;
+            let max_row = (max_row > tens_digit).then_some(max_row);
 
             for i in 0..chart_height as usize {
                 let cell_y = area.y + chart_height - 1 - i as u16;
@@ -83,6 +90,8 @@ impl Widget for HistogramWidget<'_> {
                     } else {
                         (pip_char, pip_s)
                     }
+                } else if pip_char == ' ' && max_row == Some(i) {
+                    (MAX_MARKER, self.theme.load_high)
                 } else {
                     (pip_char, bar_style)
                 };
@@ -98,7 +107,7 @@ impl Widget for HistogramWidget<'_> {
         let legend_y = area.y + chart_height;
         if legend_y < area.y + area.height {
             let legend_area = Rect::new(area.x, legend_y, area.width, 1);
-            let legend = Line::from(vec![
+            let mut spans = vec![
                 Span::styled("\u{25A0} High JIT", self.theme.histo_jit_load),
                 Span::raw("  "),
                 Span::styled("\u{25A0} SMC", self.theme.histo_smc),
@@ -106,31 +115,45 @@ impl Widget for HistogramWidget<'_> {
                 Span::styled("\u{25A0} SIGBUS", self.theme.histo_sigbus),
                 Span::raw("  "),
                 Span::styled("\u{25A0} Softfloat", self.theme.histo_softfloat),
-            ]);
+            ];
+            if self.frames_per_column > 1 {
+                spans.push(Span::raw(format!(
+                    "  [{} samples/col, \u{2594} max]",
+                    self.frames_per_column
+                )));
+            }
+            let legend = Line::from(spans);
             Paragraph::new(legend).render(legend_area, buf);
         }
     }
 }
 
+/// Draws the histogram at `zoom`, ending at frame `end` of `pyramid`.
 pub fn render(
-    frame: &mut ratatui::Frame,
+    buf: &mut Buffer,
     area: Rect,
-    histogram: &VecDeque<HistogramEntry>,
+    pyramid: &HistogramPyramid,
+    zoom: usize,
+    end: u64,
     theme: &Theme,
 ) {
     if area.height < 2 || area.width < 2 {
         return;
     }
 
-    if histogram.is_empty() {
+    if pyramid.is_empty() {
         let paragraph = Paragraph::new("Waiting for data...");
-        frame.render_widget(paragraph, area);
+        paragraph.render(area, buf);
         return;
     }
 
+    let level = zoom.min(pyramid.levels().saturating_sub(1));
+    let mut columns = Vec::with_capacity(area.width as usize);
+    pyramid.view(level, end, area.width as usize, &mut columns);
     let widget = HistogramWidget {
-        entries: histogram,
+        columns: &columns,
+        frames_per_column: HistogramPyramid::frames_per_bucket(level),
         theme,
     };
-    frame.render_widget(widget, area);
+    widget.render(area, buf);
 }
@@ -1,11 +1,15 @@
 // SPDX-License-Identifier: MIT
+use std::fmt::Write;
+
 use num_format::{Locale, ToFormattedString};
+use ratatui::buffer::Buffer;
 use ratatui::layout::Rect;
 use ratatui::text::{Line, Span};
-use ratatui::widgets::Paragraph;
+use ratatui::widgets::{Paragraph, Widget};
 
 use crate::datasource::SessionMetadata;
 use crate::sampler::accumulator::ComputedFrame;
+use crate::sampler::rolling::{ProcessStats, RateEvent, RollingStats, THREAD_WINDOW, WINDOWS};
 use crate::tui::theme::{BLOCK_CHARS, BLOCK_FULL, Theme};
 
 const NANOSECONDS_IN_SECOND: f64 = 1_000_000_000.0;
@@ -61,6 +65,7 @@ fn build_bar(load: f32, bar_width: usize) -> String {
 
 fn render_thread_loads<'a>(
     data: &ComputedFrame,
+    rolling: &RollingStats,
     metadata: &SessionMetadata,
     theme: &Theme,
     bar_width: usize,
@@ -70,9 +75,10 @@ fn render_thread_loads<'a>(
     let mut lines: Vec<Line<'a>> = Vec::new();
 
     lines.push(Line::from(format!(
-        "Top {} threads executing ({} total)",
+        "Top {} threads executing ({} total, quantiles over {}s)",
         data.thread_loads.len(),
         data.threads_sampled,
+        THREAD_WINDOW.as_secs(),
     )));
 
     for tl in &data.thread_loads {
@@ -86,7 +92,16 @@ fn render_thread_loads<'a>(
             ": {load:.2}% ({ms} ms/S, {} cycles)",
             tl.total_cycles
         ));
-        lines.push(Line::from(vec![bar_span, info_span]));
+        let mut spans = vec![bar_span, info_span];
+        if let Some(window) = rolling.thread_load(tl.tid) {
+            spans.push(Span::raw(format!(
+                " p50/p95/p99 {:.1}/{:.1}/{:.1}",
+                window.quantile(0.5),
+                window.quantile(0.95),
+                window.quantile(0.99),
+            )));
+        }
+        lines.push(Line::from(spans));
     }
 
     lines
@@ -194,10 +209,57 @@ fn render_aggregate_stats<'a>(data: &ComputedFrame, metadata: &SessionMetadata)
     ]
 }
 
+/// Quantiles and rates over each of `WINDOWS`, then the whole recording's
+/// in replay.
+fn render_rolling<'a>(rolling: &RollingStats, recording: Option<&ProcessStats>) -> Vec<Line<'a>> {
+    let mut header = String::from("Rolling:      ");
+    for w in WINDOWS {
+        let _ = write!(header, "{:>17}s", w.as_secs());
+    }
+    let mut lines = vec![Line::from(header)];
+
+    let mut load = String::from("  Load p50/p99");
+    for i in 0..WINDOWS.len() {
+        let sketch = rolling.load(i);
+        let cell = format!("{:.2}/{:.2}", sketch.quantile(0.5), sketch.quantile(0.99));
+        let _ = write!(load, "{cell:>18}");
+    }
+    lines.push(Line::from(load));
+
+    for (event, label) in
+        RateEvent::ALL
+            .iter()
+            .zip(["   SIGBUS/sec", "      SMC/sec", "  JIT Cnt/sec"])
+    {
+        let mut line = String::from(label);
+        for i in 0..WINDOWS.len() {
+            let _ = write!(line, "{:>18.2}", rolling.rate(*event, i));
+        }
+        if *event == RateEvent::Jit {
+            let _ = write!(line, "  (peak {}/s)", rolling.jit_peak_per_sec());
+        }
+        lines.push(Line::from(line));
+    }
+
+    if let Some(stats) = recording {
+        lines.push(Line::from(format!(
+            "Recording: Load p50/p95/p99 {:.2}/{:.2}/{:.2}, peak JIT {}/s, {} frames",
+            stats.fex_load.quantile(0.5),
+            stats.fex_load.quantile(0.95),
+            stats.fex_load.quantile(0.99),
+            stats.jit_peak.peak(),
+            stats.frames,
+        )));
+    }
+    lines
+}
+
 pub fn render(
-    frame: &mut ratatui::Frame,
+    buf: &mut Buffer,
     area: Rect,
     data: &ComputedFrame,
+    rolling: &RollingStats,
+    recording: Option<&ProcessStats>,
     metadata: &SessionMetadata,
     theme: &Theme,
 ) {
@@ -207,10 +269,11 @@ pub fn render(
 
     let bar_width = (area.width.saturating_sub(20) as usize).clamp(4, 48);
 
-    let mut lines = render_thread_loads(data, metadata, theme, bar_width);
+    let mut lines = render_thread_loads(data, rolling, metadata, theme, bar_width);
     lines.push(Line::from(""));
     lines.extend(render_aggregate_stats(data, metadata));
+    lines.push(Line::from(""));
+    lines.extend(render_rolling(rolling, recording));
 
-    let paragraph = Paragraph::new(lines);
-    frame.render_widget(paragraph, area);
+    Paragraph::new(lines).render(area, buf);
 }
@@ -1,7 +1,8 @@
 // SPDX-License-Identifier: MIT
+use ratatui::buffer::Buffer;
 use ratatui::layout::Rect;
 use ratatui::text::Line;
-use ratatui::widgets::Paragraph;
+use ratatui::widgets::{Paragraph, Widget};
 
 use crate::sampler::accumulator::ComputedFrame;
 use crate::tui::theme::Theme;
@@ -10,7 +11,7 @@ const KIB: u64 = 1024;
 const MIB: u64 = 1024 * KIB;
 const GIB: u64 = 1024 * MIB;
 
-fn format_bytes(bytes: u64) -> String {
+pub fn format_bytes(bytes: u64) -> String {
     if bytes >= GIB {
         #[allow(clippy::cast_precision_loss)]
         let val = bytes as f64 / GIB as f64;
@@ -28,21 +29,26 @@ fn format_bytes(bytes: u64) -> String {
     }
 }
 
-pub fn render(frame: &mut ratatui::Frame, area: Rect, data: &ComputedFrame, _theme: &Theme) {
+pub fn render(buf: &mut Buffer, area: Rect, data: &ComputedFrame, _theme: &Theme) {
     if area.height < 2 || area.width < 10 {
         return;
     }
 
     if data.mem.total_anon == 0 {
-        let paragraph = Paragraph::new("Waiting for memory data...");
-        frame.render_widget(paragraph, area);
+        Paragraph::new("Waiting for memory data...").render(area, buf);
         return;
     }
 
     let mem = &data.mem;
+    // Older recordings carry no sample age.
+    let age = if data.mem_age_ns == 0 {
+        String::new()
+    } else {
+        format!(" (sampled {} ms ago)", data.mem_age_ns / 1_000_000)
+    };
     let lines = vec![
         Line::from(format!(
-            "Total FEX Anon memory resident: {}",
+            "Total FEX Anon memory resident: {}{age}",
             format_bytes(mem.total_anon)
         )),
         Line::from(format!(
@@ -97,8 +103,7 @@ pub fn render(frame: &mut ratatui::Frame, area: Rect, data: &ComputedFrame, _the
         )),
     ];
 
-    let paragraph = Paragraph::new(lines);
-    frame.render_widget(paragraph, area);
+    Paragraph::new(lines).render(area, buf);
 }
 
 #[cfg(test)]
@@ -1,5 +1,8 @@
 // SPDX-License-Identifier: MIT
+pub mod contention;
 pub mod header;
 pub mod histogram;
 pub mod jit_stats;
 pub mod mem_stats;
+pub mod overhead;
+pub mod threads;
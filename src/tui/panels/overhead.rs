@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: MIT
+use ratatui::buffer::Buffer;
+use ratatui::layout::Rect;
+use ratatui::text::Line;
+use ratatui::widgets::{Paragraph, Widget};
+
+use super::mem_stats::format_bytes;
+use crate::sampler::jitter::format_duration_ns;
+use crate::sampler::overhead::{OverheadStats, Stage, UsageRates};
+use crate::tui::theme::Theme;
+
+/// Share of one core spent in a stage over `elapsed_ns` of session time.
+fn core_percent(total_ns: u64, elapsed_ns: u64) -> f64 {
+    if elapsed_ns == 0 {
+        return 0.0;
+    }
+    #[allow(clippy::cast_precision_loss)]
+    let percent = total_ns as f64 / elapsed_ns as f64 * 100.0;
+    percent
+}
+
+/// Per-stage timings over the frames shown so far, `elapsed_ns` of session
+/// time, and felix's own resource use.
+pub fn render(
+    buf: &mut Buffer,
+    area: Rect,
+    stats: &OverheadStats,
+    elapsed_ns: u64,
+    usage: Option<&UsageRates>,
+    _theme: &Theme,
+) {
+    if area.height < 2 || area.width < 10 {
+        return;
+    }
+
+    let mut lines = vec![Line::from(format!(
+        "{:<12}{:>10}{:>10}{:>10}{:>12}",
+        "Stage", "p50", "p99", "max", "% of a core"
+    ))];
+    for stage in Stage::ALL {
+        let h = stats.stage(stage);
+        if h.count() == 0 {
+            lines.push(Line::from(format!("{:<12}{:>10}", stage.name(), "-")));
+            continue;
+        }
+        lines.push(Line::from(format!(
+            "{:<12}{:>10}{:>10}{:>10}{:>11.3}%",
+            stage.name(),
+            format_duration_ns(h.percentile(0.5)),
+            format_duration_ns(h.percentile(0.99)),
+            format_duration_ns(h.percentile(1.0)),
+            core_percent(stats.total_ns(stage), elapsed_ns),
+        )));
+    }
+
+    lines.push(Line::from(""));
+    lines.push(Line::from(usage.map_or_else(
+        || "felix: measuring...".to_string(),
+        |u| {
+            format!(
+                "felix: CPU {:.1}% of a core | RSS {} | I/O read {}/s, written {}/s",
+                u.cpu_percent,
+                format_bytes(u.rss_bytes),
+                format_bytes(u.read_per_sec),
+                format_bytes(u.written_per_sec),
+            )
+        },
+    )));
+
+    Paragraph::new(lines).render(area, buf);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn core_share_of_session_time() {
+        assert!((core_percent(5_000_000, 1_000_000_000) - 0.5).abs() < f64::EPSILON);
+        assert!(core_percent(5, 0).abs() < f64::EPSILON);
+    }
+}
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: MIT
+use ratatui::buffer::Buffer;
+use ratatui::layout::Rect;
+use ratatui::text::{Line, Span};
+use ratatui::widgets::{Paragraph, Widget};
+
+use crate::recording::thread_index::{Counter, ThreadIndex, ThreadTimeline};
+use crate::tui::theme::{BLOCK_CHARS, Theme};
+
+/// Columns left of the timeline.
+const FIXED_WIDTH: u16 = 52;
+
+/// The threads that spent longest in the JIT over the whole recording, of
+/// process `pid` or of every process, each with its JIT time per block
+/// across the recording and `cursor_block` marked.
+pub fn render(
+    buf: &mut Buffer,
+    area: Rect,
+    index: &ThreadIndex,
+    pid: Option<i32>,
+    cursor_block: usize,
+    cycle_freq: f64,
+    theme: &Theme,
+) {
+    if area.height < 2 || area.width < FIXED_WIDTH {
+        return;
+    }
+
+    let width = usize::from(area.width - FIXED_WIDTH);
+    let rows = usize::from(area.height - 1);
+    let top = index.top(Counter::JitTime, rows, pid);
+    let scope_jit: u64 = index
+        .threads
+        .iter()
+        .filter(|t| pid.is_none_or(|p| p == t.pid))
+        .map(|t| t.total(Counter::JitTime))
+        .sum();
+    let seconds = |cycles: u64| {
+        #[allow(clippy::cast_precision_loss)]
+        let s = cycles as f64 / cycle_freq.max(1.0);
+        s
+    };
+
+    let mut lines = vec![Line::from(format!(
+        "{:>7} {:>7} {:>9} {:>6} {:>9} {:>9}  JIT time per block",
+        "PID", "TID", "JIT", "share", "wlock", "misses"
+    ))];
+    for t in top {
+        #[allow(clippy::cast_precision_loss)]
+        let share = if scope_jit == 0 {
+            0.0
+        } else {
+            t.total(Counter::JitTime) as f64 / scope_jit as f64 * 100.0
+        };
+        let (before, at, after) = sparkline(t, index.blocks.len(), width, cursor_block);
+        lines.push(Line::from(vec![
+            Span::raw(format!(
+                "{:>7} {:>7} {:>8.2}s {:>5.1}% {:>8.3}s {:>9}  ",
+                t.pid,
+                t.tid,
+                seconds(t.total(Counter::JitTime)),
+                share,
+                seconds(t.total(Counter::CacheWriteLock)),
+                t.total(Counter::CacheMiss),
+            )),
+            Span::styled(before, theme.histo_jit_load),
+            Span::styled(at, theme.border_selected),
+            Span::styled(after, theme.histo_jit_load),
+        ]));
+    }
+
+    Paragraph::new(lines).render(area, buf);
+}
+
+/// `t`'s JIT time over `blocks` blocks squeezed into `width` columns (the
+/// busiest block of each), split around the column holding `cursor`.
+fn sparkline(
+    t: &ThreadTimeline,
+    blocks: usize,
+    width: usize,
+    cursor: usize,
+) -> (String, String, String) {
+    if blocks == 0 || width == 0 {
+        return (String::new(), String::new(), String::new());
+    }
+    let columns = width.min(blocks);
+    let mut peaks = vec![0u64; columns];
+    for (block, jit) in t.timeline(Counter::JitTime) {
+        let column = block as usize * columns / blocks;
+        peaks[column] = peaks[column].max(jit);
+    }
+    let max = peaks.iter().copied().max().unwrap_or(0).max(1);
+    let chars: Vec<char> = peaks
+        .iter()
+        .map(|&p| {
+            #[allow(clippy::cast_possible_truncation)]
+            let level = (p * (BLOCK_CHARS.len() as u64 - 1)).div_ceil(max) as usize;
+            BLOCK_CHARS[level]
+        })
+        .collect();
+    let at = (cursor.min(blocks - 1) * columns / blocks).min(columns - 1);
+    (
+        chars[..at].iter().collect(),
+        chars[at].to_string(),
+        chars[at + 1..].iter().collect(),
+    )
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn sparkline_scales_to_the_busiest_block_and_splits_at_the_cursor() {
+        let mut t = ThreadTimeline {
+            blocks: vec![0, 2, 3],
+            ..ThreadTimeline::default()
+        };
+        t.columns[Counter::JitTime as usize] = vec![90, 45, 1];
+
+        let (before, at, after) = sparkline(&t, 4, 80, 2);
+        assert_eq!(before, format!("{}{}", BLOCK_CHARS[9], BLOCK_CHARS[0]));
+        assert_eq!(at, BLOCK_CHARS[5].to_string());
+        assert_eq!(after, BLOCK_CHARS[1].to_string());
+
+        // Two blocks per column keep the busier one.
+        let (before, at, after) = sparkline(&t, 4, 2, 0);
+        assert_eq!(before, "");
+        assert_eq!(after, BLOCK_CHARS[5].to_string());
+        assert_eq!(at, BLOCK_CHARS[9].to_string());
+    }
+}